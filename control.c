@@ -0,0 +1,115 @@
+/* -------------------------------------------------------------------------------------------------- */
+/* The LongMynd receiver: control.c                                                                   */
+/*    - an implementation of the Serit NIM controlling software for the MiniTiouner Hardware          */
+/*    - takes commands from a FIFO while we are running                                               */
+/* Copyright 2019 Heather Lomond                                                                      */
+/* -------------------------------------------------------------------------------------------------- */
+/*
+    This file is part of longmynd.
+
+    Longmynd is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Longmynd is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with longmynd.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+/*
+    Commands are lines of text written to the control FIFO, eg.
+        echo "export 300 60 /tmp/event.ts" > longmynd_main_control
+    The commands are:
+        export AGO LENGTH PATH   saves LENGTH seconds of the time shift, from AGO seconds ago, to PATH.
+                                 A LENGTH of 0 saves everything from then up to now
+*/
+
+/* -------------------------------------------------------------------------------------------------- */
+/* ----------------- INCLUDES ----------------------------------------------------------------------- */
+/* -------------------------------------------------------------------------------------------------- */
+
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include "main.h"
+#include "errors.h"
+#include "ts_sink.h"
+#include "control.h"
+
+/* -------------------------------------------------------------------------------------------------- */
+/* ----------------- ROUTINES ----------------------------------------------------------------------- */
+/* -------------------------------------------------------------------------------------------------- */
+
+/* -------------------------------------------------------------------------------------------------- */
+static void control_command(char *line) {
+/* -------------------------------------------------------------------------------------------------- */
+/* carries out one command. A command that fails is reported, but does not stop us                   */
+/* *line: the command, without its newline                                                            */
+/* -------------------------------------------------------------------------------------------------- */
+    char path[128];
+    unsigned int ago;
+    unsigned int length;
+
+    printf("Flow: Control command \"%s\"\n",line);
+
+    if (3==sscanf(line, "export %u %u %127s", &ago, &length, path)) {
+        ts_sink_timeshift_export(ago, length, path);
+    } else if (line[0]!='\0') {
+        printf("ERROR: Unknown control command \"%s\"\n",line);
+    }
+}
+
+/* -------------------------------------------------------------------------------------------------- */
+void *loop_control(void *arg) {
+/* -------------------------------------------------------------------------------------------------- */
+/* Runs a loop that reads commands from the control FIFO                                              */
+/* -------------------------------------------------------------------------------------------------- */
+    thread_vars_t *thread_vars=(thread_vars_t *)arg;
+    uint8_t *err=&thread_vars->thread_err;
+    char line[CONTROL_LINE_MAX];
+    uint32_t line_len=0;
+    struct pollfd pfd;
+    char *newline;
+    ssize_t len;
+    int fd;
+
+    /* opened for writing too, so that we never see end of file when a writer goes away */
+    fd=open(thread_vars->config->control_fifo_path, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+    if (fd<0) {
+        printf("ERROR: Failed to open control fifo %s\n",thread_vars->config->control_fifo_path);
+        *err=ERROR_OPEN_CONTROL_FIFO;
+        return NULL;
+    }
+
+    while (*err==ERROR_NONE && *thread_vars->main_err_ptr==ERROR_NONE) {
+        pfd.fd=fd;
+        pfd.events=POLLIN;
+        if (poll(&pfd, 1, CONTROL_POLL_MS)<=0) continue;
+
+        len=read(fd, &line[line_len], sizeof(line)-1-line_len);
+        if (len<=0) continue;
+        line_len+=len;
+        line[line_len]='\0';
+
+        while ((newline=strchr(line, '\n'))!=NULL) {
+            *newline='\0';
+            control_command(line);
+            line_len-=(uint32_t)(newline+1-line);
+            memmove(line, newline+1, line_len+1);
+        }
+        /* a line too long to be a command */
+        if (line_len==sizeof(line)-1) line_len=0;
+    }
+
+    close(fd);
+
+    return NULL;
+}
+
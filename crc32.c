@@ -0,0 +1,370 @@
+/* -------------------------------------------------------------------------------------------------- */
+/* The LongMynd receiver: crc32.c                                                                     */
+/*    - an implementation of the Serit NIM controlling software for the MiniTiouner Hardware          */
+/*    - the CRC-32/MPEG-2 that protects the PSI sections                                              */
+/* Copyright 2019 Heather Lomond                                                                      */
+/* -------------------------------------------------------------------------------------------------- */
+/*
+    This file is part of longmynd.
+
+    Longmynd is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Longmynd is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with longmynd.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+/*
+    CRC-32/MPEG-2 is polynomial 0x04C11DB7, MSB first, starting from 0xFFFFFFFF with nothing XORed
+    on the end. There are several ways of working it out, all giving the same answer:
+
+    bytewise:  the classic table, one byte at a time. The reference for the others.
+    slice8:    eight tables, so that 8 bytes are looked up at once with no chain from one to the next.
+    pclmul:    x86 carry-less multiply. The data is folded 64 bytes at a time into four 128 bit
+               accumulators, each multiplied on by x^512 mod P and the next data XORed in. These are
+               folded down to one, and that and the last few bytes finish off with slice8.
+    armv8:     the AArch64 CRC32 instructions. They do the bit reflected CRC-32, which has the same
+               polynomial, so bit reversing the bytes going in and the CRC in and out gets ours.
+
+    crc32_mpeg2_init() builds the slice8 tables and the fold constants, and picks the fastest kernel
+    the CPU has. Until then crc32_mpeg2() uses bytewise.
+*/
+
+/* -------------------------------------------------------------------------------------------------- */
+/* ----------------- INCLUDES ----------------------------------------------------------------------- */
+/* -------------------------------------------------------------------------------------------------- */
+
+#include <stdio.h>
+#include <string.h>
+#include "crc32.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define CRC32_X86
+#endif
+
+#if defined(__aarch64__)
+#include <arm_acle.h>
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#define CRC32_ARMV8
+#endif
+
+/* -------------------------------------------------------------------------------------------------- */
+/* ----------------- DEFINES ------------------------------------------------------------------------ */
+/* -------------------------------------------------------------------------------------------------- */
+
+#define CRC32_MPEG2_POLY 0x04C11DB7
+#define CRC32_MPEG2_INIT 0xFFFFFFFF
+
+#define CRC32_KERNEL_BYTEWISE 0
+#define CRC32_KERNEL_SLICE8   1
+#define CRC32_KERNEL_PCLMUL   2
+#define CRC32_KERNEL_ARMV8    3
+
+/* -------------------------------------------------------------------------------------------------- */
+/* ----------------- GLOBALS ------------------------------------------------------------------------ */
+/* -------------------------------------------------------------------------------------------------- */
+
+static const uint32_t crc32_mpeg2_table[256] = {
+    0x00000000, 0x04c11db7, 0x09823b6e, 0x0d4326d9, 0x130476dc, 0x17c56b6b, 0x1a864db2, 0x1e475005,
+    0x2608edb8, 0x22c9f00f, 0x2f8ad6d6, 0x2b4bcb61, 0x350c9b64, 0x31cd86d3, 0x3c8ea00a, 0x384fbdbd,
+    0x4c11db70, 0x48d0c6c7, 0x4593e01e, 0x4152fda9, 0x5f15adac, 0x5bd4b01b, 0x569796c2, 0x52568b75,
+    0x6a1936c8, 0x6ed82b7f, 0x639b0da6, 0x675a1011, 0x791d4014, 0x7ddc5da3, 0x709f7b7a, 0x745e66cd,
+    0x9823b6e0, 0x9ce2ab57, 0x91a18d8e, 0x95609039, 0x8b27c03c, 0x8fe6dd8b, 0x82a5fb52, 0x8664e6e5,
+    0xbe2b5b58, 0xbaea46ef, 0xb7a96036, 0xb3687d81, 0xad2f2d84, 0xa9ee3033, 0xa4ad16ea, 0xa06c0b5d,
+    0xd4326d90, 0xd0f37027, 0xddb056fe, 0xd9714b49, 0xc7361b4c, 0xc3f706fb, 0xceb42022, 0xca753d95,
+    0xf23a8028, 0xf6fb9d9f, 0xfbb8bb46, 0xff79a6f1, 0xe13ef6f4, 0xe5ffeb43, 0xe8bccd9a, 0xec7dd02d,
+    0x34867077, 0x30476dc0, 0x3d044b19, 0x39c556ae, 0x278206ab, 0x23431b1c, 0x2e003dc5, 0x2ac12072,
+    0x128e9dcf, 0x164f8078, 0x1b0ca6a1, 0x1fcdbb16, 0x018aeb13, 0x054bf6a4, 0x0808d07d, 0x0cc9cdca,
+    0x7897ab07, 0x7c56b6b0, 0x71159069, 0x75d48dde, 0x6b93dddb, 0x6f52c06c, 0x6211e6b5, 0x66d0fb02,
+    0x5e9f46bf, 0x5a5e5b08, 0x571d7dd1, 0x53dc6066, 0x4d9b3063, 0x495a2dd4, 0x44190b0d, 0x40d816ba,
+    0xaca5c697, 0xa864db20, 0xa527fdf9, 0xa1e6e04e, 0xbfa1b04b, 0xbb60adfc, 0xb6238b25, 0xb2e29692,
+    0x8aad2b2f, 0x8e6c3698, 0x832f1041, 0x87ee0df6, 0x99a95df3, 0x9d684044, 0x902b669d, 0x94ea7b2a,
+    0xe0b41de7, 0xe4750050, 0xe9362689, 0xedf73b3e, 0xf3b06b3b, 0xf771768c, 0xfa325055, 0xfef34de2,
+    0xc6bcf05f, 0xc27dede8, 0xcf3ecb31, 0xcbffd686, 0xd5b88683, 0xd1799b34, 0xdc3abded, 0xd8fba05a,
+    0x690ce0ee, 0x6dcdfd59, 0x608edb80, 0x644fc637, 0x7a089632, 0x7ec98b85, 0x738aad5c, 0x774bb0eb,
+    0x4f040d56, 0x4bc510e1, 0x46863638, 0x42472b8f, 0x5c007b8a, 0x58c1663d, 0x558240e4, 0x51435d53,
+    0x251d3b9e, 0x21dc2629, 0x2c9f00f0, 0x285e1d47, 0x36194d42, 0x32d850f5, 0x3f9b762c, 0x3b5a6b9b,
+    0x0315d626, 0x07d4cb91, 0x0a97ed48, 0x0e56f0ff, 0x1011a0fa, 0x14d0bd4d, 0x19939b94, 0x1d528623,
+    0xf12f560e, 0xf5ee4bb9, 0xf8ad6d60, 0xfc6c70d7, 0xe22b20d2, 0xe6ea3d65, 0xeba91bbc, 0xef68060b,
+    0xd727bbb6, 0xd3e6a601, 0xdea580d8, 0xda649d6f, 0xc423cd6a, 0xc0e2d0dd, 0xcda1f604, 0xc960ebb3,
+    0xbd3e8d7e, 0xb9ff90c9, 0xb4bcb610, 0xb07daba7, 0xae3afba2, 0xaafbe615, 0xa7b8c0cc, 0xa379dd7b,
+    0x9b3660c6, 0x9ff77d71, 0x92b45ba8, 0x9675461f, 0x8832161a, 0x8cf30bad, 0x81b02d74, 0x857130c3,
+    0x5d8a9099, 0x594b8d2e, 0x5408abf7, 0x50c9b640, 0x4e8ee645, 0x4a4ffbf2, 0x470cdd2b, 0x43cdc09c,
+    0x7b827d21, 0x7f436096, 0x7200464f, 0x76c15bf8, 0x68860bfd, 0x6c47164a, 0x61043093, 0x65c52d24,
+    0x119b4be9, 0x155a565e, 0x18197087, 0x1cd86d30, 0x029f3d35, 0x065e2082, 0x0b1d065b, 0x0fdc1bec,
+    0x3793a651, 0x3352bbe6, 0x3e119d3f, 0x3ad08088, 0x2497d08d, 0x2056cd3a, 0x2d15ebe3, 0x29d4f654,
+    0xc5a92679, 0xc1683bce, 0xcc2b1d17, 0xc8ea00a0, 0xd6ad50a5, 0xd26c4d12, 0xdf2f6bcb, 0xdbee767c,
+    0xe3a1cbc1, 0xe760d676, 0xea23f0af, 0xeee2ed18, 0xf0a5bd1d, 0xf464a0aa, 0xf9278673, 0xfde69bc4,
+    0x89b8fd09, 0x8d79e0be, 0x803ac667, 0x84fbdbd0, 0x9abc8bd5, 0x9e7d9662, 0x933eb0bb, 0x97ffad0c,
+    0xafb010b1, 0xab710d06, 0xa6322bdf, 0xa2f33668, 0xbcb4666d, 0xb8757bda, 0xb5365d03, 0xb1f740b4
+};
+/* [k][b] is the CRC of byte b followed by k zero bytes, [0] being the table above */
+static uint32_t crc32_mpeg2_slice[8][256];
+
+/* x^192 and x^128 mod P to fold a 128 bit accumulator on by 128 bits, x^576 and x^512 for 512 bits */
+static uint64_t crc32_mpeg2_fold_128[2];
+static uint64_t crc32_mpeg2_fold_512[2];
+
+static uint32_t crc32_mpeg2_bytewise(uint32_t crc, const uint8_t *data, size_t length);
+static uint32_t crc32_mpeg2_slice8(uint32_t crc, const uint8_t *data, size_t length);
+#ifdef CRC32_X86
+static uint32_t crc32_mpeg2_pclmul(uint32_t crc, const uint8_t *data, size_t length);
+#endif
+#ifdef CRC32_ARMV8
+static uint32_t crc32_mpeg2_armv8(uint32_t crc, const uint8_t *data, size_t length);
+#endif
+
+static crc32_mpeg2_kernel_t crc32_mpeg2_all[]={
+    { "bytewise", crc32_mpeg2_bytewise, true  },
+    { "slice8",   crc32_mpeg2_slice8,   false },
+#ifdef CRC32_X86
+    { "pclmul",   crc32_mpeg2_pclmul,   false },
+#else
+    { "pclmul",   NULL,                 false },
+#endif
+#ifdef CRC32_ARMV8
+    { "armv8",    crc32_mpeg2_armv8,    false },
+#else
+    { "armv8",    NULL,                 false },
+#endif
+};
+
+static crc32_mpeg2_kernel_t *crc32_mpeg2_best=&crc32_mpeg2_all[CRC32_KERNEL_BYTEWISE];
+
+/* -------------------------------------------------------------------------------------------------- */
+/* ----------------- ROUTINES ----------------------------------------------------------------------- */
+/* -------------------------------------------------------------------------------------------------- */
+
+/* -------------------------------------------------------------------------------------------------- */
+static uint32_t crc32_mpeg2_bytewise(uint32_t crc, const uint8_t *data, size_t length) {
+/* -------------------------------------------------------------------------------------------------- */
+/* works out the CRC one byte at a time                                                               */
+/*    crc: the CRC so far                                                                             */
+/*  *data: the data to carry it on over                                                               */
+/* length: the number of bytes                                                                        */
+/* return: the new CRC                                                                                */
+/* -------------------------------------------------------------------------------------------------- */
+    while (length--) {
+        crc=(crc << 8) ^ crc32_mpeg2_table[((crc >> 24) ^ *data++) & 0xFF];
+    }
+
+    return crc;
+}
+
+/* -------------------------------------------------------------------------------------------------- */
+static uint32_t crc32_mpeg2_slice8(uint32_t crc, const uint8_t *data, size_t length) {
+/* -------------------------------------------------------------------------------------------------- */
+/* works out the CRC 8 bytes at a time with a table for each                                          */
+/*    crc: the CRC so far                                                                             */
+/*  *data: the data to carry it on over                                                               */
+/* length: the number of bytes                                                                        */
+/* return: the new CRC                                                                                */
+/* -------------------------------------------------------------------------------------------------- */
+    for (; length>=8; data+=8, length-=8) {
+        crc^=((uint32_t)data[0] << 24) | ((uint32_t)data[1] << 16) | ((uint32_t)data[2] << 8) | data[3];
+        crc=crc32_mpeg2_slice[7][crc >> 24] ^ crc32_mpeg2_slice[6][(crc >> 16) & 0xFF] ^
+            crc32_mpeg2_slice[5][(crc >> 8) & 0xFF] ^ crc32_mpeg2_slice[4][crc & 0xFF] ^
+            crc32_mpeg2_slice[3][data[4]] ^ crc32_mpeg2_slice[2][data[5]] ^
+            crc32_mpeg2_slice[1][data[6]] ^ crc32_mpeg2_slice[0][data[7]];
+    }
+
+    return crc32_mpeg2_bytewise(crc, data, length);
+}
+
+#ifdef CRC32_X86
+/* -------------------------------------------------------------------------------------------------- */
+__attribute__((target("pclmul,ssse3")))
+static inline __m128i crc32_mpeg2_fold(__m128i x, __m128i k) {
+/* -------------------------------------------------------------------------------------------------- */
+/*      x: an accumulator, bit n being the coefficient of x^n                                         */
+/*      k: the constants for each half of it                                                          */
+/* return: the accumulator moved on by the distance the constants are for, less multiples of P       */
+/* -------------------------------------------------------------------------------------------------- */
+    return _mm_xor_si128(_mm_clmulepi64_si128(x, k, 0x11), _mm_clmulepi64_si128(x, k, 0x00));
+}
+
+/* -------------------------------------------------------------------------------------------------- */
+__attribute__((target("pclmul,ssse3")))
+static uint32_t crc32_mpeg2_pclmul(uint32_t crc, const uint8_t *data, size_t length) {
+/* -------------------------------------------------------------------------------------------------- */
+/* works out the CRC by folding with carry-less multiplies                                            */
+/*    crc: the CRC so far                                                                             */
+/*  *data: the data to carry it on over                                                               */
+/* length: the number of bytes                                                                        */
+/* return: the new CRC                                                                                */
+/* -------------------------------------------------------------------------------------------------- */
+    /* the first byte is the most significant, so it goes to the top of the accumulator */
+    const __m128i reverse=_mm_setr_epi8(15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0);
+    const __m128i k128=_mm_set_epi64x((long long)crc32_mpeg2_fold_128[0], (long long)crc32_mpeg2_fold_128[1]);
+    const __m128i k512=_mm_set_epi64x((long long)crc32_mpeg2_fold_512[0], (long long)crc32_mpeg2_fold_512[1]);
+    uint8_t folded[16];
+    __m128i x[4];
+    int i;
+    int j;
+
+    if (length<16) return crc32_mpeg2_slice8(crc, data, length);
+
+    for (i=0; (i<4) && (length>=16); i++, data+=16, length-=16) {
+        x[i]=_mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)data), reverse);
+    }
+    /* the CRC so far is the same as XORing it into the first 4 bytes and starting from 0 */
+    x[0]=_mm_xor_si128(x[0], _mm_set_epi32((int)crc, 0, 0, 0));
+
+    if (i==4) {
+        for (; length>=64; data+=64, length-=64) {
+            for (i=0; i<4; i++) {
+                x[i]=_mm_xor_si128(crc32_mpeg2_fold(x[i], k512),
+                                   _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)&data[16*i]), reverse));
+            }
+        }
+        i=4;
+    }
+
+    /* down to the one accumulator, then on 16 bytes at a time */
+    for (j=1; j<i; j++) x[0]=_mm_xor_si128(crc32_mpeg2_fold(x[0], k128), x[j]);
+    for (; length>=16; data+=16, length-=16) {
+        x[0]=_mm_xor_si128(crc32_mpeg2_fold(x[0], k128), _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)data), reverse));
+    }
+
+    /* the accumulator is the same as the data it stands for, so carry on from a CRC of 0 over it */
+    _mm_storeu_si128((__m128i *)folded, _mm_shuffle_epi8(x[0], reverse));
+    crc=crc32_mpeg2_slice8(0, folded, sizeof(folded));
+
+    return crc32_mpeg2_slice8(crc, data, length);
+}
+#endif
+
+#ifdef CRC32_ARMV8
+/* -------------------------------------------------------------------------------------------------- */
+static inline uint32_t crc32_mpeg2_rbit32(uint32_t x) {
+/* -------------------------------------------------------------------------------------------------- */
+    __asm__("rbit %w0, %w1" : "=r"(x) : "r"(x));
+    return x;
+}
+
+/* -------------------------------------------------------------------------------------------------- */
+static inline uint64_t crc32_mpeg2_rbit64(uint64_t x) {
+/* -------------------------------------------------------------------------------------------------- */
+    __asm__("rbit %x0, %x1" : "=r"(x) : "r"(x));
+    return x;
+}
+
+/* -------------------------------------------------------------------------------------------------- */
+__attribute__((target("+crc")))
+static uint32_t crc32_mpeg2_armv8(uint32_t crc, const uint8_t *data, size_t length) {
+/* -------------------------------------------------------------------------------------------------- */
+/* works out the CRC with the CRC32 instructions                                                      */
+/*    crc: the CRC so far                                                                             */
+/*  *data: the data to carry it on over                                                               */
+/* length: the number of bytes                                                                        */
+/* return: the new CRC                                                                                */
+/* -------------------------------------------------------------------------------------------------- */
+    uint64_t word;
+
+    crc=crc32_mpeg2_rbit32(crc);
+
+    for (; length>=8; data+=8, length-=8) {
+        memcpy(&word, data, 8);
+        /* reverses the bits of each byte, leaving the bytes where they are */
+        crc=__crc32d(crc, crc32_mpeg2_rbit64(__builtin_bswap64(word)));
+    }
+    for (; length>0; data++, length--) {
+        crc=__crc32b(crc, (uint8_t)(crc32_mpeg2_rbit32(*data) >> 24));
+    }
+
+    return crc32_mpeg2_rbit32(crc);
+}
+#endif
+
+/* -------------------------------------------------------------------------------------------------- */
+static uint32_t crc32_mpeg2_xpow(uint32_t n) {
+/* -------------------------------------------------------------------------------------------------- */
+/*      n: a power of x                                                                               */
+/* return: x^n mod P                                                                                  */
+/* -------------------------------------------------------------------------------------------------- */
+    uint32_t r=1;
+
+    while (n--) r=(r << 1) ^ ((r & 0x80000000) ? CRC32_MPEG2_POLY : 0);
+
+    return r;
+}
+
+/* -------------------------------------------------------------------------------------------------- */
+void crc32_mpeg2_init(void) {
+/* -------------------------------------------------------------------------------------------------- */
+/* builds the tables and constants and picks the fastest kernel the CPU we are running on has        */
+/* -------------------------------------------------------------------------------------------------- */
+    uint32_t i;
+    uint32_t k;
+
+    for (i=0; i<256; i++) {
+        crc32_mpeg2_slice[0][i]=crc32_mpeg2_table[i];
+        for (k=1; k<8; k++) {
+            crc32_mpeg2_slice[k][i]=(crc32_mpeg2_slice[k-1][i] << 8) ^ crc32_mpeg2_table[crc32_mpeg2_slice[k-1][i] >> 24];
+        }
+    }
+    crc32_mpeg2_fold_128[0]=crc32_mpeg2_xpow(128+64);
+    crc32_mpeg2_fold_128[1]=crc32_mpeg2_xpow(128);
+    crc32_mpeg2_fold_512[0]=crc32_mpeg2_xpow(512+64);
+    crc32_mpeg2_fold_512[1]=crc32_mpeg2_xpow(512);
+
+    crc32_mpeg2_all[CRC32_KERNEL_SLICE8].usable=true;
+    crc32_mpeg2_best=&crc32_mpeg2_all[CRC32_KERNEL_SLICE8];
+
+#ifdef CRC32_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("pclmul") && __builtin_cpu_supports("ssse3")) {
+        crc32_mpeg2_all[CRC32_KERNEL_PCLMUL].usable=true;
+        crc32_mpeg2_best=&crc32_mpeg2_all[CRC32_KERNEL_PCLMUL];
+    }
+#endif
+#ifdef CRC32_ARMV8
+    if (getauxval(AT_HWCAP) & HWCAP_CRC32) {
+        crc32_mpeg2_all[CRC32_KERNEL_ARMV8].usable=true;
+        crc32_mpeg2_best=&crc32_mpeg2_all[CRC32_KERNEL_ARMV8];
+    }
+#endif
+
+    printf("Flow: CRC-32/MPEG-2 using %s\n", crc32_mpeg2_best->name);
+}
+
+/* -------------------------------------------------------------------------------------------------- */
+const char *crc32_mpeg2_kernel(void) {
+/* -------------------------------------------------------------------------------------------------- */
+/* return: the name of the kernel crc32_mpeg2_init() picked                                           */
+/* -------------------------------------------------------------------------------------------------- */
+    return crc32_mpeg2_best->name;
+}
+
+/* -------------------------------------------------------------------------------------------------- */
+uint32_t crc32_mpeg2_kernels(const crc32_mpeg2_kernel_t **kernels) {
+/* -------------------------------------------------------------------------------------------------- */
+/* for comparing the kernels with each other                                                          */
+/* *kernels: filled in with all of them, bytewise first, whether or not this CPU can run them        */
+/*   return: how many there are                                                                       */
+/* -------------------------------------------------------------------------------------------------- */
+    *kernels=crc32_mpeg2_all;
+
+    return sizeof(crc32_mpeg2_all)/sizeof(crc32_mpeg2_all[0]);
+}
+
+/* -------------------------------------------------------------------------------------------------- */
+uint32_t crc32_mpeg2(const uint8_t *data, size_t length) {
+/* -------------------------------------------------------------------------------------------------- */
+/* works out the CRC of some data with the fastest kernel                                             */
+/*  *data: the data, eg. a PSI section up to and including its CRC, which then comes out as 0        */
+/* length: the number of bytes                                                                        */
+/* return: the CRC                                                                                    */
+/* -------------------------------------------------------------------------------------------------- */
+    return crc32_mpeg2_best->fn(CRC32_MPEG2_INIT, data, length);
+}
+
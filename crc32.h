@@ -0,0 +1,44 @@
+/* -------------------------------------------------------------------------------------------------- */
+/* The LongMynd receiver: crc32.h                                                                     */
+/* Copyright 2019 Heather Lomond                                                                      */
+/* -------------------------------------------------------------------------------------------------- */
+/*
+    This file is part of longmynd.
+
+    Longmynd is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Longmynd is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with longmynd.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef CRC32_H
+#define CRC32_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/* a kernel carries a CRC on over some more data: the CRC so far, the data and its length */
+typedef uint32_t (*crc32_mpeg2_fn_t)(uint32_t, const uint8_t *, size_t);
+
+typedef struct {
+    const char *name;
+    crc32_mpeg2_fn_t fn;
+    bool usable;                     /* this CPU can run it, filled in by crc32_mpeg2_init()           */
+} crc32_mpeg2_kernel_t;
+
+void crc32_mpeg2_init(void);
+const char *crc32_mpeg2_kernel(void);
+uint32_t crc32_mpeg2_kernels(const crc32_mpeg2_kernel_t **);
+uint32_t crc32_mpeg2(const uint8_t *, size_t);
+
+#endif
+
@@ -0,0 +1,101 @@
+/* checks each of the CRC-32/MPEG-2 kernels this CPU can run against the bytewise one, then times them */
+/*     usage: crc_bench [MEGABYTES]                                                                   */
+/* MEGABYTES is how much to run through each kernel at each size, 256 if not given                    */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include "crc32.h"
+
+#define CRC_BENCH_MAX    65536
+#define CRC_BENCH_CHECKS 100000
+
+/* a PAT of our own, a PSI section, the biggest SDT or PMT section and a private one, and something big */
+static const size_t sizes[]={ 12, 188, 1021, 4093, CRC_BENCH_MAX };
+
+static double now(void) {
+    struct timespec t;
+
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (double)t.tv_sec+(double)t.tv_nsec/1e9;
+}
+
+int main(int argc, char *argv[]) {
+    const crc32_mpeg2_kernel_t *kernels;
+    uint32_t num_kernels;
+    uint8_t *data;
+    double megabytes=256;
+    double start;
+    double elapsed;
+    uint32_t expected;
+    uint32_t sink=0;
+    uint32_t failures=0;
+    size_t offset;
+    size_t length;
+    size_t s;
+    uint32_t k;
+    uint64_t n;
+    uint64_t runs;
+    int i;
+
+    if (argc>2) {
+        fprintf(stderr, "usage: crc_bench [MEGABYTES]\n");
+        return 1;
+    }
+    if (argc==2) megabytes=strtod(argv[1], NULL);
+
+    crc32_mpeg2_init();
+    num_kernels=crc32_mpeg2_kernels(&kernels);
+
+    /* room for the largest run at any alignment */
+    data=malloc(CRC_BENCH_MAX+64);
+    if (data==NULL) return 1;
+    srand(1);
+    for (i=0; i<CRC_BENCH_MAX+64; i++) data[i]=(uint8_t)rand();
+
+    /* a known answer first, then random lengths and alignments against bytewise */
+    if (kernels[0].fn(0xFFFFFFFF, (const uint8_t *)"123456789", 9)!=0x0376E6E7) {
+        printf("bytewise: wrong check value\n");
+        failures++;
+    }
+    for (i=0; i<CRC_BENCH_CHECKS; i++) {
+        offset=(size_t)(rand() % 64);
+        length=(i<8192) ? (size_t)i : (size_t)(rand() % CRC_BENCH_MAX);
+        expected=kernels[0].fn(0xFFFFFFFF, &data[offset], length);
+        for (k=1; k<num_kernels; k++) {
+            if (!kernels[k].usable) continue;
+            if (kernels[k].fn(0xFFFFFFFF, &data[offset], length)!=expected) {
+                if (failures<10) printf("%s: wrong CRC for %zu bytes at offset %zu\n", kernels[k].name, length, offset);
+                failures++;
+            }
+        }
+    }
+
+    printf("%-10s", "bytes");
+    for (s=0; s<sizeof(sizes)/sizeof(sizes[0]); s++) printf("%10zu", sizes[s]);
+    printf("   (MB/s)\n");
+
+    for (k=0; k<num_kernels; k++) {
+        if (!kernels[k].usable) {
+            printf("%-10s   not available on this CPU\n", kernels[k].name);
+            continue;
+        }
+        printf("%-10s", kernels[k].name);
+        for (s=0; s<sizeof(sizes)/sizeof(sizes[0]); s++) {
+            runs=(uint64_t)(megabytes*1e6/(double)sizes[s])+1;
+            start=now();
+            for (n=0; n<runs; n++) sink+=kernels[k].fn(0xFFFFFFFF, &data[n & 7], sizes[s]);
+            elapsed=now()-start;
+            printf("%10.0f", (double)runs*(double)sizes[s]/elapsed/1e6);
+            fflush(stdout);
+        }
+        printf("\n");
+    }
+
+    free(data);
+    printf("%s, %u wrong (%08x)\n", failures ? "FAILED" : "all kernels agree", failures, sink);
+
+    return failures ? 1 : 0;
+}
+
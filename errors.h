@@ -73,6 +73,15 @@
 #define ERROR_VITERBI_PUNCTURE_RATE 40
 #define ERROR_TS_BUFFER_MALLOC 41
 #define ERROR_THREAD_ERROR 41
+#define ERROR_UDP_ADDRESS 42
+#define ERROR_UDP_MULTICAST 43
+#define ERROR_TS_FILE_OPEN 44
+#define ERROR_TS_FILE_WRITE 45
+#define ERROR_HTTP_SOCKET_OPEN 46
+#define ERROR_HTTP_CLOSE 47
+#define ERROR_TIMESHIFT_OPEN 48
+#define ERROR_TIMESHIFT_EXPORT 49
+#define ERROR_OPEN_CONTROL_FIFO 50
 
 #endif
 
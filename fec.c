@@ -0,0 +1,203 @@
+/* -------------------------------------------------------------------------------------------------- */
+/* The LongMynd receiver: fec.c                                                                       */
+/*    - an implementation of the Serit NIM controlling software for the MiniTiouner Hardware          */
+/*    - Pro-MPEG COP3 / SMPTE 2022-1 row and column XOR FEC for the RTP TS outputs                   */
+/* Copyright 2019 Heather Lomond                                                                      */
+/* -------------------------------------------------------------------------------------------------- */
+/*
+    This file is part of longmynd.
+
+    Longmynd is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Longmynd is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with longmynd.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+/*
+    The RTP datagrams are laid out in turn, a row at a time, in a matrix of L columns and D rows.
+    Each column and each row has a parity packet, the XOR of the payloads (and of the lengths,
+    payload types and timestamps) of the datagrams in it, which can rebuild any one of them that
+    goes missing. Column parity goes out on port+2 and copes with a burst of up to L lost
+    datagrams, row parity goes out on port+4 and mops up the odd one that the columns cannot.
+
+    A parity packet goes out as soon as the last datagram in its column or row has gone. The XOR
+    is done a vector at a time with the compiler's vector extensions, so it comes out as whatever
+    the -march allows (SSE2, AVX2, NEON) with no code for each.
+*/
+
+/* -------------------------------------------------------------------------------------------------- */
+/* ----------------- INCLUDES ----------------------------------------------------------------------- */
+/* -------------------------------------------------------------------------------------------------- */
+
+#include <string.h>
+#include "fec.h"
+
+/* -------------------------------------------------------------------------------------------------- */
+/* ----------------- DEFINES ------------------------------------------------------------------------ */
+/* -------------------------------------------------------------------------------------------------- */
+
+#define FEC_VECTOR_SIZE 32
+
+typedef uint8_t fec_vector_t __attribute__((vector_size(FEC_VECTOR_SIZE)));
+
+#define FEC_RTP_VERSION 0x80
+
+/* -------------------------------------------------------------------------------------------------- */
+/* ----------------- ROUTINES ----------------------------------------------------------------------- */
+/* -------------------------------------------------------------------------------------------------- */
+
+/* -------------------------------------------------------------------------------------------------- */
+void fec_xor(uint8_t *dst, const uint8_t *src, size_t len) {
+/* -------------------------------------------------------------------------------------------------- */
+/* XORs one buffer into another, neither needs to be aligned                                          */
+/* *dst: the buffer to XOR into                                                                       */
+/* *src: the buffer to XOR in                                                                         */
+/*  len: how many bytes                                                                               */
+/* -------------------------------------------------------------------------------------------------- */
+    fec_vector_t a;
+    fec_vector_t b;
+    size_t i=0;
+
+    /* the memcpy()s become unaligned vector loads and stores */
+    for (; i+FEC_VECTOR_SIZE<=len; i+=FEC_VECTOR_SIZE) {
+        memcpy(&a, &dst[i], FEC_VECTOR_SIZE);
+        memcpy(&b, &src[i], FEC_VECTOR_SIZE);
+        a^=b;
+        memcpy(&dst[i], &a, FEC_VECTOR_SIZE);
+    }
+    for (; i<len; i++) dst[i]^=src[i];
+}
+
+/* -------------------------------------------------------------------------------------------------- */
+void fec_ts_init(fec_ts_t *fec, uint8_t l, uint8_t d) {
+/* -------------------------------------------------------------------------------------------------- */
+/* sets up an FEC generator with an empty matrix                                                      */
+/* *fec: the generator to set up                                                                      */
+/*    l: the number of columns, which is the number of datagrams in a row                             */
+/*    d: the number of rows, which is the number of datagrams in a column                             */
+/* -------------------------------------------------------------------------------------------------- */
+    memset(fec, 0, sizeof(fec_ts_t));
+    fec->l=l;
+    fec->d=d;
+}
+
+/* -------------------------------------------------------------------------------------------------- */
+static void fec_ts_parity_add(fec_ts_parity_t *parity, uint8_t *rtp, struct iovec *pieces, int num_pieces) {
+/* -------------------------------------------------------------------------------------------------- */
+/* XORs a datagram into a parity packet, starting it afresh if this is its first                      */
+/*    *parity: the parity packet                                                                      */
+/*       *rtp: the datagram's RTP header                                                              */
+/*    *pieces: the datagram's payload, in one or more segments                                        */
+/* num_pieces: the number of segments                                                                 */
+/* -------------------------------------------------------------------------------------------------- */
+    uint16_t length=0;
+    int i;
+
+    if (parity->count==0) {
+        memset(parity->payload, 0, FEC_TS_PAYLOAD_SIZE);
+        parity->sn_base=((uint16_t)rtp[2] << 8) | rtp[3];
+        parity->length_recovery=0;
+        parity->pt_recovery=0;
+        parity->ts_recovery=0;
+    }
+
+    for (i=0; i<num_pieces; i++) {
+        if (length+pieces[i].iov_len>FEC_TS_PAYLOAD_SIZE) break;
+        fec_xor(&parity->payload[length], pieces[i].iov_base, pieces[i].iov_len);
+        length+=(uint16_t)pieces[i].iov_len;
+    }
+
+    parity->length_recovery^=length;
+    parity->pt_recovery^=rtp[1] & 0x7f;
+    parity->ts_recovery^=((uint32_t)rtp[4] << 24) | ((uint32_t)rtp[5] << 16) | ((uint32_t)rtp[6] << 8) | rtp[7];
+    parity->count++;
+}
+
+/* -------------------------------------------------------------------------------------------------- */
+uint8_t fec_ts_add(fec_ts_t *fec, struct iovec *pieces, int num_pieces) {
+/* -------------------------------------------------------------------------------------------------- */
+/* adds a datagram that has just been sent to the matrix                                              */
+/*       *fec: the FEC generator                                                                      */
+/*    *pieces: the datagram, the first segment is the RTP header and the rest the payload             */
+/* num_pieces: the number of segments                                                                 */
+/*     return: FEC_TS_COLUMN and/or FEC_TS_ROW for the parity packets that are now ready to go        */
+/* -------------------------------------------------------------------------------------------------- */
+    uint8_t *rtp=pieces[0].iov_base;
+    uint32_t column=fec->index % fec->l;
+    uint32_t row=fec->index / fec->l;
+    uint8_t ready=0;
+
+    fec_ts_parity_add(&fec->columns[column], rtp, &pieces[1], num_pieces-1);
+    fec_ts_parity_add(&fec->row, rtp, &pieces[1], num_pieces-1);
+    fec->timestamp=((uint32_t)rtp[4] << 24) | ((uint32_t)rtp[5] << 16) | ((uint32_t)rtp[6] << 8) | rtp[7];
+
+    if (column==(uint32_t)fec->l-1) ready|=FEC_TS_ROW;
+    if (row==(uint32_t)fec->d-1) {
+        ready|=FEC_TS_COLUMN;
+        fec->ready_column=(uint8_t)column;
+    }
+
+    fec->index++;
+    if (fec->index==(uint32_t)fec->l*fec->d) fec->index=0;
+
+    return ready;
+}
+
+/* -------------------------------------------------------------------------------------------------- */
+void fec_ts_packet(fec_ts_t *fec, uint8_t which, struct iovec *iov) {
+/* -------------------------------------------------------------------------------------------------- */
+/* puts together a parity packet that fec_ts_add() said was ready. It has to be sent before the next  */
+/* datagram is added                                                                                  */
+/*  *fec: the FEC generator                                                                           */
+/* which: FEC_TS_COLUMN or FEC_TS_ROW                                                                 */
+/*  *iov: filled in with the packet as 2 segments, its headers and its payload                       */
+/* -------------------------------------------------------------------------------------------------- */
+    bool is_row=(which==FEC_TS_ROW);
+    fec_ts_parity_t *parity = is_row ? &fec->row : &fec->columns[fec->ready_column];
+    uint8_t *header=fec->headers[is_row ? 1 : 0];
+    uint8_t *fec_header=&header[FEC_RTP_HEADER_SIZE];
+    uint16_t sequence=fec->sequence[is_row ? 1 : 0]++;
+
+    /* RTP header, SMPTE 2022-1 has the SSRC as 0 */
+    memset(header, 0, FEC_RTP_HEADER_SIZE+FEC_HEADER_SIZE);
+    header[0]=FEC_RTP_VERSION;
+    header[1]=FEC_RTP_PAYLOAD_FEC;
+    header[2]=(uint8_t)(sequence >> 8);
+    header[3]=(uint8_t)(sequence);
+    header[4]=(uint8_t)(fec->timestamp >> 24);
+    header[5]=(uint8_t)(fec->timestamp >> 16);
+    header[6]=(uint8_t)(fec->timestamp >> 8);
+    header[7]=(uint8_t)(fec->timestamp);
+
+    /* FEC header: SNBase, length recovery, E and PT recovery, mask (0), TS recovery, */
+    /* D, type (XOR) and index (0), offset, NA and the SNBase extension (0)           */
+    fec_header[0]=(uint8_t)(parity->sn_base >> 8);
+    fec_header[1]=(uint8_t)(parity->sn_base);
+    fec_header[2]=(uint8_t)(parity->length_recovery >> 8);
+    fec_header[3]=(uint8_t)(parity->length_recovery);
+    fec_header[4]=0x80 | parity->pt_recovery;
+    fec_header[8]=(uint8_t)(parity->ts_recovery >> 24);
+    fec_header[9]=(uint8_t)(parity->ts_recovery >> 16);
+    fec_header[10]=(uint8_t)(parity->ts_recovery >> 8);
+    fec_header[11]=(uint8_t)(parity->ts_recovery);
+    fec_header[12]=is_row ? 0x40 : 0x00;
+    fec_header[13]=is_row ? 1 : fec->l;
+    fec_header[14]=is_row ? fec->l : fec->d;
+
+    iov[0].iov_base=header;
+    iov[0].iov_len=FEC_RTP_HEADER_SIZE+FEC_HEADER_SIZE;
+    iov[1].iov_base=parity->payload;
+    iov[1].iov_len=FEC_TS_PAYLOAD_SIZE;
+
+    /* the next datagram for this column or row starts it again */
+    parity->count=0;
+}
+
@@ -0,0 +1,79 @@
+/* -------------------------------------------------------------------------------------------------- */
+/* The LongMynd receiver: fec.h                                                                       */
+/* Copyright 2019 Heather Lomond                                                                      */
+/* -------------------------------------------------------------------------------------------------- */
+/*
+    This file is part of longmynd.
+
+    Longmynd is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Longmynd is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with longmynd.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef FEC_H
+#define FEC_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/uio.h>
+
+/* the RTP payload is always 7 TS packets */
+#define FEC_TS_PAYLOAD_SIZE  (7*188)
+#define FEC_RTP_HEADER_SIZE  12
+#define FEC_HEADER_SIZE      16
+
+/* the limits SMPTE 2022-1 puts on the L columns by D rows matrix */
+#define FEC_TS_MAX_L         20
+#define FEC_TS_MIN_D         4
+#define FEC_TS_MAX_D         20
+#define FEC_TS_MAX_LD        100
+
+/* the parity streams go to these ports above the TS */
+#define FEC_TS_COLUMN_PORT   2
+#define FEC_TS_ROW_PORT      4
+
+/* which parity packets are ready to go */
+#define FEC_TS_COLUMN        0x01
+#define FEC_TS_ROW           0x02
+
+#define FEC_RTP_PAYLOAD_FEC  96
+
+typedef struct {
+    uint8_t payload[FEC_TS_PAYLOAD_SIZE] __attribute__((aligned(32)));
+    uint32_t count;                  /* how many media packets are in it so far                        */
+    uint16_t sn_base;                /* the sequence number of the first of them                      */
+    uint16_t length_recovery;
+    uint8_t pt_recovery;
+    uint32_t ts_recovery;
+} fec_ts_parity_t;
+
+typedef struct {
+    uint8_t l;
+    uint8_t d;
+    uint32_t index;                  /* where the next media packet goes in the matrix                 */
+    fec_ts_parity_t row;
+    fec_ts_parity_t columns[FEC_TS_MAX_L];
+    uint8_t ready_column;            /* the column whose parity is ready to go                         */
+    uint32_t timestamp;              /* of the last media packet, for the parity packets               */
+    /* the RTP and FEC headers of the parity packets, [0] is the column stream, [1] the row stream */
+    uint16_t sequence[2];
+    uint8_t headers[2][FEC_RTP_HEADER_SIZE+FEC_HEADER_SIZE];
+} fec_ts_t;
+
+void fec_xor(uint8_t *, const uint8_t *, size_t);
+void fec_ts_init(fec_ts_t *, uint8_t, uint8_t);
+uint8_t fec_ts_add(fec_ts_t *, struct iovec *, int);
+void fec_ts_packet(fec_ts_t *, uint8_t, struct iovec *);
+
+#endif
+
@@ -0,0 +1,320 @@
+/* receives an RTP TS output with SMPTE 2022-1 FEC, throws some of it away and puts it back together */
+/*     usage: fec_read [-d PERCENT] [-b BURST] PORT > out.ts                                         */
+/*     eg.    longmynd -R 127.0.0.1 1234 -E 10 5 ...  and  fec_read -d 2 -b 3 1234 > out.ts          */
+/* The TS goes to stdout, and how many datagrams were lost, rebuilt and still missing to stderr     */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include "fec.h"
+
+/* how many datagrams we hold on to, waiting for the parity that could rebuild them */
+#define FEC_READ_DELAY    (2*FEC_TS_MAX_LD+FEC_TS_MAX_L)
+#define FEC_READ_SLOTS    1024
+#define FEC_READ_PARITIES 256
+#define FEC_READ_MAX      (FEC_RTP_HEADER_SIZE+FEC_HEADER_SIZE+FEC_TS_PAYLOAD_SIZE)
+/* so that the kernel does not lose any more than we are going to */
+#define FEC_READ_RCVBUF   (4*1024*1024)
+
+typedef struct {
+    bool valid;
+    uint16_t seq;
+    uint16_t len;
+    uint8_t pt;
+    uint32_t ts;
+    uint8_t payload[FEC_TS_PAYLOAD_SIZE];
+} media_t;
+
+typedef struct {
+    bool valid;
+    uint16_t sn_base;
+    uint8_t offset;
+    uint8_t na;
+    uint16_t length_recovery;
+    uint8_t pt_recovery;
+    uint32_t ts_recovery;
+    uint8_t payload[FEC_TS_PAYLOAD_SIZE];
+} parity_t;
+
+static media_t media[FEC_READ_SLOTS];
+static parity_t parities[FEC_READ_PARITIES];
+static bool started=false;
+static uint16_t next_out;
+static uint16_t highest;
+
+static uint32_t received=0;
+static uint32_t dropped=0;
+static uint32_t recovered=0;
+static uint32_t lost=0;
+
+static volatile sig_atomic_t running=1;
+
+static void stop(int sig) {
+    (void)sig;
+    running=0;
+}
+
+static int open_port(int port) {
+    struct sockaddr_in6 addr6;
+    struct sockaddr_in addr;
+    int off=0;
+    int rcvbuf=FEC_READ_RCVBUF;
+    int fd;
+
+    /* IPv6 and IPv4 on the one socket if we can, just IPv4 if not */
+    fd=socket(AF_INET6, SOCK_DGRAM, 0);
+    if (fd>=0) {
+        setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &off, sizeof(off));
+        setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+        memset(&addr6, 0, sizeof(addr6));
+        addr6.sin6_family=AF_INET6;
+        addr6.sin6_addr=in6addr_any;
+        addr6.sin6_port=htons((uint16_t)port);
+        if (bind(fd, (struct sockaddr *)&addr6, sizeof(addr6))==0) return fd;
+        close(fd);
+    }
+    fd=socket(AF_INET, SOCK_DGRAM, 0);
+    if (fd>=0) {
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family=AF_INET;
+        addr.sin_addr.s_addr=htonl(INADDR_ANY);
+        addr.sin_port=htons((uint16_t)port);
+        setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+        if (bind(fd, (struct sockaddr *)&addr, sizeof(addr))==0) return fd;
+        close(fd);
+    }
+    fprintf(stderr, "Failed to open UDP port %i\n", port);
+    return -1;
+}
+
+/* true if a is after b, allowing for the sequence numbers wrapping */
+static bool after(uint16_t a, uint16_t b) {
+    return (int16_t)(a-b)>0;
+}
+
+static void heard_of(uint16_t seq) {
+    if (!started) {
+        next_out=seq;
+        highest=seq;
+        started=true;
+    } else if (after(seq, highest)) {
+        highest=seq;
+    }
+}
+
+static void store(uint16_t seq, uint16_t len, uint8_t pt, uint32_t ts, const uint8_t *payload) {
+    media_t *m=&media[seq % FEC_READ_SLOTS];
+
+    if (started && after(next_out, seq)) return; /* too late, it has already gone */
+    m->valid=true;
+    m->seq=seq;
+    m->len=len;
+    m->pt=pt;
+    m->ts=ts;
+    memcpy(m->payload, payload, len);
+    memset(&m->payload[len], 0, FEC_TS_PAYLOAD_SIZE-len);
+    heard_of(seq);
+}
+
+static bool have(uint16_t seq) {
+    return media[seq % FEC_READ_SLOTS].valid && (media[seq % FEC_READ_SLOTS].seq==seq);
+}
+
+/* goes round the parity packets rebuilding what we can, until nothing more can be done */
+static void recover(void) {
+    media_t rebuilt;
+    parity_t *p;
+    uint16_t missing_seq=0;
+    uint16_t seq;
+    int missing;
+    bool progress=true;
+    int i;
+    int k;
+
+    while (progress) {
+        progress=false;
+        for (i=0; i<FEC_READ_PARITIES; i++) {
+            p=&parities[i];
+            if (!p->valid) continue;
+            missing=0;
+            for (k=0; k<p->na; k++) {
+                seq=(uint16_t)(p->sn_base+k*p->offset);
+                if (!have(seq)) {
+                    missing++;
+                    missing_seq=seq;
+                }
+            }
+            /* nothing to do, or it is too late to do it */
+            if ((missing==0) || after(next_out, (uint16_t)(p->sn_base+(p->na-1)*p->offset))) p->valid=false;
+            if ((missing==1) && after(next_out, missing_seq)) p->valid=false;
+            if ((missing!=1) || !p->valid) continue;
+
+            memcpy(rebuilt.payload, p->payload, FEC_TS_PAYLOAD_SIZE);
+            rebuilt.len=p->length_recovery;
+            rebuilt.pt=p->pt_recovery;
+            rebuilt.ts=p->ts_recovery;
+            for (k=0; k<p->na; k++) {
+                seq=(uint16_t)(p->sn_base+k*p->offset);
+                if (seq==missing_seq) continue;
+                fec_xor(rebuilt.payload, media[seq % FEC_READ_SLOTS].payload, FEC_TS_PAYLOAD_SIZE);
+                rebuilt.len^=media[seq % FEC_READ_SLOTS].len;
+                rebuilt.pt^=media[seq % FEC_READ_SLOTS].pt;
+                rebuilt.ts^=media[seq % FEC_READ_SLOTS].ts;
+            }
+            if (rebuilt.len<=FEC_TS_PAYLOAD_SIZE) {
+                store(missing_seq, rebuilt.len, rebuilt.pt, rebuilt.ts, rebuilt.payload);
+                recovered++;
+            }
+            p->valid=false;
+            progress=true;
+        }
+    }
+}
+
+static void write_all(const uint8_t *data, size_t len) {
+    ssize_t ret;
+
+    while (len>0) {
+        ret=write(STDOUT_FILENO, data, len);
+        if (ret<=0) {
+            running=0;
+            return;
+        }
+        data+=ret;
+        len-=(size_t)ret;
+    }
+}
+
+/* sends out, in order, the datagrams that have waited long enough for any parity to arrive. The */
+/* missing ones are only rebuilt then, as until then they may just be late                        */
+static void output(bool flush) {
+    media_t *m;
+
+    while (started && (flush ? !after(next_out, highest) : (uint16_t)(highest-next_out)>FEC_READ_DELAY)) {
+        m=&media[next_out % FEC_READ_SLOTS];
+        if (!have(next_out)) recover();
+        if (have(next_out)) {
+            /* it stays, as it may be needed to rebuild another */
+            write_all(m->payload, m->len);
+        } else {
+            lost++;
+        }
+        next_out++;
+    }
+}
+
+static void media_in(uint8_t *buf, ssize_t len, double drop_percent, int burst) {
+    static int burst_left=0;
+    uint16_t seq;
+
+    if ((len<FEC_RTP_HEADER_SIZE) || (len-FEC_RTP_HEADER_SIZE>FEC_TS_PAYLOAD_SIZE) || ((buf[0] & 0xc0)!=0x80)) return;
+    received++;
+
+    /* pretend the network lost it */
+    if ((burst_left==0) && (drop_percent>0) && (rand()<drop_percent/100*RAND_MAX)) burst_left=burst;
+    if (burst_left>0) {
+        burst_left--;
+        dropped++;
+        return;
+    }
+
+    seq=((uint16_t)buf[2] << 8) | buf[3];
+    store(seq, (uint16_t)(len-FEC_RTP_HEADER_SIZE), buf[1] & 0x7f,
+          ((uint32_t)buf[4] << 24) | ((uint32_t)buf[5] << 16) | ((uint32_t)buf[6] << 8) | buf[7],
+          &buf[FEC_RTP_HEADER_SIZE]);
+}
+
+static void parity_in(uint8_t *buf, ssize_t len) {
+    uint8_t *h=&buf[FEC_RTP_HEADER_SIZE];
+    parity_t *p=NULL;
+    int i;
+
+    if (len<FEC_RTP_HEADER_SIZE+FEC_HEADER_SIZE) return;
+    len-=FEC_RTP_HEADER_SIZE+FEC_HEADER_SIZE;
+    if ((len>FEC_TS_PAYLOAD_SIZE) || (h[13]==0) || (h[14]==0)) return;
+
+    /* a free slot, or the oldest if they are all in use */
+    for (i=0; i<FEC_READ_PARITIES; i++) {
+        if (!parities[i].valid) {
+            p=&parities[i];
+            break;
+        }
+        if ((p==NULL) || after(p->sn_base, parities[i].sn_base)) p=&parities[i];
+    }
+
+    p->valid=true;
+    p->sn_base=((uint16_t)h[0] << 8) | h[1];
+    p->length_recovery=((uint16_t)h[2] << 8) | h[3];
+    p->pt_recovery=h[4] & 0x7f;
+    p->ts_recovery=((uint32_t)h[8] << 24) | ((uint32_t)h[9] << 16) | ((uint32_t)h[10] << 8) | h[11];
+    p->offset=h[13];
+    p->na=h[14];
+    memcpy(p->payload, &h[FEC_HEADER_SIZE], (size_t)len);
+    memset(&p->payload[len], 0, FEC_TS_PAYLOAD_SIZE-(size_t)len);
+
+    heard_of((uint16_t)(p->sn_base+(p->na-1)*p->offset));
+}
+
+int main(int argc, char *argv[]) {
+    uint8_t buf[FEC_READ_MAX];
+    struct pollfd pfd[3];
+    double drop_percent=0;
+    int burst=1;
+    int port;
+    time_t last=time(NULL);
+    ssize_t len;
+    int opt;
+    int i;
+
+    while ((opt=getopt(argc, argv, "d:b:"))!=-1) {
+        if (opt=='d') drop_percent=strtod(optarg, NULL);
+        else if (opt=='b') burst=atoi(optarg);
+        else optind=argc+1;
+    }
+    if ((optind!=argc-1) || (burst<1)) {
+        fprintf(stderr, "usage: fec_read [-d PERCENT] [-b BURST] PORT > out.ts\n");
+        return 1;
+    }
+    port=atoi(argv[optind]);
+
+    /* the TS, then the column parity on port+2 and the row parity on port+4 */
+    pfd[0].fd=open_port(port);
+    pfd[1].fd=open_port(port+FEC_TS_COLUMN_PORT);
+    pfd[2].fd=open_port(port+FEC_TS_ROW_PORT);
+    if ((pfd[0].fd<0) || (pfd[1].fd<0) || (pfd[2].fd<0)) return 1;
+    for (i=0; i<3; i++) pfd[i].events=POLLIN;
+
+    signal(SIGINT, stop);
+    signal(SIGTERM, stop);
+    srand((unsigned int)time(NULL));
+
+    while (running) {
+        if (poll(pfd, 3, 100)>0) {
+            for (i=0; i<3; i++) {
+                if ((pfd[i].revents & POLLIN)==0) continue;
+                len=recv(pfd[i].fd, buf, sizeof(buf), 0);
+                if (len<=0) continue;
+                if (i==0) media_in(buf, len, drop_percent, burst);
+                else      parity_in(buf, len);
+            }
+            output(false);
+        }
+        if (time(NULL)!=last) {
+            last=time(NULL);
+            fprintf(stderr, "received %u dropped %u recovered %u lost %u\n", received, dropped, recovered, lost);
+        }
+    }
+
+    output(true);
+    fprintf(stderr, "received %u dropped %u recovered %u lost %u\n", received, dropped, recovered, lost);
+
+    for (i=0; i<3; i++) close(pfd[i].fd);
+    return 0;
+}
@@ -30,9 +30,14 @@
 #include <fcntl.h> 
 #include <sys/stat.h> 
 #include <sys/types.h> 
+#include <sys/uio.h>
+#include <sys/ioctl.h>
 #include <stdint.h>
 #include <unistd.h>
 #include <stdbool.h>
+#include <stdlib.h>
+#include <errno.h>
+#include "main.h"
 #include "errors.h"
 #include "fifo.h"
 
@@ -40,7 +45,6 @@
 /* ----------------- GLOBALS ------------------------------------------------------------------------ */
 /* -------------------------------------------------------------------------------------------------- */
 
-int fd_ts_fifo;
 int fd_status_fifo;
 
 /* -------------------------------------------------------------------------------------------------- */
@@ -48,44 +52,233 @@ int fd_status_fifo;
 /* -------------------------------------------------------------------------------------------------- */
 
 /* -------------------------------------------------------------------------------------------------- */
-uint8_t fifo_ts_write(uint8_t *buffer, uint32_t len) {
+static size_t fifo_iov_advance(struct iovec **iov, int *iovcnt, size_t len) {
 /* -------------------------------------------------------------------------------------------------- */
-/* takes a buffer and writes out the contents to the ts fifo but removes the unwanted bytes           */
-/* *buffer: the buffer that contains the data to be sent                                              */
-/*     len: the length (number of bytes) of data to be sent                                           */
+/* moves a list of segments on past a number of bytes                                                 */
+/*    **iov: the list, left pointing at the first segment with anything left in it                    */
+/*  *iovcnt: the number of segments, reduced by the ones used up                                      */
+/*      len: the number of bytes to move on                                                           */
+/*   return: the number of bytes actually moved on, less than len if the list ran out                 */
+/* -------------------------------------------------------------------------------------------------- */
+    size_t done=0;
+    size_t n;
+
+    while ((*iovcnt>0) && (done<len)) {
+        n=(*iov)->iov_len;
+        if (n>len-done) n=len-done;
+        (*iov)->iov_base=(uint8_t *)(*iov)->iov_base+n;
+        (*iov)->iov_len-=n;
+        done+=n;
+        if ((*iov)->iov_len==0) {
+            (*iov)++;
+            (*iovcnt)--;
+        }
+    }
+
+    return done;
+}
+
+/* -------------------------------------------------------------------------------------------------- */
+static ssize_t fifo_ts_writev(fifo_ts_t *fifo_ts, struct iovec *iov, int iovcnt, bool splice) {
+/* -------------------------------------------------------------------------------------------------- */
+/* puts a list of TS segments into the pipe, either by copying or by handing over the pages          */
+/* *fifo_ts: the TS fifo to write to                                                                  */
+/*     *iov: the segments of TS                                                                       */
+/*   iovcnt: the number of segments                                                                   */
+/*   splice: true to put references to our pages in the pipe rather than a copy of them               */
+/*   return: the number of bytes taken, or -1 with errno set                                          */
+/* -------------------------------------------------------------------------------------------------- */
+    ssize_t ret;
+
+    /* without SPLICE_F_GIFT the pages stay ours, they are just not to be written until they are read */
+    if (splice) ret=vmsplice(fifo_ts->fd, iov, iovcnt, fifo_ts->nonblocking ? SPLICE_F_NONBLOCK : 0);
+    else        ret=writev(fifo_ts->fd, iov, iovcnt);
+
+    if (ret>0) fifo_ts->piped+=ret;
+
+    return ret;
+}
+
+/* -------------------------------------------------------------------------------------------------- */
+static void fifo_ts_drop(fifo_ts_t *fifo_ts, size_t len) {
+/* -------------------------------------------------------------------------------------------------- */
+/* throws away TS we cannot write, keeping count of the packets that never get to the reader          */
+/* *fifo_ts: the TS fifo                                                                              */
+/*      len: the number of bytes being thrown away, starting at phase                                 */
+/* -------------------------------------------------------------------------------------------------- */
+    size_t first=(FIFO_TS_PACKET_SIZE-fifo_ts->phase) % FIFO_TS_PACKET_SIZE;
+
+    /* the packet we are part way into was either dropped already or written, so only count new ones */
+    if (fifo_ts->connected && (len>first)) fifo_ts->drops+=(len-first-1)/FIFO_TS_PACKET_SIZE+1;
+
+    fifo_ts->phase=(fifo_ts->phase+len) % FIFO_TS_PACKET_SIZE;
+    /* whatever is left of the packet we stopped in has to go too, or the reader gets half a packet */
+    if (len>0) fifo_ts->dropping=(fifo_ts->phase!=0);
+}
+
+/* -------------------------------------------------------------------------------------------------- */
+static void fifo_ts_set_pipe_size(fifo_ts_t *fifo_ts) {
+/* -------------------------------------------------------------------------------------------------- */
+/* makes the pipe behind the fifo as big as we are allowed, so that the reader can pause for longer   */
+/* before we have to start dropping                                                                   */
+/* *fifo_ts: the TS fifo, just opened                                                                 */
+/* -------------------------------------------------------------------------------------------------- */
+    int size=FIFO_TS_PIPE_SIZE;
+    FILE *f;
+
+    if (fcntl(fifo_ts->fd, F_SETPIPE_SZ, size)<0) {
+        /* without CAP_SYS_RESOURCE we can only go up to the system limit */
+        f=fopen("/proc/sys/fs/pipe-max-size", "r");
+        if (f!=NULL) {
+            if ((fscanf(f, "%i", &size)==1) && (size<FIFO_TS_PIPE_SIZE)) fcntl(fifo_ts->fd, F_SETPIPE_SZ, size);
+            fclose(f);
+        }
+    }
+
+    size=fcntl(fifo_ts->fd, F_GETPIPE_SZ);
+    fifo_ts->pipe_size = (size>0) ? (uint32_t)size : 0;
+    printf("      Status: ts fifo pipe is %i bytes\n",fifo_ts->pipe_size);
+}
+
+/* -------------------------------------------------------------------------------------------------- */
+static void fifo_ts_connect(fifo_ts_t *fifo_ts) {
+/* -------------------------------------------------------------------------------------------------- */
+/* non-blocking mode: tries to open the fifo, which only works once something has it open to read    */
+/* *fifo_ts: the TS fifo                                                                              */
+/* -------------------------------------------------------------------------------------------------- */
+    fifo_ts->last_connect=monotonic_ms();
+
+    fifo_ts->fd=open(fifo_ts->path, O_WRONLY | O_NONBLOCK);
+    if (fifo_ts->fd>=0) {
+        printf("      Status: ts fifo %s has a reader\n",fifo_ts->path);
+        fifo_ts_set_pipe_size(fifo_ts);
+        fifo_ts->connected=true;
+        fifo_ts->pending_len=0;
+    }
+}
+
+/* -------------------------------------------------------------------------------------------------- */
+static void fifo_ts_disconnect(fifo_ts_t *fifo_ts) {
+/* -------------------------------------------------------------------------------------------------- */
+/* non-blocking mode: the reader has gone, so we go back to waiting for the next one                  */
+/* *fifo_ts: the TS fifo                                                                              */
+/* -------------------------------------------------------------------------------------------------- */
+    printf("      Status: ts fifo %s has lost its reader\n",fifo_ts->path);
+    close(fifo_ts->fd);
+    fifo_ts->fd=-1;
+    fifo_ts->connected=false;
+    fifo_ts->pending_len=0;
+    fifo_ts->last_connect=monotonic_ms();
+    fifo_ts->reconnects++;
+}
+
+/* -------------------------------------------------------------------------------------------------- */
+static uint8_t fifo_ts_write_nonblocking(fifo_ts_t *fifo_ts, struct iovec *iov, int iovcnt, bool splice) {
+/* -------------------------------------------------------------------------------------------------- */
+/* writes as much TS as the pipe has room for, and drops whole packets of the rest. A missing reader  */
+/* is not an error, we just keep looking for a new one                                                */
+/* *fifo_ts: the TS fifo to write to                                                                  */
+/*    *iov: the segments of TS to be sent                                                             */
+/*  iovcnt: the number of segments                                                                    */
+/*  splice: true to vmsplice the TS in, see fifo_ts_write()                                           */
 /*  return: error code                                                                                */
 /* -------------------------------------------------------------------------------------------------- */
-    uint8_t err=ERROR_NONE;
-    int ret;
-    int32_t remaining_len; /* note it is signed so can go negative */
-    uint32_t write_size;
-
-    remaining_len=len;
-    /* we need to loop round sending 510 byte chunks so that we can skip the 2 extra bytes put in by */
-    /* the FTDI chip every 512 bytes of USB message */
-    while (remaining_len>0) {
-        if (remaining_len>510) {
-             /* calculate where to start in the buffer and how many bytes to send */
-             write_size=510;
-             ret=write(fd_ts_fifo, &buffer[len-remaining_len], write_size); 
-             /* note we skip over the 2 bytes inserted by the FTDI */
-             remaining_len-=512;
-        } else {
-             write_size=remaining_len;
-             ret=write(fd_ts_fifo, &buffer[len-remaining_len], write_size);
-             remaining_len-=write_size; /* should be 0 if all went well */
+    size_t len=0;
+    size_t n;
+    size_t m;
+    ssize_t ret;
+    int i;
+
+    for (i=0; i<iovcnt; i++) len+=iov[i].iov_len;
+
+    if (!fifo_ts->connected && (monotonic_ms() > fifo_ts->last_connect+FIFO_TS_RECONNECT_MS)) {
+        fifo_ts_connect(fifo_ts);
+    }
+
+    /* the end of a packet we only got part way through last time has to go first */
+    if (fifo_ts->connected && (fifo_ts->pending_len>0)) {
+        ret=write(fifo_ts->fd, fifo_ts->pending, fifo_ts->pending_len);
+        if (ret>0) {
+            fifo_ts->piped+=ret;
+            fifo_ts->pending_len-=ret;
+            memmove(fifo_ts->pending, &fifo_ts->pending[ret], fifo_ts->pending_len);
+        } else if ((ret<0) && (errno!=EAGAIN)) {
+            fifo_ts_disconnect(fifo_ts);
         }
-        if (ret!=(int)write_size) {
-            printf("ERROR: ts fifo write\n");
-            err=ERROR_TS_FIFO_WRITE;
-            break;
+    }
+
+    /* finish throwing away a packet we started to drop last time */
+    if (fifo_ts->dropping) {
+        n=fifo_iov_advance(&iov, &iovcnt, (FIFO_TS_PACKET_SIZE-fifo_ts->phase) % FIFO_TS_PACKET_SIZE);
+        fifo_ts_drop(fifo_ts, n);
+        len-=n;
+    }
+
+    if (fifo_ts->connected && (fifo_ts->pending_len==0) && (len>0)) {
+        ret=fifo_ts_writev(fifo_ts, iov, iovcnt, splice);
+        if (ret>0) {
+            fifo_iov_advance(&iov, &iovcnt, ret);
+            fifo_ts->phase=(fifo_ts->phase+ret) % FIFO_TS_PACKET_SIZE;
+            len-=ret;
+        } else if ((ret<0) && (errno!=EAGAIN)) {
+            fifo_ts_disconnect(fifo_ts);
         }
     }
 
-    /* if someting went bad with our calcs, remaining will not be 0 */
-    if ((err==ERROR_NONE) && (remaining_len!=0)) {
-        printf("ERROR: ts fifo write incorrect number of bytes\n");
-        err=ERROR_TS_FIFO_WRITE;
+    /* the pipe is full: keep hold of the rest of the packet we are part way through, drop the others */
+    if (fifo_ts->connected && !fifo_ts->dropping && (fifo_ts->phase!=0) && (len>0)) {
+        n=FIFO_TS_PACKET_SIZE-fifo_ts->phase;
+        if (n>len) n=len;
+        while ((iovcnt>0) && (n>0)) {
+            m = (iov->iov_len<n) ? iov->iov_len : n;
+            memcpy(&fifo_ts->pending[fifo_ts->pending_len], iov->iov_base, m);
+            fifo_ts->pending_len+=m;
+            fifo_ts->phase=(fifo_ts->phase+m) % FIFO_TS_PACKET_SIZE;
+            len-=m;
+            n-=m;
+            fifo_iov_advance(&iov, &iovcnt, m);
+        }
+    }
+
+    if (len>0) fifo_ts_drop(fifo_ts, len);
+
+    return ERROR_NONE;
+}
+
+/* -------------------------------------------------------------------------------------------------- */
+uint8_t fifo_ts_write(fifo_ts_t *fifo_ts, struct iovec *iov, int iovcnt, bool splice) {
+/* -------------------------------------------------------------------------------------------------- */
+/* takes a list of TS segments and writes them all out to the ts fifo in one go                       */
+/* *fifo_ts: the TS fifo to write to                                                                  */
+/*    *iov: the segments of TS to be sent, the FTDI headers have already been taken out              */
+/*  iovcnt: the number of segments                                                                    */
+/*  splice: true to vmsplice the TS in rather than copy it. The pipe then holds our pages, so they    */
+/*          must not be written again until fifo_ts_drained() has gone past fifo_ts->piped as it      */
+/*          stands once this returns                                                                  */
+/*  return: error code                                                                                */
+/* -------------------------------------------------------------------------------------------------- */
+    uint8_t err=ERROR_NONE;
+    ssize_t ret;
+
+    if (fifo_ts->nonblocking) return fifo_ts_write_nonblocking(fifo_ts, iov, iovcnt, splice);
+
+    while ((err==ERROR_NONE) && (iovcnt>0)) {
+        ret=fifo_ts_writev(fifo_ts, iov, iovcnt, splice);
+        if (ret<0) {
+            printf("ERROR: ts fifo write\n");
+            err=ERROR_TS_FIFO_WRITE;
+        } else {
+            /* a short write leaves us part way through the list, so carry on from where it got to */
+            while ((iovcnt>0) && ((size_t)ret>=iov->iov_len)) {
+                ret-=iov->iov_len;
+                iov++;
+                iovcnt--;
+            }
+            if (iovcnt>0) {
+                iov->iov_base=(uint8_t *)iov->iov_base+ret;
+                iov->iov_len-=ret;
+            }
+        }
     }
 
     if (err!=ERROR_NONE) printf("ERROR: fifo ts write\n");
@@ -93,6 +286,26 @@ uint8_t fifo_ts_write(uint8_t *buffer, uint32_t len) {
     return err;
 }
 
+/* -------------------------------------------------------------------------------------------------- */
+uint64_t fifo_ts_drained(fifo_ts_t *fifo_ts) {
+/* -------------------------------------------------------------------------------------------------- */
+/* works out how much of what we have put into the pipe is no longer in it                            */
+/* *fifo_ts: the TS fifo                                                                              */
+/*   return: the bytes out of fifo_ts->piped that the pipe has finished with, either because they     */
+/*           have been read or because the pipe they were in has gone                                 */
+/* -------------------------------------------------------------------------------------------------- */
+    int queued;
+
+    /* with no pipe open nothing of ours can still be in one */
+    if (fifo_ts->fd<0) return fifo_ts->piped;
+
+    /* if we can't tell, assume nothing has been read, so that pages are never reused too soon */
+    if ((ioctl(fifo_ts->fd, FIONREAD, &queued)<0) || (queued<0)) return 0;
+    if ((uint64_t)queued>fifo_ts->piped) return 0;
+
+    return fifo_ts->piped-(uint64_t)queued;
+}
+
 /* -------------------------------------------------------------------------------------------------- */
 uint8_t fifo_status_write(uint8_t message, uint32_t data) {
 /* -------------------------------------------------------------------------------------------------- */
@@ -165,8 +378,43 @@ static uint8_t fifo_init(int *fd_ptr, char *fifo_path) {
     return err;
 }
 
-uint8_t fifo_ts_init(char *fifo_path) {
-    return fifo_init(&fd_ts_fifo, fifo_path);
+/* -------------------------------------------------------------------------------------------------- */
+uint8_t fifo_ts_init(fifo_ts_t *fifo_ts, char *fifo_path, bool nonblocking) {
+/* -------------------------------------------------------------------------------------------------- */
+/* initialises a TS fifo. In blocking mode this waits for a reader, in non-blocking mode it carries  */
+/* on without one and picks the reader up when it arrives                                             */
+/*    *fifo_ts: the TS fifo to set up                                                                 */
+/*   fifo_path: the name of the fifo                                                                  */
+/* nonblocking: true to never wait for the reader                                                     */
+/*      return: error code                                                                            */
+/* -------------------------------------------------------------------------------------------------- */
+    strncpy(fifo_ts->path, fifo_path, sizeof(fifo_ts->path)-1);
+    fifo_ts->path[sizeof(fifo_ts->path)-1]='\0';
+    fifo_ts->nonblocking=nonblocking;
+    fifo_ts->connected=false;
+    fifo_ts->pipe_size=0;
+    fifo_ts->pending_len=0;
+    fifo_ts->phase=0;
+    fifo_ts->dropping=false;
+    fifo_ts->drops=0;
+    fifo_ts->reconnects=0;
+    fifo_ts->piped=0;
+    fifo_ts->fd=-1;
+
+    if (!nonblocking) return fifo_init(&fifo_ts->fd, fifo_path);
+
+    printf("Flow: Fifo Init, non-blocking\n");
+    fifo_ts_connect(fifo_ts);
+    if (!fifo_ts->connected) {
+        if (errno==ENXIO) {
+            printf("      Status: ts fifo %s has no reader yet\n",fifo_ts->path);
+        } else {
+            printf("ERROR: Failed to open fifo %s\n",fifo_path);
+            return ERROR_OPEN_TS_FIFO;
+        }
+    }
+
+    return ERROR_NONE;
 }
 
 uint8_t fifo_status_init(char *fifo_path) {
@@ -174,22 +422,36 @@ uint8_t fifo_status_init(char *fifo_path) {
 }
 
 /* -------------------------------------------------------------------------------------------------- */
-uint8_t fifo_close(bool ignore_ts_fifo) {
-/* ------------------------------------------------------------------------------------------------- */
-/* closes the fifo's                                                                                  */
-/* return: error code                                                                                 */
+uint8_t fifo_ts_close(fifo_ts_t *fifo_ts) {
 /* -------------------------------------------------------------------------------------------------- */
-    uint8_t err;
+/* closes a TS fifo                                                                                   */
+/* *fifo_ts: the TS fifo to close                                                                     */
+/*   return: error code                                                                               */
+/* -------------------------------------------------------------------------------------------------- */
+    uint8_t err=ERROR_NONE;
     int ret;
 
-    if (!ignore_ts_fifo) {
-        ret=close(fd_ts_fifo);
-        if (ret!=0) {
-            printf("ERROR: ts fifo close\n");
-            err=ERROR_TS_FIFO_CLOSE;
-        }
+    /* non-blocking and nobody listening, so there is nothing open */
+    if (fifo_ts->fd<0) return err;
+
+    ret=close(fifo_ts->fd);
+    if (ret!=0) {
+        printf("ERROR: ts fifo close\n");
+        err=ERROR_TS_FIFO_CLOSE;
     }
 
+    return err;
+}
+
+/* -------------------------------------------------------------------------------------------------- */
+uint8_t fifo_close(void) {
+/* ------------------------------------------------------------------------------------------------- */
+/* closes the status fifo                                                                             */
+/* return: error code                                                                                 */
+/* -------------------------------------------------------------------------------------------------- */
+    uint8_t err=ERROR_NONE;
+    int ret;
+
     ret=close(fd_status_fifo); 
     if (ret!=0) {
         printf("ERROR: status fifo close\n");
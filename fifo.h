@@ -23,13 +23,39 @@
 #define FIFO_H
 
 #include <stdint.h>
-
-uint8_t fifo_ts_write(uint8_t*, uint32_t);
+#include <stdbool.h>
+#include <sys/uio.h>
+
+#define FIFO_TS_PACKET_SIZE   188
+#define FIFO_TS_PIPE_SIZE     (1024*1024) /* asked for in non-blocking mode, capped at pipe-max-size   */
+#define FIFO_TS_RECONNECT_MS  500         /* how often to look for a reader when there isn't one       */
+
+typedef struct {
+    int fd;
+    char path[128];
+    bool nonblocking;
+    bool connected;
+    uint32_t pipe_size;
+    uint64_t last_connect;                /* monotonic ms of the last attempt to open the fifo          */
+    /* when a write only gets part way through a packet the rest of that packet waits here, so that  */
+    /* the reader only ever sees whole packets                                                        */
+    uint8_t pending[FIFO_TS_PACKET_SIZE];
+    uint32_t pending_len;
+    uint32_t phase;                       /* how far into a packet the TS we have been given has got   */
+    bool dropping;                        /* the packet at phase is being thrown away                  */
+    uint32_t drops;                       /* TS packets thrown away because the pipe was full          */
+    uint32_t reconnects;
+    uint64_t piped;                       /* bytes put into the pipe so far, however they went in      */
+} fifo_ts_t;
+
+uint8_t fifo_ts_write(fifo_ts_t*, struct iovec*, int, bool);
+uint64_t fifo_ts_drained(fifo_ts_t*);
 uint8_t fifo_status_write(uint8_t, uint32_t);
 uint8_t fifo_status_string_write(uint8_t, char*);
-uint8_t fifo_ts_init(char *fifo_path);
+uint8_t fifo_ts_init(fifo_ts_t *fifo_ts, char *fifo_path, bool nonblocking);
 uint8_t fifo_status_init(char *fifo_path);
-uint8_t fifo_close(bool);
+uint8_t fifo_ts_close(fifo_ts_t*);
+uint8_t fifo_close(void);
 
 #endif
 
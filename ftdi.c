@@ -48,6 +48,15 @@
 #define MSB_FALLING_EDGE_CLOCK_BYTE_OUT 0x11
 #define MSB_RISING_EDGE_CLOCK_BIT_IN    0x22
 #define MSB_FAILING_EDGE_CLOCK_BIT_IN   0x26
+#define MPSSE_SEND_IMMEDIATE            0x87
+
+/* a whole i2c transaction (start, address, register, restart, read, stop) is queued up in the out   */
+/* buffer and sent as one usb write. Every ack bit or data byte clocked in gives one reply byte      */
+#define FTDI_OUT_BUFFER_SIZE 4096
+#define FTDI_MAX_REPLIES     512
+/* number of bytes queued by a start and a stop together, and by writing out each byte */
+#define FTDI_I2C_START_STOP_LEN (12*FTDI_STOP_START_REPEATS + 3)
+#define FTDI_I2C_BYTE_LEN       12
 
 /*
 FTDI GPIO Pins
@@ -73,7 +82,12 @@ MSB
 /* -------------------------------------------------------------------------------------------------- */
 
 static int num_bytes_to_send = 0;
-static uint8_t out_buffer[256];
+static uint8_t out_buffer[FTDI_OUT_BUFFER_SIZE];
+
+/* for each reply byte we are expecting back: NULL means it is an ack bit to be checked, otherwise it */
+/* is where to put the data byte that was read */
+static uint8_t *replies[FTDI_MAX_REPLIES];
+static int num_replies_expected = 0;
 
 /* Default GPIO value 0x6f = 0b01101111 = LNB Bias Off, LNB Voltage 12V, NIM not reset */
 static uint8_t ftdi_gpio_value = 0x6f;
@@ -202,14 +216,12 @@ uint8_t ftdi_i2c_set_stop(void) {
 /* -------------------------------------------------------------------------------------------------- */
 uint8_t ftdi_i2c_send_byte_check_ack(uint8_t b)
 /* -------------------------------------------------------------------------------------------------- */
-/* writes a byte to the i2c bus and checks we get an ack                                              */
+/* queues up writing a byte to the i2c bus and reading back the ack bit                               */
+/* the ack is checked in ftdi_i2c_output() once the whole transaction has been sent                   */
 /*      b: the byte to write out                                                                      */
 /* return: error code                                                                                 */
 /* -------------------------------------------------------------------------------------------------- */
 {
-    uint8_t *in_buffer;
-    uint8_t err;
-
     out_buffer[num_bytes_to_send++] = 0x80;
     out_buffer[num_bytes_to_send++] = 0x00;
     out_buffer[num_bytes_to_send++] = 0x13;
@@ -222,29 +234,51 @@ uint8_t ftdi_i2c_send_byte_check_ack(uint8_t b)
     out_buffer[num_bytes_to_send++] = 0x11;
     out_buffer[num_bytes_to_send++] = 0x27;
     out_buffer[num_bytes_to_send++] = 0x00;
-    out_buffer[num_bytes_to_send++] = 0x87;
-    err=ftdi_usb_i2c_write(out_buffer, num_bytes_to_send);
-    num_bytes_to_send = 0;
+    /* note we don't send this out yet as there will be more */
 
-    if (err==ERROR_NONE) err=ftdi_usb_i2c_read(&in_buffer);
-    if ((err==ERROR_NONE) && ((*in_buffer&0x01)!=0)) {
-        err=ERROR_I2C_NO_ACK;
-    }
+    replies[num_replies_expected++] = NULL;
 
-    return err;
+    return ERROR_NONE;
 }
 
 /* -------------------------------------------------------------------------------------------------- */
-int ftdi_i2c_read_byte_send_nak(uint8_t *b ) {
+uint8_t ftdi_i2c_read_byte_send_ack(uint8_t *b ) {
 /* -------------------------------------------------------------------------------------------------- */
-/* reads a byte from the i2c bus                                                                      */
-/* *b: a byte to return the read value in                                                             */
+/* queues up reading a byte from the i2c bus and then acks it so that the slave carries on sending    */
+/* the next (auto incremented) register                                                               */
+/* *b: a byte to return the read value in, filled in by ftdi_i2c_output()                             */
 /* return: error code                                                                                 */
 /* -------------------------------------------------------------------------------------------------- */
-    uint8_t err;
-    uint8_t *in_buffer;
+    out_buffer[num_bytes_to_send++] = 0x80;
+    out_buffer[num_bytes_to_send++] = 0x00;
+    out_buffer[num_bytes_to_send++] = 0x13;
+    out_buffer[num_bytes_to_send++] = 0x80;
+    out_buffer[num_bytes_to_send++] = 0x00;
+    out_buffer[num_bytes_to_send++] = 0x11; 
+    out_buffer[num_bytes_to_send++] = 0x25;
+    out_buffer[num_bytes_to_send++] = 0x00;
+    out_buffer[num_bytes_to_send++] = 0x00;
+    /* now drive SDA low and clock out the ack bit */
+    out_buffer[num_bytes_to_send++] = 0x80;
+    out_buffer[num_bytes_to_send++] = 0x00;
+    out_buffer[num_bytes_to_send++] = 0x13;
+    out_buffer[num_bytes_to_send++] = 0x13;
+    out_buffer[num_bytes_to_send++] = 0x00; /* Data length of 0x00 means clock out 1 bit */
+    out_buffer[num_bytes_to_send++] = 0x00; /* ack */
+    /* note we don't send this out yet as there will be more */
 
-    /* first send off the commands to do the read */
+    replies[num_replies_expected++] = b;
+
+    return ERROR_NONE;
+}
+
+/* -------------------------------------------------------------------------------------------------- */
+uint8_t ftdi_i2c_read_byte_send_nak(uint8_t *b ) {
+/* -------------------------------------------------------------------------------------------------- */
+/* queues up reading a byte from the i2c bus                                                          */
+/* *b: a byte to return the read value in, filled in by ftdi_i2c_output()                             */
+/* return: error code                                                                                 */
+/* -------------------------------------------------------------------------------------------------- */
     out_buffer[num_bytes_to_send++] = 0x80;
     out_buffer[num_bytes_to_send++] = 0x00;
     out_buffer[num_bytes_to_send++] = 0x13;
@@ -254,15 +288,11 @@ int ftdi_i2c_read_byte_send_nak(uint8_t *b ) {
     out_buffer[num_bytes_to_send++] = 0x25;
     out_buffer[num_bytes_to_send++] = 0x00;
     out_buffer[num_bytes_to_send++] = 0x00;
-    out_buffer[num_bytes_to_send++] = 0x87;
-    err=ftdi_usb_i2c_write(out_buffer, num_bytes_to_send);
-    num_bytes_to_send = 0;
+    /* note we don't send this out yet as there will be more */
 
-    /* now read the value back */
-    if (err==ERROR_NONE) err=ftdi_usb_i2c_read(&in_buffer);
-    *b = *in_buffer;
+    replies[num_replies_expected++] = b;
 
-    return err;
+    return ERROR_NONE;
 }
 
 
@@ -270,60 +300,100 @@ int ftdi_i2c_read_byte_send_nak(uint8_t *b ) {
 uint8_t ftdi_i2c_output(void) {
 /* -------------------------------------------------------------------------------------------------- */
 /* once other routines have set up a sequence of bytes to write, this actually sends them             */
+/* if any acks or data bytes were queued, we then read all of the replies back in one go and check    */
+/* the acks afterwards. Every reply is always read so that we stay in step with the MPSSE             */
 /* return: error code */
 /* -------------------------------------------------------------------------------------------------- */
     uint8_t err;
+    uint8_t *in_buffer;
+    int i;
+
+    /* make the MPSSE send back what it has clocked in straight away */
+    if (num_replies_expected>0) out_buffer[num_bytes_to_send++] = MPSSE_SEND_IMMEDIATE;
 
     err=ftdi_usb_i2c_write(out_buffer, num_bytes_to_send);
     num_bytes_to_send = 0;
 
+    for (i=0; (err==ERROR_NONE) && (i<num_replies_expected); i++) {
+        err=ftdi_usb_i2c_read(&in_buffer);
+        if (err==ERROR_NONE) {
+            if (replies[i]!=NULL) {
+                *replies[i]=*in_buffer;
+            } else if ((*in_buffer&0x01)!=0) {
+                /* keep going so that we use up the rest of the replies */
+                err=ERROR_I2C_NO_ACK;
+                for (i++; i<num_replies_expected; i++) {
+                    if (ftdi_usb_i2c_read(&in_buffer)!=ERROR_NONE) break;
+                    if (replies[i]!=NULL) *replies[i]=*in_buffer;
+                }
+            }
+        }
+    }
+    num_replies_expected = 0;
+
     return err;
 }
 
 /* -------------------------------------------------------------------------------------------------- */
-uint8_t ftdi_i2c_read_reg16(uint8_t addr, uint16_t reg, uint8_t *val) {
+uint8_t ftdi_i2c_read_reg16_burst(uint8_t addr, uint16_t reg, uint8_t *vals, uint8_t count) {
 /* -------------------------------------------------------------------------------------------------- */
-/* read an i2c 16 bit register from the nim                                                           */
-/*   addr: the i2c buser address to access                                                            */
-/*    reg: the i2c register to read                                                                   */
-/*   *val: the return value for the register we have read                                             */
+/* read a run of contiguous i2c 16 bit registers from the nim in one i2c transaction. This relies on  */
+/* the device auto incrementing the register address after each byte read                            */
+/*   addr: the i2c bus address to access                                                              */
+/*    reg: the first i2c register to read                                                             */
+/*  *vals: the return values for the registers we have read                                           */
+/*  count: how many registers to read                                                                 */
 /* return: error code                                                                                 */
 /* -------------------------------------------------------------------------------------------------- */
     int err;
     int i;
+    int n;
     int timeout=0;
 
+    if (count==0) {
+        printf("ERROR: i2c read reg16 burst of %i registers\n",count);
+        return ERROR_READ_DEMOD;
+    }
+
     do {
-        /* Send the register that needs to be read */
+        /* send the register that needs to be read, then read back the contents of the registers */
         for(i=0; i<FTDI_NUM_TRIES; i++) {
             err =ftdi_i2c_set_start();
             err|=ftdi_i2c_send_byte_check_ack(addr);
             err|=ftdi_i2c_send_byte_check_ack(reg>>8);
             err|=ftdi_i2c_send_byte_check_ack(reg&0xff);
-            if (err==ERROR_NONE) break;
-        }
-
-        if (err==ERROR_NONE) {
-            /* Read back the contents of that register */
-            for(i=0; i<FTDI_NUM_TRIES; i++) {
-                err =ftdi_i2c_set_start();
-                err|=ftdi_i2c_send_byte_check_ack(addr|0x01);
-                err|=ftdi_i2c_read_byte_send_nak(val);
-                err|=ftdi_i2c_set_stop();
-                err|=ftdi_i2c_output();
-                if (err==ERROR_NONE) break;
+            err|=ftdi_i2c_set_start();
+            err|=ftdi_i2c_send_byte_check_ack(addr|0x01);
+            for (n=0; n<count-1; n++) {
+                err|=ftdi_i2c_read_byte_send_ack(&vals[n]);
             }
+            err|=ftdi_i2c_read_byte_send_nak(&vals[count-1]);
+            err|=ftdi_i2c_set_stop();
+            err|=ftdi_i2c_output();
+            if (err==ERROR_NONE) break;
         }
 
         timeout++;
 
     } while ((err!=ERROR_NONE) && (timeout!=FTDI_RDWR_TIMEOUT));
 
-    if (err!=ERROR_NONE) printf("ERROR: i2c read reg16 0x%.2x, 0x%.4x\n",addr,reg);
+    if (err!=ERROR_NONE) printf("ERROR: i2c read reg16 0x%.2x, 0x%.4x, %i bytes\n",addr,reg,count);
 
     return err;
 }
 
+/* -------------------------------------------------------------------------------------------------- */
+uint8_t ftdi_i2c_read_reg16(uint8_t addr, uint16_t reg, uint8_t *val) {
+/* -------------------------------------------------------------------------------------------------- */
+/* read an i2c 16 bit register from the nim                                                           */
+/*   addr: the i2c buser address to access                                                            */
+/*    reg: the i2c register to read                                                                   */
+/*   *val: the return value for the register we have read                                             */
+/* return: error code                                                                                 */
+/* -------------------------------------------------------------------------------------------------- */
+    return ftdi_i2c_read_reg16_burst(addr, reg, val, 1);
+}
+
 /* -------------------------------------------------------------------------------------------------- */
 uint8_t ftdi_i2c_write_reg16(uint8_t addr, uint16_t reg, uint8_t val) {
 /* -------------------------------------------------------------------------------------------------- */
@@ -358,6 +428,78 @@ uint8_t ftdi_i2c_write_reg16(uint8_t addr, uint16_t reg, uint8_t val) {
     return err;
 }
 
+/* -------------------------------------------------------------------------------------------------- */
+static void ftdi_i2c_queue_write_reg16_run(uint8_t addr, const ftdi_i2c_run_t *run) {
+/* -------------------------------------------------------------------------------------------------- */
+/* queues up one auto incrementing i2c write of a run of contiguous 16 bit registers                  */
+/*   addr: the i2c bus address to access                                                              */
+/*    run: the first register, how many registers and their values                                    */
+/* -------------------------------------------------------------------------------------------------- */
+    int n;
+
+    ftdi_i2c_set_start();
+    ftdi_i2c_send_byte_check_ack(addr);
+    ftdi_i2c_send_byte_check_ack(run->reg>>8);
+    ftdi_i2c_send_byte_check_ack(run->reg&0xff);
+    for (n=0; n<run->count; n++) {
+        ftdi_i2c_send_byte_check_ack(run->vals[n]);
+    }
+    ftdi_i2c_set_stop();
+}
+
+/* -------------------------------------------------------------------------------------------------- */
+uint8_t ftdi_i2c_write_reg16_runs(uint8_t addr, const ftdi_i2c_run_t *runs, uint16_t num_runs) {
+/* -------------------------------------------------------------------------------------------------- */
+/* writes a list of runs of contiguous 16 bit registers. Each run is a single auto incrementing i2c   */
+/* write, and as many runs as will fit are packed into each usb write to the MPSSE                    */
+/*     addr: the i2c bus address to access                                                            */
+/*     runs: the list of runs to write out                                                            */
+/* num_runs: how many runs there are in the list                                                      */
+/*   return: error code                                                                               */
+/* -------------------------------------------------------------------------------------------------- */
+    uint8_t err=ERROR_NONE;
+    uint16_t first=0;
+    uint16_t last;
+    uint16_t r;
+    int bytes;
+    int acks;
+    int i;
+    int timeout;
+
+    while ((err==ERROR_NONE) && (first<num_runs)) {
+        /* work out how many runs we can get into this usb write */
+        bytes=1; /* the send immediate */
+        acks=0;
+        for (last=first; last<num_runs; last++) {
+            bytes+=FTDI_I2C_START_STOP_LEN + (3+runs[last].count)*FTDI_I2C_BYTE_LEN;
+            acks+=3+runs[last].count;
+            if ((bytes>FTDI_OUT_BUFFER_SIZE) || (acks>FTDI_MAX_REPLIES)) break;
+        }
+        if (last==first) {
+            printf("ERROR: i2c write reg16 run of %i registers is too long\n",runs[first].count);
+            err=ERROR_WRITE_DEMOD;
+            break;
+        }
+
+        /* send them, if any of the writes are not acked then we send the whole lot again */
+        timeout=0;
+        do {
+            for (i=0; i<FTDI_NUM_TRIES; i++) {
+                for (r=first; r<last; r++) ftdi_i2c_queue_write_reg16_run(addr, &runs[r]);
+                err=ftdi_i2c_output();
+                if (err==ERROR_NONE) break;
+            }
+            timeout++;
+        } while ((err!=ERROR_NONE) && (timeout!=FTDI_RDWR_TIMEOUT));
+
+        if (err!=ERROR_NONE) printf("ERROR: i2c write reg16 runs 0x%.2x, 0x%.4x to 0x%.4x\n",addr,runs[first].reg,runs[last-1].reg);
+
+        first=last;
+    }
+
+    return err;
+}
+
 /* -------------------------------------------------------------------------------------------------- */
 uint8_t ftdi_i2c_read_reg8(uint8_t addr, uint8_t reg, uint8_t *val) {
 /* -------------------------------------------------------------------------------------------------- */
@@ -377,21 +519,14 @@ uint8_t ftdi_i2c_read_reg8(uint8_t addr, uint8_t reg, uint8_t *val) {
             err|=ftdi_i2c_send_byte_check_ack(addr);
             err|=ftdi_i2c_send_byte_check_ack(reg);
             err|=ftdi_i2c_set_stop();
+            err|=ftdi_i2c_set_start();
+            err|=ftdi_i2c_send_byte_check_ack(addr|0x01);
+            err|=ftdi_i2c_read_byte_send_nak(val);
+            err|=ftdi_i2c_set_stop();
             err|=ftdi_i2c_output();
             if (err==ERROR_NONE) break;
         }
 
-        if (err==ERROR_NONE) {
-            for (i=0; i<FTDI_NUM_TRIES; i++) {
-                err =ftdi_i2c_set_start();
-                err|=ftdi_i2c_send_byte_check_ack(addr|0x01);
-                err|=ftdi_i2c_read_byte_send_nak(val);
-                err|=ftdi_i2c_set_stop();
-                err|=ftdi_i2c_output();
-                if (err==ERROR_NONE) break;
-            }
-        }
-
         timeout++;
 
     } while ((err!=ERROR_NONE) && (timeout!=FTDI_RDWR_TIMEOUT));
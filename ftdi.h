@@ -25,6 +25,13 @@
 #include <stdint.h>
 #include <stdbool.h>
 
+/* a run of contiguous registers to be written in one auto incrementing i2c write */
+typedef struct {
+    uint16_t reg;
+    uint8_t count;
+    const uint8_t *vals;
+} ftdi_i2c_run_t;
+
 uint8_t ftdi_init(uint8_t, uint8_t);
 uint8_t ftdi_set_polarisation_supply(bool, bool);
 uint8_t ftdi_send_byte(uint8_t);
@@ -33,8 +40,10 @@ uint8_t ftdi_read_highbyte(uint8_t*);
 uint8_t ftdi_write_highbyte(uint8_t, uint8_t);
 
 uint8_t ftdi_i2c_read_reg16 (uint8_t, uint16_t, uint8_t*);
+uint8_t ftdi_i2c_read_reg16_burst(uint8_t, uint16_t, uint8_t*, uint8_t);
 uint8_t ftdi_i2c_read_reg8  (uint8_t, uint8_t,  uint8_t*);
 uint8_t ftdi_i2c_write_reg16(uint8_t, uint16_t, uint8_t );
+uint8_t ftdi_i2c_write_reg16_runs(uint8_t, const ftdi_i2c_run_t*, uint16_t);
 uint8_t ftdi_i2c_write_reg8 (uint8_t, uint8_t,  uint8_t );
 
 #endif
@@ -31,6 +31,8 @@
 #include <libusb-1.0/libusb.h>
 #include <memory.h>
 #include <unistd.h>
+#include <time.h>
+#include <pthread.h>
 #include "errors.h"
 #include "ftdi_usb.h"
 #include "ftdi.h"
@@ -74,6 +76,7 @@
 #define FTDI_DEVICE_IN_REQTYPE (LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE | LIBUSB_ENDPOINT_IN)
 
 #define FTDI_RX_CHUNK_SIZE 4096
+#define FTDI_USB_PACKET_SIZE 512
 #define FTDI_TX_CHUNK_SIZE 4096
 
 /* -------------------------------------------------------------------------------------------------- */
@@ -101,12 +104,56 @@ static libusb_device_handle *usb_device_handle_ts; // interface 1, endpoints: 0x
 static libusb_context *usb_context_i2c;
 static libusb_context *usb_context_ts;
 
+/* the asynchronous TS engine keeps a number of bulk transfers outstanding on the TS endpoint so that */
+/* there is always a buffer waiting for the FTDI FIFO, even while we are busy with the last one. The  */
+/* buffers read out can be handed on (eg. to the parser) and given back from any thread, so there are */
+/* spare transfers to keep the endpoint topped up until they are                                      */
+#define FTDI_USB_TS_MAX_XFERS (FTDI_USB_TS_MAX_TRANSFERS+FTDI_USB_TS_MAX_SPARE)
+
+typedef struct {
+    struct libusb_transfer *transfer;
+    uint8_t *buffer;
+    uint64_t submitted_us;
+    bool out;                                           /* read out and not yet given back           */
+} ftdi_usb_ts_xfer_t;
+
+static struct {
+    ftdi_usb_ts_xfer_t xfers[FTDI_USB_TS_MAX_XFERS];
+    uint8_t num_xfers;
+    /* completed transfers waiting for loop_ts, in order of completion */
+    uint8_t completed[FTDI_USB_TS_MAX_XFERS];
+    uint8_t completed_head;
+    uint8_t completed_count;
+    /* transfers that are neither outstanding, completed nor out, for when we are short */
+    uint8_t spare[FTDI_USB_TS_MAX_XFERS];
+    uint8_t spare_count;
+    uint8_t target;                                     /* how many we keep outstanding               */
+    uint8_t in_flight;
+    bool running;
+    bool event_thread_started;
+    pthread_t event_thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t signal;
+    /* stats */
+    uint64_t dry_start_us;
+    uint64_t dry_total_us;
+    uint64_t latency_total_us;
+    uint32_t latency_max_us;
+    uint32_t latency_count;
+} ftdi_usb_ts_async = {
+    .num_xfers = 0,
+    .running = false,
+    .event_thread_started = false,
+    .mutex = PTHREAD_MUTEX_INITIALIZER,
+    .signal = PTHREAD_COND_INITIALIZER
+};
+
 /* -------------------------------------------------------------------------------------------------- */
 /* ----------------- ROUTINES ----------------------------------------------------------------------- */
 /* -------------------------------------------------------------------------------------------------- */
 
 /* -------------------------------------------------------------------------------------------------- */
-uint8_t ftdi_usb_i2c_write( uint8_t *buffer, uint8_t len ){
+uint8_t ftdi_usb_i2c_write( uint8_t *buffer, uint16_t len ){
 /* -------------------------------------------------------------------------------------------------- */
 /* writes data out to the usb                                                                         */
 /* *buffer: the buffer containing the data to be written out                                          */
@@ -135,8 +182,8 @@ uint8_t ftdi_usb_i2c_write( uint8_t *buffer, uint8_t len ){
 uint8_t ftdi_usb_i2c_read( uint8_t **buffer) {
 /* -------------------------------------------------------------------------------------------------- */
 /* reads one byte from the usb and returns it. Keeping any other data bytes for later                 */ 
-/* Note: we only ever need to read one byte of actual data so we can avoid data copying by using the  */
-/* internal buffers of the usb reads to keep the data                                                 */
+/* Note: a batched i2c transaction gets all its replies back in one usb read, so we hand them out one */
+/* at a time from the internal buffers of the usb reads to avoid data copying                         */
 /* *buffer: iretruned as a pointer the the actual data read into the usb                              */
 /*     len: the number of bytes to read                                                               */
 /* return : error code                                                                                */
@@ -147,8 +194,11 @@ uint8_t ftdi_usb_i2c_read( uint8_t **buffer) {
     int res;
     int n;
 
+    /* skip over the 2 byte status header the FTDI puts at the start of every usb packet */
+    if ((posn<rxed) && ((posn%FTDI_USB_PACKET_SIZE)==0)) posn+=2;
+
     /* if we have unused characters in the buffer then use them up first */
-    if (posn!=rxed) {
+    if (posn<rxed) {
         *buffer=&rx_chunk[posn++];
     } else {
         /* if we couldn't do it with data we already have then get a new buffer */
@@ -374,3 +424,346 @@ uint8_t ftdi_usb_ts_read(uint8_t *buffer, uint16_t *len, uint32_t frame_size) {
 
     return err;
 }
+
+/* -------------------------------------------------------------------------------------------------- */
+static uint64_t ftdi_usb_monotonic_us(void) {
+/* -------------------------------------------------------------------------------------------------- */
+/* return: monotonic timer in microseconds                                                            */
+/* -------------------------------------------------------------------------------------------------- */
+    struct timespec tp;
+
+    clock_gettime(CLOCK_MONOTONIC, &tp);
+
+    return (uint64_t)tp.tv_sec * 1000000 + tp.tv_nsec / 1000;
+}
+
+/* -------------------------------------------------------------------------------------------------- */
+static void LIBUSB_CALL ftdi_usb_ts_async_callback(struct libusb_transfer *transfer) {
+/* -------------------------------------------------------------------------------------------------- */
+/* called from the libusb event thread whenever one of our TS transfers completes                     */
+/* we just note the timings and queue it up for loop_ts to pick up                                    */
+/* -------------------------------------------------------------------------------------------------- */
+    uint8_t index=(uint8_t)(uintptr_t)transfer->user_data;
+    uint64_t now=ftdi_usb_monotonic_us();
+    uint32_t latency;
+
+    pthread_mutex_lock(&ftdi_usb_ts_async.mutex);
+
+    ftdi_usb_ts_async.in_flight--;
+    if (ftdi_usb_ts_async.in_flight==0) ftdi_usb_ts_async.dry_start_us=now;
+
+    if (transfer->status!=LIBUSB_TRANSFER_CANCELLED) {
+        latency=(uint32_t)(now-ftdi_usb_ts_async.xfers[index].submitted_us);
+        ftdi_usb_ts_async.latency_total_us+=latency;
+        ftdi_usb_ts_async.latency_count++;
+        if (latency>ftdi_usb_ts_async.latency_max_us) ftdi_usb_ts_async.latency_max_us=latency;
+
+        ftdi_usb_ts_async.completed[(ftdi_usb_ts_async.completed_head+ftdi_usb_ts_async.completed_count)
+                                                                    % FTDI_USB_TS_MAX_XFERS]=index;
+        ftdi_usb_ts_async.completed_count++;
+        pthread_cond_signal(&ftdi_usb_ts_async.signal);
+    }
+
+    pthread_mutex_unlock(&ftdi_usb_ts_async.mutex);
+}
+
+/* -------------------------------------------------------------------------------------------------- */
+static uint8_t ftdi_usb_ts_async_submit(uint8_t index) {
+/* -------------------------------------------------------------------------------------------------- */
+/* (re)submits one of our TS transfers. Must be called with the async mutex held                      */
+/*  index: which transfer to submit                                                                   */
+/* return: error code                                                                                 */
+/* -------------------------------------------------------------------------------------------------- */
+    uint8_t err=ERROR_NONE;
+    uint64_t now=ftdi_usb_monotonic_us();
+    int res;
+
+    ftdi_usb_ts_async.xfers[index].submitted_us=now;
+    res=libusb_submit_transfer(ftdi_usb_ts_async.xfers[index].transfer);
+    if (res<0) {
+        printf("ERROR: USB TS transfer submit %i (%s)\n",res,libusb_error_name(res));
+        err=ERROR_USB_TS_READ;
+    } else {
+        if (ftdi_usb_ts_async.in_flight==0 && ftdi_usb_ts_async.dry_start_us!=0) {
+            ftdi_usb_ts_async.dry_total_us+=now-ftdi_usb_ts_async.dry_start_us;
+        }
+        ftdi_usb_ts_async.dry_start_us=0;
+        ftdi_usb_ts_async.in_flight++;
+    }
+
+    return err;
+}
+
+/* -------------------------------------------------------------------------------------------------- */
+static uint8_t ftdi_usb_ts_async_top_up(void) {
+/* -------------------------------------------------------------------------------------------------- */
+/* submits spare transfers until we have as many outstanding as we should. Must be called with the    */
+/* async mutex held                                                                                   */
+/* return: error code                                                                                 */
+/* -------------------------------------------------------------------------------------------------- */
+    uint8_t err=ERROR_NONE;
+    uint8_t index;
+
+    while ((err==ERROR_NONE) && ftdi_usb_ts_async.running && (ftdi_usb_ts_async.spare_count>0) &&
+           (ftdi_usb_ts_async.in_flight<ftdi_usb_ts_async.target)) {
+        index=ftdi_usb_ts_async.spare[--ftdi_usb_ts_async.spare_count];
+        err=ftdi_usb_ts_async_submit(index);
+        if (err!=ERROR_NONE) ftdi_usb_ts_async.spare[ftdi_usb_ts_async.spare_count++]=index;
+    }
+
+    return err;
+}
+
+/* -------------------------------------------------------------------------------------------------- */
+static void *ftdi_usb_ts_async_loop(void *arg) {
+/* -------------------------------------------------------------------------------------------------- */
+/* the dedicated libusb event thread for the TS transfers. Carries on until we are stopped and all    */
+/* the outstanding transfers have come back                                                           */
+/* -------------------------------------------------------------------------------------------------- */
+    struct timeval tv;
+    bool done=false;
+    (void)arg;
+
+    while (!done) {
+        tv.tv_sec=0;
+        tv.tv_usec=100*1000;
+        libusb_handle_events_timeout_completed(usb_context_ts, &tv, NULL);
+
+        pthread_mutex_lock(&ftdi_usb_ts_async.mutex);
+        done=(!ftdi_usb_ts_async.running) && (ftdi_usb_ts_async.in_flight==0);
+        pthread_mutex_unlock(&ftdi_usb_ts_async.mutex);
+    }
+
+    return NULL;
+}
+
+/* -------------------------------------------------------------------------------------------------- */
+uint8_t ftdi_usb_ts_async_start(uint8_t num_transfers, uint8_t num_spare, uint32_t frame_size) {
+/* -------------------------------------------------------------------------------------------------- */
+/* starts the asynchronous TS engine: allocates the transfers, submits them all and starts the libusb */
+/* event thread to service them                                                                       */
+/* num_transfers: how many transfers to keep outstanding on the TS endpoint                           */
+/*     num_spare: how many more to allocate, for the most buffers that will be out at once            */
+/*    frame_size: the size of each transfer                                                           */
+/*        return: error code                                                                          */
+/* -------------------------------------------------------------------------------------------------- */
+    uint8_t err=ERROR_NONE;
+    uint8_t i;
+
+    printf("Flow: FTDI USB TS async start, %i transfers, %i spare\n",num_transfers,num_spare);
+
+    if (num_transfers>FTDI_USB_TS_MAX_TRANSFERS) num_transfers=FTDI_USB_TS_MAX_TRANSFERS;
+    if (num_spare>FTDI_USB_TS_MAX_SPARE) num_spare=FTDI_USB_TS_MAX_SPARE;
+
+    pthread_mutex_lock(&ftdi_usb_ts_async.mutex);
+
+    ftdi_usb_ts_async.num_xfers=0;
+    ftdi_usb_ts_async.completed_head=0;
+    ftdi_usb_ts_async.completed_count=0;
+    ftdi_usb_ts_async.spare_count=0;
+    ftdi_usb_ts_async.target=num_transfers;
+    ftdi_usb_ts_async.in_flight=0;
+    ftdi_usb_ts_async.dry_start_us=0;
+    ftdi_usb_ts_async.dry_total_us=0;
+    ftdi_usb_ts_async.latency_total_us=0;
+    ftdi_usb_ts_async.latency_max_us=0;
+    ftdi_usb_ts_async.latency_count=0;
+    ftdi_usb_ts_async.running=true;
+
+    for (i=0; (err==ERROR_NONE) && (i<num_transfers+num_spare); i++) {
+        ftdi_usb_ts_async.xfers[i].buffer=malloc(frame_size);
+        ftdi_usb_ts_async.xfers[i].transfer=libusb_alloc_transfer(0);
+        if ((ftdi_usb_ts_async.xfers[i].buffer==NULL) || (ftdi_usb_ts_async.xfers[i].transfer==NULL)) {
+            free(ftdi_usb_ts_async.xfers[i].buffer);
+            if (ftdi_usb_ts_async.xfers[i].transfer!=NULL) libusb_free_transfer(ftdi_usb_ts_async.xfers[i].transfer);
+            printf("ERROR: USB TS transfer alloc\n");
+            err=ERROR_TS_BUFFER_MALLOC;
+        } else {
+            /* the TS traffic is on endpoint 0x83 */
+            libusb_fill_bulk_transfer(ftdi_usb_ts_async.xfers[i].transfer, usb_device_handle_ts, 0x83,
+                                      ftdi_usb_ts_async.xfers[i].buffer, frame_size,
+                                      ftdi_usb_ts_async_callback, (void *)(uintptr_t)i, USB_FAST_TIMEOUT);
+            ftdi_usb_ts_async.xfers[i].out=false;
+            ftdi_usb_ts_async.num_xfers++;
+            if (i<num_transfers) err=ftdi_usb_ts_async_submit(i);
+            else ftdi_usb_ts_async.spare[ftdi_usb_ts_async.spare_count++]=i;
+        }
+    }
+
+    pthread_mutex_unlock(&ftdi_usb_ts_async.mutex);
+
+    if (0!=pthread_create(&ftdi_usb_ts_async.event_thread, NULL, ftdi_usb_ts_async_loop, NULL)) {
+        printf("ERROR: USB TS event thread create\n");
+        err=ERROR_THREAD_ERROR;
+    } else {
+        pthread_setname_np(ftdi_usb_ts_async.event_thread, "TS USB Events");
+        ftdi_usb_ts_async.event_thread_started=true;
+    }
+
+    if (err!=ERROR_NONE) printf("ERROR: FTDI USB TS async start\n");
+
+    return err;
+}
+
+/* -------------------------------------------------------------------------------------------------- */
+uint8_t ftdi_usb_ts_async_read(uint8_t **buffer, uint16_t *len) {
+/* -------------------------------------------------------------------------------------------------- */
+/* waits for the next completed TS transfer and hands its buffer over. The buffer belongs to us until */
+/* it is given to ftdi_usb_ts_async_release(), from this or any other thread, which puts the transfer */
+/* back in the queue. A spare transfer takes its place meanwhile                                      */
+/* *buffer: returned as a pointer to the data that was read, NULL if nothing was                      */
+/*    *len: how many bytes are in the buffer                                                          */
+/* return : error code                                                                                */
+/* -------------------------------------------------------------------------------------------------- */
+    uint8_t err=ERROR_NONE;
+    struct timespec ts;
+    struct libusb_transfer *transfer;
+    uint8_t index;
+
+    *buffer=NULL;
+    *len=0;
+
+    pthread_mutex_lock(&ftdi_usb_ts_async.mutex);
+
+    if (ftdi_usb_ts_async.completed_count==0) {
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_sec+=USB_FAST_TIMEOUT/1000;
+        ts.tv_nsec+=(USB_FAST_TIMEOUT%1000)*1000000;
+        if (ts.tv_nsec>=1000000000) {
+            ts.tv_sec++;
+            ts.tv_nsec-=1000000000;
+        }
+        while ((ftdi_usb_ts_async.completed_count==0) &&
+               (pthread_cond_timedwait(&ftdi_usb_ts_async.signal, &ftdi_usb_ts_async.mutex, &ts)==0));
+    }
+
+    if (ftdi_usb_ts_async.completed_count>0) {
+        index=ftdi_usb_ts_async.completed[ftdi_usb_ts_async.completed_head];
+        ftdi_usb_ts_async.completed_head=(ftdi_usb_ts_async.completed_head+1) % FTDI_USB_TS_MAX_XFERS;
+        ftdi_usb_ts_async.completed_count--;
+
+        transfer=ftdi_usb_ts_async.xfers[index].transfer;
+        /* a timeout can still have brought in some data, so we pass on whatever we got */
+        if ((transfer->status==LIBUSB_TRANSFER_COMPLETED) || (transfer->status==LIBUSB_TRANSFER_TIMED_OUT)) {
+            ftdi_usb_ts_async.xfers[index].out=true;
+            *buffer=transfer->buffer;
+            *len=transfer->actual_length;
+        } else {
+            printf("ERROR: USB TS Data Read status %i, received %i\n",transfer->status,transfer->actual_length);
+            ftdi_usb_ts_async.spare[ftdi_usb_ts_async.spare_count++]=index;
+            err=ERROR_USB_TS_READ;
+        }
+        if (err==ERROR_NONE) err=ftdi_usb_ts_async_top_up();
+    } else if (ftdi_usb_ts_async.in_flight==0) {
+        /* nothing outstanding and nothing came back, so something has gone badly wrong */
+        printf("ERROR: USB TS no transfers in flight\n");
+        err=ERROR_USB_TS_READ;
+    }
+
+    pthread_mutex_unlock(&ftdi_usb_ts_async.mutex);
+
+    if (err!=ERROR_NONE) printf("ERROR: FTDI USB ts async read\n");
+
+    return err;
+}
+
+/* -------------------------------------------------------------------------------------------------- */
+uint8_t ftdi_usb_ts_async_release(uint8_t *buffer) {
+/* -------------------------------------------------------------------------------------------------- */
+/* gives back a buffer from ftdi_usb_ts_async_read(), resubmitting its transfer if we are short and   */
+/* keeping it spare if not. Once the engine has been stopped the transfer is freed instead            */
+/* *buffer: the buffer, NULL for none                                                                 */
+/* return : error code                                                                                */
+/* -------------------------------------------------------------------------------------------------- */
+    uint8_t err=ERROR_NONE;
+    uint8_t i;
+
+    if (buffer==NULL) return err;
+
+    pthread_mutex_lock(&ftdi_usb_ts_async.mutex);
+
+    for (i=0; i<ftdi_usb_ts_async.num_xfers; i++) {
+        if (ftdi_usb_ts_async.xfers[i].out && (ftdi_usb_ts_async.xfers[i].buffer==buffer)) break;
+    }
+
+    if (i<ftdi_usb_ts_async.num_xfers) {
+        ftdi_usb_ts_async.xfers[i].out=false;
+        if (ftdi_usb_ts_async.running) {
+            ftdi_usb_ts_async.spare[ftdi_usb_ts_async.spare_count++]=i;
+            err=ftdi_usb_ts_async_top_up();
+        } else {
+            libusb_free_transfer(ftdi_usb_ts_async.xfers[i].transfer);
+            free(ftdi_usb_ts_async.xfers[i].buffer);
+            ftdi_usb_ts_async.xfers[i].transfer=NULL;
+            ftdi_usb_ts_async.xfers[i].buffer=NULL;
+        }
+    }
+
+    pthread_mutex_unlock(&ftdi_usb_ts_async.mutex);
+
+    return err;
+}
+
+/* -------------------------------------------------------------------------------------------------- */
+void ftdi_usb_ts_async_stats(uint32_t *dry_ms, uint32_t *latency_avg_us, uint32_t *latency_max_us) {
+/* -------------------------------------------------------------------------------------------------- */
+/* reads out the TS engine counters. The latencies are since the last call, the dry time is the total */
+/*         dry_ms: total time we have had no transfers outstanding on the TS endpoint                 */
+/* latency_avg_us: mean time from submitting a transfer to it completing                              */
+/* latency_max_us: worst case time from submitting a transfer to it completing                        */
+/* -------------------------------------------------------------------------------------------------- */
+    uint64_t dry_us;
+
+    pthread_mutex_lock(&ftdi_usb_ts_async.mutex);
+
+    dry_us=ftdi_usb_ts_async.dry_total_us;
+    if (ftdi_usb_ts_async.dry_start_us!=0) dry_us+=ftdi_usb_monotonic_us()-ftdi_usb_ts_async.dry_start_us;
+    *dry_ms=(uint32_t)(dry_us/1000);
+
+    *latency_avg_us = ftdi_usb_ts_async.latency_count>0 ?
+                        (uint32_t)(ftdi_usb_ts_async.latency_total_us/ftdi_usb_ts_async.latency_count) : 0;
+    *latency_max_us = ftdi_usb_ts_async.latency_max_us;
+
+    ftdi_usb_ts_async.latency_total_us=0;
+    ftdi_usb_ts_async.latency_count=0;
+    ftdi_usb_ts_async.latency_max_us=0;
+
+    pthread_mutex_unlock(&ftdi_usb_ts_async.mutex);
+}
+
+/* -------------------------------------------------------------------------------------------------- */
+uint8_t ftdi_usb_ts_async_stop(void) {
+/* -------------------------------------------------------------------------------------------------- */
+/* stops the asynchronous TS engine, cancelling the outstanding transfers and freeing them up         */
+/* return : error code                                                                                */
+/* -------------------------------------------------------------------------------------------------- */
+    uint8_t i;
+
+    printf("Flow: FTDI USB TS async stop\n");
+
+    pthread_mutex_lock(&ftdi_usb_ts_async.mutex);
+    ftdi_usb_ts_async.running=false;
+    for (i=0; i<ftdi_usb_ts_async.num_xfers; i++) {
+        if (ftdi_usb_ts_async.xfers[i].transfer!=NULL) libusb_cancel_transfer(ftdi_usb_ts_async.xfers[i].transfer);
+    }
+    pthread_mutex_unlock(&ftdi_usb_ts_async.mutex);
+
+    /* the event thread only exits once all the cancelled transfers have come back */
+    if (ftdi_usb_ts_async.event_thread_started) pthread_join(ftdi_usb_ts_async.event_thread, NULL);
+    ftdi_usb_ts_async.event_thread_started=false;
+
+    /* the buffers that are still out are freed as they are given back */
+    pthread_mutex_lock(&ftdi_usb_ts_async.mutex);
+    for (i=0; i<ftdi_usb_ts_async.num_xfers; i++) {
+        if (ftdi_usb_ts_async.xfers[i].out || (ftdi_usb_ts_async.xfers[i].transfer==NULL)) continue;
+        libusb_free_transfer(ftdi_usb_ts_async.xfers[i].transfer);
+        free(ftdi_usb_ts_async.xfers[i].buffer);
+        ftdi_usb_ts_async.xfers[i].transfer=NULL;
+        ftdi_usb_ts_async.xfers[i].buffer=NULL;
+    }
+    ftdi_usb_ts_async.spare_count=0;
+    ftdi_usb_ts_async.completed_count=0;
+    pthread_mutex_unlock(&ftdi_usb_ts_async.mutex);
+
+    return ERROR_NONE;
+}
@@ -25,16 +25,27 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <stdbool.h>
 
 /* Definitions for flow control */
 #define USB_TIMEOUT 5000
 #define USB_FAST_TIMEOUT 500
 
-uint8_t ftdi_usb_i2c_write( uint8_t *, uint8_t);
+/* the most TS transfers we will keep outstanding at once in async mode */
+#define FTDI_USB_TS_MAX_TRANSFERS 32
+/* the most spare ones, to stand in for those whose buffers have been handed on and not yet given back */
+#define FTDI_USB_TS_MAX_SPARE     72
+
+uint8_t ftdi_usb_i2c_write( uint8_t *, uint16_t);
 uint8_t ftdi_usb_i2c_read( uint8_t **);
 uint8_t ftdi_usb_set_mpsse_mode_i2c(void);
 uint8_t ftdi_usb_set_mpsse_mode_ts(void);
 uint8_t ftdi_usb_ts_read(uint8_t *, uint16_t *, uint32_t);
+uint8_t ftdi_usb_ts_async_start(uint8_t, uint8_t, uint32_t);
+uint8_t ftdi_usb_ts_async_read(uint8_t **, uint16_t *);
+uint8_t ftdi_usb_ts_async_release(uint8_t *);
+uint8_t ftdi_usb_ts_async_stop(void);
+void ftdi_usb_ts_async_stats(uint32_t *, uint32_t *, uint32_t *);
 uint8_t ftdi_usb_init_i2c(uint8_t, uint8_t, uint16_t, uint16_t);
 uint8_t ftdi_usb_init_ts(uint8_t, uint8_t, uint16_t, uint16_t);
 
@@ -0,0 +1,494 @@
+/* -------------------------------------------------------------------------------------------------- */
+/* The LongMynd receiver: http.c                                                                      */
+/*    - an implementation of the Serit NIM controlling software for the MiniTiouner Hardware          */
+/*    - a small HTTP server that streams the TS to any number of clients over TCP                     */
+/* Copyright 2019 Heather Lomond                                                                      */
+/* -------------------------------------------------------------------------------------------------- */
+/*
+    This file is part of longmynd.
+
+    Longmynd is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Longmynd is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with longmynd.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+/*
+    Everything here runs in one thread (the HTTP sink's writer thread) around one epoll: the
+    listening socket, the clients and an eventfd that is rung when there is more TS to hand out.
+    All the sockets are non-blocking, so one client can never hold up another.
+
+    Each lump of TS is shared, not copied: http_ts_queue() takes a reference on it for every client
+    it is queued on and gives it back once that client has sent it. A client's queue is bounded, and
+    a client whose queue is full when the next lump turns up has fallen too far behind to be worth
+    keeping, so it is disconnected rather than being fed a broken stream.
+*/
+
+/* -------------------------------------------------------------------------------------------------- */
+/* ----------------- INCLUDES ----------------------------------------------------------------------- */
+/* -------------------------------------------------------------------------------------------------- */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include "errors.h"
+#include "http.h"
+
+/* -------------------------------------------------------------------------------------------------- */
+/* ----------------- DEFINES ------------------------------------------------------------------------ */
+/* -------------------------------------------------------------------------------------------------- */
+
+/* epoll data for the two fds that are not clients, the clients are their index */
+#define HTTP_TS_EPOLL_LISTEN   0xfffffffe
+#define HTTP_TS_EPOLL_DOORBELL 0xffffffff
+
+#define HTTP_TS_MAX_EVENTS (HTTP_TS_MAX_CLIENTS+2)
+
+/* what the socket can buffer for each client on top of its queue */
+#define HTTP_TS_SNDBUF (256*1024)
+
+#define HTTP_TS_RESPONSE_OK  "HTTP/1.0 200 OK\r\n"                \
+                             "Content-Type: video/MP2T\r\n"       \
+                             "Cache-Control: no-cache\r\n"        \
+                             "Connection: close\r\n\r\n"
+#define HTTP_TS_RESPONSE_BAD "HTTP/1.0 405 Method Not Allowed\r\n" \
+                             "Allow: GET\r\n"                      \
+                             "Connection: close\r\n\r\n"
+#define HTTP_TS_RESPONSE_BUSY "HTTP/1.0 503 Service Unavailable\r\n" \
+                              "Connection: close\r\n\r\n"
+
+/* -------------------------------------------------------------------------------------------------- */
+/* ----------------- ROUTINES ----------------------------------------------------------------------- */
+/* -------------------------------------------------------------------------------------------------- */
+
+/* -------------------------------------------------------------------------------------------------- */
+static void http_ts_watch(http_ts_t *http, http_ts_client_t *client, bool want_out) {
+/* -------------------------------------------------------------------------------------------------- */
+/* sets whether epoll tells us when a client's socket has room to send                               */
+/*    *http: the server                                                                               */
+/*  *client: the client                                                                               */
+/* want_out: true to wait for room to send as well as for the client saying something                 */
+/* -------------------------------------------------------------------------------------------------- */
+    struct epoll_event event;
+
+    if (client->want_out!=want_out) {
+        event.events=EPOLLIN | EPOLLRDHUP | (want_out ? EPOLLOUT : 0);
+        event.data.u32=(uint32_t)(client-http->clients);
+        epoll_ctl(http->epoll_fd, EPOLL_CTL_MOD, client->fd, &event);
+        client->want_out=want_out;
+    }
+}
+
+/* -------------------------------------------------------------------------------------------------- */
+static void http_ts_disconnect(http_ts_t *http, http_ts_client_t *client) {
+/* -------------------------------------------------------------------------------------------------- */
+/* closes a client's connection and gives back everything it had queued                               */
+/*   *http: the server                                                                                */
+/* *client: the client to get rid of                                                                  */
+/* -------------------------------------------------------------------------------------------------- */
+    if (client->fd>=0) {
+        /* closing the fd takes it out of the epoll too */
+        close(client->fd);
+        client->fd=-1;
+        http->num_clients--;
+        while (client->queue_count>0) {
+            http->release(client->queue[client->queue_head].ref);
+            client->queue_head=(client->queue_head+1) % HTTP_TS_CLIENT_DEPTH;
+            client->queue_count--;
+        }
+    }
+}
+
+/* -------------------------------------------------------------------------------------------------- */
+static void http_ts_send(http_ts_t *http, http_ts_client_t *client) {
+/* -------------------------------------------------------------------------------------------------- */
+/* sends as much of what a client has waiting as its socket will take, without blocking               */
+/*   *http: the server                                                                                */
+/* *client: the client to send to                                                                     */
+/* -------------------------------------------------------------------------------------------------- */
+    struct iovec iov[HTTP_TS_CLIENT_DEPTH];
+    http_ts_chunk_t *chunk;
+    uint32_t n;
+    ssize_t sent;
+
+    if (client->fd<0) return;
+
+    if (client->header_sent<client->header_len) {
+        sent=send(client->fd, &client->header[client->header_sent], client->header_len-client->header_sent,
+                  MSG_NOSIGNAL);
+        if (sent<0) {
+            if ((errno!=EAGAIN) && (errno!=EWOULDBLOCK) && (errno!=EINTR)) http_ts_disconnect(http, client);
+            else http_ts_watch(http, client, true);
+            return;
+        }
+        client->header_sent+=sent;
+        if (client->header_sent<client->header_len) {
+            http_ts_watch(http, client, true);
+            return;
+        }
+        if (client->closing) {
+            http_ts_disconnect(http, client);
+            return;
+        }
+    }
+
+    while (client->queue_count>0) {
+        for (n=0; n<client->queue_count; n++) {
+            chunk=&client->queue[(client->queue_head+n) % HTTP_TS_CLIENT_DEPTH];
+            iov[n].iov_base=chunk->data;
+            iov[n].iov_len=chunk->len;
+        }
+        iov[0].iov_base=(uint8_t *)iov[0].iov_base+client->offset;
+        iov[0].iov_len-=client->offset;
+
+        sent=writev(client->fd, iov, (int)client->queue_count);
+        if (sent<0) {
+            if ((errno!=EAGAIN) && (errno!=EWOULDBLOCK) && (errno!=EINTR)) {
+                http_ts_disconnect(http, client);
+                return;
+            }
+            break;
+        }
+
+        /* give back whatever has gone completely */
+        while ((client->queue_count>0) && (sent>0)) {
+            chunk=&client->queue[client->queue_head];
+            if ((size_t)sent<chunk->len-client->offset) {
+                client->offset+=sent;
+                sent=0;
+            } else {
+                sent-=chunk->len-client->offset;
+                client->offset=0;
+                http->release(chunk->ref);
+                client->queue_head=(client->queue_head+1) % HTTP_TS_CLIENT_DEPTH;
+                client->queue_count--;
+            }
+        }
+    }
+
+    http_ts_watch(http, client, client->queue_count>0);
+}
+
+/* -------------------------------------------------------------------------------------------------- */
+static void http_ts_accept(http_ts_t *http) {
+/* -------------------------------------------------------------------------------------------------- */
+/* takes on all the new connections waiting on the listening socket                                   */
+/* *http: the server                                                                                  */
+/* -------------------------------------------------------------------------------------------------- */
+    struct epoll_event event;
+    http_ts_client_t *client;
+    uint32_t i;
+    int sndbuf=HTTP_TS_SNDBUF;
+    int nodelay=1;
+    int fd;
+
+    while ((fd=accept4(http->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC))>=0) {
+        for (i=0; (i<HTTP_TS_MAX_CLIENTS) && (http->clients[i].fd>=0); i++);
+        if (i==HTTP_TS_MAX_CLIENTS) {
+            /* best effort, it is going anyway */
+            send(fd, HTTP_TS_RESPONSE_BUSY, strlen(HTTP_TS_RESPONSE_BUSY), MSG_NOSIGNAL | MSG_DONTWAIT);
+            close(fd);
+            continue;
+        }
+
+        setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+
+        client=&http->clients[i];
+        client->streaming=false;
+        client->closing=false;
+        client->want_out=false;
+        client->request_len=0;
+        client->header_len=0;
+        client->header_sent=0;
+        client->queue_head=0;
+        client->queue_count=0;
+        client->offset=0;
+
+        event.events=EPOLLIN | EPOLLRDHUP;
+        event.data.u32=i;
+        if (epoll_ctl(http->epoll_fd, EPOLL_CTL_ADD, fd, &event)<0) {
+            close(fd);
+            continue;
+        }
+        client->fd=fd;
+        http->num_clients++;
+    }
+}
+
+/* -------------------------------------------------------------------------------------------------- */
+static void http_ts_receive(http_ts_t *http, http_ts_client_t *client) {
+/* -------------------------------------------------------------------------------------------------- */
+/* reads what a client has sent us. Until the request is complete we collect it, after that anything */
+/* else is thrown away, and a client that hangs up is disconnected                                    */
+/*   *http: the server                                                                                */
+/* *client: the client to read from                                                                   */
+/* -------------------------------------------------------------------------------------------------- */
+    char discard[256];
+    ssize_t len;
+    const char *response;
+
+    for (;;) {
+        if (client->request_len<HTTP_TS_REQUEST_MAX-1) {
+            len=recv(client->fd, &client->request[client->request_len], HTTP_TS_REQUEST_MAX-1-client->request_len, 0);
+        } else {
+            len=recv(client->fd, discard, sizeof(discard), 0);
+        }
+        if (len==0) {
+            http_ts_disconnect(http, client);
+            return;
+        }
+        if (len<0) {
+            if ((errno!=EAGAIN) && (errno!=EWOULDBLOCK) && (errno!=EINTR)) http_ts_disconnect(http, client);
+            break;
+        }
+        if (client->request_len<HTTP_TS_REQUEST_MAX-1) client->request_len+=len;
+    }
+
+    if ((client->header_len==0) && (client->fd>=0)) {
+        client->request[client->request_len]='\0';
+        /* we only need the request line, but wait for the end of the headers or a full buffer */
+        if ((strstr(client->request, "\r\n\r\n")==NULL) && (strstr(client->request, "\n\n")==NULL) &&
+            (client->request_len<HTTP_TS_REQUEST_MAX-1)) return;
+
+        /* any path will do, there is only the one stream */
+        if (0==strncmp(client->request, "GET ", 4)) {
+            response=HTTP_TS_RESPONSE_OK;
+            client->streaming=true;
+        } else {
+            response=HTTP_TS_RESPONSE_BAD;
+            client->closing=true;
+        }
+        client->header_len=strlen(response);
+        memcpy(client->header, response, client->header_len);
+        http_ts_send(http, client);
+    }
+}
+
+/* -------------------------------------------------------------------------------------------------- */
+static int http_ts_listen(int port) {
+/* -------------------------------------------------------------------------------------------------- */
+/* opens the listening socket, on IPv6 and IPv4 if we can and on just IPv4 if not                     */
+/*   port: the TCP port to listen on                                                                  */
+/* return: the socket, or -1 if it could not be opened                                                */
+/* -------------------------------------------------------------------------------------------------- */
+    struct sockaddr_in6 addr6;
+    struct sockaddr_in addr4;
+    int reuse=1;
+    int v6only=0;
+    int fd;
+
+    fd=socket(AF_INET6, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd>=0) {
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+        setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &v6only, sizeof(v6only));
+        memset(&addr6, 0, sizeof(addr6));
+        addr6.sin6_family=AF_INET6;
+        addr6.sin6_addr=in6addr_any;
+        addr6.sin6_port=htons(port);
+        if ((bind(fd, (struct sockaddr *)&addr6, sizeof(addr6))==0) && (listen(fd, HTTP_TS_MAX_CLIENTS)==0)) return fd;
+        close(fd);
+    }
+
+    fd=socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd>=0) {
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+        memset(&addr4, 0, sizeof(addr4));
+        addr4.sin_family=AF_INET;
+        addr4.sin_addr.s_addr=htonl(INADDR_ANY);
+        addr4.sin_port=htons(port);
+        if ((bind(fd, (struct sockaddr *)&addr4, sizeof(addr4))==0) && (listen(fd, HTTP_TS_MAX_CLIENTS)==0)) return fd;
+        close(fd);
+    }
+
+    return -1;
+}
+
+/* -------------------------------------------------------------------------------------------------- */
+uint8_t http_ts_init(http_ts_t *http, int port, void (*retain)(void *), void (*release)(void *)) {
+/* -------------------------------------------------------------------------------------------------- */
+/* starts listening for clients wanting the TS                                                        */
+/*    *http: the server to set up                                                                     */
+/*     port: the TCP port to listen on                                                                */
+/*  retain: takes a reference on a lump of TS given to http_ts_queue()                                */
+/* release: gives a reference back                                                                    */
+/*   return: error code                                                                               */
+/* -------------------------------------------------------------------------------------------------- */
+    uint8_t err=ERROR_NONE;
+    struct epoll_event event;
+    uint32_t i;
+
+    printf("Flow: HTTP TS init, port %i\n",port);
+
+    http->retain=retain;
+    http->release=release;
+    http->num_clients=0;
+    http->slow_disconnects=0;
+    for (i=0; i<HTTP_TS_MAX_CLIENTS; i++) http->clients[i].fd=-1;
+    http->epoll_fd=-1;
+    http->doorbell_fd=-1;
+
+    http->listen_fd=http_ts_listen(port);
+    if (http->listen_fd<0) {
+        printf("ERROR: HTTP TS socket open on port %i\n",port);
+        err=ERROR_HTTP_SOCKET_OPEN;
+    }
+
+    if (err==ERROR_NONE) {
+        http->epoll_fd=epoll_create1(EPOLL_CLOEXEC);
+        http->doorbell_fd=eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if ((http->epoll_fd<0) || (http->doorbell_fd<0)) err=ERROR_HTTP_SOCKET_OPEN;
+    }
+
+    if (err==ERROR_NONE) {
+        event.events=EPOLLIN;
+        event.data.u32=HTTP_TS_EPOLL_LISTEN;
+        if (epoll_ctl(http->epoll_fd, EPOLL_CTL_ADD, http->listen_fd, &event)<0) err=ERROR_HTTP_SOCKET_OPEN;
+        event.events=EPOLLIN;
+        event.data.u32=HTTP_TS_EPOLL_DOORBELL;
+        if (epoll_ctl(http->epoll_fd, EPOLL_CTL_ADD, http->doorbell_fd, &event)<0) err=ERROR_HTTP_SOCKET_OPEN;
+    }
+
+    if (err!=ERROR_NONE) {
+        printf("ERROR: HTTP TS init\n");
+        http_ts_close(http);
+    }
+
+    return err;
+}
+
+/* -------------------------------------------------------------------------------------------------- */
+void http_ts_service(http_ts_t *http, int timeout_ms) {
+/* -------------------------------------------------------------------------------------------------- */
+/* waits for something to happen on any of the sockets and deals with it. Returns early if the        */
+/* doorbell is rung                                                                                   */
+/*       *http: the server                                                                            */
+/*  timeout_ms: the longest to wait, 0 to just deal with what is already there                        */
+/* -------------------------------------------------------------------------------------------------- */
+    struct epoll_event events[HTTP_TS_MAX_EVENTS];
+    http_ts_client_t *client;
+    uint64_t rings;
+    int num_events;
+    int n;
+
+    num_events=epoll_wait(http->epoll_fd, events, HTTP_TS_MAX_EVENTS, timeout_ms);
+
+    for (n=0; n<num_events; n++) {
+        if (events[n].data.u32==HTTP_TS_EPOLL_LISTEN) {
+            http_ts_accept(http);
+        } else if (events[n].data.u32==HTTP_TS_EPOLL_DOORBELL) {
+            /* all we need is to have woken up, the caller has the TS to hand out */
+            while (read(http->doorbell_fd, &rings, sizeof(rings))>0);
+        } else if (events[n].data.u32<HTTP_TS_MAX_CLIENTS) {
+            client=&http->clients[events[n].data.u32];
+            /* a slot freed and reused within this batch is told about on the next wait */
+            if (client->fd<0) continue;
+            if (events[n].events & (EPOLLERR | EPOLLHUP)) {
+                http_ts_disconnect(http, client);
+                continue;
+            }
+            if (events[n].events & (EPOLLIN | EPOLLRDHUP)) http_ts_receive(http, client);
+            if ((client->fd>=0) && (events[n].events & EPOLLOUT)) http_ts_send(http, client);
+        }
+    }
+}
+
+/* -------------------------------------------------------------------------------------------------- */
+void http_ts_doorbell(http_ts_t *http) {
+/* -------------------------------------------------------------------------------------------------- */
+/* wakes up http_ts_service(). This is the only call that can be made from another thread             */
+/* *http: the server                                                                                  */
+/* -------------------------------------------------------------------------------------------------- */
+    uint64_t ring=1;
+
+    if (http->doorbell_fd>=0) {
+        if (write(http->doorbell_fd, &ring, sizeof(ring))<0) {
+            /* only fails if it has been rung 2^64 times without being answered */
+        }
+    }
+}
+
+/* -------------------------------------------------------------------------------------------------- */
+void http_ts_queue(http_ts_t *http, void *ref, uint8_t *data, uint32_t len) {
+/* -------------------------------------------------------------------------------------------------- */
+/* queues a lump of TS on every client that is streaming and starts sending it                        */
+/*  *http: the server                                                                                 */
+/*   *ref: passed to retain() and release() to keep the data alive while it is queued                 */
+/*  *data: the TS                                                                                     */
+/*    len: the number of bytes of TS                                                                  */
+/* -------------------------------------------------------------------------------------------------- */
+    struct linger abort_linger={ .l_onoff=1, .l_linger=0 };
+    http_ts_client_t *client;
+    http_ts_chunk_t *chunk;
+    uint32_t i;
+
+    for (i=0; i<HTTP_TS_MAX_CLIENTS; i++) {
+        client=&http->clients[i];
+        if ((client->fd<0) || !client->streaming) continue;
+
+        if (client->queue_count==HTTP_TS_CLIENT_DEPTH) {
+            /* it is not keeping up with the TS, and never will */
+            printf("      Status: HTTP TS client %i too slow, disconnecting\n",i);
+            http->slow_disconnects++;
+            /* reset rather than close, so that what is stuck in the socket goes too */
+            setsockopt(client->fd, SOL_SOCKET, SO_LINGER, &abort_linger, sizeof(abort_linger));
+            http_ts_disconnect(http, client);
+            continue;
+        }
+
+        http->retain(ref);
+        chunk=&client->queue[(client->queue_head+client->queue_count) % HTTP_TS_CLIENT_DEPTH];
+        chunk->ref=ref;
+        chunk->data=data;
+        chunk->len=len;
+        client->queue_count++;
+
+        /* if it is already waiting for room to send, epoll will tell us when */
+        if (!client->want_out) http_ts_send(http, client);
+    }
+}
+
+/* -------------------------------------------------------------------------------------------------- */
+uint8_t http_ts_close(http_ts_t *http) {
+/* -------------------------------------------------------------------------------------------------- */
+/* disconnects all the clients and stops listening                                                    */
+/*   *http: the server                                                                                */
+/*  return: error code                                                                                */
+/* -------------------------------------------------------------------------------------------------- */
+    uint8_t err=ERROR_NONE;
+    uint32_t i;
+
+    printf("Flow: HTTP TS close\n");
+
+    for (i=0; i<HTTP_TS_MAX_CLIENTS; i++) http_ts_disconnect(http, &http->clients[i]);
+
+    if ((http->listen_fd>=0) && (close(http->listen_fd)!=0)) err=ERROR_HTTP_CLOSE;
+    if (http->epoll_fd>=0) close(http->epoll_fd);
+    if (http->doorbell_fd>=0) close(http->doorbell_fd);
+    http->listen_fd=-1;
+    http->epoll_fd=-1;
+    http->doorbell_fd=-1;
+
+    if (err!=ERROR_NONE) printf("ERROR: HTTP TS close\n");
+
+    return err;
+}
+
@@ -0,0 +1,75 @@
+/* -------------------------------------------------------------------------------------------------- */
+/* The LongMynd receiver: http.h                                                                      */
+/* Copyright 2019 Heather Lomond                                                                      */
+/* -------------------------------------------------------------------------------------------------- */
+/*
+    This file is part of longmynd.
+
+    Longmynd is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Longmynd is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with longmynd.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef HTTP_H
+#define HTTP_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define HTTP_TS_MAX_CLIENTS  8
+/* how many buffers of TS a client can fall behind by before we give up on it */
+#define HTTP_TS_CLIENT_DEPTH 32
+#define HTTP_TS_REQUEST_MAX  1024
+#define HTTP_TS_HEADER_MAX   256
+
+typedef struct {
+    void *ref;                       /* what the owner of the data uses to keep track of it            */
+    uint8_t *data;
+    uint32_t len;
+} http_ts_chunk_t;
+
+typedef struct {
+    int fd;                          /* -1 if this client slot is free                                 */
+    bool streaming;                  /* the request has been answered, so the TS can follow            */
+    bool closing;                    /* close once the header has gone, eg. for a bad request          */
+    bool want_out;                   /* we are waiting on epoll for room to send                       */
+    char request[HTTP_TS_REQUEST_MAX];
+    uint32_t request_len;
+    char header[HTTP_TS_HEADER_MAX];
+    uint32_t header_len;
+    uint32_t header_sent;
+    /* the TS waiting to go to this client, the first chunk may be part sent */
+    http_ts_chunk_t queue[HTTP_TS_CLIENT_DEPTH];
+    uint32_t queue_head;
+    uint32_t queue_count;
+    uint32_t offset;
+} http_ts_client_t;
+
+typedef struct {
+    int listen_fd;
+    int epoll_fd;
+    int doorbell_fd;                 /* an eventfd, rung when there is more TS to hand out             */
+    http_ts_client_t clients[HTTP_TS_MAX_CLIENTS];
+    uint32_t num_clients;
+    uint32_t slow_disconnects;
+    void (*retain)(void *);          /* called for every client a chunk is queued on ...               */
+    void (*release)(void *);         /* ... and when it is done with it                                */
+} http_ts_t;
+
+uint8_t http_ts_init(http_ts_t *, int, void (*)(void *), void (*)(void *));
+void http_ts_service(http_ts_t *, int);
+void http_ts_doorbell(http_ts_t *);
+void http_ts_queue(http_ts_t *, void *, uint8_t *, uint32_t);
+uint8_t http_ts_close(http_ts_t *);
+
+#endif
+
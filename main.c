@@ -32,6 +32,7 @@
 #include <stdbool.h>
 #include <string.h>
 #include <pthread.h>
+#include <signal.h>
 #include "main.h"
 #include "ftdi.h"
 #include "stv0910.h"
@@ -46,6 +47,11 @@
 #include "udp.h"
 #include "beep.h"
 #include "ts.h"
+#include "ts_ring.h"
+#include "ts_sink.h"
+#include "record.h"
+#include "timeshift.h"
+#include "control.h"
 
 /* -------------------------------------------------------------------------------------------------- */
 /* ----------------- DEFINES ------------------------------------------------------------------------ */
@@ -75,6 +81,7 @@ static pthread_t thread_ts_parse;
 static pthread_t thread_ts;
 static pthread_t thread_i2c;
 static pthread_t thread_beep;
+static pthread_t thread_control;
 
 /* -------------------------------------------------------------------------------------------------- */
 /* ----------------- ROUTINES ----------------------------------------------------------------------- */
@@ -175,21 +182,56 @@ uint8_t process_command_line(int argc, char *argv[], longmynd_config_t *config)
     uint8_t param;
     bool main_usb_set=false;
     bool ts_ip_set=false;
-    bool ts_fifo_set=false;
     bool status_ip_set=false;
     bool status_fifo_set=false;
+    bool timeshift_set=false;
+    bool fec_set=false;
 
     /* Defaults */
     config->port_swap = false;
     config->beep_enabled = false;
     config->device_usb_addr = 0;
     config->device_usb_bus = 0;
-    config->ts_use_ip = false;
-    strcpy(config->ts_fifo_path, "longmynd_main_ts");
+    config->ts_num_sinks = 0;
+    config->ts_sink_depth = TS_SINK_DEFAULT_DEPTH;
+    config->ts_fifo_nonblocking = false;
+    config->ts_fifo_splice = false;
+    config->ts_filter_nulls = false;
+    config->ts_filter_pids_mode = TS_FILTER_PIDS_ALL;
+    config->ts_filter_num_pids = 0;
+    config->ts_record_segment_mb = RECORD_TS_DEFAULT_SEGMENT_MB;
+    config->ts_record_segment_s = 0;
+    config->ts_timeshift_mb = 0;
+    config->control_use_fifo = false;
+    config->ts_udp_pace = false;
+    config->ts_fec_l = 0;
+    config->ts_fec_d = 0;
+    config->ts_usb_transfers = 0;
+    config->ts_parse_slots = TS_RING_DEFAULT_SLOTS;
+    config->ts_parse_drop_oldest = false;
     config->status_use_ip = false;
+    config->multicast_ttl = 1;
+    config->multicast_iface[0] = '\0';
+    config->multicast_loop = true;
     strcpy(config->status_fifo_path, "longmynd_main_status");
     config->polarisation_supply=false;
     char polarisation_str[8];
+    longmynd_ts_sink_config_t *sink;
+    uint8_t i;
+    char *pid_str;
+    long pid;
+    long usb_transfers=0;
+    long parse_slots=TS_RING_DEFAULT_SLOTS;
+    long sink_depth=TS_SINK_DEFAULT_DEPTH;
+    long multicast_ttl=config->multicast_ttl;
+    long fec_l=0;
+    long fec_d=0;
+    bool pids_ok=true;
+    bool program_ok=true;
+    bool iface_ok=true;
+    bool control_ok=true;
+    bool path_ok=true;
+    bool status_ip_ok=true;
 
     param=1;
     while (param<argc-2) {
@@ -201,17 +243,127 @@ uint8_t process_command_line(int argc, char *argv[], longmynd_config_t *config)
                 main_usb_set=true;
                 break;
             case 'i':
-                strncpy(config->ts_ip_addr,argv[param++], 16);
-                config->ts_ip_port=(uint16_t)strtol(argv[param],NULL,10);
-                config->ts_use_ip=true;
-                ts_ip_set = true;
+            case 'R':
+                if (config->ts_num_sinks<TS_MAX_SINKS) {
+                    sink=&config->ts_sinks[config->ts_num_sinks++];
+                    sink->type=TS_SINK_UDP;
+                    strncpy(sink->path,argv[param++], 64);
+                    sink->port=(uint16_t)strtol(argv[param],NULL,10);
+                    sink->rtp=(argv[param-2][1]=='R');
+                    sink->program=0;
+                } else {
+                    err=ERROR_ARGS_INPUT;
+                    param++;
+                }
                 break;
             case 't':
-                strncpy(config->status_fifo_path, argv[param], 128);
-                ts_fifo_set=true;
+            case 'f':
+            case 'F':
+                if (config->ts_num_sinks<TS_MAX_SINKS) {
+                    sink=&config->ts_sinks[config->ts_num_sinks++];
+                    if (argv[param-1][1]=='F')      sink->type=TS_SINK_RECORD;
+                    else if (argv[param-1][1]=='f') sink->type=TS_SINK_FILE;
+                    else                            sink->type=TS_SINK_FIFO;
+                    /* a path that does not fit would be cut short into some other file's */
+                    if (strlen(argv[param])<sizeof(sink->path)) strcpy(sink->path, argv[param]);
+                    else path_ok=false;
+                    sink->port=0;
+                    sink->rtp=false;
+                    sink->program=0;
+                } else {
+                    err=ERROR_ARGS_INPUT;
+                }
+                break;
+            case 'H':
+                if (config->ts_num_sinks<TS_MAX_SINKS) {
+                    sink=&config->ts_sinks[config->ts_num_sinks++];
+                    sink->type=TS_SINK_HTTP;
+                    sink->path[0]='\0';
+                    sink->port=(uint16_t)strtol(argv[param],NULL,10);
+                    sink->rtp=false;
+                    sink->program=0;
+                } else {
+                    err=ERROR_ARGS_INPUT;
+                }
+                break;
+            case 'S':
+                /* cuts the TS output given just before this down to one programme */
+                if (config->ts_num_sinks>0) {
+                    config->ts_sinks[config->ts_num_sinks-1].program=(uint16_t)strtol(argv[param],NULL,0);
+                } else {
+                    program_ok=false;
+                }
+                break;
+            case 'X':
+                if (config->ts_num_sinks<TS_MAX_SINKS) {
+                    sink=&config->ts_sinks[config->ts_num_sinks++];
+                    sink->type=TS_SINK_TIMESHIFT;
+                    if (strlen(argv[param])<sizeof(sink->path)) strcpy(sink->path, argv[param]);
+                    else path_ok=false;
+                    param++;
+                    config->ts_timeshift_mb=(uint32_t)strtol(argv[param],NULL,10);
+                    timeshift_set=true;
+                    sink->port=0;
+                    sink->rtp=false;
+                    sink->program=0;
+                } else {
+                    err=ERROR_ARGS_INPUT;
+                    param++;
+                }
+                break;
+            case 'c':
+                /* a path that does not fit would be cut short into some other file's */
+                if (strlen(argv[param])<sizeof(config->control_fifo_path)) strcpy(config->control_fifo_path, argv[param]);
+                else control_ok=false;
+                config->control_use_fifo=true;
+                break;
+            case 'G':
+                config->ts_record_segment_mb=(uint32_t)strtol(argv[param],NULL,10);
+                break;
+            case 'Y':
+                config->ts_record_segment_s=(uint32_t)strtol(argv[param],NULL,10);
+                break;
+            case 'q':
+                sink_depth=strtol(argv[param],NULL,10);
+                break;
+            case 'n':
+                config->ts_fifo_nonblocking=true;
+                param--; /* there is no data for this so go back */
+                break;
+            case 'z':
+                config->ts_fifo_splice=true;
+                param--; /* there is no data for this so go back */
+                break;
+            case 'E':
+                fec_l=strtol(argv[param++],NULL,10);
+                fec_d=strtol(argv[param  ],NULL,10);
+                fec_set=true;
+                break;
+            case 'C':
+                config->ts_udp_pace=true;
+                param--; /* there is no data for this so go back */
+                break;
+            case 'N':
+                config->ts_filter_nulls=true;
+                param--; /* there is no data for this so go back */
+                break;
+            case 'P':
+                if (0==strcasecmp("auto", argv[param])) {
+                    config->ts_filter_pids_mode=TS_FILTER_PIDS_AUTO;
+                } else {
+                    /* a comma separated list, in decimal or 0x hex */
+                    config->ts_filter_pids_mode=TS_FILTER_PIDS_LIST;
+                    for (pid_str=strtok(argv[param], ","); pid_str!=NULL; pid_str=strtok(NULL, ",")) {
+                        pid=strtol(pid_str,NULL,0);
+                        if ((pid<0) || (pid>=TS_PID_COUNT) || (config->ts_filter_num_pids>=TS_FILTER_MAX_PIDS)) pids_ok=false;
+                        else config->ts_filter_pids[config->ts_filter_num_pids++]=(uint16_t)pid;
+                    }
+                }
                 break;
             case 'I':
-                strncpy(config->status_ip_addr,argv[param++], 16);
+                if (strlen(argv[param])<sizeof(config->status_ip_addr)) strcpy(config->status_ip_addr, argv[param]);
+                else status_ip_ok=false;
+                param++;
                 config->status_ip_port=(uint16_t)strtol(argv[param],NULL,10);
                 config->status_use_ip=true;
                 status_ip_set = true;
@@ -232,16 +384,49 @@ uint8_t process_command_line(int argc, char *argv[], longmynd_config_t *config)
                 config->beep_enabled=true;
                 param--; /* there is no data for this so go back */
                 break;
+            case 'a':
+                usb_transfers=strtol(argv[param],NULL,10);
+                break;
+            case 'T':
+                multicast_ttl=strtol(argv[param],NULL,10);
+                break;
+            case 'M':
+                /* a name that does not fit would be cut short into some other interface's */
+                if (strlen(argv[param])<sizeof(config->multicast_iface)) strcpy(config->multicast_iface, argv[param]);
+                else iface_ok=false;
+                break;
+            case 'L':
+                config->multicast_loop=(0!=strtol(argv[param],NULL,10));
+                break;
+            case 'r':
+                parse_slots=strtol(argv[param],NULL,10);
+                break;
+            case 'd':
+                config->ts_parse_drop_oldest=true;
+                param--; /* there is no data for this so go back */
+                break;
           }
         }
         param++;
     }
 
-    if ((argc-param)<2) {
+    if (err!=ERROR_NONE) {
+        printf("ERROR: No more than %i TS outputs can be set\n",TS_MAX_SINKS);
+    } else if ((argc-param)<2) {
         err=ERROR_ARGS_INPUT;
         printf("ERROR: Main Frequency and Main Symbol Rate not found.\n");
     }
 
+    /* with no TS outputs given we fall back to the usual FIFO */
+    if (config->ts_num_sinks==0) {
+        sink=&config->ts_sinks[config->ts_num_sinks++];
+        sink->type=TS_SINK_FIFO;
+        strcpy(sink->path, "longmynd_main_ts");
+        sink->port=0;
+        sink->rtp=false;
+        sink->program=0;
+    }
+
     if (err==ERROR_NONE) {
         config->freq_requested =(uint32_t)strtol(argv[param++],NULL,10);
         if(config->freq_requested==0) {
@@ -284,27 +469,118 @@ uint8_t process_command_line(int argc, char *argv[], longmynd_config_t *config)
         } else if (config->sr_requested<33) {
             err=ERROR_ARGS_INPUT;
             printf("ERROR: SR must be >= 33 Ksymbols/s\n");
-        } else if (ts_ip_set && ts_fifo_set) {
-            err=ERROR_ARGS_INPUT;
-            printf("ERROR: Cannot set TS FIFO and TS IP address\n");
         } else if (status_ip_set && status_fifo_set) {
             err=ERROR_ARGS_INPUT;
             printf("ERROR: Cannot set Status FIFO and Status IP address\n");
-        } else if (config->ts_use_ip && config->status_use_ip && (config->ts_ip_port == config->status_ip_port) && (0==strcmp(config->ts_ip_addr, config->status_ip_addr))) {
+        } else if ((usb_transfers<0) || (usb_transfers>FTDI_USB_TS_MAX_TRANSFERS)) {
+            err=ERROR_ARGS_INPUT;
+            printf("ERROR: TS USB transfers must be between 0 and %i\n",FTDI_USB_TS_MAX_TRANSFERS);
+        } else if ((parse_slots<2) || (parse_slots>TS_RING_MAX_SLOTS)) {
+            err=ERROR_ARGS_INPUT;
+            printf("ERROR: TS parser slots must be between 2 and %i\n",TS_RING_MAX_SLOTS);
+        } else if ((sink_depth<2) || (sink_depth>TS_SINK_MAX_DEPTH)) {
+            err=ERROR_ARGS_INPUT;
+            printf("ERROR: TS output queue depth must be between 2 and %i\n",TS_SINK_MAX_DEPTH);
+        } else if (config->ts_record_segment_mb==0) {
+            err=ERROR_ARGS_INPUT;
+            printf("ERROR: TS recording segments must be at least 1 MB\n");
+        } else if (timeshift_set && ((config->ts_timeshift_mb==0) || (config->ts_timeshift_mb>TIMESHIFT_TS_MAX_MB))) {
+            err=ERROR_ARGS_INPUT;
+            printf("ERROR: The time shift must be between 1 and %i MB\n",TIMESHIFT_TS_MAX_MB);
+        } else if (fec_set && ((fec_l<1) || (fec_l>FEC_TS_MAX_L) || (fec_d<FEC_TS_MIN_D) || (fec_d>FEC_TS_MAX_D) ||
+                               (fec_l*fec_d>FEC_TS_MAX_LD))) {
+            err=ERROR_ARGS_INPUT;
+            printf("ERROR: FEC must have 1 to %i columns and %i to %i rows, and no more than %i in all\n",
+                   FEC_TS_MAX_L,FEC_TS_MIN_D,FEC_TS_MAX_D,FEC_TS_MAX_LD);
+        } else if ((multicast_ttl<0) || (multicast_ttl>255)) {
             err=ERROR_ARGS_INPUT;
-            printf("ERROR: Cannot set Status IP & Port identical to TS IP & Port\n");
-        } else { /* err==ERROR_NONE */
+            printf("ERROR: Multicast TTL must be between 0 and 255\n");
+        } else if (!iface_ok) {
+            err=ERROR_ARGS_INPUT;
+            printf("ERROR: Multicast interface names must be shorter than %i characters\n",(int)sizeof(config->multicast_iface));
+        } else if (!path_ok) {
+            err=ERROR_ARGS_INPUT;
+            printf("ERROR: TS output paths must be shorter than %i characters\n",(int)sizeof(config->ts_sinks[0].path));
+        } else if (!status_ip_ok) {
+            err=ERROR_ARGS_INPUT;
+            printf("ERROR: Status IP addresses must be shorter than %i characters\n",(int)sizeof(config->status_ip_addr));
+        } else if (!control_ok) {
+            err=ERROR_ARGS_INPUT;
+            printf("ERROR: Control FIFO paths must be shorter than %i characters\n",(int)sizeof(config->control_fifo_path));
+        } else if (!program_ok) {
+            err=ERROR_ARGS_INPUT;
+            printf("ERROR: A programme can only be set after the TS output it is for\n");
+        } else if (!pids_ok || ((config->ts_filter_pids_mode==TS_FILTER_PIDS_LIST) && (config->ts_filter_num_pids==0))) {
+            err=ERROR_ARGS_INPUT;
+            printf("ERROR: TS output PIDs must be \"auto\" or a list of up to %i PIDs below %i\n",TS_FILTER_MAX_PIDS,TS_PID_COUNT);
+        }
+        /* the numbers are only narrowed down to fit the config once they are known to be in range */
+        if (err==ERROR_NONE) {
+            config->ts_usb_transfers=(uint8_t)usb_transfers;
+            config->ts_parse_slots=(uint8_t)parse_slots;
+            config->ts_sink_depth=(uint8_t)sink_depth;
+            config->multicast_ttl=(uint8_t)multicast_ttl;
+            config->ts_fec_l=(uint8_t)fec_l;
+            config->ts_fec_d=(uint8_t)fec_d;
+        }
+        for (i=0; (err==ERROR_NONE) && (i<config->ts_num_sinks); i++) {
+            sink=&config->ts_sinks[i];
+            if (sink->type==TS_SINK_UDP) ts_ip_set=true;
+            if ((sink->type==TS_SINK_UDP) && config->status_use_ip && (sink->port == config->status_ip_port) && (0==strcmp(sink->path, config->status_ip_addr))) {
+                err=ERROR_ARGS_INPUT;
+                printf("ERROR: Cannot set Status IP & Port identical to TS IP & Port\n");
+            }
+            if ((sink->type==TS_SINK_HTTP) && (sink->port==0)) {
+                err=ERROR_ARGS_INPUT;
+                printf("ERROR: HTTP TS port must be between 1 and 65535\n");
+            }
+        }
+        if (err==ERROR_NONE) {
              printf("      Status: Main Frequency=%i KHz\n",config->freq_requested);
              printf("              Main Symbol Rate=%i KSymbols/s\n",config->sr_requested);
              if (!main_usb_set)       printf("              Using First Minitiouner detected on USB\n");
              else                     printf("              USB bus/device=%i,%i\n",config->device_usb_bus,config->device_usb_addr);
-             if (!config->ts_use_ip)  printf("              Main TS output to FIFO=%s\n",config->ts_fifo_path);
-             else                     printf("              Main TS output to IP=%s:%i\n",config->ts_ip_addr,config->ts_ip_port);
+             for (i=0; i<config->ts_num_sinks; i++) {
+                 sink=&config->ts_sinks[i];
+                 if (sink->type==TS_SINK_FIFO)      printf("              Main TS output to FIFO=%s\n",sink->path);
+                 else if (sink->type==TS_SINK_FILE) printf("              Main TS output to file=%s\n",sink->path);
+                 else if (sink->type==TS_SINK_HTTP) printf("              Main TS output to HTTP clients on port %i\n",sink->port);
+                 else if (sink->type==TS_SINK_TIMESHIFT) printf("              Main TS time shifted in %s, %i MB\n",sink->path,
+                                                                                    config->ts_timeshift_mb);
+                 else if (sink->type==TS_SINK_RECORD) printf("              Main TS recorded to %s-*.ts, %i MB segments\n",sink->path,
+                                                                                    config->ts_record_segment_mb);
+                 else                               printf("              Main TS output to IP=%s:%i%s\n",sink->path,sink->port,
+                                                                                    sink->rtp ? " (RTP)" : "");
+                 if (sink->program!=0)              printf("                  just programme %i\n",sink->program);
+             }
+             printf("              TS outputs queue up to %i buffers each\n",config->ts_sink_depth);
+             if (config->ts_fifo_nonblocking) printf("              TS FIFOs are non-blocking, dropping packets when full\n");
+             if (config->ts_record_segment_s>0) printf("              TS recordings are also cut every %i s\n",config->ts_record_segment_s);
+             if (config->ts_fifo_splice) printf("              TS FIFOs are fed with vmsplice\n");
+             if (config->ts_fec_l>0) printf("              TS RTP outputs have %ix%i FEC on port+2 and port+4\n",
+                                            config->ts_fec_l,config->ts_fec_d);
+             if (config->ts_udp_pace) printf("              TS UDP outputs are paced out at the TS bit rate\n");
+             if (config->ts_filter_nulls) printf("              Null packets are not sent out\n");
+             if (config->ts_filter_pids_mode==TS_FILTER_PIDS_AUTO) printf("              Only the PIDs found by the TS parser are sent out\n");
+             if (config->ts_filter_pids_mode==TS_FILTER_PIDS_LIST) {
+                 printf("              Only PIDs");
+                 for (i=0; i<config->ts_filter_num_pids; i++) printf(" %i",config->ts_filter_pids[i]);
+                 printf(" are sent out\n");
+             }
+             if (config->control_use_fifo) printf("              Main Control input from FIFO=%s\n",config->control_fifo_path);
              if (!config->status_use_ip)  printf("              Main Status output to FIFO=%s\n",config->status_fifo_path);
              else                     printf("              Main Status output to IP=%s:%i\n",config->status_ip_addr,config->status_ip_port);
+             if (ts_ip_set || config->status_use_ip) {
+                 printf("              Multicast TTL=%i, loopback %s, interface %s\n",config->multicast_ttl,
+                             config->multicast_loop ? "on" : "off",
+                             (config->multicast_iface[0]!='\0') ? config->multicast_iface : "from routing");
+             }
              if (config->port_swap)   printf("              NIM inputs are swapped (Main now refers to BOTTOM F-Type\n");
              else                     printf("              Main refers to TOP F-Type\n");
              if (config->beep_enabled) printf("              MER Beep enabled\n");
+             if (config->ts_usb_transfers>0) printf("              TS USB async with %i transfers in flight\n",config->ts_usb_transfers);
+             printf("              TS parser has %i slots, %s when behind\n",config->ts_parse_slots,
+                                                    config->ts_parse_drop_oldest ? "drops oldest" : "skips new");
              if (config->polarisation_supply) printf("              Polarisation Voltage Supply enabled: %s\n", (config->polarisation_horizontal ? "H, 18V" : "V, 13V"));
         }
     }
@@ -623,12 +899,17 @@ uint8_t status_all_write(longmynd_status_t *status, uint8_t (*status_write)(uint
     if (err==ERROR_NONE) err=status_string_write(STATUS_SERVICE_PROVIDER_NAME, status->service_provider_name);
     /* TS Null Percentage */
     if (err==ERROR_NONE) err=status_write(STATUS_TS_NULL_PERCENTAGE, status->ts_null_percentage);
-    /* TS Elementary Stream PIDs */
-    for (uint8_t count=0; count<NUM_ELEMENT_STREAMS; count++) {
-        if(status->ts_elementary_streams[count][0] > 0)
-        {
-            if (err==ERROR_NONE) err=status_write(STATUS_ES_PID, status->ts_elementary_streams[count][0]);
-            if (err==ERROR_NONE) err=status_write(STATUS_ES_TYPE, status->ts_elementary_streams[count][1]);
+    /* TS Services, each followed by its Elementary Stream PIDs */
+    for (uint32_t count=0; count<status->ts_services.num_services; count++) {
+        longmynd_service_t *service=&status->ts_services.services[count];
+        if (err==ERROR_NONE) err=status_write(STATUS_TS_SERVICE, service->number);
+        if (err==ERROR_NONE) err=status_string_write(STATUS_TS_SERVICE_NAME, service->name);
+        if (err==ERROR_NONE) err=status_string_write(STATUS_TS_PROVIDER_NAME, service->provider_name);
+        if (err==ERROR_NONE) err=status_write(STATUS_TS_PMT_PID, service->pmt_pid);
+        if (err==ERROR_NONE) err=status_write(STATUS_TS_PCR_PID, service->pcr_pid);
+        for (uint32_t stream=service->first_stream; stream<service->first_stream+service->num_streams; stream++) {
+            if (err==ERROR_NONE) err=status_write(STATUS_ES_PID, status->ts_services.streams[stream].pid);
+            if (err==ERROR_NONE) err=status_write(STATUS_ES_TYPE, status->ts_services.streams[stream].type);
         }
     }
     /* MODCOD */
@@ -637,6 +918,71 @@ uint8_t status_all_write(longmynd_status_t *status, uint8_t (*status_write)(uint
     if (err==ERROR_NONE) err=status_write(STATUS_SHORT_FRAME, status->short_frame);
     /* Pilots */
     if (err==ERROR_NONE) err=status_write(STATUS_PILOTS, status->pilots);
+    /* TS USB engine counters, only there in async mode */
+    if (status->ts_usb_async) {
+        if (err==ERROR_NONE) err=status_write(STATUS_TS_USB_DRY_TIME, status->ts_usb_dry_time);
+        if (err==ERROR_NONE) err=status_write(STATUS_TS_USB_LATENCY, status->ts_usb_latency_avg);
+        if (err==ERROR_NONE) err=status_write(STATUS_TS_USB_LATENCY_MAX, status->ts_usb_latency_max);
+    }
+    /* TS buffers the parser did not get to */
+    if (err==ERROR_NONE) err=status_write(STATUS_TS_PARSE_OVERRUNS, status->ts_parse_overruns);
+    /* times the parser lost the packet sync */
+    if (err==ERROR_NONE) err=status_write(STATUS_TS_SYNC_LOSSES, status->ts_sync_losses);
+    /* the rest of the TR 101 290 priority 1 and 2 errors */
+    if (err==ERROR_NONE) err=status_write(STATUS_TS_SYNC_BYTE_ERR, status->ts_sync_byte_errors);
+    if (err==ERROR_NONE) err=status_write(STATUS_TS_PAT_ERRORS, status->ts_pat_errors);
+    if (err==ERROR_NONE) err=status_write(STATUS_TS_CC_ERRORS, status->ts_cc_errors);
+    if (err==ERROR_NONE) err=status_write(STATUS_TS_PMT_ERRORS, status->ts_pmt_errors);
+    if (err==ERROR_NONE) err=status_write(STATUS_TS_PID_ERRORS, status->ts_pid_errors);
+    if (err==ERROR_NONE) err=status_write(STATUS_TS_TRANSPORT_ERR, status->ts_transport_errors);
+    if (err==ERROR_NONE) err=status_write(STATUS_TS_CRC_ERRORS, status->ts_crc_errors);
+    if (err==ERROR_NONE) err=status_write(STATUS_TS_PCR_REPETITION, status->ts_pcr_repetition_errors);
+    if (err==ERROR_NONE) err=status_write(STATUS_TS_PCR_DISCONT, status->ts_pcr_discontinuity_errors);
+    /* each PID seen over the last second */
+    for (uint32_t count=0; count<status->ts_num_pids; count++) {
+        if (err==ERROR_NONE) err=status_write(STATUS_TS_PID, status->ts_pids[count].pid);
+        if (err==ERROR_NONE) err=status_write(STATUS_TS_PID_RATE, status->ts_pids[count].rate);
+        if (err==ERROR_NONE) err=status_write(STATUS_TS_PID_CC_ERRORS, status->ts_pids[count].cc_errors);
+        if (err==ERROR_NONE) err=status_write(STATUS_TS_PID_TRANSPORT, status->ts_pids[count].transport_errors);
+        if (err==ERROR_NONE) err=status_write(STATUS_TS_PID_FLAGS, status->ts_pids[count].flags);
+    }
+    /* TS buffers each output has had to drop, one line per output in command line order */
+    for (uint8_t count=0; count<status->ts_num_sinks; count++) {
+        if (err==ERROR_NONE) err=status_write(STATUS_TS_SINK_DROPS, status->ts_sink_drops[count]);
+    }
+    /* TS the output filter has saved us sending */
+    if (status->ts_filter_enabled) {
+        if (err==ERROR_NONE) err=status_write(STATUS_TS_FILTER_SAVED, status->ts_filter_saved);
+    }
+    /* non-blocking TS FIFO counters, again one line per output */
+    if (status->ts_fifo_nonblocking) {
+        for (uint8_t count=0; count<status->ts_num_sinks; count++) {
+            if (err==ERROR_NONE) err=status_write(STATUS_TS_FIFO_DROPS, status->ts_fifo_drops[count]);
+            if (err==ERROR_NONE) err=status_write(STATUS_TS_FIFO_RECONNECTS, status->ts_fifo_reconnects[count]);
+        }
+    }
+    /* HTTP TS server counters, again one line per output */
+    if (status->ts_http) {
+        for (uint8_t count=0; count<status->ts_num_sinks; count++) {
+            if (err==ERROR_NONE) err=status_write(STATUS_TS_HTTP_CLIENTS, status->ts_http_clients[count]);
+            if (err==ERROR_NONE) err=status_write(STATUS_TS_HTTP_SLOW, status->ts_http_slow[count]);
+        }
+    }
+    /* UDP pacing, again one set of lines per output */
+    if (status->ts_udp_pace) {
+        for (uint8_t count=0; count<status->ts_num_sinks; count++) {
+            if (err==ERROR_NONE) err=status_write(STATUS_TS_PACE_RATE, status->ts_pace_rate[count]);
+            if (err==ERROR_NONE) err=status_write(STATUS_TS_PACE_JITTER, status->ts_pace_jitter[count]);
+            if (err==ERROR_NONE) err=status_write(STATUS_TS_PACE_BACKLOG, status->ts_pace_backlog[count]);
+        }
+    }
+    /* TS recording throughput and worst write time, again one line per output */
+    if (status->ts_record) {
+        for (uint8_t count=0; count<status->ts_num_sinks; count++) {
+            if (err==ERROR_NONE) err=status_write(STATUS_TS_RECORD_RATE, status->ts_record_rate[count]);
+            if (err==ERROR_NONE) err=status_write(STATUS_TS_RECORD_LATENCY, status->ts_record_latency[count]);
+        }
+    }
 
     return err;
 }
@@ -656,7 +1002,11 @@ int main(int argc, char *argv[]) {
 
     err=process_command_line(argc, argv, &longmynd_config);
 
+    /* a TS FIFO losing its reader shows up as EPIPE from the write, rather than killing us */
+    signal(SIGPIPE, SIG_IGN);
+
     /* first setup the fifos, udp socket, ftdi and usb */
+    udp_set_multicast(longmynd_config.multicast_ttl, longmynd_config.multicast_iface, longmynd_config.multicast_loop);
     if(longmynd_config.status_use_ip) {
         if (err==ERROR_NONE) err=udp_status_init(longmynd_config.status_ip_addr, longmynd_config.status_ip_port);
         status_write = udp_status_write;
@@ -669,6 +1019,8 @@ int main(int argc, char *argv[]) {
 
     if (err==ERROR_NONE) err=ftdi_init(longmynd_config.device_usb_bus, longmynd_config.device_usb_addr);
 
+    if (err==ERROR_NONE) err=ts_init(&longmynd_config);
+
     thread_vars_t thread_vars_ts = {
         .main_err_ptr = &err,
         .thread_err = ERROR_NONE,
@@ -733,8 +1085,29 @@ int main(int argc, char *argv[]) {
         pthread_setname_np(thread_beep, "Beep Audio");
     }
 
+    thread_vars_t thread_vars_control = {
+        .main_err_ptr = &err,
+        .thread_err = ERROR_NONE,
+        .config = &longmynd_config,
+        .status = &longmynd_status
+    };
+
+    if(longmynd_config.control_use_fifo)
+    {
+        if(0 != pthread_create(&thread_control, NULL, loop_control, (void *)&thread_vars_control))
+        {
+            fprintf(stderr, "Error creating loop_control pthread\n");
+            longmynd_config.control_use_fifo = false;
+        }
+        else
+        {
+            pthread_setname_np(thread_control, "Control");
+        }
+    }
+
     uint64_t last_status_sent_monotonic = 0;
     longmynd_status_t longmynd_status_cpy;
+    longmynd_service_table_t longmynd_services_cpy = { 0 };
 
     while (err==ERROR_NONE) {
         /* Test if new status data is available */
@@ -743,6 +1116,9 @@ int main(int argc, char *argv[]) {
             pthread_mutex_lock(&longmynd_status.mutex);
             /* Clone status struct locally */
             memcpy(&longmynd_status_cpy, &longmynd_status, sizeof(longmynd_status_t));
+            /* the service table is only pointed to, so it needs copying too */
+            ts_services_copy(&longmynd_services_cpy, &longmynd_status.ts_services);
+            longmynd_status_cpy.ts_services = longmynd_services_cpy;
             /* Release lock on global status struct */
             pthread_mutex_unlock(&longmynd_status.mutex);
 
@@ -760,7 +1136,8 @@ int main(int argc, char *argv[]) {
             (thread_vars_ts.thread_err!=ERROR_NONE
             || thread_vars_ts_parse.thread_err!=ERROR_NONE
             || thread_vars_beep.thread_err!=ERROR_NONE
-            || thread_vars_i2c.thread_err!=ERROR_NONE)) {
+            || thread_vars_i2c.thread_err!=ERROR_NONE
+            || thread_vars_control.thread_err!=ERROR_NONE)) {
             err=ERROR_THREAD_ERROR;
         }
     }
@@ -770,6 +1147,11 @@ int main(int argc, char *argv[]) {
     pthread_join(thread_ts, NULL);
     pthread_join(thread_i2c, NULL);
     pthread_join(thread_beep, NULL);
+    if(longmynd_config.control_use_fifo) pthread_join(thread_control, NULL);
+
+    ts_close();
+    ts_services_free(&longmynd_status.ts_services);
+    ts_services_free(&longmynd_services_cpy);
 
     return err;
 }
@@ -60,11 +60,76 @@
 #define STATUS_ERRORS_BCH_UNCORRECTED   23
 #define STATUS_LNB_SUPPLY         24
 #define STATUS_LNB_POLARISATION_H 25
+#define STATUS_TS_USB_DRY_TIME    26
+#define STATUS_TS_USB_LATENCY     27
+#define STATUS_TS_PARSE_OVERRUNS  28
+#define STATUS_TS_SINK_DROPS      29
+#define STATUS_TS_FIFO_DROPS      30
+#define STATUS_TS_FIFO_RECONNECTS 31
+#define STATUS_TS_FILTER_SAVED    32
+#define STATUS_TS_HTTP_CLIENTS    33
+#define STATUS_TS_HTTP_SLOW       34
+#define STATUS_TS_RECORD_RATE     35
+#define STATUS_TS_RECORD_LATENCY  36
+#define STATUS_TS_PACE_RATE       37
+#define STATUS_TS_PACE_JITTER     38
+#define STATUS_TS_PACE_BACKLOG    39
+#define STATUS_TS_SYNC_LOSSES     40
+#define STATUS_TS_SERVICE         41
+#define STATUS_TS_SERVICE_NAME    42
+#define STATUS_TS_PROVIDER_NAME   43
+#define STATUS_TS_PMT_PID         44
+#define STATUS_TS_PCR_PID         45
+#define STATUS_TS_SYNC_BYTE_ERR   46
+#define STATUS_TS_PAT_ERRORS      47
+#define STATUS_TS_CC_ERRORS       48
+#define STATUS_TS_PMT_ERRORS      49
+#define STATUS_TS_PID_ERRORS      50
+#define STATUS_TS_TRANSPORT_ERR   51
+#define STATUS_TS_CRC_ERRORS      52
+#define STATUS_TS_PCR_REPETITION  53
+#define STATUS_TS_PCR_DISCONT     54
+#define STATUS_TS_PID             55
+#define STATUS_TS_PID_RATE        56
+#define STATUS_TS_PID_CC_ERRORS   57
+#define STATUS_TS_PID_TRANSPORT   58
+#define STATUS_TS_PID_FLAGS       59
+#define STATUS_TS_USB_LATENCY_MAX 60
 
 /* The number of constellation peeks we do for each background loop */
 #define NUM_CONSTELLATIONS 16
 
-#define NUM_ELEMENT_STREAMS 16
+/* The most PIDs the status lists what the parser has seen on */
+#define TS_MAX_STATUS_PIDS 64
+
+/* what is sent in STATUS_TS_PID_FLAGS */
+#define TS_PID_SCRAMBLED 0x01
+#define TS_PID_PCR       0x02
+
+/* The TS can go out to several places at once */
+#define TS_MAX_SINKS 8
+
+#define TS_SINK_FIFO 0
+#define TS_SINK_UDP  1
+#define TS_SINK_FILE 2
+#define TS_SINK_HTTP 3
+#define TS_SINK_RECORD 4
+#define TS_SINK_TIMESHIFT 5
+
+/* Which PIDs go out on the TS outputs */
+#define TS_PID_COUNT         8192
+#define TS_FILTER_MAX_PIDS   32
+#define TS_FILTER_PIDS_ALL   0
+#define TS_FILTER_PIDS_LIST  1 // only the ones given on the command line
+#define TS_FILTER_PIDS_AUTO  2 // only the PAT, PMT, PCR and ES PIDs the parser has found
+
+typedef struct {
+    uint8_t type;
+    char path[128]; // FIFO or file path, IP address, the start of a recording's segment paths, or the time shift file
+    int port; // UDP port to send to, or TCP port to listen on
+    bool rtp;
+    uint16_t program; // 0 -> the whole TS, otherwise just this programme
+} longmynd_ts_sink_config_t;
 
 typedef struct {
     bool port_swap;
@@ -76,17 +141,38 @@ typedef struct {
     uint8_t device_usb_bus;
     uint8_t device_usb_addr;
 
-    bool ts_use_ip;
     bool ts_reset;
-    char ts_fifo_path[128];
-    char ts_ip_addr[16];
-    int ts_ip_port;
+    uint8_t ts_usb_transfers; // 0 -> synchronous reads
+    uint8_t ts_parse_slots;
+    bool ts_parse_drop_oldest; // false -> skip new buffers when the parser is behind
+    longmynd_ts_sink_config_t ts_sinks[TS_MAX_SINKS];
+    uint8_t ts_num_sinks;
+    uint8_t ts_sink_depth;
+    bool ts_fifo_nonblocking; // true -> TS FIFOs drop packets rather than wait for the reader
+    bool ts_fifo_splice; // true -> TS FIFOs are fed with vmsplice rather than write
+    bool ts_filter_nulls; // true -> null packets are not sent out
+    uint8_t ts_filter_pids_mode;
+    uint16_t ts_filter_pids[TS_FILTER_MAX_PIDS];
+    uint8_t ts_filter_num_pids;
+    uint32_t ts_record_segment_mb;
+    uint32_t ts_record_segment_s; // 0 -> recordings are only cut by size
+    uint32_t ts_timeshift_mb;
+    bool ts_udp_pace; // true -> UDP outputs are paced out at the TS bit rate
+    uint8_t ts_fec_l; // 0 -> no FEC on the RTP outputs
+    uint8_t ts_fec_d;
+
+    bool control_use_fifo;
+    char control_fifo_path[128];
 
     bool status_use_ip;
     char status_fifo_path[128];
-    char status_ip_addr[16];
+    char status_ip_addr[64];
     int status_ip_port;
 
+    uint8_t multicast_ttl;
+    char multicast_iface[16];
+    bool multicast_loop;
+
     bool polarisation_supply;
     bool polarisation_horizontal; // false -> 13V, true -> 18V
 
@@ -94,6 +180,44 @@ typedef struct {
     pthread_mutex_t mutex;
 } longmynd_config_t;
 
+/* an elementary stream, as listed in a PMT */
+typedef struct {
+    uint16_t pid;
+    uint8_t type;
+} longmynd_stream_t;
+
+/* a programme in the PAT or a service in the SDT, the two being the same thing */
+typedef struct {
+    uint16_t number;                 // program_number, service_id in the SDT
+    uint16_t pmt_pid;                // 0 if it is not in the PAT
+    uint16_t pcr_pid;
+    char name[256];
+    char provider_name[256];
+    uint32_t first_stream;           // its streams in the table's streams
+    uint32_t num_streams;
+    bool in_pat;
+    bool in_sdt;
+} longmynd_service_t;
+
+/* every service in the TS with its streams, grown as more are found */
+typedef struct {
+    longmynd_service_t *services;
+    uint32_t num_services;
+    uint32_t services_size;
+    longmynd_stream_t *streams;
+    uint32_t num_streams;
+    uint32_t streams_size;
+} longmynd_service_table_t;
+
+/* what the parser has seen on a PID */
+typedef struct {
+    uint16_t pid;
+    uint8_t flags;                   // TS_PID_*, over the last second
+    uint32_t rate;                   // kbit/s, over the last second
+    uint32_t cc_errors;              // total
+    uint32_t transport_errors;       // total
+} longmynd_pid_t;
+
 typedef struct {
     uint8_t state;
     uint8_t demod_state;
@@ -117,10 +241,44 @@ typedef struct {
     char service_name[255];
     char service_provider_name[255];
     uint8_t ts_null_percentage;
-    uint16_t ts_elementary_streams[NUM_ELEMENT_STREAMS][2]; // { pid, type }
+    longmynd_service_table_t ts_services; // a copy of the parser's, only changed with the mutex held
     uint32_t modcod;
     bool short_frame;
     bool pilots;
+    bool ts_usb_async;
+    uint32_t ts_usb_dry_time;       // ms, total
+    uint32_t ts_usb_latency_avg;    // us
+    uint32_t ts_usb_latency_max;    // us
+    uint32_t ts_parse_overruns;
+    uint32_t ts_sync_losses;        // total
+    uint32_t ts_sync_byte_errors;   // total, as are the rest of the TR 101 290 errors
+    uint32_t ts_pat_errors;
+    uint32_t ts_cc_errors;
+    uint32_t ts_pmt_errors;
+    uint32_t ts_pid_errors;
+    uint32_t ts_transport_errors;
+    uint32_t ts_crc_errors;
+    uint32_t ts_pcr_repetition_errors;
+    uint32_t ts_pcr_discontinuity_errors;
+    uint32_t ts_num_pids;
+    longmynd_pid_t ts_pids[TS_MAX_STATUS_PIDS]; // those seen over the last second, in PID order
+    uint8_t ts_num_sinks;
+    uint32_t ts_sink_drops[TS_MAX_SINKS];
+    bool ts_fifo_nonblocking;
+    uint32_t ts_fifo_drops[TS_MAX_SINKS];
+    uint32_t ts_fifo_reconnects[TS_MAX_SINKS];
+    bool ts_http;
+    uint32_t ts_http_clients[TS_MAX_SINKS];
+    uint32_t ts_http_slow[TS_MAX_SINKS];
+    bool ts_record;
+    uint32_t ts_record_rate[TS_MAX_SINKS];      // KB/s
+    uint32_t ts_record_latency[TS_MAX_SINKS];   // us, worst over the last second
+    bool ts_udp_pace;
+    uint32_t ts_pace_rate[TS_MAX_SINKS];        // kbit/s
+    uint32_t ts_pace_jitter[TS_MAX_SINKS];      // us, worst over the last second
+    uint32_t ts_pace_backlog[TS_MAX_SINKS];     // buffers, most over the last second
+    bool ts_filter_enabled;
+    uint32_t ts_filter_saved;       // KB, total
 
     uint64_t last_updated_monotonic;
     pthread_mutex_t mutex;
@@ -136,6 +294,7 @@ typedef struct {
 } thread_vars_t;
 
 uint64_t timestamp_ms(void);
+uint64_t monotonic_ms(void);
 
 void config_set_frequency(uint32_t frequency);
 void config_set_symbolrate(uint32_t symbolrate);
@@ -71,6 +71,28 @@ uint8_t nim_read_demod(uint16_t reg, uint8_t *val) {
     return err;
 }
 
+/* -------------------------------------------------------------------------------------------------- */
+uint8_t nim_read_demod_burst(uint16_t reg, uint8_t *vals, uint8_t count) {
+/* -------------------------------------------------------------------------------------------------- */
+/* reads a run of contiguous demodulator registers in one i2c transaction (using the auto increment   */
+/* set up in I2CCFG) and takes care of the i2c bus repeater                                           */
+/*    reg: the first demod register to read                                                           */
+/*   vals: where to put the results, count of them                                                    */
+/*  count: how many registers to read                                                                 */
+/* return: error code                                                                                 */
+/* -------------------------------------------------------------------------------------------------- */
+    uint8_t err=ERROR_NONE;
+
+    if (repeater_on) {
+        repeater_on=false;
+        err=nim_write_demod(0xf12a,0x38);
+    }
+    if (err==ERROR_NONE) err=ftdi_i2c_read_reg16_burst(NIM_DEMOD_ADDR,reg,vals,count);
+    if (err!=ERROR_NONE) printf("ERROR: demod burst read 0x%.4x, %i bytes\n",reg,count);
+
+    return err;
+}
+
 /* -------------------------------------------------------------------------------------------------- */
 uint8_t nim_write_demod(uint16_t reg, uint8_t val) {
 /* -------------------------------------------------------------------------------------------------- */
@@ -91,6 +113,27 @@ uint8_t nim_write_demod(uint16_t reg, uint8_t val) {
     return err;
 }
 
+/* -------------------------------------------------------------------------------------------------- */
+uint8_t nim_write_demod_runs(const ftdi_i2c_run_t *runs, uint16_t num_runs) {
+/* -------------------------------------------------------------------------------------------------- */
+/* writes runs of contiguous demodulator registers, each run as one auto incrementing i2c write, and  */
+/* takes care of the i2c bus repeater                                                                 */
+/*     runs: the list of runs to write                                                                */
+/* num_runs: how many runs there are                                                                  */
+/*   return: error code                                                                               */
+/* -------------------------------------------------------------------------------------------------- */
+    uint8_t err=ERROR_NONE;
+
+    if (repeater_on) {
+        repeater_on=false;
+        err=nim_write_demod(0xf12a,0x38);
+    }
+    if (err==ERROR_NONE) err=ftdi_i2c_write_reg16_runs(NIM_DEMOD_ADDR,runs,num_runs);
+    if (err!=ERROR_NONE) printf("ERROR: demod write runs\n");
+
+    return err;
+}
+
 /* -------------------------------------------------------------------------------------------------- */
 uint8_t nim_read_lna(uint8_t lna_addr, uint8_t reg, uint8_t *val) {
 /* -------------------------------------------------------------------------------------------------- */
@@ -23,6 +23,7 @@
 #define NIM_H
 
 #include "stvvglna.h"
+#include "ftdi.h"
 #include <stdint.h>
 
 #define NIM_DEMOD_ADDR 0xd2
@@ -41,7 +42,9 @@ uint8_t nim_send_d0();
 uint8_t nim_read_tuner (uint8_t,  uint8_t*);
 uint8_t nim_write_tuner(uint8_t,  uint8_t );
 uint8_t nim_read_demod (uint16_t, uint8_t*);
+uint8_t nim_read_demod_burst(uint16_t, uint8_t*, uint8_t);
 uint8_t nim_write_demod(uint16_t, uint8_t );
+uint8_t nim_write_demod_runs(const ftdi_i2c_run_t*, uint16_t);
 uint8_t nim_read_lna   (uint8_t,  uint8_t, uint8_t*);
 uint8_t nim_write_lna  (uint8_t,  uint8_t, uint8_t );
 
@@ -0,0 +1,223 @@
+/* -------------------------------------------------------------------------------------------------- */
+/* The LongMynd receiver: pace.c                                                                      */
+/*    - an implementation of the Serit NIM controlling software for the MiniTiouner Hardware          */
+/*    - spreads the TS out evenly at its own bit rate, rather than in bursts as it comes off the USB  */
+/* Copyright 2019 Heather Lomond                                                                      */
+/* -------------------------------------------------------------------------------------------------- */
+/*
+    This file is part of longmynd.
+
+    Longmynd is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Longmynd is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with longmynd.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+/*
+    The bit rate comes from the PCRs on the first PID that carries them: the bytes between two PCRs
+    over the time between them. Without PCRs it falls back to the rate the TS is arriving at. Both
+    are smoothed, as the bytes can be out where an output has dropped a buffer.
+
+    Each datagram is given a slot at that rate, and the writer thread sleeps until its slot with
+    clock_nanosleep(). The rate is never quite right, so when buffers are queued up waiting the
+    slots are closed up a little to catch up, and if we ever fall a long way behind we start again
+    from now rather than send everything that is late in one burst.
+*/
+
+/* -------------------------------------------------------------------------------------------------- */
+/* ----------------- INCLUDES ----------------------------------------------------------------------- */
+/* -------------------------------------------------------------------------------------------------- */
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include "main.h"
+#include "pace.h"
+
+/* -------------------------------------------------------------------------------------------------- */
+/* ----------------- DEFINES ------------------------------------------------------------------------ */
+/* -------------------------------------------------------------------------------------------------- */
+
+#define PACE_TS_SYNC          0x47
+#define PACE_PCR_CLOCK        27000000ULL
+#define PACE_PCR_WRAP         ((1ULL<<33)*300)
+/* PCRs are meant to be no more than 100ms apart, anything further than this is a discontinuity */
+#define PACE_PCR_MAX_GAP      PACE_PCR_CLOCK
+/* how long the PCR rate is trusted for once they stop */
+#define PACE_PCR_TIMEOUT_MS   2000
+/* when we are this far behind we give up catching up */
+#define PACE_MAX_LATE_NS      50000000ULL
+/* a slot is cut to PACE_CATCH_UP/(PACE_CATCH_UP+backlog) of its length while there is a backlog */
+#define PACE_CATCH_UP         8
+
+/* -------------------------------------------------------------------------------------------------- */
+/* ----------------- ROUTINES ----------------------------------------------------------------------- */
+/* -------------------------------------------------------------------------------------------------- */
+
+/* -------------------------------------------------------------------------------------------------- */
+static uint64_t pace_ts_ns(void) {
+/* -------------------------------------------------------------------------------------------------- */
+/* return: the monotonic clock in ns, the one clock_nanosleep() waits on                              */
+/* -------------------------------------------------------------------------------------------------- */
+    struct timespec tp;
+
+    clock_gettime(CLOCK_MONOTONIC, &tp);
+
+    return (uint64_t)tp.tv_sec*1000000000 + tp.tv_nsec;
+}
+
+/* -------------------------------------------------------------------------------------------------- */
+void pace_ts_init(pace_ts_t *pace) {
+/* -------------------------------------------------------------------------------------------------- */
+/* starts a pacer off with no idea of the rate, so that it sends straight away until it has one      */
+/* *pace: the pacer to set up                                                                         */
+/* -------------------------------------------------------------------------------------------------- */
+    memset(pace, 0, sizeof(pace_ts_t));
+    pace->pcr_pid=PACE_TS_NO_PID;
+    pace->arrival_start=monotonic_ms();
+    pace->window_start=pace->arrival_start;
+}
+
+/* -------------------------------------------------------------------------------------------------- */
+static void pace_ts_packet(pace_ts_t *pace, uint8_t *packet, uint64_t position) {
+/* -------------------------------------------------------------------------------------------------- */
+/* looks for a PCR in a packet, and works out the rate from it and the one before                    */
+/*    *pace: the pacer                                                                                */
+/*  *packet: the TS packet                                                                            */
+/* position: where the packet starts in the TS                                                        */
+/* -------------------------------------------------------------------------------------------------- */
+    uint16_t pid;
+    uint64_t pcr;
+    uint64_t gap;
+    uint64_t rate;
+
+    /* an adaptation field with room for a PCR, and the PCR flag set */
+    if (((packet[3] & 0x20)==0) || (packet[4]<7) || ((packet[5] & 0x10)==0)) return;
+
+    pid=((uint16_t)(packet[1] & 0x1f) << 8) | packet[2];
+    if (pace->pcr_pid==PACE_TS_NO_PID) pace->pcr_pid=pid;
+    if (pid!=pace->pcr_pid) return;
+
+    pcr = (((uint64_t)packet[6] << 25) | ((uint64_t)packet[7] << 17) | ((uint64_t)packet[8] << 9) |
+           ((uint64_t)packet[9] << 1) | ((uint64_t)packet[10] >> 7))*300 +
+          ((((uint64_t)packet[10] & 0x01) << 8) | packet[11]);
+
+    /* the discontinuity indicator says the clock has jumped */
+    if (pace->pcr_valid && ((packet[5] & 0x80)==0)) {
+        gap=(pcr+PACE_PCR_WRAP-pace->pcr_last) % PACE_PCR_WRAP;
+        if ((gap>0) && (gap<=PACE_PCR_MAX_GAP) && (position>pace->pcr_last_position)) {
+            rate=(position-pace->pcr_last_position)*PACE_PCR_CLOCK/gap;
+            pace->pcr_rate = (pace->pcr_rate==0) ? rate : (7*pace->pcr_rate+rate)/8;
+            pace->pcr_updated=monotonic_ms();
+        }
+    }
+
+    pace->pcr_last=pcr;
+    pace->pcr_last_position=position;
+    pace->pcr_valid=true;
+}
+
+/* -------------------------------------------------------------------------------------------------- */
+void pace_ts_feed(pace_ts_t *pace, uint8_t *data, uint32_t len) {
+/* -------------------------------------------------------------------------------------------------- */
+/* updates the rate from a buffer of TS that is about to be paced out                                 */
+/*  *pace: the pacer                                                                                  */
+/*  *data: the TS                                                                                     */
+/*    len: how much of it there is                                                                    */
+/* -------------------------------------------------------------------------------------------------- */
+    uint64_t now=monotonic_ms();
+    uint64_t rate;
+    uint32_t i=0;
+    uint32_t n;
+
+    /* finish off the packet that was split over the last buffer and this one */
+    if (pace->partial_len>0) {
+        n=PACE_TS_PACKET_SIZE-pace->partial_len;
+        if (n>len) n=len;
+        memcpy(&pace->partial[pace->partial_len], data, n);
+        pace->partial_len+=n;
+        i=n;
+        if (pace->partial_len==PACE_TS_PACKET_SIZE) {
+            pace_ts_packet(pace, pace->partial, pace->position-PACE_TS_PACKET_SIZE+n);
+            pace->partial_len=0;
+        }
+    }
+
+    while (i<len) {
+        if (data[i]!=PACE_TS_SYNC) {
+            i++;
+        } else if (i+PACE_TS_PACKET_SIZE<=len) {
+            pace_ts_packet(pace, &data[i], pace->position+i);
+            i+=PACE_TS_PACKET_SIZE;
+        } else {
+            pace->partial_len=len-i;
+            memcpy(pace->partial, &data[i], pace->partial_len);
+            i=len;
+        }
+    }
+    pace->position+=len;
+
+    pace->arrival_bytes+=len;
+    if (now-pace->arrival_start>=PACE_TS_STATS_MS) {
+        rate=pace->arrival_bytes*1000/(now-pace->arrival_start);
+        pace->arrival_rate = (pace->arrival_rate==0) ? rate : (3*pace->arrival_rate+rate)/4;
+        pace->arrival_start=now;
+        pace->arrival_bytes=0;
+    }
+}
+
+/* -------------------------------------------------------------------------------------------------- */
+void pace_ts_wait(pace_ts_t *pace, uint32_t len, uint32_t backlog) {
+/* -------------------------------------------------------------------------------------------------- */
+/* sleeps until it is time for the next datagram to go                                                */
+/*    *pace: the pacer                                                                                */
+/*      len: the size of the datagram                                                                 */
+/*  backlog: how many buffers are queued up behind this one                                           */
+/* -------------------------------------------------------------------------------------------------- */
+    uint64_t now_ms=monotonic_ms();
+    uint64_t now=pace_ts_ns();
+    uint64_t rate;
+    uint64_t slot;
+    uint32_t jitter;
+    struct timespec until;
+
+    rate = ((pace->pcr_rate>0) && (now_ms-pace->pcr_updated<PACE_PCR_TIMEOUT_MS)) ? pace->pcr_rate : pace->arrival_rate;
+
+    if (backlog>pace->window_backlog) pace->window_backlog=backlog;
+    if (now_ms-pace->window_start>=PACE_TS_STATS_MS) {
+        pace->jitter_us=pace->window_jitter_us;
+        pace->backlog=pace->window_backlog;
+        pace->rate_kbps=(uint32_t)(rate*8/1000);
+        pace->window_start=now_ms;
+        pace->window_jitter_us=0;
+        pace->window_backlog=0;
+    }
+
+    /* until we know the rate there is nothing to pace to */
+    if (rate==0) return;
+
+    if ((pace->next_ns==0) || (now>pace->next_ns+PACE_MAX_LATE_NS)) {
+        pace->next_ns=now;
+    } else if (pace->next_ns>now) {
+        until.tv_sec=pace->next_ns/1000000000;
+        until.tv_nsec=pace->next_ns%1000000000;
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &until, NULL)==EINTR);
+        now=pace_ts_ns();
+    }
+
+    jitter=(uint32_t)((now-pace->next_ns)/1000);
+    if (jitter>pace->window_jitter_us) pace->window_jitter_us=jitter;
+
+    slot=(uint64_t)len*1000000000/rate;
+    pace->next_ns+=slot*PACE_CATCH_UP/(PACE_CATCH_UP+backlog);
+}
+
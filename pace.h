@@ -0,0 +1,65 @@
+/* -------------------------------------------------------------------------------------------------- */
+/* The LongMynd receiver: pace.h                                                                      */
+/* Copyright 2019 Heather Lomond                                                                      */
+/* -------------------------------------------------------------------------------------------------- */
+/*
+    This file is part of longmynd.
+
+    Longmynd is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Longmynd is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with longmynd.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef PACE_H
+#define PACE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define PACE_TS_PACKET_SIZE 188
+#define PACE_TS_NO_PID      0xffff
+
+#define PACE_TS_STATS_MS    1000
+
+typedef struct {
+    /* a packet split over two buffers */
+    uint8_t partial[PACE_TS_PACKET_SIZE];
+    uint32_t partial_len;
+    uint64_t position;               /* bytes of TS fed in so far                                      */
+    /* the rate from the PCRs, in bytes/s */
+    uint16_t pcr_pid;
+    uint64_t pcr_last;
+    uint64_t pcr_last_position;
+    bool pcr_valid;
+    uint64_t pcr_rate;
+    uint64_t pcr_updated;            /* monotonic ms of the last PCR that gave a rate                  */
+    /* the rate the TS is arriving at, for when there are no PCRs */
+    uint64_t arrival_start;
+    uint64_t arrival_bytes;
+    uint64_t arrival_rate;
+    /* when the next datagram should go, in monotonic ns */
+    uint64_t next_ns;
+    /* the status, worked out over each PACE_TS_STATS_MS */
+    uint64_t window_start;
+    uint32_t window_jitter_us;
+    uint32_t window_backlog;
+    uint32_t jitter_us;              /* the furthest a datagram went from its slot                     */
+    uint32_t backlog;                /* the most buffers there were queued up waiting to be paced out  */
+    uint32_t rate_kbps;              /* the bit rate it is pacing at                                   */
+} pace_ts_t;
+
+void pace_ts_init(pace_ts_t *);
+void pace_ts_feed(pace_ts_t *, uint8_t *, uint32_t);
+void pace_ts_wait(pace_ts_t *, uint32_t, uint32_t);
+
+#endif
+
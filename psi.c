@@ -0,0 +1,261 @@
+/* -------------------------------------------------------------------------------------------------- */
+/* The LongMynd receiver: psi.c                                                                       */
+/*    - an implementation of the Serit NIM controlling software for the MiniTiouner Hardware          */
+/*    - puts the PSI sections on a PID back together from its TS packets                              */
+/* Copyright 2019 Heather Lomond                                                                      */
+/* -------------------------------------------------------------------------------------------------- */
+/*
+    This file is part of longmynd.
+
+    Longmynd is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Longmynd is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with longmynd.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+/*
+    A section can be spread over several packets, and a packet can hold the end of one section and
+    the start of several more. A packet with payload_unit_start_indicator set has a pointer field
+    first, saying how many bytes of the section already under way there are before the next one
+    starts. Sections then follow on from each other until one starts with 0xFF, which is stuffing.
+
+    The tables come round several times a second and hardly ever change. So once the first 8 bytes
+    of a section are in (table id, length, table id extension, version, section number and last
+    section number) they are compared with those of the sections already had on this PID. A match
+    is a repeat, and the rest of it is stepped over without being copied or CRC checked. Only a new
+    section with a good CRC is handed on, and remembered.
+
+    Only the long form of section, with a version and a CRC, is looked at, which all of PAT, PMT and
+    SDT are. Sections that are not current yet are dropped.
+
+    A gap in the continuity counter loses the section that was being put together, and the repeat
+    of a packet that is allowed once is ignored.
+*/
+
+/* -------------------------------------------------------------------------------------------------- */
+/* ----------------- INCLUDES ----------------------------------------------------------------------- */
+/* -------------------------------------------------------------------------------------------------- */
+
+#include <string.h>
+#include "psi.h"
+#include "crc32.h"
+
+/* -------------------------------------------------------------------------------------------------- */
+/* ----------------- DEFINES ------------------------------------------------------------------------ */
+/* -------------------------------------------------------------------------------------------------- */
+
+#define PSI_STUFFING 0xFF
+
+/* a long form section has 5 bytes after its length, and a CRC */
+#define PSI_SECTION_MIN_LENGTH (5+4)
+
+/* -------------------------------------------------------------------------------------------------- */
+/* ----------------- ROUTINES ----------------------------------------------------------------------- */
+/* -------------------------------------------------------------------------------------------------- */
+
+/* -------------------------------------------------------------------------------------------------- */
+void psi_init(psi_t *psi, uint16_t pid) {
+/* -------------------------------------------------------------------------------------------------- */
+/* sets up an empty section assembler                                                                 */
+/* *psi: the assembler                                                                                */
+/*  pid: the PID it is for                                                                            */
+/* -------------------------------------------------------------------------------------------------- */
+    memset(psi, 0, sizeof(psi_t));
+    psi->pid=pid;
+}
+
+/* -------------------------------------------------------------------------------------------------- */
+void psi_reset(psi_t *psi) {
+/* -------------------------------------------------------------------------------------------------- */
+/* forgets any section part way through and all the ones we have had, for when the TS does not       */
+/* follow on from what came before                                                                    */
+/* *psi: the assembler                                                                                */
+/* -------------------------------------------------------------------------------------------------- */
+    psi->cc_valid=false;
+    psi->in_section=false;
+    psi->ptr=NULL;
+    psi->end=NULL;
+    psi->start=NULL;
+    psi->num_headers=0;
+    psi->next_header=0;
+}
+
+/* -------------------------------------------------------------------------------------------------- */
+void psi_packet(psi_t *psi, const uint8_t *payload, uint32_t length, bool pusi, uint8_t cc) {
+/* -------------------------------------------------------------------------------------------------- */
+/* starts on the payload of the next packet on the PID, psi_section() then takes the sections out of */
+/* it. The payload must stay where it is until psi_section() has returned NULL                        */
+/*     *psi: the assembler                                                                            */
+/* *payload: the packet's payload, after any adaptation field                                        */
+/*   length: the number of bytes in it                                                                */
+/*     pusi: the packet's payload_unit_start_indicator                                                */
+/*       cc: the packet's continuity_counter                                                          */
+/* -------------------------------------------------------------------------------------------------- */
+    psi->ptr=payload;
+    psi->end=payload;
+    psi->start=NULL;
+
+    if (psi->cc_valid) {
+        /* the same packet again adds nothing */
+        if (cc==psi->cc) return;
+        /* but a gap leaves a hole in the section being put together */
+        if (cc!=((psi->cc+1) & 0x0F)) psi->in_section=false;
+    }
+    psi->cc=cc;
+    psi->cc_valid=true;
+
+    if (pusi) {
+        /* a pointer field that goes past the end of the packet means we cannot trust any of it */
+        if ((length<1) || ((uint32_t)payload[0]+1>length)) {
+            psi->in_section=false;
+            return;
+        }
+        psi->ptr=&payload[1];
+        psi->start=&payload[1+payload[0]];
+    } else if (!psi->in_section) {
+        /* nothing in here for us until a section starts */
+        return;
+    }
+    psi->end=&payload[length];
+}
+
+/* -------------------------------------------------------------------------------------------------- */
+static bool psi_cached(psi_t *psi) {
+/* -------------------------------------------------------------------------------------------------- */
+/* *psi: the assembler, with the header of a section in                                               */
+/* return: true if we have had this section before                                                     */
+/* -------------------------------------------------------------------------------------------------- */
+    uint32_t i;
+
+    for (i=0; i<psi->num_headers; i++) {
+        if (memcmp(psi->headers[i], psi->section, PSI_HEADER_SIZE)==0) return true;
+    }
+
+    return false;
+}
+
+/* -------------------------------------------------------------------------------------------------- */
+static void psi_cache_add(psi_t *psi) {
+/* -------------------------------------------------------------------------------------------------- */
+/* remembers a new section, in place of an older version of it if there is one                        */
+/* *psi: the assembler, with a complete section in                                                     */
+/* -------------------------------------------------------------------------------------------------- */
+    uint8_t *header;
+    uint32_t i;
+
+    /* the same table id, table id extension and section number, so it is the same section */
+    for (i=0; i<psi->num_headers; i++) {
+        header=psi->headers[i];
+        if ((header[0]==psi->section[0]) && (header[3]==psi->section[3]) && (header[4]==psi->section[4])
+            && (header[6]==psi->section[6])) break;
+    }
+
+    if (i==psi->num_headers) {
+        if (psi->num_headers<PSI_CACHE_SIZE) {
+            psi->num_headers++;
+        } else {
+            i=psi->next_header;
+            psi->next_header=(psi->next_header+1) % PSI_CACHE_SIZE;
+        }
+    }
+
+    memcpy(psi->headers[i], psi->section, PSI_HEADER_SIZE);
+}
+
+/* -------------------------------------------------------------------------------------------------- */
+const uint8_t *psi_section(psi_t *psi, uint32_t *length) {
+/* -------------------------------------------------------------------------------------------------- */
+/* carries on through the packet psi_packet() was given, to the end of the next new section           */
+/*    *psi: the assembler                                                                             */
+/* *length: filled in with the length of the section, including its header and CRC                  */
+/*  return: the section, which stays good until the next call, or NULL when the packet is used up   */
+/* -------------------------------------------------------------------------------------------------- */
+    const uint8_t *limit;
+    uint32_t want;
+    uint32_t take;
+
+    while (true) {
+        if (!psi->in_section) {
+            /* a section can only start where the pointer field says, or straight after another one */
+            if (psi->start==NULL) return NULL;
+            psi->ptr=psi->start;
+            if ((psi->ptr>=psi->end) || (*psi->ptr==PSI_STUFFING)) {
+                psi->start=NULL;
+                return NULL;
+            }
+            psi->in_section=true;
+            psi->skip=false;
+            psi->have=0;
+            psi->need=0;
+        }
+
+        /* the end of a section that was already under way cannot run on into the next one */
+        limit = ((psi->start!=NULL) && (psi->ptr<psi->start)) ? psi->start : psi->end;
+        if (psi->ptr>=limit) {
+            if (limit==psi->end) return NULL;
+            psi->in_section=false;
+            continue;
+        }
+
+        /* the header comes in first, then the rest once we know if it is wanted */
+        if (psi->have<3) {
+            want=3;
+        } else if (psi->have<PSI_HEADER_SIZE) {
+            want=PSI_HEADER_SIZE;
+        } else {
+            want=psi->need;
+        }
+        take=want-psi->have;
+        if (take>(uint32_t)(limit-psi->ptr)) take=(uint32_t)(limit-psi->ptr);
+        if (!psi->skip) memcpy(&psi->section[psi->have], psi->ptr, take);
+        psi->have+=take;
+        psi->ptr+=take;
+
+        if (psi->have<want) continue;
+
+        if (psi->have==3) {
+            psi->need=3+(((uint32_t)(psi->section[1] & 0x0F) << 8) | psi->section[2]);
+            if (((psi->section[1] & 0x80)==0) || (psi->need<3+PSI_SECTION_MIN_LENGTH) || (psi->need>PSI_SECTION_MAX)) {
+                /* not a section we can use, and nothing to say where the next one is */
+                psi->in_section=false;
+                if ((psi->start!=NULL) && (psi->ptr>psi->start)) psi->start=NULL;
+                continue;
+            }
+        } else if (psi->have==PSI_HEADER_SIZE) {
+            /* a repeat, or not current yet */
+            if (psi_cached(psi)) {
+                psi->skip=true;
+                psi->repeats++;
+            } else if ((psi->section[5] & 0x01)==0) {
+                psi->skip=true;
+            }
+        }
+
+        if (psi->have<psi->need) continue;
+
+        /* the next section can start straight after this one */
+        psi->in_section=false;
+        if ((psi->start!=NULL) && (psi->ptr>=psi->start)) psi->start=psi->ptr;
+
+        if (psi->skip) continue;
+
+        /* the CRC of the whole section, its own CRC included, comes out as 0 */
+        if (crc32_mpeg2(psi->section, psi->need)!=0) {
+            psi->crc_errors++;
+            continue;
+        }
+
+        psi_cache_add(psi);
+        *length=psi->need;
+        return psi->section;
+    }
+}
+
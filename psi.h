@@ -0,0 +1,64 @@
+/* -------------------------------------------------------------------------------------------------- */
+/* The LongMynd receiver: psi.h                                                                       */
+/* Copyright 2019 Heather Lomond                                                                      */
+/* -------------------------------------------------------------------------------------------------- */
+/*
+    This file is part of longmynd.
+
+    Longmynd is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Longmynd is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with longmynd.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef PSI_H
+#define PSI_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/* the longest a section can be, with its 3 byte header */
+#define PSI_SECTION_MAX  4096
+/* table id to last section number, all that is compared to tell if we have had a section before */
+#define PSI_HEADER_SIZE  8
+/* how many sections on a PID are remembered */
+#define PSI_CACHE_SIZE   64
+
+/* puts together the sections on one PID from its packets */
+typedef struct {
+    uint16_t pid;
+    bool cc_valid;
+    uint8_t cc;                                          /* of the last packet                         */
+    bool in_section;                                     /* part way through a section                 */
+    bool skip;                                           /* which is not wanted, so is not kept        */
+    uint32_t have;                                       /* bytes of it so far                         */
+    uint32_t need;                                       /* bytes in all, once the header is in        */
+    /* what is left of the packet being worked through, and where its pointer field says a section */
+    /* starts, or NULL                                                                             */
+    const uint8_t *ptr;
+    const uint8_t *end;
+    const uint8_t *start;
+    /* the headers of the sections we have had, so that repeats can be dropped as they come in */
+    uint8_t headers[PSI_CACHE_SIZE][PSI_HEADER_SIZE];
+    uint32_t num_headers;
+    uint32_t next_header;
+    uint32_t repeats;
+    uint32_t crc_errors;
+    uint8_t section[PSI_SECTION_MAX];
+} psi_t;
+
+void psi_init(psi_t *, uint16_t);
+void psi_reset(psi_t *);
+void psi_packet(psi_t *, const uint8_t *, uint32_t, bool, uint8_t);
+const uint8_t *psi_section(psi_t *, uint32_t *);
+
+#endif
+
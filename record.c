@@ -0,0 +1,345 @@
+/* -------------------------------------------------------------------------------------------------- */
+/* The LongMynd receiver: record.c                                                                    */
+/*    - an implementation of the Serit NIM controlling software for the MiniTiouner Hardware          */
+/*    - records the TS to disk in segments, in large aligned blocks                                   */
+/* Copyright 2019 Heather Lomond                                                                      */
+/* -------------------------------------------------------------------------------------------------- */
+/*
+    This file is part of longmynd.
+
+    Longmynd is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Longmynd is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with longmynd.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+/*
+    This runs in a TS sink's writer thread, so however long the disk takes it only ever holds up
+    its own queue, never the USB. The TS is collected into RECORD_TS_BLOCK_SIZE blocks and written
+    with O_DIRECT, which keeps a long recording from filling the page cache and then stalling
+    everything while it is written back. File systems that do not take O_DIRECT (eg. tmpfs) get
+    the same blocks through the page cache.
+
+    A new segment is started once the current one reaches its size or age, at the next TS packet
+    boundary, so that each segment can be played on its own. Each segment is fsynced as it is
+    closed.
+*/
+
+/* -------------------------------------------------------------------------------------------------- */
+/* ----------------- INCLUDES ----------------------------------------------------------------------- */
+/* -------------------------------------------------------------------------------------------------- */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include "main.h"
+#include "errors.h"
+#include "record.h"
+
+/* -------------------------------------------------------------------------------------------------- */
+/* ----------------- DEFINES ------------------------------------------------------------------------ */
+/* -------------------------------------------------------------------------------------------------- */
+
+#define RECORD_TS_SYNC        0x47
+#define RECORD_TS_PACKET_SIZE 188
+
+/* -------------------------------------------------------------------------------------------------- */
+/* ----------------- ROUTINES ----------------------------------------------------------------------- */
+/* -------------------------------------------------------------------------------------------------- */
+
+/* -------------------------------------------------------------------------------------------------- */
+static uint64_t record_ts_us(void) {
+/* -------------------------------------------------------------------------------------------------- */
+/* return: a monotonic timer in microseconds, for timing the disk                                     */
+/* -------------------------------------------------------------------------------------------------- */
+    struct timespec tp;
+
+    clock_gettime(CLOCK_MONOTONIC, &tp);
+
+    return (uint64_t)tp.tv_sec*1000000 + tp.tv_nsec/1000;
+}
+
+/* -------------------------------------------------------------------------------------------------- */
+static void record_ts_timed(record_ts_t *rec, uint64_t start_us, uint32_t bytes) {
+/* -------------------------------------------------------------------------------------------------- */
+/* adds a write or fsync to the status, and works the status out again once a window is up            */
+/*     *rec: the recording                                                                            */
+/* start_us: when the write started                                                                   */
+/*    bytes: how much it wrote                                                                        */
+/* -------------------------------------------------------------------------------------------------- */
+    uint64_t taken=record_ts_us()-start_us;
+    uint64_t now=monotonic_ms();
+
+    if (taken>rec->window_worst_us) rec->window_worst_us=(uint32_t)taken;
+    rec->window_bytes+=bytes;
+
+    if (now-rec->window_start>=RECORD_TS_STATS_MS) {
+        rec->rate_kbps=(uint32_t)((rec->window_bytes*1000/(now-rec->window_start))/1024);
+        rec->worst_us=rec->window_worst_us;
+        rec->window_start=now;
+        rec->window_bytes=0;
+        rec->window_worst_us=0;
+    }
+}
+
+/* -------------------------------------------------------------------------------------------------- */
+static uint8_t record_ts_write_all(record_ts_t *rec, uint8_t *data, uint32_t len) {
+/* -------------------------------------------------------------------------------------------------- */
+/* writes all of a piece of the block out, timing it                                                  */
+/*   *rec: the recording                                                                              */
+/*  *data: what to write                                                                              */
+/*    len: how much of it                                                                             */
+/* return: error code                                                                                 */
+/* -------------------------------------------------------------------------------------------------- */
+    uint64_t start_us=record_ts_us();
+    uint32_t done=0;
+    ssize_t n;
+
+    while (done<len) {
+        n=write(rec->fd, &data[done], len-done);
+        if (n<0) {
+            if (errno==EINTR) continue;
+            printf("ERROR: TS recording write\n");
+            return ERROR_TS_FILE_WRITE;
+        }
+        done+=n;
+    }
+    record_ts_timed(rec, start_us, len);
+
+    return ERROR_NONE;
+}
+
+/* -------------------------------------------------------------------------------------------------- */
+static uint8_t record_ts_flush(record_ts_t *rec) {
+/* -------------------------------------------------------------------------------------------------- */
+/* writes out what is in the block. Only the last block of a segment can be a part block, and O_DIRECT */
+/* cannot write the odd bytes at the end of that, so they go through the page cache                   */
+/*   *rec: the recording                                                                              */
+/* return: error code                                                                                 */
+/* -------------------------------------------------------------------------------------------------- */
+    uint8_t err=ERROR_NONE;
+    uint32_t aligned=rec->block_len;
+
+    if (rec->direct) aligned-=rec->block_len % RECORD_TS_ALIGN;
+
+    if (aligned>0) err=record_ts_write_all(rec, rec->block, aligned);
+
+    if ((err==ERROR_NONE) && (aligned<rec->block_len)) {
+        fcntl(rec->fd, F_SETFL, fcntl(rec->fd, F_GETFL) & ~O_DIRECT);
+        rec->direct=false;
+        err=record_ts_write_all(rec, &rec->block[aligned], rec->block_len-aligned);
+    }
+
+    rec->block_len=0;
+
+    return err;
+}
+
+/* -------------------------------------------------------------------------------------------------- */
+static uint8_t record_ts_open_segment(record_ts_t *rec) {
+/* -------------------------------------------------------------------------------------------------- */
+/* starts the next segment file                                                                       */
+/*   *rec: the recording                                                                              */
+/* return: error code                                                                                 */
+/* -------------------------------------------------------------------------------------------------- */
+    char path[192];
+
+    snprintf(path, sizeof(path), "%s-%s-%04u.ts", rec->prefix, rec->started, rec->segment);
+
+    rec->direct=true;
+    rec->fd=open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC | O_DIRECT, 0644);
+    if ((rec->fd<0) && (errno==EINVAL)) {
+        rec->direct=false;
+        rec->fd=open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    }
+    if (rec->fd<0) {
+        printf("ERROR: Failed to open TS recording %s\n",path);
+        return ERROR_TS_FILE_OPEN;
+    }
+
+    printf("      Status: TS recording to %s%s\n",path,rec->direct ? "" : " (no O_DIRECT)");
+
+    rec->segment_bytes=0;
+    rec->segment_start=monotonic_ms();
+
+    return ERROR_NONE;
+}
+
+/* -------------------------------------------------------------------------------------------------- */
+static uint8_t record_ts_close_segment(record_ts_t *rec) {
+/* -------------------------------------------------------------------------------------------------- */
+/* writes out the rest of a segment, makes sure it is on the disk and closes it                       */
+/*   *rec: the recording                                                                              */
+/* return: error code                                                                                 */
+/* -------------------------------------------------------------------------------------------------- */
+    uint8_t err;
+    uint64_t start_us;
+
+    err=record_ts_flush(rec);
+
+    start_us=record_ts_us();
+    if (fsync(rec->fd)!=0) {
+        printf("ERROR: TS recording fsync\n");
+        if (err==ERROR_NONE) err=ERROR_TS_FILE_WRITE;
+    }
+    record_ts_timed(rec, start_us, 0);
+
+    close(rec->fd);
+    rec->fd=-1;
+    rec->segment++;
+
+    return err;
+}
+
+/* -------------------------------------------------------------------------------------------------- */
+static uint32_t record_ts_packet_start(uint8_t *data, uint32_t len) {
+/* -------------------------------------------------------------------------------------------------- */
+/* finds where the first whole TS packet starts, so that a segment can be cut there                  */
+/*  *data: the TS                                                                                     */
+/*    len: how much of it there is                                                                    */
+/* return: the offset of the packet, or len if there is not one                                       */
+/* -------------------------------------------------------------------------------------------------- */
+    uint32_t i;
+
+    for (i=0; i<len; i++) {
+        if ((data[i]==RECORD_TS_SYNC) &&
+            ((i+RECORD_TS_PACKET_SIZE>=len) || (data[i+RECORD_TS_PACKET_SIZE]==RECORD_TS_SYNC))) break;
+    }
+
+    return i;
+}
+
+/* -------------------------------------------------------------------------------------------------- */
+static uint8_t record_ts_append(record_ts_t *rec, uint8_t *data, uint32_t len) {
+/* -------------------------------------------------------------------------------------------------- */
+/* adds TS to the current segment, writing out each block as it fills                                */
+/*   *rec: the recording                                                                              */
+/*  *data: the TS                                                                                     */
+/*    len: how much of it there is                                                                    */
+/* return: error code                                                                                 */
+/* -------------------------------------------------------------------------------------------------- */
+    uint8_t err=ERROR_NONE;
+    uint32_t n;
+
+    while ((err==ERROR_NONE) && (len>0)) {
+        n=RECORD_TS_BLOCK_SIZE-rec->block_len;
+        if (n>len) n=len;
+        memcpy(&rec->block[rec->block_len], data, n);
+        rec->block_len+=n;
+        rec->segment_bytes+=n;
+        data+=n;
+        len-=n;
+        if (rec->block_len==RECORD_TS_BLOCK_SIZE) err=record_ts_flush(rec);
+    }
+
+    return err;
+}
+
+/* -------------------------------------------------------------------------------------------------- */
+uint8_t record_ts_init(record_ts_t *rec, char *prefix, uint32_t segment_mb, uint32_t segment_s) {
+/* -------------------------------------------------------------------------------------------------- */
+/* starts a recording, opening its first segment                                                      */
+/*       *rec: the recording to set up                                                                */
+/*    *prefix: the start of each segment's path, the time and segment number are added to it          */
+/* segment_mb: the size a segment is cut at, in MB                                                    */
+/*  segment_s: the age a segment is cut at, in seconds, or 0 to cut them on size alone                 */
+/*     return: error code                                                                             */
+/* -------------------------------------------------------------------------------------------------- */
+    uint8_t err=ERROR_NONE;
+    time_t now=time(NULL);
+
+    printf("Flow: TS recording init\n");
+
+    strncpy(rec->prefix, prefix, sizeof(rec->prefix)-1);
+    rec->prefix[sizeof(rec->prefix)-1]='\0';
+    strftime(rec->started, sizeof(rec->started), "%Y%m%d-%H%M%S", localtime(&now));
+    rec->segment_max_bytes=(uint64_t)segment_mb*1024*1024;
+    rec->segment_max_ms=(uint64_t)segment_s*1000;
+    rec->segment=0;
+    rec->block_len=0;
+    rec->window_start=monotonic_ms();
+    rec->window_bytes=0;
+    rec->window_worst_us=0;
+    rec->rate_kbps=0;
+    rec->worst_us=0;
+    rec->fd=-1;
+
+    if (0!=posix_memalign((void **)&rec->block, RECORD_TS_ALIGN, RECORD_TS_BLOCK_SIZE)) {
+        rec->block=NULL;
+        err=ERROR_TS_BUFFER_MALLOC;
+    }
+
+    if (err==ERROR_NONE) err=record_ts_open_segment(rec);
+
+    if (err!=ERROR_NONE) {
+        printf("ERROR: TS recording init\n");
+        free(rec->block);
+        rec->block=NULL;
+    }
+
+    return err;
+}
+
+/* -------------------------------------------------------------------------------------------------- */
+uint8_t record_ts_write(record_ts_t *rec, uint8_t *data, uint32_t len) {
+/* -------------------------------------------------------------------------------------------------- */
+/* records some TS, moving on to a new segment first if the current one is due to be cut              */
+/*   *rec: the recording                                                                              */
+/*  *data: the TS                                                                                     */
+/*    len: how much of it there is                                                                    */
+/* return: error code                                                                                 */
+/* -------------------------------------------------------------------------------------------------- */
+    uint8_t err=ERROR_NONE;
+    uint32_t cut;
+
+    /* if the last segment could not be opened, try again */
+    if (rec->fd<0) err=record_ts_open_segment(rec);
+
+    if ((err==ERROR_NONE) && ((rec->segment_bytes>=rec->segment_max_bytes) ||
+        ((rec->segment_max_ms>0) && (monotonic_ms()-rec->segment_start>=rec->segment_max_ms)))) {
+        cut=record_ts_packet_start(data, len);
+        /* no packet starts in this lot, so the cut waits for the next */
+        if (cut<len) {
+            err=record_ts_append(rec, data, cut);
+            if (err==ERROR_NONE) err=record_ts_close_segment(rec);
+            if (err==ERROR_NONE) err=record_ts_open_segment(rec);
+            data+=cut;
+            len-=cut;
+        }
+    }
+
+    if (err==ERROR_NONE) err=record_ts_append(rec, data, len);
+
+    return err;
+}
+
+/* -------------------------------------------------------------------------------------------------- */
+uint8_t record_ts_close(record_ts_t *rec) {
+/* -------------------------------------------------------------------------------------------------- */
+/* finishes off the last segment and stops the recording                                              */
+/*   *rec: the recording                                                                              */
+/* return: error code                                                                                 */
+/* -------------------------------------------------------------------------------------------------- */
+    uint8_t err=ERROR_NONE;
+
+    printf("Flow: TS recording close\n");
+
+    if (rec->fd>=0) err=record_ts_close_segment(rec);
+    free(rec->block);
+    rec->block=NULL;
+
+    return err;
+}
+
@@ -0,0 +1,60 @@
+/* -------------------------------------------------------------------------------------------------- */
+/* The LongMynd receiver: record.h                                                                    */
+/* Copyright 2019 Heather Lomond                                                                      */
+/* -------------------------------------------------------------------------------------------------- */
+/*
+    This file is part of longmynd.
+
+    Longmynd is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Longmynd is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with longmynd.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef RECORD_H
+#define RECORD_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/* the TS goes to disk in blocks of this size, aligned for O_DIRECT */
+#define RECORD_TS_BLOCK_SIZE  (1024*1024)
+#define RECORD_TS_ALIGN       4096
+
+#define RECORD_TS_DEFAULT_SEGMENT_MB 1024
+#define RECORD_TS_STATS_MS           1000
+
+typedef struct {
+    char prefix[128];
+    char started[32];                /* when the recording started, part of every segment's name      */
+    uint64_t segment_max_bytes;
+    uint64_t segment_max_ms;         /* 0 -> segments are only cut by size                             */
+    int fd;
+    bool direct;                     /* the file system took O_DIRECT                                  */
+    uint32_t segment;
+    uint64_t segment_bytes;
+    uint64_t segment_start;
+    uint8_t *block;
+    uint32_t block_len;
+    /* the status, worked out over each RECORD_TS_STATS_MS */
+    uint64_t window_start;
+    uint64_t window_bytes;
+    uint32_t window_worst_us;
+    uint32_t rate_kbps;              /* KB/s that made it to disk                                      */
+    uint32_t worst_us;               /* the longest a write or fsync took                              */
+} record_ts_t;
+
+uint8_t record_ts_init(record_ts_t *, char *, uint32_t, uint32_t);
+uint8_t record_ts_write(record_ts_t *, uint8_t *, uint32_t);
+uint8_t record_ts_close(record_ts_t *);
+
+#endif
+
@@ -28,6 +28,7 @@
 #include <stdio.h>
 #include <stdint.h>
 #include <unistd.h>
+#include "main.h"
 #include "stv0910.h"
 #include "stv0910_regs.h"
 #include "stv0910_utils.h"
@@ -48,19 +49,14 @@ uint8_t stv0910_read_car_freq(uint8_t demod, int32_t *cf) {
 /*   return: error state                                                                              */
 /* -------------------------------------------------------------------------------------------------- */
     uint8_t err;
-    uint8_t val_h, val_m, val_l;
+    uint8_t val[3];
     double car_offset_freq;
 
-    /* first off we read in the carrier offset as a signed number */
-                           err=stv0910_read_reg(demod==STV0910_DEMOD_TOP ?
-                                            RSTV0910_P2_CFR2 : RSTV0910_P1_CFR2, &val_h); /* high byte*/
-    if (err==ERROR_NONE) err=stv0910_read_reg(demod==STV0910_DEMOD_TOP ? 
-                                            RSTV0910_P2_CFR1 : RSTV0910_P1_CFR1, &val_m); /* mid */
-    if (err==ERROR_NONE) err=stv0910_read_reg(demod==STV0910_DEMOD_TOP ? 
-                                            RSTV0910_P2_CFR0 : RSTV0910_P1_CFR0, &val_l); /* low */
+    /* first off we read in the carrier offset as a signed number, CFR2 (high), CFR1 (mid), CFR0 (low) */
+    err=stv0910_read_regs(demod==STV0910_DEMOD_TOP ? RSTV0910_P2_CFR2 : RSTV0910_P1_CFR2, val, 3);
     /* since this is a 24 bit signed value, we need to build it as a 24 bit value, shift it up to the top
        to get a 32 bit signed value, then convert it to a double */
-    car_offset_freq=(double)(int32_t)((((uint32_t)val_h<<16) + ((uint32_t)val_m<< 8) + ((uint32_t)val_l )) << 8);
+    car_offset_freq=(double)(int32_t)((((uint32_t)val[0]<<16) + ((uint32_t)val[1]<< 8) + ((uint32_t)val[2] )) << 8);
     /* carrier offset freq (MHz)= mclk (MHz) * CFR/2^24. But we have the extra 256 in there from the sign shift */
     /* so in Hz we need: */
     car_offset_freq=135000000*car_offset_freq/256.0/256.0/256.0/256.0;
@@ -99,17 +95,15 @@ uint8_t stv0910_read_sr(uint8_t demod, uint32_t *found_sr) {
 /*  return: error state                                                                               */
 /* -------------------------------------------------------------------------------------------------- */
     double sr;
-    uint8_t val_h, val_mu, val_ml, val_l;
+    uint8_t val[4];
     uint8_t err;
 
-                         err=stv0910_read_reg(demod==STV0910_DEMOD_TOP ? RSTV0910_P2_SFR3 : RSTV0910_P1_SFR3, &val_h);  /* high byte */
-    if (err==ERROR_NONE) err=stv0910_read_reg(demod==STV0910_DEMOD_TOP ? RSTV0910_P2_SFR2 : RSTV0910_P1_SFR2, &val_mu); /* mid upper */
-    if (err==ERROR_NONE) err=stv0910_read_reg(demod==STV0910_DEMOD_TOP ? RSTV0910_P2_SFR1 : RSTV0910_P1_SFR1, &val_ml); /* mid lower */
-    if (err==ERROR_NONE) err=stv0910_read_reg(demod==STV0910_DEMOD_TOP ? RSTV0910_P2_SFR0 : RSTV0910_P1_SFR0, &val_l);  /* low byte */
-    sr=((uint32_t)val_h  << 24) +
-       ((uint32_t)val_mu << 16) +
-       ((uint32_t)val_ml <<  8) +
-       ((uint32_t)val_l       );
+    /* SFR3 (high byte) down to SFR0 (low byte) */
+    err=stv0910_read_regs(demod==STV0910_DEMOD_TOP ? RSTV0910_P2_SFR3 : RSTV0910_P1_SFR3, val, 4);
+    sr=((uint32_t)val[0] << 24) +
+       ((uint32_t)val[1] << 16) +
+       ((uint32_t)val[2] <<  8) +
+       ((uint32_t)val[3]      );
     /* sr (MHz) = ckadc (MHz) * SFR/2^32. So in Symbols per Second we need */
     sr=135000000*sr/256.0/256.0/256.0/256.0;
     *found_sr=(uint32_t)sr;
@@ -199,24 +193,17 @@ uint8_t stv0910_read_ber(uint8_t demod, uint32_t *ber) {
 /*   return: error state                                                                              */
 /* -------------------------------------------------------------------------------------------------- */
     uint8_t err;
-    uint8_t high, mid_u, mid_m, mid_l, low;
+    uint8_t val[8];
     double cpt;
     double errs;
 
-    /* first we trigger a buffer transfer and read the byte counter 40 bits */
-                         err=stv0910_read_reg(demod==STV0910_DEMOD_TOP ? RSTV0910_P2_FBERCPT4 : RSTV0910_P1_FBERCPT4, &high);
-    if (err==ERROR_NONE) err=stv0910_read_reg(demod==STV0910_DEMOD_TOP ? RSTV0910_P2_FBERCPT3 : RSTV0910_P1_FBERCPT3, &mid_u);
-    if (err==ERROR_NONE) err=stv0910_read_reg(demod==STV0910_DEMOD_TOP ? RSTV0910_P2_FBERCPT2 : RSTV0910_P1_FBERCPT2, &mid_m);
-    if (err==ERROR_NONE) err=stv0910_read_reg(demod==STV0910_DEMOD_TOP ? RSTV0910_P2_FBERCPT1 : RSTV0910_P1_FBERCPT1, &mid_l);
-    if (err==ERROR_NONE) err=stv0910_read_reg(demod==STV0910_DEMOD_TOP ? RSTV0910_P2_FBERCPT0 : RSTV0910_P1_FBERCPT0, &low);
-    cpt=(double)high*256.0*256.0*256.0*256.0 + (double)mid_u*256.0*256.0*256.0 + (double)mid_m*256.0*256.0 +
-        (double)mid_l*256.0 + (double)low;
-
-    /* we have already triggered the register buffer transfer, so now we we read the bit error from them */
-                         err=stv0910_read_reg(demod==STV0910_DEMOD_TOP ? RSTV0910_P2_FBERERR2 : RSTV0910_P1_FBERERR2, &high);
-    if (err==ERROR_NONE) err=stv0910_read_reg(demod==STV0910_DEMOD_TOP ? RSTV0910_P2_FBERERR1 : RSTV0910_P1_FBERERR1, &mid_m);
-    if (err==ERROR_NONE) err=stv0910_read_reg(demod==STV0910_DEMOD_TOP ? RSTV0910_P2_FBERERR0 : RSTV0910_P1_FBERERR0, &low);
-    errs=(double)high*256.0*256.0 + (double)mid_m*256.0 + (double)low;
+    /* FBERCPT4..0 (the 40 bit byte counter) are followed by FBERERR2..0 (the bit errors), so we read  */
+    /* them all in one go. Reading FBERCPT4 first triggers the buffer transfer for the rest of them    */
+    err=stv0910_read_regs(demod==STV0910_DEMOD_TOP ? RSTV0910_P2_FBERCPT4 : RSTV0910_P1_FBERCPT4, val, 8);
+    cpt=(double)val[0]*256.0*256.0*256.0*256.0 + (double)val[1]*256.0*256.0*256.0 + (double)val[2]*256.0*256.0 +
+        (double)val[3]*256.0 + (double)val[4];
+
+    errs=(double)val[5]*256.0*256.0 + (double)val[6]*256.0 + (double)val[7];
 
     *ber=(uint32_t)(10000.0*errs/(cpt*8.0));
 
@@ -600,16 +587,64 @@ uint8_t stv0910_read_scan_state(uint8_t demod, uint8_t *state) {
     return err;
 }
 
+/* -------------------------------------------------------------------------------------------------- */
+static uint16_t stv0910_build_init_runs(ftdi_i2c_run_t *runs, uint8_t *vals, uint8_t *i2ccfg) {
+/* -------------------------------------------------------------------------------------------------- */
+/* groups the register initialisation table into runs of contiguous registers so that each run can be */
+/* written in one auto incrementing i2c write. I2CCFG is what turns the auto increment on, so it is   */
+/* left out of the runs, to be written on its own before any of them                                  */
+/*   runs: where to put the runs (at most one per table entry)                                        */
+/*   vals: where to put the register values, in table order, for the runs to point into               */
+/* i2ccfg: where to put the value for I2CCFG                                                          */
+/* return: the number of runs                                                                         */
+/* -------------------------------------------------------------------------------------------------- */
+    uint16_t num_runs=0;
+    uint16_t i=0;
+    bool new_run;
+
+    do {
+        if (STV0910DefVal[i].reg==RSTV0910_I2CCFG) {
+            *i2ccfg=STV0910DefVal[i].val;
+            continue;
+        }
+
+        vals[i]=STV0910DefVal[i].val;
+
+        /* the repeater registers change how the i2c bus behaves, so they get written on their own */
+        /* rather than in the middle of a burst                                                    */
+        new_run = (num_runs==0) ||
+                  (STV0910DefVal[i].reg!=runs[num_runs-1].reg+runs[num_runs-1].count) ||
+                  (runs[num_runs-1].count==255) ||
+                  (STV0910DefVal[i].reg==RSTV0910_P1_I2CRPT) || (STV0910DefVal[i].reg==RSTV0910_P2_I2CRPT) ||
+                  (runs[num_runs-1].reg==RSTV0910_P1_I2CRPT) || (runs[num_runs-1].reg==RSTV0910_P2_I2CRPT);
+
+        if (new_run) {
+            runs[num_runs].reg=STV0910DefVal[i].reg;
+            runs[num_runs].count=0;
+            runs[num_runs].vals=&vals[i];
+            num_runs++;
+        }
+        runs[num_runs-1].count++;
+    }
+    while (STV0910DefVal[i++].reg!=RSTV0910_TSTTSRS);
+
+    return num_runs;
+}
+
 /* -------------------------------------------------------------------------------------------------- */
 uint8_t stv0910_init_regs() {
 /* -------------------------------------------------------------------------------------------------- */
 /* reads all the initial values for all the demodulator registers and sets them up                    */
 /* return: error code                                                                                 */
 /* -------------------------------------------------------------------------------------------------- */
+    static ftdi_i2c_run_t init_runs[STV0910_NBREGS];
+    static uint8_t init_vals[STV0910_NBREGS];
+    static uint16_t num_init_runs=0;
+    static uint8_t init_i2ccfg;
     uint8_t val1;
     uint8_t val2;
     uint8_t err;
-    uint16_t i=0;
+    uint64_t start_ms;
 
     printf("Flow: stv0910 init regs\n");
 
@@ -622,11 +657,15 @@ uint8_t stv0910_init_regs() {
         return ERROR_DEMOD_INIT;
     }
 
-    /* next we initialise all the registers in the list */
-    do {
-        if (err==ERROR_NONE) err=stv0910_write_reg(STV0910DefVal[i].reg, STV0910DefVal[i].val);
-    }        
-    while (STV0910DefVal[i++].reg!=RSTV0910_TSTTSRS);
+    /* the table never changes, so we only need to work out the runs the first time through */
+    if (num_init_runs==0) num_init_runs=stv0910_build_init_runs(init_runs, init_vals, &init_i2ccfg);
+
+    /* next we initialise all the registers in the list, once the auto increment the bursts need is on */
+    start_ms=monotonic_ms();
+    if (err==ERROR_NONE) err=stv0910_write_reg(RSTV0910_I2CCFG, init_i2ccfg);
+    if (err==ERROR_NONE) err=stv0910_write_reg_runs(init_runs, num_init_runs);
+    if (err==ERROR_NONE) printf("      Status: STV0910 registers initialised in %i bursts, took %"PRIu64" ms\n",
+                                                                  num_init_runs, monotonic_ms()-start_ms);
 
     /* finally (from ST example code) reset the LDPC decoder */
     if (err==ERROR_NONE) err=stv0910_write_reg(RSTV0910_TSTRES0, 0x80);
@@ -99,6 +99,24 @@ uint8_t stv0910_write_reg(uint16_t reg, uint8_t val) {
     return nim_write_demod(reg, val);
 }
 
+/* -------------------------------------------------------------------------------------------------- */
+uint8_t stv0910_write_reg_runs(const ftdi_i2c_run_t *runs, uint16_t num_runs) {
+/* -------------------------------------------------------------------------------------------------- */
+/* abstracts writing runs of contiguous hardware registers to the stv0910, keeping the shadows in step */
+/*    return: error code                                                                              */
+/* -------------------------------------------------------------------------------------------------- */
+    uint16_t r;
+    uint8_t n;
+
+    for (r=0; r<num_runs; r++) {
+        for (n=0; n<runs[r].count; n++) {
+            stv0910_shadow_regs[runs[r].reg+n-STV0910_START_ADDR]=runs[r].vals[n];
+        }
+    }
+
+    return nim_write_demod_runs(runs, num_runs);
+}
+
 /* -------------------------------------------------------------------------------------------------- */
 uint8_t stv0910_read_reg(uint16_t reg, uint8_t *val) {
 /* -------------------------------------------------------------------------------------------------- */
@@ -109,3 +127,14 @@ uint8_t stv0910_read_reg(uint16_t reg, uint8_t *val) {
     return nim_read_demod(reg, val);
 }
 
+/* -------------------------------------------------------------------------------------------------- */
+uint8_t stv0910_read_regs(uint16_t reg, uint8_t *vals, uint8_t count) {
+/* -------------------------------------------------------------------------------------------------- */
+/* abstracts a burst read of count contiguous hardware registers from the stv0910, starting at reg.   */
+/* As they are all read in one i2c transaction, multi-byte counters cannot change between bytes      */
+/*    return: error code                                                                              */
+/* -------------------------------------------------------------------------------------------------- */
+
+    return nim_read_demod_burst(reg, vals, count);
+}
+
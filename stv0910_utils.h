@@ -22,13 +22,17 @@
 #ifndef STV0910_UTILS_H
 #define STV0910_UTILS_H
 
+#include "ftdi.h"
+
 #define STV0910_START_ADDR RSTV0910_MID
 #define STV0910_END_ADDR RSTV0910_TSTTSRS
 
 uint8_t stv0910_write_reg_field(uint32_t, uint8_t);
 uint8_t stv0910_read_reg_field(uint32_t, uint8_t *);
 uint8_t stv0910_write_reg(uint16_t, uint8_t);
+uint8_t stv0910_write_reg_runs(const ftdi_i2c_run_t *, uint16_t);
 uint8_t stv0910_read_reg(uint16_t, uint8_t *);
+uint8_t stv0910_read_regs(uint16_t, uint8_t *, uint8_t);
 
 #endif
 
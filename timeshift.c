@@ -0,0 +1,303 @@
+/* -------------------------------------------------------------------------------------------------- */
+/* The LongMynd receiver: timeshift.c                                                                 */
+/*    - an implementation of the Serit NIM controlling software for the MiniTiouner Hardware          */
+/*    - keeps the last few minutes of TS in a ring on disk, so that any of it can be saved afterwards */
+/* Copyright 2019 Heather Lomond                                                                      */
+/* -------------------------------------------------------------------------------------------------- */
+/*
+    This file is part of longmynd.
+
+    Longmynd is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Longmynd is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with longmynd.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+/*
+    The ring is a file mapped into memory, so the page cache does all the buffering and the kernel
+    writes it back in its own time. It is written by a TS sink's writer thread, only in whole packets,
+    and is split into TIMESHIFT_TS_BLOCK_SIZE blocks. The index holds when each block was started and
+    where it is in the TS.
+
+    An export runs in whichever thread asks for it, at the same time as the writer. It looks up the
+    blocks for the interval in the index, then copies them straight out of the map. The writer may
+    go round the ring and overwrite the oldest of them while that is happening, which the export
+    spots from the write position and gives up on.
+*/
+
+/* -------------------------------------------------------------------------------------------------- */
+/* ----------------- INCLUDES ----------------------------------------------------------------------- */
+/* -------------------------------------------------------------------------------------------------- */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include "main.h"
+#include "errors.h"
+#include "timeshift.h"
+
+/* -------------------------------------------------------------------------------------------------- */
+/* ----------------- DEFINES ------------------------------------------------------------------------ */
+/* -------------------------------------------------------------------------------------------------- */
+
+#define TIMESHIFT_TS_SYNC         0x47
+/* the most an export hands to write() in one go */
+#define TIMESHIFT_TS_EXPORT_CHUNK (1024*1024)
+
+/* -------------------------------------------------------------------------------------------------- */
+/* ----------------- ROUTINES ----------------------------------------------------------------------- */
+/* -------------------------------------------------------------------------------------------------- */
+
+/* -------------------------------------------------------------------------------------------------- */
+uint8_t timeshift_ts_init(timeshift_ts_t *ts, char *path, uint32_t size_mb) {
+/* -------------------------------------------------------------------------------------------------- */
+/* creates the ring file, maps it in and starts with an empty index                                   */
+/*     *ts: the time shift ring to set up                                                             */
+/*   *path: the file to keep the ring in, it is overwritten                                           */
+/* size_mb: how big the ring is, which with the bit rate sets how far back it goes                    */
+/*  return: error code                                                                                */
+/* -------------------------------------------------------------------------------------------------- */
+    uint8_t err=ERROR_NONE;
+    uint32_t i;
+    void *map;
+
+    printf("Flow: Time shift init, %i MB\n",size_mb);
+
+    ts->num_blocks=(uint32_t)(((uint64_t)size_mb*1024*1024)/TIMESHIFT_TS_BLOCK_SIZE);
+    ts->size=(uint64_t)ts->num_blocks*TIMESHIFT_TS_BLOCK_SIZE;
+    ts->map=NULL;
+    ts->index=NULL;
+    ts->partial_len=0;
+    atomic_init(&ts->written, 0);
+    pthread_mutex_init(&ts->index_mutex, NULL);
+
+    ts->fd=open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (ts->fd<0) {
+        printf("ERROR: Failed to open time shift file %s\n",path);
+        err=ERROR_TIMESHIFT_OPEN;
+    }
+
+    /* the space has to be there up front, as running out of it later is a SIGBUS, not an error */
+    if ((err==ERROR_NONE) && (posix_fallocate(ts->fd, 0, (off_t)ts->size)!=0)) {
+        printf("ERROR: No room for the %i MB time shift file %s\n",size_mb,path);
+        err=ERROR_TIMESHIFT_OPEN;
+    }
+
+    if (err==ERROR_NONE) {
+        map=mmap(NULL, ts->size, PROT_READ | PROT_WRITE, MAP_SHARED, ts->fd, 0);
+        if (map==MAP_FAILED) {
+            printf("ERROR: Failed to map time shift file %s\n",path);
+            err=ERROR_TIMESHIFT_OPEN;
+        } else {
+            ts->map=(uint8_t *)map;
+        }
+    }
+
+    if (err==ERROR_NONE) {
+        ts->index=malloc(ts->num_blocks*sizeof(timeshift_ts_index_t));
+        if (ts->index==NULL) err=ERROR_TS_BUFFER_MALLOC;
+        else for (i=0; i<ts->num_blocks; i++) ts->index[i].position=TIMESHIFT_TS_UNUSED;
+    }
+
+    if (err!=ERROR_NONE) {
+        printf("ERROR: Time shift init\n");
+        timeshift_ts_close(ts);
+    }
+
+    return err;
+}
+
+/* -------------------------------------------------------------------------------------------------- */
+static void timeshift_ts_put(timeshift_ts_t *ts, uint8_t *data, uint32_t len) {
+/* -------------------------------------------------------------------------------------------------- */
+/* copies whole packets into the ring, indexing each block as it is started                          */
+/*    *ts: the time shift ring                                                                        */
+/*  *data: the packets                                                                                */
+/*    len: how many bytes of them                                                                     */
+/* -------------------------------------------------------------------------------------------------- */
+    uint64_t written=atomic_load_explicit(&ts->written, memory_order_relaxed);
+    uint64_t offset;
+    uint32_t n;
+
+    while (len>0) {
+        offset=written % ts->size;
+        if ((written % TIMESHIFT_TS_BLOCK_SIZE)==0) {
+            /* the block is about to be overwritten, so it has to go from the index first */
+            pthread_mutex_lock(&ts->index_mutex);
+            ts->index[offset/TIMESHIFT_TS_BLOCK_SIZE].arrived=monotonic_ms();
+            ts->index[offset/TIMESHIFT_TS_BLOCK_SIZE].position=written;
+            pthread_mutex_unlock(&ts->index_mutex);
+        }
+        n=TIMESHIFT_TS_BLOCK_SIZE-(uint32_t)(written % TIMESHIFT_TS_BLOCK_SIZE);
+        if (n>len) n=len;
+        memcpy(&ts->map[offset], data, n);
+        written+=n;
+        atomic_store_explicit(&ts->written, written, memory_order_release);
+        data+=n;
+        len-=n;
+    }
+}
+
+/* -------------------------------------------------------------------------------------------------- */
+void timeshift_ts_write(timeshift_ts_t *ts, uint8_t *data, uint32_t len) {
+/* -------------------------------------------------------------------------------------------------- */
+/* adds some TS to the ring. Only whole packets go in, so that every block starts on a packet and an */
+/* export is always whole packets; after a gap we wait for the next sync byte                         */
+/*    *ts: the time shift ring                                                                        */
+/*  *data: the TS                                                                                     */
+/*    len: how much of it there is                                                                    */
+/* -------------------------------------------------------------------------------------------------- */
+    uint8_t *sync;
+    uint32_t n;
+
+    while (len>0) {
+        if (ts->partial_len>0) {
+            n=TIMESHIFT_TS_PACKET_SIZE-ts->partial_len;
+            if (n>len) n=len;
+            memcpy(&ts->partial[ts->partial_len], data, n);
+            ts->partial_len+=n;
+            data+=n;
+            len-=n;
+            if (ts->partial_len==TIMESHIFT_TS_PACKET_SIZE) {
+                timeshift_ts_put(ts, ts->partial, TIMESHIFT_TS_PACKET_SIZE);
+                ts->partial_len=0;
+            }
+        } else if (data[0]!=TIMESHIFT_TS_SYNC) {
+            sync=memchr(data, TIMESHIFT_TS_SYNC, len);
+            n = (sync==NULL) ? len : (uint32_t)(sync-data);
+            data+=n;
+            len-=n;
+        } else {
+            /* as many whole packets as are here and in step, in one go */
+            for (n=0; (n+TIMESHIFT_TS_PACKET_SIZE<=len) && (data[n]==TIMESHIFT_TS_SYNC); n+=TIMESHIFT_TS_PACKET_SIZE);
+            if (n>0) {
+                timeshift_ts_put(ts, data, n);
+            } else {
+                /* the start of a packet that finishes in the next write */
+                n=len;
+                memcpy(ts->partial, data, n);
+                ts->partial_len=n;
+            }
+            data+=n;
+            len-=n;
+        }
+    }
+}
+
+/* -------------------------------------------------------------------------------------------------- */
+uint8_t timeshift_ts_export(timeshift_ts_t *ts, uint32_t ago_s, uint32_t length_s, char *path) {
+/* -------------------------------------------------------------------------------------------------- */
+/* saves an interval of the ring to a .ts file. The interval is rounded out to whole blocks           */
+/*       *ts: the time shift ring                                                                     */
+/*     ago_s: how many seconds ago the interval starts                                                */
+/*  length_s: how long it is in seconds, 0 for right up to now                                        */
+/*     *path: the file to save it to                                                                  */
+/*    return: error code                                                                              */
+/* -------------------------------------------------------------------------------------------------- */
+    uint8_t err=ERROR_NONE;
+    uint64_t now=monotonic_ms();
+    uint64_t from;
+    uint64_t to;
+    uint64_t start=TIMESHIFT_TS_UNUSED;
+    uint64_t oldest=TIMESHIFT_TS_UNUSED;
+    uint64_t oldest_arrived=0;
+    uint64_t end;
+    uint64_t position;
+    uint32_t n;
+    uint32_t i;
+    ssize_t sent;
+    int fd;
+
+    from = ((uint64_t)ago_s*1000 < now) ? now-(uint64_t)ago_s*1000 : 0;
+    to = (length_s==0) ? now : from+(uint64_t)length_s*1000;
+
+    pthread_mutex_lock(&ts->index_mutex);
+    end=atomic_load_explicit(&ts->written, memory_order_acquire);
+    for (i=0; i<ts->num_blocks; i++) {
+        position=ts->index[i].position;
+        if (position==TIMESHIFT_TS_UNUSED) continue;
+        if (position<oldest) {
+            oldest=position;
+            oldest_arrived=ts->index[i].arrived;
+        }
+        /* the last block started by the start of the interval, and the first one started after it */
+        if ((ts->index[i].arrived<=from) && ((start==TIMESHIFT_TS_UNUSED) || (position>start))) start=position;
+        if ((ts->index[i].arrived>to) && (position<end)) end=position;
+    }
+    pthread_mutex_unlock(&ts->index_mutex);
+
+    if (oldest==TIMESHIFT_TS_UNUSED) {
+        printf("ERROR: Time shift export, nothing has been received yet\n");
+        return ERROR_TIMESHIFT_EXPORT;
+    }
+    if (start==TIMESHIFT_TS_UNUSED) {
+        printf("      Status: Time shift only goes back to %i s ago\n",(int)((now-oldest_arrived)/1000));
+        start=oldest;
+    }
+    if (end<=start) {
+        printf("ERROR: Time shift export, there is nothing in that interval\n");
+        return ERROR_TIMESHIFT_EXPORT;
+    }
+
+    fd=open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd<0) {
+        printf("ERROR: Failed to open time shift export %s\n",path);
+        return ERROR_TS_FILE_OPEN;
+    }
+
+    for (position=start; (err==ERROR_NONE) && (position<end); position+=n) {
+        n = (end-position > TIMESHIFT_TS_EXPORT_CHUNK) ? TIMESHIFT_TS_EXPORT_CHUNK : (uint32_t)(end-position);
+        if (n>ts->size-(position % ts->size)) n=(uint32_t)(ts->size-(position % ts->size));
+        sent=write(fd, &ts->map[position % ts->size], n);
+        if (sent<=0) {
+            printf("ERROR: Time shift export write\n");
+            err=ERROR_TS_FILE_WRITE;
+        } else {
+            n=(uint32_t)sent;
+            /* if the writer has come round to where we were copying from, what we have is not right. */
+            /* It can be anywhere in the block after written, so that counts too                      */
+            if (atomic_load_explicit(&ts->written, memory_order_acquire)+TIMESHIFT_TS_BLOCK_SIZE>position+ts->size) {
+                printf("ERROR: Time shift export overtaken by new TS, start it less far back\n");
+                err=ERROR_TIMESHIFT_EXPORT;
+            }
+        }
+    }
+
+    close(fd);
+
+    /* better no file than one with a hole in it */
+    if (err!=ERROR_NONE) unlink(path);
+    else printf("      Status: Time shift exported %i KB to %s\n",(int)((end-start)/1024),path);
+
+    return err;
+}
+
+/* -------------------------------------------------------------------------------------------------- */
+void timeshift_ts_close(timeshift_ts_t *ts) {
+/* -------------------------------------------------------------------------------------------------- */
+/* unmaps the ring and closes its file. The file is left behind, to be overwritten next time          */
+/* *ts: the time shift ring                                                                           */
+/* -------------------------------------------------------------------------------------------------- */
+    printf("Flow: Time shift close\n");
+
+    if (ts->map!=NULL) munmap(ts->map, ts->size);
+    if (ts->fd>=0) close(ts->fd);
+    free(ts->index);
+    ts->map=NULL;
+    ts->index=NULL;
+    ts->fd=-1;
+    pthread_mutex_destroy(&ts->index_mutex);
+}
+
@@ -0,0 +1,62 @@
+/* -------------------------------------------------------------------------------------------------- */
+/* The LongMynd receiver: timeshift.h                                                                 */
+/* Copyright 2019 Heather Lomond                                                                      */
+/* -------------------------------------------------------------------------------------------------- */
+/*
+    This file is part of longmynd.
+
+    Longmynd is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Longmynd is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with longmynd.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef TIMESHIFT_H
+#define TIMESHIFT_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+#define TIMESHIFT_TS_PACKET_SIZE 188
+/* the ring is indexed in blocks of whole packets, about a second each at low bit rates */
+#define TIMESHIFT_TS_BLOCK_SIZE  (256*TIMESHIFT_TS_PACKET_SIZE)
+#define TIMESHIFT_TS_MAX_MB      65536
+
+#define TIMESHIFT_TS_UNUSED      UINT64_MAX
+
+typedef struct {
+    uint64_t arrived;                /* monotonic ms when the first packet of the block was written    */
+    uint64_t position;               /* where the block starts in the TS, TIMESHIFT_TS_UNUSED if empty */
+} timeshift_ts_index_t;
+
+typedef struct {
+    int fd;
+    uint8_t *map;
+    uint64_t size;
+    uint32_t num_blocks;
+    timeshift_ts_index_t *index;
+    pthread_mutex_t index_mutex;
+    /* how much TS has been written since the start, only the writer moves it */
+    _Atomic uint64_t written;
+    /* a packet split over two writes */
+    uint8_t partial[TIMESHIFT_TS_PACKET_SIZE];
+    uint32_t partial_len;
+} timeshift_ts_t;
+
+uint8_t timeshift_ts_init(timeshift_ts_t *, char *, uint32_t);
+void timeshift_ts_write(timeshift_ts_t *, uint8_t *, uint32_t);
+uint8_t timeshift_ts_export(timeshift_ts_t *, uint32_t, uint32_t, char *);
+void timeshift_ts_close(timeshift_ts_t *);
+
+#endif
+
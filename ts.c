@@ -19,22 +19,38 @@
     along with longmynd.  If not, see <https://www.gnu.org/licenses/>.
 */
 
+#include <stdlib.h>
 #include <string.h>
+#include <stdatomic.h>
+#include <sys/uio.h>
 
 #include "main.h"
 #include "errors.h"
-#include "udp.h"
-#include "fifo.h"
 #include "ftdi.h"
 #include "ftdi_usb.h"
+#include "ts_ring.h"
+#include "ts_sink.h"
+#include "ts_header.h"
+#include "crc32.h"
+#include "psi.h"
+#include "ts_monitor.h"
 #include "ts.h"
 
 #define TS_FRAME_SIZE 20*512 // 512 is base USB FTDI frame
+#define TS_USB_PACKET_SIZE 512
+#define TS_USB_HEADER_SIZE 2 // the FTDI puts 2 status bytes at the start of every USB packet
+#define TS_MAX_SEGMENTS ((TS_FRAME_SIZE + TS_USB_PACKET_SIZE - 1) / TS_USB_PACKET_SIZE)
+#define TS_STATS_MS 1000
+#define TS_PARSE_LOST_MS 100 // no TS for this long and the parser takes it as gone
+
+/* every slot in the parse ring can be holding a USB buffer, and loop_ts one more */
+#if TS_RING_MAX_SLOTS+1 > FTDI_USB_TS_MAX_SPARE
+#error "not enough spare USB transfers for the TS parse ring"
+#endif
 
 #define MAX_PID  8192
 
 #define TS_PACKET_SIZE 188
-#define TS_HEADER_SYNC 0x47
 
 #define TS_PID_PAT 0x0000
 #define TS_PID_SDT 0x0011
@@ -44,25 +60,554 @@
 #define TS_TABLE_PMT 0x02
 #define TS_TABLE_SDT 0x42
 
-uint8_t *ts_buffer_ptr = NULL;
-bool ts_buffer_waiting;
+#define TS_DESCRIPTOR_SERVICE 0x48
+
+/* the sections are put back together for the PAT, the SDT and this many PMTs */
+#define TS_PSI_MAX_PMTS 64
+#define TS_PSI_MAX      (2+TS_PSI_MAX_PMTS)
+
+/* the parser locks on after this many sync bytes in a row at the packet stride, and loses lock after */
+/* this many bad ones in a row, as TR 101 290 does for its sync loss                                  */
+#define TS_SYNC_LOCK_PACKETS   5
+#define TS_SYNC_UNLOCK_PACKETS 2
+
+/* one filtered packet can straddle two segments, so at worst there are two pieces per packet */
+#define TS_FILTER_MAX_PIECES (2*(TS_FRAME_SIZE/TS_PACKET_SIZE)+3)
+
+/* what the filter does with each packet */
+#define TS_FILTER_DROP 0
+#define TS_FILTER_PASS 1
+#define TS_FILTER_PAT  2 // swapped for a PAT of our own that only lists the one programme
+
+/* PATs come round a few times a second, so there are never more than this in one transfer */
+#define TS_SPLIT_MAX_PATS 4
 
 typedef struct {
-    uint8_t *buffer;
-    uint32_t length;
-    bool waiting;
-    pthread_mutex_t mutex;
-    pthread_cond_t signal;
-} longmynd_ts_parse_buffer_t;
-
-static longmynd_ts_parse_buffer_t longmynd_ts_parse_buffer = {
-    .buffer = NULL,
-    .length = 0,
-    .waiting = false,
-    .mutex = PTHREAD_MUTEX_INITIALIZER,
-    .signal = PTHREAD_COND_INITIALIZER
+    struct iovec *iov;
+    int iovcnt;
+    size_t offset;
+    size_t remaining;
+} ts_cursor_t;
+
+/* where the parser is in the TS, which carries on from one buffer to the next */
+typedef struct {
+    bool locked;
+    uint32_t position;                                  /* where the next packet starts in the buffer */
+    uint32_t bad;                                       /* bad sync bytes in a row while locked       */
+    uint32_t losses;                                    /* times the lock has been lost               */
+    uint32_t sync_errors;                               /* bad sync bytes while locked                */
+    uint8_t partial[TS_PACKET_SIZE];                    /* a packet split over two buffers            */
+    uint32_t partial_len;
+    /* the run of packets being handed out, with their headers decoded in one go */
+    ts_header_batch_t headers;
+    uint8_t *run;
+    uint32_t run_next;                                  /* the next of the run to hand out            */
+    uint32_t index;                                     /* the one last handed out, into headers      */
+} ts_sync_t;
+
+typedef struct ts_program_s ts_program_t;
+
+typedef struct {
+    bool enabled;
+    bool drop_nulls;
+    uint8_t pids_mode;
+    ts_program_t *program;                              /* cut the TS down to this programme, or NULL */
+    uint8_t pats[TS_SPLIT_MAX_PATS][TS_PACKET_SIZE];    /* the PATs made for the programme            */
+    uint8_t num_pats;
+    uint32_t pids[MAX_PID/32];                          /* the allow list as a bitmap                 */
+    /* a packet that straddles two transfers is put back together here, and sent out from joined as */
+    /* partial may be needed again for the end of the same transfer                                  */
+    uint8_t partial[TS_PACKET_SIZE];
+    uint32_t partial_len;
+    uint8_t joined[TS_PACKET_SIZE];
+    struct iovec pieces[TS_FILTER_MAX_PIECES];
+    uint64_t bytes_saved;
+} ts_filter_t;
+
+/* a programme that some of the TS outputs want on its own */
+struct ts_program_s {
+    uint16_t number;
+    atomic_uint pmt_pid;                                /* 0 until the parser finds it in the PAT     */
+    atomic_uint pids[MAX_PID/32];                       /* PMT, PCR and ES PIDs, found by the parser  */
+    ts_filter_t filter;
 };
 
+/* the USB buffers go over to the parser through here, without locking or copying */
+static ts_ring_t ts_parse_ring;
+
+/* what loop_ts sends out, only used by loop_ts */
+static ts_filter_t ts_output_filter;
+
+/* bumped by loop_ts each time it changes station, for the parser to start again from nothing */
+static atomic_uint ts_retunes;
+
+/* the PIDs the parser has found the service on (PAT, PMT, PCR and ES), for the automatic filter */
+static atomic_uint ts_auto_pids[MAX_PID/32];
+static atomic_bool ts_auto_pids_found;
+
+/* the programmes being split out of the TS. The parser fills them in and loop_ts uses them */
+static ts_program_t ts_programs[TS_MAX_SINKS];
+static uint8_t ts_num_programs=0;
+static atomic_uint ts_pat_info;                         /* TS id << 8 | version, from the last PAT    */
+
+/* the section assemblers, only used by loop_ts_parse, and which one each PID has (+1, 0 for none) */
+static psi_t *ts_psi[TS_PSI_MAX];
+static uint8_t ts_psi_num;
+static uint8_t ts_psi_slot[MAX_PID];
+static uint32_t ts_psi_crc_errors;                      /* on the assemblers that have been freed      */
+
+/* the services the parser has found, a copy of which goes in the status */
+static longmynd_service_table_t ts_service_table;
+
+/* what the parser has seen on each PID and the TR 101 290 checks, only used by loop_ts_parse */
+static ts_monitor_t ts_monitor;
+
+/* -------------------------------------------------------------------------------------------------- */
+static ts_program_t *ts_program_find(uint16_t number) {
+/* -------------------------------------------------------------------------------------------------- */
+/* number: the programme number, as in the PAT                                                        */
+/* return: the programme if an output wants it on its own, otherwise NULL                             */
+/* -------------------------------------------------------------------------------------------------- */
+    uint8_t i;
+
+    for (i=0; i<ts_num_programs; i++) {
+        if (ts_programs[i].number==number) return &ts_programs[i];
+    }
+
+    return NULL;
+}
+
+/* -------------------------------------------------------------------------------------------------- */
+static void ts_usb_give_back(uint8_t *data) {
+/* -------------------------------------------------------------------------------------------------- */
+/* hands a USB buffer that was lent to the parse ring back to the asynchronous engine                 */
+/* *data: the buffer                                                                                  */
+/* -------------------------------------------------------------------------------------------------- */
+    ftdi_usb_ts_async_release(data);
+}
+
+/* -------------------------------------------------------------------------------------------------- */
+uint8_t ts_init(longmynd_config_t *config) {
+/* -------------------------------------------------------------------------------------------------- */
+/* sets up what loop_ts and loop_ts_parse share. Must be done before either thread is started         */
+/* config: for the ring size, what to do when the parser falls behind and what to send out          */
+/* return: error code                                                                                 */
+/* -------------------------------------------------------------------------------------------------- */
+    ts_program_t *program;
+    uint16_t i;
+    uint16_t j;
+
+    memset(&ts_output_filter, 0, sizeof(ts_output_filter));
+    ts_output_filter.drop_nulls=config->ts_filter_nulls;
+    ts_output_filter.pids_mode=config->ts_filter_pids_mode;
+    ts_output_filter.enabled=config->ts_filter_nulls || (config->ts_filter_pids_mode!=TS_FILTER_PIDS_ALL);
+    for (i=0; i<config->ts_filter_num_pids; i++) {
+        ts_output_filter.pids[config->ts_filter_pids[i]/32] |= 1u << (config->ts_filter_pids[i]%32);
+    }
+
+    atomic_init(&ts_retunes, 0);
+    for (i=0; i<MAX_PID/32; i++) atomic_init(&ts_auto_pids[i], 0);
+    atomic_init(&ts_auto_pids_found, false);
+
+    /* one programme for each different one the outputs have asked for */
+    ts_num_programs=0;
+    atomic_init(&ts_pat_info, 0);
+    for (i=0; i<config->ts_num_sinks; i++) {
+        if ((config->ts_sinks[i].program!=0) && (ts_program_find(config->ts_sinks[i].program)==NULL)) {
+            program=&ts_programs[ts_num_programs++];
+            memset(&program->filter, 0, sizeof(program->filter));
+            program->number=config->ts_sinks[i].program;
+            program->filter.enabled=true;
+            program->filter.program=program;
+            atomic_init(&program->pmt_pid, 0);
+            for (j=0; j<MAX_PID/32; j++) atomic_init(&program->pids[j], 0);
+        }
+    }
+
+    ts_header_init();
+    crc32_mpeg2_init();
+
+    return ts_ring_init(&ts_parse_ring, config->ts_parse_slots, TS_FRAME_SIZE,
+                        config->ts_parse_drop_oldest ? TS_RING_POLICY_DROP_OLDEST : TS_RING_POLICY_SKIP,
+                        ts_usb_give_back);
+}
+
+/* -------------------------------------------------------------------------------------------------- */
+void ts_close(void) {
+/* -------------------------------------------------------------------------------------------------- */
+/* frees up what ts_init() set up, once both threads have exited                                      */
+/* -------------------------------------------------------------------------------------------------- */
+    ts_ring_free(&ts_parse_ring);
+}
+
+
+/* -------------------------------------------------------------------------------------------------- */
+static int ts_deframe(uint8_t *buffer, uint32_t len, struct iovec *iov) {
+/* -------------------------------------------------------------------------------------------------- */
+/* describes the TS in a USB transfer as a list of segments, one per USB packet, each missing the 2   */
+/* status bytes the FTDI puts at the front of every 512 byte packet. Nothing is copied                */
+/* *buffer: the USB transfer as it was read                                                           */
+/*     len: the number of bytes in the transfer                                                       */
+/*    *iov: filled with the segments, must have room for TS_MAX_SEGMENTS                              */
+/*  return: the number of segments                                                                    */
+/* -------------------------------------------------------------------------------------------------- */
+    uint32_t posn;
+    uint32_t size;
+    int iovcnt=0;
+
+    for (posn=0; posn<len; posn+=TS_USB_PACKET_SIZE) {
+        size = (len-posn < TS_USB_PACKET_SIZE) ? len-posn : TS_USB_PACKET_SIZE;
+        if (size>TS_USB_HEADER_SIZE) {
+            iov[iovcnt].iov_base=&buffer[posn+TS_USB_HEADER_SIZE];
+            iov[iovcnt].iov_len=size-TS_USB_HEADER_SIZE;
+            iovcnt++;
+        }
+    }
+
+    return iovcnt;
+}
+
+/* -------------------------------------------------------------------------------------------------- */
+static uint32_t ts_deframe_compact(uint8_t *buffer, uint32_t len) {
+/* -------------------------------------------------------------------------------------------------- */
+/* takes the FTDI status bytes out of a USB transfer in place so that it is just contiguous TS        */
+/* *buffer: the USB transfer as it was read, returned as the TS                                       */
+/*     len: the number of bytes in the transfer                                                       */
+/*  return: the number of bytes of TS now at the start of the buffer                                  */
+/* -------------------------------------------------------------------------------------------------- */
+    struct iovec iov[TS_MAX_SEGMENTS];
+    uint32_t ts_len=0;
+    int iovcnt;
+    int i;
+
+    iovcnt=ts_deframe(buffer, len, iov);
+    for (i=0; i<iovcnt; i++) {
+        memmove(&buffer[ts_len], iov[i].iov_base, iov[i].iov_len);
+        ts_len+=iov[i].iov_len;
+    }
+
+    return ts_len;
+}
+
+/* -------------------------------------------------------------------------------------------------- */
+static void ts_auto_pids_add(uint32_t pid) {
+/* -------------------------------------------------------------------------------------------------- */
+/* parser: adds a PID the service has been found on to the set the automatic filter lets through      */
+/* pid: the PID                                                                                       */
+/* -------------------------------------------------------------------------------------------------- */
+    atomic_fetch_or_explicit(&ts_auto_pids[pid/32], 1u << (pid%32), memory_order_relaxed);
+}
+
+/* -------------------------------------------------------------------------------------------------- */
+static void ts_auto_pids_clear(void) {
+/* -------------------------------------------------------------------------------------------------- */
+/* parser: forgets the PIDs we have found, when we change station, until they are found again        */
+/* -------------------------------------------------------------------------------------------------- */
+    uint16_t i;
+
+    atomic_store(&ts_auto_pids_found, false);
+    for (i=0; i<MAX_PID/32; i++) atomic_store_explicit(&ts_auto_pids[i], 0, memory_order_relaxed);
+}
+
+/* -------------------------------------------------------------------------------------------------- */
+static void ts_program_pids_add(ts_program_t *program, uint32_t pid) {
+/* -------------------------------------------------------------------------------------------------- */
+/* parser: adds a PID that a programme being split out has been found on                              */
+/* *program: the programme                                                                            */
+/*      pid: the PID                                                                                  */
+/* -------------------------------------------------------------------------------------------------- */
+    atomic_fetch_or_explicit(&program->pids[pid/32], 1u << (pid%32), memory_order_relaxed);
+}
+
+/* -------------------------------------------------------------------------------------------------- */
+static void ts_programs_clear(void) {
+/* -------------------------------------------------------------------------------------------------- */
+/* parser: forgets where the programmes were, when we change station, until they are found again     */
+/* -------------------------------------------------------------------------------------------------- */
+    uint16_t i;
+    uint8_t p;
+
+    for (p=0; p<ts_num_programs; p++) {
+        atomic_store(&ts_programs[p].pmt_pid, 0);
+        for (i=0; i<MAX_PID/32; i++) atomic_store_explicit(&ts_programs[p].pids[i], 0, memory_order_relaxed);
+    }
+}
+
+/* -------------------------------------------------------------------------------------------------- */
+static size_t ts_cursor_take(ts_cursor_t *cursor, size_t len, struct iovec *pieces, int *num_pieces) {
+/* -------------------------------------------------------------------------------------------------- */
+/* moves the cursor on through the TS, adding the bytes it passes over onto a list of pieces. Pieces  */
+/* that follow straight on from the last one in the list are merged into it                           */
+/*     *cursor: where we are in the TS                                                                */
+/*         len: how many bytes to take                                                                */
+/*     *pieces: if not NULL, the list the bytes taken are added onto                                  */
+/* *num_pieces: the number of pieces in the list                                                      */
+/*      return: the number of bytes taken, less than len if the TS ran out                            */
+/* -------------------------------------------------------------------------------------------------- */
+    size_t taken=0;
+    size_t size;
+    uint8_t *base;
+
+    while ((taken<len) && (cursor->iovcnt>0)) {
+        size=cursor->iov->iov_len-cursor->offset;
+        if (size>len-taken) size=len-taken;
+        base=(uint8_t *)cursor->iov->iov_base+cursor->offset;
+        if (pieces!=NULL) {
+            if ((*num_pieces>0) && ((uint8_t *)pieces[*num_pieces-1].iov_base+pieces[*num_pieces-1].iov_len==base)) {
+                pieces[*num_pieces-1].iov_len+=size;
+            } else {
+                pieces[*num_pieces].iov_base=base;
+                pieces[*num_pieces].iov_len=size;
+                (*num_pieces)++;
+            }
+        }
+        taken+=size;
+        cursor->offset+=size;
+        cursor->remaining-=size;
+        if (cursor->offset==cursor->iov->iov_len) {
+            cursor->iov++;
+            cursor->iovcnt--;
+            cursor->offset=0;
+        }
+    }
+
+    return taken;
+}
+
+/* -------------------------------------------------------------------------------------------------- */
+static uint8_t ts_cursor_peek(ts_cursor_t *cursor, size_t ahead) {
+/* -------------------------------------------------------------------------------------------------- */
+/* *cursor: where we are in the TS                                                                    */
+/*   ahead: how far past the cursor to look, there must be at least this many bytes left             */
+/*  return: the byte there                                                                            */
+/* -------------------------------------------------------------------------------------------------- */
+    struct iovec *iov=cursor->iov;
+
+    ahead+=cursor->offset;
+    while (ahead>=iov->iov_len) {
+        ahead-=iov->iov_len;
+        iov++;
+    }
+
+    return ((uint8_t *)iov->iov_base)[ahead];
+}
+
+/* -------------------------------------------------------------------------------------------------- */
+static inline uint8_t ts_filter_check(ts_filter_t *filter, uint8_t header1, uint8_t header2) {
+/* -------------------------------------------------------------------------------------------------- */
+/*  *filter: the filter settings                                                                      */
+/*  header1: the second byte of the packet header                                                     */
+/*  header2: the third byte of the packet header                                                      */
+/*   return: TS_FILTER_PASS, TS_FILTER_DROP or TS_FILTER_PAT                                          */
+/* -------------------------------------------------------------------------------------------------- */
+    uint32_t pid=((uint32_t)(header1 & 0x1F) << 8) | header2;
+
+    if (filter->program!=NULL) {
+        /* nothing goes out for a programme until we know enough to make its PAT */
+        if (pid==TS_PID_PAT) {
+            return (atomic_load_explicit(&filter->program->pmt_pid, memory_order_relaxed)!=0) ? TS_FILTER_PAT : TS_FILTER_DROP;
+        }
+        return ((atomic_load_explicit(&filter->program->pids[pid/32], memory_order_relaxed) >> (pid%32)) & 1) ? TS_FILTER_PASS : TS_FILTER_DROP;
+    }
+
+    if (pid==TS_PID_NULL) return filter->drop_nulls ? TS_FILTER_DROP : TS_FILTER_PASS;
+
+    switch (filter->pids_mode) {
+        case TS_FILTER_PIDS_LIST:
+            return ((filter->pids[pid/32] >> (pid%32)) & 1) ? TS_FILTER_PASS : TS_FILTER_DROP;
+        case TS_FILTER_PIDS_AUTO:
+            /* until the parser has found the service we let everything through */
+            if (!atomic_load_explicit(&ts_auto_pids_found, memory_order_relaxed)) return TS_FILTER_PASS;
+            return ((atomic_load_explicit(&ts_auto_pids[pid/32], memory_order_relaxed) >> (pid%32)) & 1) ? TS_FILTER_PASS : TS_FILTER_DROP;
+        default:
+            return TS_FILTER_PASS;
+    }
+}
+
+/* -------------------------------------------------------------------------------------------------- */
+static uint8_t *ts_filter_pat(ts_filter_t *filter, uint8_t header3) {
+/* -------------------------------------------------------------------------------------------------- */
+/* makes a PAT listing just the filter's programme, to go out in place of one from the TS              */
+/* *filter: the filter for the programme                                                              */
+/* header3: the fourth byte of the header of the PAT it is replacing, for the continuity counter      */
+/*  return: the PAT packet, or NULL if we have run out of room for them this time round               */
+/* -------------------------------------------------------------------------------------------------- */
+    uint8_t *packet;
+    uint8_t *section;
+    uint32_t pat_info;
+    uint32_t pmt_pid;
+    uint32_t crc;
+
+    if (filter->num_pats==TS_SPLIT_MAX_PATS) return NULL;
+    packet=filter->pats[filter->num_pats++];
+
+    pat_info=atomic_load_explicit(&ts_pat_info, memory_order_relaxed);
+    pmt_pid=atomic_load_explicit(&filter->program->pmt_pid, memory_order_relaxed);
+
+    /* header: payload unit start on the PAT PID, payload only, keeping the continuity counter */
+    packet[0]=TS_HEADER_SYNC;
+    packet[1]=0x40;
+    packet[2]=0x00;
+    packet[3]=0x10 | (header3 & 0x0F);
+    packet[4]=0x00; /* pointer field */
+
+    section=&packet[5];
+    section[0]=TS_TABLE_PAT;
+    section[1]=0xB0;                                    /* section syntax, 9 bytes + 4 per programme  */
+    section[2]=9+4;
+    section[3]=(pat_info >> 16) & 0xFF;                 /* transport stream id                        */
+    section[4]=(pat_info >> 8) & 0xFF;
+    section[5]=0xC1 | ((pat_info & 0x1F) << 1);         /* version, current                           */
+    section[6]=0x00;                                    /* section number                             */
+    section[7]=0x00;                                    /* last section number                        */
+    section[8]=(filter->program->number >> 8) & 0xFF;
+    section[9]=filter->program->number & 0xFF;
+    section[10]=0xE0 | ((pmt_pid >> 8) & 0x1F);
+    section[11]=pmt_pid & 0xFF;
+    crc=crc32_mpeg2(section, 12);
+    section[12]=(crc >> 24) & 0xFF;
+    section[13]=(crc >> 16) & 0xFF;
+    section[14]=(crc >> 8) & 0xFF;
+    section[15]=crc & 0xFF;
+
+    memset(&section[16], 0xFF, TS_PACKET_SIZE-5-16);
+
+    return packet;
+}
+
+/* -------------------------------------------------------------------------------------------------- */
+static void ts_filter_add(ts_filter_t *filter, uint8_t *packet, int *num_pieces) {
+/* -------------------------------------------------------------------------------------------------- */
+/* adds a whole packet of our own onto the list of pieces to send out                                 */
+/*     *filter: the filter                                                                            */
+/*     *packet: the packet, NULL to send nothing                                                      */
+/* *num_pieces: the number of pieces in the list                                                      */
+/* -------------------------------------------------------------------------------------------------- */
+    if (packet==NULL) {
+        filter->bytes_saved+=TS_PACKET_SIZE;
+    } else {
+        filter->pieces[*num_pieces].iov_base=packet;
+        filter->pieces[*num_pieces].iov_len=TS_PACKET_SIZE;
+        (*num_pieces)++;
+    }
+}
+
+/* -------------------------------------------------------------------------------------------------- */
+static int ts_filter(ts_filter_t *filter, struct iovec *iov, int iovcnt, struct iovec **out) {
+/* -------------------------------------------------------------------------------------------------- */
+/* takes out the packets that are not wanted on the TS outputs. Nothing is copied, apart from a       */
+/* packet that straddles two transfers                                                                */
+/* *filter: the filter settings and what it has kept from last time                                   */
+/*    *iov: the segments of TS, the FTDI headers have already been taken out                         */
+/*  iovcnt: the number of segments                                                                    */
+/*   **out: returned as the list of pieces of TS to send out, valid until the next call               */
+/*  return: the number of pieces                                                                      */
+/* -------------------------------------------------------------------------------------------------- */
+    ts_cursor_t cursor;
+    size_t n;
+    int num_pieces=0;
+    int i;
+
+    cursor.iov=iov;
+    cursor.iovcnt=iovcnt;
+    cursor.offset=0;
+    cursor.remaining=0;
+    for (i=0; i<iovcnt; i++) cursor.remaining+=iov[i].iov_len;
+
+    filter->num_pats=0;
+
+    /* finish off the packet we were part way through at the end of the last transfer */
+    if (filter->partial_len>0) {
+        n=TS_PACKET_SIZE-filter->partial_len;
+        if (n>cursor.remaining) n=cursor.remaining;
+        for (i=0; i<(int)n; i++) filter->partial[filter->partial_len+i]=ts_cursor_peek(&cursor, i);
+        ts_cursor_take(&cursor, n, NULL, NULL);
+        filter->partial_len+=n;
+        if (filter->partial_len==TS_PACKET_SIZE) {
+            switch (ts_filter_check(filter, filter->partial[1], filter->partial[2])) {
+                case TS_FILTER_PASS:
+                    memcpy(filter->joined, filter->partial, TS_PACKET_SIZE);
+                    ts_filter_add(filter, filter->joined, &num_pieces);
+                    break;
+                case TS_FILTER_PAT:
+                    ts_filter_add(filter, ts_filter_pat(filter, filter->partial[3]), &num_pieces);
+                    break;
+                default:
+                    filter->bytes_saved+=TS_PACKET_SIZE;
+                    break;
+            }
+            filter->partial_len=0;
+        }
+    }
+
+    while (cursor.remaining>0) {
+        if (ts_cursor_peek(&cursor, 0)!=TS_HEADER_SYNC) {
+            /* lost sync, so nothing goes out until we find the start of a packet again */
+            filter->bytes_saved+=ts_cursor_take(&cursor, 1, NULL, NULL);
+        } else if (cursor.remaining<TS_PACKET_SIZE) {
+            /* keep what we have of the last packet until the next transfer brings the rest */
+            filter->partial_len=cursor.remaining;
+            for (i=0; i<(int)filter->partial_len; i++) filter->partial[i]=ts_cursor_peek(&cursor, i);
+            ts_cursor_take(&cursor, filter->partial_len, NULL, NULL);
+        } else {
+            switch (ts_filter_check(filter, ts_cursor_peek(&cursor, 1), ts_cursor_peek(&cursor, 2))) {
+                case TS_FILTER_PASS:
+                    ts_cursor_take(&cursor, TS_PACKET_SIZE, filter->pieces, &num_pieces);
+                    break;
+                case TS_FILTER_PAT:
+                    ts_filter_add(filter, ts_filter_pat(filter, ts_cursor_peek(&cursor, 3)), &num_pieces);
+                    ts_cursor_take(&cursor, TS_PACKET_SIZE, NULL, NULL);
+                    break;
+                default:
+                    filter->bytes_saved+=ts_cursor_take(&cursor, TS_PACKET_SIZE, NULL, NULL);
+                    break;
+            }
+        }
+    }
+
+    *out=filter->pieces;
+
+    return num_pieces;
+}
+
+/* -------------------------------------------------------------------------------------------------- */
+static uint8_t ts_usb_read(longmynd_config_t *config, uint8_t *buffer, uint8_t **data, uint16_t *len) {
+/* -------------------------------------------------------------------------------------------------- */
+/* reads the next lump of TS from the USB, either from the asynchronous engine or synchronously into  */
+/* our own buffer. In async mode the data must be handed back with ts_usb_release() when done, or     */
+/* lent to the parse ring which hands it back itself                                                  */
+/* config: so we know which way we are reading the TS                                                 */
+/* buffer: the buffer to use for synchronous reads                                                    */
+/*  *data: returned as a pointer to the data that was read, NULL if nothing was                       */
+/*   *len: how many bytes were read                                                                   */
+/* return: error code                                                                                 */
+/* -------------------------------------------------------------------------------------------------- */
+    uint8_t err;
+
+    if (config->ts_usb_transfers>0) {
+        err=ftdi_usb_ts_async_read(data, len);
+    } else {
+        err=ftdi_usb_ts_read(buffer, len, TS_FRAME_SIZE);
+        *data=buffer;
+    }
+
+    return err;
+}
+
+/* -------------------------------------------------------------------------------------------------- */
+static uint8_t ts_usb_release(longmynd_config_t *config, uint8_t *data) {
+/* -------------------------------------------------------------------------------------------------- */
+/* hands a buffer read by ts_usb_read() back to the asynchronous engine, if we are using it           */
+/* config: so we know which way we are reading the TS                                                 */
+/*  *data: the buffer, NULL for none                                                                  */
+/* return: error code                                                                                 */
+/* -------------------------------------------------------------------------------------------------- */
+    uint8_t err=ERROR_NONE;
+
+    if (config->ts_usb_transfers>0) err=ftdi_usb_ts_async_release(data);
+
+    return err;
+}
 
 /* -------------------------------------------------------------------------------------------------- */
 void *loop_ts(void *arg) {
@@ -74,8 +619,15 @@ void *loop_ts(void *arg) {
     longmynd_config_t *config = thread_vars->config;
 
     uint8_t *buffer;
+    uint8_t *slot;
+    uint8_t *data=NULL;
     uint16_t len=0;
-    uint8_t (*ts_write)(uint8_t*,uint32_t);
+    struct iovec iov[TS_MAX_SEGMENTS];
+    struct iovec *out_iov;
+    int iovcnt;
+    int out_iovcnt;
+    uint64_t last_stats=monotonic_ms();
+    uint8_t i;
 
     *err=ERROR_NONE;
 
@@ -85,61 +637,696 @@ void *loop_ts(void *arg) {
         *err=ERROR_TS_BUFFER_MALLOC;
     }
 
-    if(thread_vars->config->ts_use_ip) {
-        *err=udp_ts_init(thread_vars->config->ts_ip_addr, thread_vars->config->ts_ip_port);
-        ts_write = udp_ts_write;
-    } else {
-        *err=fifo_ts_init(thread_vars->config->ts_fifo_path);
-        ts_write = fifo_ts_write;
+    /* each output opens itself in its own thread, so a FIFO with no reader yet no longer holds us up */
+    if (*err==ERROR_NONE) *err=ts_sinks_init(config, TS_FRAME_SIZE);
+
+    /* with multiple transfers queued on the endpoint the FTDI FIFO always has somewhere to go. The */
+    /* spares stand in for the buffers lent to the parse ring, and the one we are working on          */
+    if ((*err==ERROR_NONE) && (config->ts_usb_transfers>0)) {
+        *err=ftdi_usb_ts_async_start(config->ts_usb_transfers, ts_parse_ring.num_slots+1, TS_FRAME_SIZE);
     }
 
     while(*err == ERROR_NONE && *thread_vars->main_err_ptr == ERROR_NONE){
         /* If reset flag is active (eg. just started or changed station), then clear out the ts buffer */
         if(config->ts_reset) {
             do {
-                if (*err==ERROR_NONE) *err=ftdi_usb_ts_read(buffer, &len, TS_FRAME_SIZE);
+                if (*err==ERROR_NONE) *err=ts_usb_read(config, buffer, &data, &len);
+                if (*err==ERROR_NONE) *err=ts_usb_release(config, data);
             } while (*err==ERROR_NONE && len>2);
            config->ts_reset = false; 
+           /* the parser starts again on the new station's PIDs, and the old half packets are no use */
+           atomic_fetch_add(&ts_retunes, 1);
+           ts_output_filter.partial_len=0;
+           for (i=0; i<ts_num_programs; i++) ts_programs[i].filter.partial_len=0;
         }
 
-        *err=ftdi_usb_ts_read(buffer, &len, TS_FRAME_SIZE);
+        /* if the parser has a free slot we read straight into it, otherwise it misses this one */
+        slot=ts_ring_write_acquire(&ts_parse_ring);
 
-        /* if there is ts data then we send it out to the required output. But, we have to lose the first 2 bytes */
-        /* that are the usual FTDI 2 byte response and not part of the TS */
-        if ((*err==ERROR_NONE) && (len>2)) {
-            ts_write(&buffer[2],len-2);
+        *err=ts_usb_read(config, (slot!=NULL) ? slot : buffer, &data, &len);
 
-            if(longmynd_ts_parse_buffer.waiting && longmynd_ts_parse_buffer.buffer != NULL)
-            {                
-                pthread_mutex_lock(&longmynd_ts_parse_buffer.mutex);
+        /* if there is ts data then we send it out to the required output. But, we have to lose the 2 bytes */
+        /* at the start of each USB packet that are the usual FTDI 2 byte response and not part of the TS */
+        iovcnt = (*err==ERROR_NONE) ? ts_deframe(data, len, iov) : 0;
+        if (iovcnt>0) {
+            if (ts_output_filter.enabled) {
+                out_iovcnt=ts_filter(&ts_output_filter, iov, iovcnt, &out_iov);
+                if (out_iovcnt>0) ts_sinks_write(0, out_iov, out_iovcnt);
+            } else {
+                ts_sinks_write(0, iov, iovcnt);
+            }
+            /* and each of the programmes that are being sent out on their own */
+            for (i=0; i<ts_num_programs; i++) {
+                out_iovcnt=ts_filter(&ts_programs[i].filter, iov, iovcnt, &out_iov);
+                if (out_iovcnt>0) ts_sinks_write(ts_programs[i].number, out_iov, out_iovcnt);
+            }
 
-                memcpy(longmynd_ts_parse_buffer.buffer, &buffer[2],len-2);
-                longmynd_ts_parse_buffer.length = len-2;
-                pthread_cond_signal(&longmynd_ts_parse_buffer.signal);
-                longmynd_ts_parse_buffer.waiting = false;
+            if (slot!=NULL) {
+                /* the async engine's buffer is lent to the ring as it is, and comes back once parsed */
+                /* the tag is so that the parser can tell the old station's TS from the new           */
+                ts_ring_write_publish(&ts_parse_ring, data, len, atomic_load(&ts_retunes));
+                if (data!=slot) data=NULL;
+            }
+        }
 
-                pthread_mutex_unlock(&longmynd_ts_parse_buffer.mutex);
+        if (*err==ERROR_NONE) *err=ts_usb_release(config, data);
+
+        /* an output that could not be opened stops us, as it always has */
+        if (*err==ERROR_NONE) *err=ts_sinks_error();
+
+        /* pass the USB engine and output counters over to the status once a second */
+        if (monotonic_ms() > last_stats+TS_STATS_MS) {
+            pthread_mutex_lock(&thread_vars->status->mutex);
+            if (config->ts_usb_transfers>0) {
+                thread_vars->status->ts_usb_async=true;
+                ftdi_usb_ts_async_stats(&thread_vars->status->ts_usb_dry_time,
+                                        &thread_vars->status->ts_usb_latency_avg,
+                                        &thread_vars->status->ts_usb_latency_max);
+            }
+            thread_vars->status->ts_num_sinks=ts_sinks_count();
+            thread_vars->status->ts_fifo_nonblocking=config->ts_fifo_nonblocking;
+            thread_vars->status->ts_http=false;
+            thread_vars->status->ts_record=false;
+            thread_vars->status->ts_udp_pace=config->ts_udp_pace;
+            thread_vars->status->ts_filter_enabled=ts_output_filter.enabled;
+            thread_vars->status->ts_filter_saved=(uint32_t)(ts_output_filter.bytes_saved/1024);
+            for (i=0; i<ts_sinks_count(); i++) {
+                thread_vars->status->ts_sink_drops[i]=ts_sink_drops(i);
+                ts_sink_fifo_stats(i, &thread_vars->status->ts_fifo_drops[i], &thread_vars->status->ts_fifo_reconnects[i]);
+                ts_sink_http_stats(i, &thread_vars->status->ts_http_clients[i], &thread_vars->status->ts_http_slow[i]);
+                if (config->ts_sinks[i].type==TS_SINK_HTTP) thread_vars->status->ts_http=true;
+                ts_sink_record_stats(i, &thread_vars->status->ts_record_rate[i], &thread_vars->status->ts_record_latency[i]);
+                if (config->ts_sinks[i].type==TS_SINK_RECORD) thread_vars->status->ts_record=true;
+                ts_sink_pace_stats(i, &thread_vars->status->ts_pace_rate[i], &thread_vars->status->ts_pace_jitter[i],
+                                   &thread_vars->status->ts_pace_backlog[i]);
             }
+            pthread_mutex_unlock(&thread_vars->status->mutex);
+            last_stats=monotonic_ms();
         }
     }
 
+    if (config->ts_usb_transfers>0) ftdi_usb_ts_async_stop();
+
+    ts_sinks_close();
+
     free(buffer);
 
     return NULL;
 }
 
-static const uint32_t crc32_mpeg2_table[256];
+/* -------------------------------------------------------------------------------------------------- */
+static bool ts_sync_hunt(ts_sync_t *sync, uint8_t *buffer, uint32_t length) {
+/* -------------------------------------------------------------------------------------------------- */
+/* looks for a sync byte that is followed by TS_SYNC_LOCK_PACKETS-1 more at the packet stride, so    */
+/* that a 0x47 in a payload does not fool us                                                          */
+/*   *sync: where to start looking, filled in with the first packet and locked if one is found        */
+/* *buffer: the TS                                                                                    */
+/*  length: the number of bytes of TS in the buffer                                                   */
+/*  return: true if we are locked on                                                                  */
+/* -------------------------------------------------------------------------------------------------- */
+    uint8_t *candidate;
+    uint32_t from=sync->position;
+    uint32_t posn;
+    uint32_t i;
+
+    while (from<length) {
+        candidate=memchr(&buffer[from], TS_HEADER_SYNC, length-from);
+        if (candidate==NULL) return false;
+        posn=(uint32_t)(candidate-buffer);
+
+        /* not enough of the buffer left to be sure, so wait for the next one */
+        if (posn+(TS_SYNC_LOCK_PACKETS-1)*TS_PACKET_SIZE>=length) return false;
+
+        for (i=1; (i<TS_SYNC_LOCK_PACKETS) && (buffer[posn+i*TS_PACKET_SIZE]==TS_HEADER_SYNC); i++);
+        if (i==TS_SYNC_LOCK_PACKETS) {
+            sync->locked=true;
+            sync->bad=0;
+            sync->position=posn;
+            return true;
+        }
+        from=posn+1;
+    }
 
-static uint32_t crc32_mpeg2(uint8_t *data_ptr, size_t length)
-{
-    uint32_t crc;
+    return false;
+}
 
-    crc = 0xFFFFFFFF;
-    while (length--)
-    {
-        crc = (crc << 8) ^ crc32_mpeg2_table[((crc >> 24) ^ *data_ptr++) & 0xFF];
+/* -------------------------------------------------------------------------------------------------- */
+static bool ts_sync_run(ts_sync_t *sync, uint8_t *buffer, uint32_t length) {
+/* -------------------------------------------------------------------------------------------------- */
+/* takes the next run of packets, as many as follow on from each other in the buffer (up to           */
+/* TS_HEADER_BATCH) or else the one that straddles two buffers, put back together. Their headers are  */
+/* decoded in one go and the sync bytes checked: a single bad one is taken to be a corrupt packet,    */
+/* only TS_SYNC_UNLOCK_PACKETS in a row loses the lock, ends the run and starts the search again      */
+/*   *sync: where we are in the TS, filled in with the run                                            */
+/* *buffer: the TS                                                                                    */
+/*  length: the number of bytes of TS in the buffer                                                   */
+/*  return: false at the end of the buffer                                                            */
+/* -------------------------------------------------------------------------------------------------- */
+    uint8_t *first;
+    uint32_t count;
+    uint32_t size;
+    uint32_t i;
+
+    sync->headers.count=0;
+    sync->run_next=0;
+
+    if (!sync->locked && !ts_sync_hunt(sync, buffer, length)) {
+        /* look again from the start of the next buffer */
+        sync->position=0;
+        return false;
+    }
+
+    if (sync->partial_len>0) {
+        /* finish off the packet the last buffer ended part way through */
+        size=TS_PACKET_SIZE-sync->partial_len;
+        if (size>length) size=length;
+        memcpy(&sync->partial[sync->partial_len], buffer, size);
+        sync->partial_len+=size;
+        if (sync->partial_len<TS_PACKET_SIZE) return false;
+        sync->partial_len=0;
+        sync->position=size;
+        first=sync->partial;
+        count=1;
+    } else if (sync->position+TS_PACKET_SIZE>length) {
+        /* keep what there is of this packet until the next buffer */
+        if (sync->position<length) {
+            sync->partial_len=length-sync->position;
+            memcpy(sync->partial, &buffer[sync->position], sync->partial_len);
+            sync->position=0;
+        } else {
+            sync->position-=length;
+        }
+        return false;
+    } else {
+        first=&buffer[sync->position];
+        count=(length-sync->position)/TS_PACKET_SIZE;
+        if (count>TS_HEADER_BATCH) count=TS_HEADER_BATCH;
+        sync->position+=count*TS_PACKET_SIZE;
+    }
+
+    ts_header_decode(first, count, &sync->headers);
+    sync->run=first;
+
+    for (i=0; i<count; i++) {
+        if (sync->headers.sync[i]) {
+            sync->bad=0;
+            continue;
+        }
+        sync->sync_errors++;
+        if (++sync->bad>=TS_SYNC_UNLOCK_PACKETS) {
+            sync->locked=false;
+            sync->losses++;
+            /* none of the run from here on is handed out, and the search goes on from the bad packet */
+            sync->headers.count=i;
+            sync->position = (first==sync->partial) ? 0 : (uint32_t)(first-buffer)+i*TS_PACKET_SIZE;
+            break;
+        }
+    }
+
+    return true;
+}
+
+/* -------------------------------------------------------------------------------------------------- */
+static uint8_t *ts_sync_next(ts_sync_t *sync, uint8_t *buffer, uint32_t length) {
+/* -------------------------------------------------------------------------------------------------- */
+/* steps on to the next packet with a good sync byte, a run at a time once we are locked on, so that  */
+/* none are missed. The packet's header fields are in sync->headers at sync->index                    */
+/*   *sync: where we are in the TS                                                                    */
+/* *buffer: the TS                                                                                    */
+/*  length: the number of bytes of TS in the buffer                                                   */
+/*  return: the next packet, or NULL at the end of the buffer                                         */
+/* -------------------------------------------------------------------------------------------------- */
+    uint32_t i;
+
+    while (true) {
+        while (sync->run_next<sync->headers.count) {
+            i=sync->run_next++;
+            if (sync->headers.sync[i]) {
+                sync->index=i;
+                return &sync->run[i*TS_PACKET_SIZE];
+            }
+        }
+
+        if (!ts_sync_run(sync, buffer, length)) return NULL;
+    }
+}
+
+/* -------------------------------------------------------------------------------------------------- */
+static void ts_sync_reset(ts_sync_t *sync) {
+/* -------------------------------------------------------------------------------------------------- */
+/* forgets where we were, for when the next buffer does not follow on from the last                   */
+/* *sync: where we are in the TS                                                                      */
+/* -------------------------------------------------------------------------------------------------- */
+    sync->locked=false;
+    sync->position=0;
+    sync->bad=0;
+    sync->partial_len=0;
+    sync->headers.count=0;
+    sync->run_next=0;
+}
+
+/* -------------------------------------------------------------------------------------------------- */
+static psi_t *ts_psi_add(uint16_t pid) {
+/* -------------------------------------------------------------------------------------------------- */
+/* puts together the sections on a PID from now on                                                   */
+/*    pid: the PID                                                                                    */
+/* return: its assembler, or NULL if they are all in use                                              */
+/* -------------------------------------------------------------------------------------------------- */
+    psi_t *psi;
+
+    if (ts_psi_slot[pid]!=0) return ts_psi[ts_psi_slot[pid]-1];
+    if (ts_psi_num==TS_PSI_MAX) return NULL;
+
+    psi=malloc(sizeof(psi_t));
+    if (psi==NULL) return NULL;
+    psi_init(psi, pid);
+    ts_psi[ts_psi_num++]=psi;
+    ts_psi_slot[pid]=ts_psi_num;
+
+    return psi;
+}
+
+/* -------------------------------------------------------------------------------------------------- */
+static void ts_psi_reset(void) {
+/* -------------------------------------------------------------------------------------------------- */
+/* forgets all the sections, for when the TS does not follow on from what came before                 */
+/* -------------------------------------------------------------------------------------------------- */
+    uint8_t i;
+
+    for (i=0; i<ts_psi_num; i++) psi_reset(ts_psi[i]);
+}
+
+/* -------------------------------------------------------------------------------------------------- */
+static void ts_psi_free(void) {
+/* -------------------------------------------------------------------------------------------------- */
+/* frees all the assemblers, keeping their CRC error counts                                          */
+/* -------------------------------------------------------------------------------------------------- */
+    uint8_t i;
+
+    for (i=0; i<ts_psi_num; i++) {
+        ts_psi_crc_errors+=ts_psi[i]->crc_errors;
+        free(ts_psi[i]);
+    }
+    ts_psi_num=0;
+    memset(ts_psi_slot, 0, sizeof(ts_psi_slot));
+}
+
+/* -------------------------------------------------------------------------------------------------- */
+static void *ts_table_grow(void *array, uint32_t *size, uint32_t needed, size_t item) {
+/* -------------------------------------------------------------------------------------------------- */
+/* makes sure an array has room, doubling it as it needs to grow                                      */
+/*  *array: the array, or NULL if there is not one yet                                                */
+/*   *size: the number of items there is room for, updated if it grows                                */
+/*  needed: the number of items it needs room for                                                     */
+/*    item: the size of an item                                                                       */
+/*  return: the array, which may have moved, or NULL if it could not grow (and is as it was)          */
+/* -------------------------------------------------------------------------------------------------- */
+    uint32_t new_size;
+
+    if ((needed<=*size) && (array!=NULL)) return array;
+
+    new_size = (*size==0) ? 8 : *size;
+    while (new_size<needed) new_size*=2;
+
+    array=realloc(array, new_size*item);
+    if (array!=NULL) *size=new_size;
+
+    return array;
+}
+
+/* -------------------------------------------------------------------------------------------------- */
+void ts_services_copy(longmynd_service_table_t *dst, const longmynd_service_table_t *src) {
+/* -------------------------------------------------------------------------------------------------- */
+/* copies a service table into another, which keeps its own arrays                                    */
+/* *dst: the table to copy into, left empty if there is not the memory                               */
+/* *src: the table to copy                                                                            */
+/* -------------------------------------------------------------------------------------------------- */
+    longmynd_service_t *services;
+    longmynd_stream_t *streams;
+
+    dst->num_services=0;
+    dst->num_streams=0;
+
+    services=ts_table_grow(dst->services, &dst->services_size, src->num_services, sizeof(longmynd_service_t));
+    if (services==NULL) return;
+    dst->services=services;
+
+    streams=ts_table_grow(dst->streams, &dst->streams_size, src->num_streams, sizeof(longmynd_stream_t));
+    if (streams==NULL) return;
+    dst->streams=streams;
+
+    if (src->num_services>0) memcpy(dst->services, src->services, src->num_services*sizeof(longmynd_service_t));
+    if (src->num_streams>0) memcpy(dst->streams, src->streams, src->num_streams*sizeof(longmynd_stream_t));
+    dst->num_services=src->num_services;
+    dst->num_streams=src->num_streams;
+}
+
+/* -------------------------------------------------------------------------------------------------- */
+void ts_services_free(longmynd_service_table_t *table) {
+/* -------------------------------------------------------------------------------------------------- */
+/* frees a service table's arrays and leaves it empty                                                 */
+/* *table: the table                                                                                  */
+/* -------------------------------------------------------------------------------------------------- */
+    free(table->services);
+    free(table->streams);
+    memset(table, 0, sizeof(longmynd_service_table_t));
+}
+
+/* -------------------------------------------------------------------------------------------------- */
+static longmynd_service_t *ts_service_find(uint16_t number) {
+/* -------------------------------------------------------------------------------------------------- */
+/* number: the program number or service id                                                           */
+/* return: the service, added to the table if it is new, or NULL if there is not the memory          */
+/* -------------------------------------------------------------------------------------------------- */
+    longmynd_service_table_t *table=&ts_service_table;
+    longmynd_service_t *services;
+    uint32_t i;
+
+    for (i=0; i<table->num_services; i++) {
+        if (table->services[i].number==number) return &table->services[i];
+    }
+
+    services=ts_table_grow(table->services, &table->services_size, table->num_services+1, sizeof(longmynd_service_t));
+    if (services==NULL) return NULL;
+    table->services=services;
+
+    memset(&table->services[table->num_services], 0, sizeof(longmynd_service_t));
+    table->services[table->num_services].number=number;
+    table->services[table->num_services].first_stream=table->num_streams;
+
+    return &table->services[table->num_services++];
+}
+
+/* -------------------------------------------------------------------------------------------------- */
+static void ts_service_streams_clear(longmynd_service_t *service) {
+/* -------------------------------------------------------------------------------------------------- */
+/* takes a service's streams out of the table, closing up the gap                                     */
+/* *service: the service                                                                              */
+/* -------------------------------------------------------------------------------------------------- */
+    longmynd_service_table_t *table=&ts_service_table;
+    uint32_t i;
+
+    if (service->num_streams==0) return;
+
+    memmove(&table->streams[service->first_stream], &table->streams[service->first_stream+service->num_streams],
+            (table->num_streams-service->first_stream-service->num_streams)*sizeof(longmynd_stream_t));
+    table->num_streams-=service->num_streams;
+
+    for (i=0; i<table->num_services; i++) {
+        if (table->services[i].first_stream>service->first_stream) {
+            table->services[i].first_stream-=service->num_streams;
+        }
+    }
+
+    service->first_stream=table->num_streams;
+    service->num_streams=0;
+}
+
+/* -------------------------------------------------------------------------------------------------- */
+static void ts_services_sweep(bool pat) {
+/* -------------------------------------------------------------------------------------------------- */
+/* once the last section of a PAT or SDT is in, forgets what it no longer lists, and the services     */
+/* that neither of them list                                                                          */
+/* pat: true for the PAT, false for the SDT                                                           */
+/* -------------------------------------------------------------------------------------------------- */
+    longmynd_service_table_t *table=&ts_service_table;
+    longmynd_service_t *service;
+    uint32_t i=0;
+
+    while (i<table->num_services) {
+        service=&table->services[i];
+        if (pat && !service->in_pat) {
+            ts_service_streams_clear(service);
+            service->pmt_pid=0;
+            service->pcr_pid=0;
+        }
+        if (!pat && !service->in_sdt) {
+            service->name[0]='\0';
+            service->provider_name[0]='\0';
+        }
+
+        if (!service->in_pat && !service->in_sdt) {
+            ts_service_streams_clear(service);
+            memmove(service, &service[1], (table->num_services-i-1)*sizeof(longmynd_service_t));
+            table->num_services--;
+        } else {
+            i++;
+        }
     }
-    return crc;
+}
+
+/* -------------------------------------------------------------------------------------------------- */
+static void ts_services_publish(longmynd_status_t *status) {
+/* -------------------------------------------------------------------------------------------------- */
+/* puts a copy of the service table in the status, and the first service's names where they were     */
+/* always sent                                                                                        */
+/* *status: the status                                                                                */
+/* -------------------------------------------------------------------------------------------------- */
+    uint32_t i;
+
+    pthread_mutex_lock(&status->mutex);
+
+    ts_services_copy(&status->ts_services, &ts_service_table);
+
+    status->service_name[0]='\0';
+    status->service_provider_name[0]='\0';
+    for (i=0; i<ts_service_table.num_services; i++) {
+        if (ts_service_table.services[i].name[0]!='\0') {
+            strcpy(status->service_name, ts_service_table.services[i].name);
+            strcpy(status->service_provider_name, ts_service_table.services[i].provider_name);
+            break;
+        }
+    }
+
+    pthread_mutex_unlock(&status->mutex);
+}
+
+/* -------------------------------------------------------------------------------------------------- */
+static void ts_parse_retune(longmynd_status_t *status) {
+/* -------------------------------------------------------------------------------------------------- */
+/* parser: forgets everything that was found on the station loop_ts has just changed away from. The   */
+/* error counts carry on, as the sync losses always have                                              */
+/* *status: the status, which is given the now empty service table                                    */
+/* -------------------------------------------------------------------------------------------------- */
+    /* the old station's PMTs would otherwise hold on to their assemblers for good */
+    ts_psi_free();
+    ts_psi_add(TS_PID_PAT);
+    ts_psi_add(TS_PID_SDT);
+
+    ts_service_table.num_services=0;
+    ts_service_table.num_streams=0;
+    ts_services_publish(status);
+
+    ts_monitor_reset(&ts_monitor);
+    ts_monitor_refer(&ts_monitor, &ts_service_table);
+
+    ts_auto_pids_clear();
+    ts_programs_clear();
+}
+
+/* -------------------------------------------------------------------------------------------------- */
+static void ts_parse_pat(const uint8_t *section, uint32_t length) {
+/* -------------------------------------------------------------------------------------------------- */
+/* takes the programmes and their PMT PIDs from a new PAT section, and starts putting their PMTs       */
+/* together                                                                                           */
+/* *section: the section, CRC checked                                                                 */
+/*   length: its length, including the header and CRC                                                 */
+/* -------------------------------------------------------------------------------------------------- */
+    longmynd_service_t *service;
+    ts_program_t *program;
+    psi_t *psi;
+    uint32_t number;
+    uint32_t pid;
+    uint32_t i;
+
+    if (section[0]!=TS_TABLE_PAT) return;
+
+    /* the TS id and version go into the PATs made for the programmes we split out */
+    atomic_store(&ts_pat_info, ((uint32_t)section[3] << 16) | ((uint32_t)section[4] << 8)
+                               | (uint32_t)((section[5] >> 1) & 0x1F));
+
+    /* the first section of a new PAT starts the list again */
+    if (section[6]==0) {
+        for (i=0; i<ts_service_table.num_services; i++) ts_service_table.services[i].in_pat=false;
+    }
+
+    for (i=8; i+4<=length-4; i+=4) {
+        number=((uint32_t)section[i] << 8) | section[i+1];
+        pid=((uint32_t)(section[i+2] & 0x1F) << 8) | section[i+3];
+
+        /* programme 0 points at the NIT, not a PMT */
+        if (number==0) continue;
+
+        service=ts_service_find((uint16_t)number);
+        if (service!=NULL) {
+            if (service->pmt_pid!=pid) {
+                /* the PMT may be one we have had before, so forget it to be sure it comes out again */
+                service->pmt_pid=(uint16_t)pid;
+                psi=ts_psi_add((uint16_t)pid);
+                if (psi!=NULL) psi_reset(psi);
+            }
+            service->in_pat=true;
+        }
+
+        program=ts_program_find(number);
+        if (program!=NULL) {
+            ts_program_pids_add(program, pid);
+            atomic_store(&program->pmt_pid, pid);
+        }
+    }
+
+    if (section[6]==section[7]) ts_services_sweep(true);
+}
+
+/* -------------------------------------------------------------------------------------------------- */
+static void ts_parse_sdt(const uint8_t *section, uint32_t length) {
+/* -------------------------------------------------------------------------------------------------- */
+/* takes the names of the services from a new SDT section                                             */
+/* *section: the section, CRC checked                                                                 */
+/*   length: its length, including the header and CRC                                                 */
+/* -------------------------------------------------------------------------------------------------- */
+    longmynd_service_t *service;
+    const uint8_t *descriptor;
+    uint32_t posn;
+    uint32_t descriptors;
+    uint32_t descriptors_end;
+    uint32_t provider_length;
+    uint32_t name_length;
+    uint32_t i;
+
+    if (section[0]!=TS_TABLE_SDT) return;
+
+    /* the first section of a new SDT starts the list again */
+    if (section[6]==0) {
+        for (i=0; i<ts_service_table.num_services; i++) ts_service_table.services[i].in_sdt=false;
+    }
+
+    /* after the header and original network id, each service is 5 bytes and then its descriptors */
+    for (posn=11; posn+5<=length-4; posn=descriptors_end) {
+        descriptors_end=posn+5+((((uint32_t)section[posn+3] & 0x0F) << 8) | section[posn+4]);
+        if (descriptors_end>length-4) break;
+
+        service=ts_service_find((uint16_t)(((uint32_t)section[posn] << 8) | section[posn+1]));
+        if (service==NULL) continue;
+        service->in_sdt=true;
+        service->name[0]='\0';
+        service->provider_name[0]='\0';
+
+        for (descriptors=posn+5; descriptors+2<=descriptors_end; descriptors+=2+section[descriptors+1]) {
+            descriptor=&section[descriptors];
+            if ((descriptor[0]!=TS_DESCRIPTOR_SERVICE) || (descriptors+2+descriptor[1]>descriptors_end)) continue;
+
+            /* type, provider name length, provider name, name length, name */
+            provider_length=descriptor[3];
+            if (4+provider_length+1>2+(uint32_t)descriptor[1]) break;
+            name_length=descriptor[4+provider_length];
+            if (4+provider_length+1+name_length>2+(uint32_t)descriptor[1]) break;
+
+            memcpy(service->provider_name, &descriptor[4], provider_length);
+            service->provider_name[provider_length]='\0';
+            memcpy(service->name, &descriptor[4+provider_length+1], name_length);
+            service->name[name_length]='\0';
+            break;
+        }
+    }
+
+    if (section[6]==section[7]) ts_services_sweep(false);
+}
+
+/* -------------------------------------------------------------------------------------------------- */
+static void ts_parse_pmt(uint16_t pid, const uint8_t *section, uint32_t length) {
+/* -------------------------------------------------------------------------------------------------- */
+/* takes the streams of a programme from a new PMT section, and lets their PIDs through the output    */
+/* filters                                                                                            */
+/*      pid: the PID it came on                                                                       */
+/* *section: the section, CRC checked                                                                 */
+/*   length: its length, including the header and CRC                                                 */
+/* -------------------------------------------------------------------------------------------------- */
+    longmynd_service_table_t *table=&ts_service_table;
+    longmynd_service_t *service=NULL;
+    longmynd_stream_t *streams;
+    ts_program_t *program;
+    uint32_t number;
+    uint32_t pcr_pid;
+    uint32_t es_pid;
+    uint32_t posn;
+    uint32_t i;
+
+    if ((section[0]!=TS_TABLE_PMT) || (length<12+4)) return;
+
+    /* only the PMT the PAT says this programme's is on */
+    number=((uint32_t)section[3] << 8) | section[4];
+    for (i=0; i<table->num_services; i++) {
+        if (table->services[i].number==number) service=&table->services[i];
+    }
+    if ((service==NULL) || (service->pmt_pid!=pid)) return;
+
+    pcr_pid=((uint32_t)(section[8] & 0x1F) << 8) | section[9];
+    service->pcr_pid=(uint16_t)pcr_pid;
+    ts_service_streams_clear(service);
+
+    /* this is a good PMT, so the automatic output filter can let its PIDs through */
+    ts_auto_pids_add(TS_PID_PAT);
+    ts_auto_pids_add(pid);
+    ts_auto_pids_add(pcr_pid);
+
+    /* and if it is a programme that is being split out, so can that */
+    program=ts_program_find(number);
+    if (program!=NULL) {
+        ts_program_pids_add(program, pid);
+        ts_program_pids_add(program, pcr_pid);
+    }
+
+    /* after the program info, each stream is 5 bytes and then its descriptors. They go on the end */
+    service->first_stream=table->num_streams;
+    for (posn=12+((((uint32_t)section[10] & 0x0F) << 8) | section[11]); posn+5<=length-4;
+         posn+=5+((((uint32_t)section[posn+3] & 0x0F) << 8) | section[posn+4])) {
+        es_pid=((uint32_t)(section[posn+1] & 0x1F) << 8) | section[posn+2];
+
+        ts_auto_pids_add(es_pid);
+        if (program!=NULL) ts_program_pids_add(program, es_pid);
+
+        streams=ts_table_grow(table->streams, &table->streams_size, table->num_streams+1, sizeof(longmynd_stream_t));
+        if (streams==NULL) continue;
+        table->streams=streams;
+        table->streams[table->num_streams].pid=(uint16_t)es_pid;
+        table->streams[table->num_streams].type=section[posn];
+        table->num_streams++;
+        service->num_streams++;
+    }
+
+    atomic_store(&ts_auto_pids_found, true);
+}
+
+/* -------------------------------------------------------------------------------------------------- */
+static void ts_parse_status(longmynd_status_t *status, ts_sync_t *sync, uint32_t total, uint32_t nulls) {
+/* -------------------------------------------------------------------------------------------------- */
+/* parser: puts what it has counted in the status, and lets the status output know                    */
+/* *status: the status                                                                                */
+/*   *sync: where the parser is in the TS                                                             */
+/*   total: the packets in the buffer just parsed, 0 if none came                                     */
+/*   nulls: how many of them were null packets                                                        */
+/* -------------------------------------------------------------------------------------------------- */
+    uint32_t crc_errors;
+    uint8_t i;
+
+    pthread_mutex_lock(&status->mutex);
+
+    if (total>0) status->ts_null_percentage=(100*nulls)/total;
+    status->ts_parse_overruns=ts_ring_overruns(&ts_parse_ring);
+    status->ts_sync_losses=sync->losses;
+    status->ts_sync_byte_errors=sync->sync_errors;
+
+    crc_errors=ts_psi_crc_errors;
+    for (i=0; i<ts_psi_num; i++) crc_errors+=ts_psi[i]->crc_errors;
+    status->ts_crc_errors=crc_errors;
+
+    ts_monitor_status(&ts_monitor, status);
+
+    /* Trigger pthread signal */
+    pthread_cond_signal(&status->signal);
+
+    pthread_mutex_unlock(&status->mutex);
 }
 
 /* -------------------------------------------------------------------------------------------------- */
@@ -154,10 +1341,14 @@ void *loop_ts_parse(void *arg) {
     longmynd_status_t *status = thread_vars->status;
 
     /* TS Processing Vars */
+    ts_ring_slot_t *ts_slot;
     uint8_t *ts_buffer;
     uint32_t ts_buffer_length;
     uint8_t *ts_packet_ptr;
-    uint32_t ts_buffer_length_remaining;
+    ts_sync_t ts_sync;
+    uint32_t ts_overruns_seen = 0;
+    uint32_t ts_retunes_seen = 0;
+    uint64_t ts_last_buffer_ms = monotonic_ms();
 
     /* TS Stats Vars */
     uint32_t ts_packet_total_count;
@@ -168,121 +1359,116 @@ void *loop_ts_parse(void *arg) {
     uint32_t ts_adaption_field_flag;
     uint32_t ts_adaption_field_length;
     uint32_t ts_payload_content_offset;
-    uint32_t ts_payload_content_length;
-    uint8_t *ts_payload_ptr;
-    uint32_t ts_payload_section_length;
-
-    uint32_t ts_payload_crc;
-    uint32_t ts_payload_crc_c;
-
-    /* PAT */
-    //uint32_t ts_pat_programs_count;
-    //uint32_t ts_pat_program_id;
-    //uint32_t ts_pat_program_pid;
-
-    /* PMT */
-    //uint32_t ts_pmt_pcr_pid;
-    uint32_t ts_pmt_program_info_length;
-    uint8_t *ts_pmt_es_ptr;
-    uint32_t ts_pmt_es_type;
-    uint32_t ts_pmt_es_pid;
-    uint32_t ts_pmt_es_info_length;
-    uint32_t ts_pmt_offset;
-    uint32_t ts_pmt_index;
-
-    /* SDT */
-    uint8_t *ts_packet_sdt_table_ptr;
-    //uint32_t service_id;
-    uint8_t *ts_packet_sdt_descriptor_ptr;
-    //uint32_t descriptor_tag;
-    //uint32_t descriptor_length;
-    uint32_t service_provider_name_length;
-    uint32_t service_name_length;
-
-    ts_buffer = malloc(TS_FRAME_SIZE);
-    if(ts_buffer == NULL)
-    {
-        *err=ERROR_TS_BUFFER_MALLOC;
-    }
+    psi_t *ts_psi_ptr;
+    const uint8_t *ts_section_ptr;
+    uint32_t ts_section_length;
+    uint32_t ts_losses_seen = 0;
 
-    longmynd_ts_parse_buffer.buffer = ts_buffer;
+    ts_sync.losses = 0;
+    ts_sync.sync_errors = 0;
+    ts_sync_reset(&ts_sync);
 
-    struct timespec ts;
+    ts_monitor_init(&ts_monitor, (uint32_t)monotonic_ms());
 
-    /* Set pthread timer on .signal to use monotonic clock */
-    pthread_condattr_t attr;
-    pthread_condattr_init(&attr);
-    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
-    pthread_cond_init (&longmynd_ts_parse_buffer.signal, &attr);
-    pthread_condattr_destroy(&attr);
+    ts_psi_free();
+    ts_psi_crc_errors = 0;
+    ts_psi_add(TS_PID_PAT);
+    ts_psi_add(TS_PID_SDT);
 
     while(*err == ERROR_NONE && *thread_vars->main_err_ptr == ERROR_NONE)
     {
-        //ts_pat_program_pid = 0x00; // Updated by PAT parse
 
         /* Reset Stats */
         ts_packet_total_count = 0;
         ts_packet_null_count = 0;
 
-        pthread_mutex_lock(&longmynd_ts_parse_buffer.mutex);
-        longmynd_ts_parse_buffer.waiting = true;
-
-        while(longmynd_ts_parse_buffer.waiting && *thread_vars->main_err_ptr == ERROR_NONE)
+        /* wait up to 100ms for loop_ts to hand us something, then work on it in place in the ring */
+        if (!ts_ring_read_wait(&ts_parse_ring, 100))
         {
-            /* Set timer for 100ms */
-            clock_gettime(CLOCK_MONOTONIC, &ts);
-            ts.tv_nsec += 100 * 1000000;
+            /* nothing has come for a while, so the TS has gone: that loses the sync, and the tables */
+            /* and PIDs we are waiting for are still missed, as they would be in a TS that carried on */
+            /* without them                                                                          */
+            if(monotonic_ms() - ts_last_buffer_ms >= TS_PARSE_LOST_MS)
+            {
+                if(ts_sync.locked)
+                {
+                    ts_sync.losses++;
+                    ts_sync_reset(&ts_sync);
+                }
+                ts_monitor_tick(&ts_monitor, (uint32_t)monotonic_ms(), true);
 
-            pthread_cond_timedwait(&longmynd_ts_parse_buffer.signal, &longmynd_ts_parse_buffer.mutex, &ts);
+                ts_parse_status(status, &ts_sync, 0, 0);
+            }
+            continue;
         }
 
-        pthread_mutex_unlock(&longmynd_ts_parse_buffer.mutex);
+        ts_slot = ts_ring_read_acquire(&ts_parse_ring);
+        if (ts_slot == NULL) continue;
+        ts_last_buffer_ms = monotonic_ms();
 
-        ts_packet_ptr = &ts_buffer[0];
-        ts_buffer_length = longmynd_ts_parse_buffer.length;
-        ts_buffer_length_remaining = ts_buffer_length;
+        /* loop_ts has changed station, so nothing we know about the old one holds any more */
+        if(atomic_load(&ts_retunes) != ts_retunes_seen)
+        {
+            ts_retunes_seen = atomic_load(&ts_retunes);
+            ts_sync_reset(&ts_sync);
+            ts_parse_retune(status);
+        }
 
-        while(ts_packet_ptr != NULL)
+        /* and what is left of the old station's TS in the ring would only put it all back */
+        if(ts_slot->tag != ts_retunes_seen)
         {
-            if(ts_packet_ptr[0] != TS_HEADER_SYNC)
-            {
-                /* Align input to the TS sync byte */
-                ts_buffer_length_remaining = ts_buffer_length - (&ts_packet_ptr[0] - &ts_buffer[0]);
+            ts_ring_read_release(&ts_parse_ring);
+            continue;
+        }
 
-                if(ts_buffer_length_remaining <= TS_PACKET_SIZE)
-                {
-                    /* Nothing more in buffer, force exit */
-                    ts_packet_ptr = NULL;
-                    continue;
-                }
+        /* lose the 2 byte FTDI responses from each USB packet, as for the TS output */
+        ts_buffer = ts_slot->data;
+        ts_buffer_length = ts_deframe_compact(ts_slot->data, ts_slot->length);
 
-                ts_packet_ptr = memchr(ts_packet_ptr, TS_HEADER_SYNC, ts_buffer_length_remaining - TS_PACKET_SIZE);
-                if(ts_packet_ptr == NULL)
-                {
-                    continue;
-                }
+        /* the buffers follow on from each other, unless the ring has dropped one in between */
+        if(ts_ring_overruns(&ts_parse_ring) != ts_overruns_seen)
+        {
+            ts_overruns_seen = ts_ring_overruns(&ts_parse_ring);
+            ts_sync_reset(&ts_sync);
+            ts_psi_reset();
+            ts_monitor_reset(&ts_monitor);
+        }
+
+        /* the timeouts are only looked at while we have the sync, from before this buffer */
+        ts_monitor_tick(&ts_monitor, (uint32_t)monotonic_ms(), ts_sync.locked);
+
+        while((ts_packet_ptr = ts_sync_next(&ts_sync, ts_buffer, ts_buffer_length)) != NULL)
+        {
+            ts_pid = ts_sync.headers.pid[ts_sync.index];
+
+            /* a loss of sync is usually a retune, so the tables we have had may not be the ones now */
+            if(ts_sync.losses != ts_losses_seen)
+            {
+                ts_losses_seen = ts_sync.losses;
+                ts_psi_reset();
+                ts_monitor_reset(&ts_monitor);
             }
 
-            ts_pid = (uint32_t)((ts_packet_ptr[1] & 0x1F) << 8) | (uint32_t)ts_packet_ptr[2];
+            /* every packet goes in the per PID table, before anything else is done with it */
+            ts_monitor_packet(&ts_monitor, &ts_sync.headers, ts_sync.index, ts_packet_ptr);
         
             ts_packet_total_count++;
             
             ts_payload_content_offset = 4;
 
-            ts_adaption_field_flag = (uint32_t)(ts_packet_ptr[3] & 0x20) >> 5;
+            ts_adaption_field_flag = (ts_sync.headers.afc[ts_sync.index] & TS_HEADER_AFC_ADAPTATION) >> 1;
             if(ts_adaption_field_flag > 0)
             {
                 ts_adaption_field_length = ts_packet_ptr[4];
 
-                if(ts_adaption_field_length == 0
-                    || ts_adaption_field_length > 183)
+                if(ts_adaption_field_length > 183)
                 {
                     /* Length invalid, packet is likely invalid */
-                    ts_packet_ptr++;
                     continue;
                 }
 
-                ts_payload_content_offset += ts_adaption_field_length;
+                /* a length of 0 is a single stuffing byte, the length byte itself */
+                ts_payload_content_offset += 1 + ts_adaption_field_length;
             }
             
             /* NULL/padding packets */
@@ -290,259 +1476,54 @@ void *loop_ts_parse(void *arg) {
             {
                 ts_packet_null_count++;
 
-                ts_packet_ptr++;
                 continue;
             }
 
-#if 0
-            if(ts_pid == TS_PID_PAT)
+            /* nothing left after the adaptation field for a table to be in */
+            if((ts_sync.headers.afc[ts_sync.index] & TS_HEADER_AFC_PAYLOAD) == 0
+                || ts_payload_content_offset >= TS_PACKET_SIZE)
             {
-                ts_payload_ptr = (uint8_t *)&ts_packet_ptr[ts_payload_content_offset + 1 + ts_packet_ptr[ts_payload_content_offset]];
-
-                if(ts_payload_ptr[0] != TS_TABLE_PAT)
-                {
-                    ts_packet_ptr++;
-                    continue;
-                }
-
-                ts_payload_section_length = ((uint32_t)(ts_payload_ptr[1] & 0x0F) << 8) | (uint32_t)ts_payload_ptr[2];
-
-                if(ts_payload_section_length < 1)
-                {
-                    ts_packet_ptr++;
-                    continue;
-                }
-
-                ts_payload_crc = ((uint32_t)ts_payload_ptr[ts_payload_section_length-1] << 24) | ((uint32_t)ts_payload_ptr[ts_payload_section_length] << 16)
-                                | ((uint32_t)ts_payload_ptr[ts_payload_section_length+1] << 8) | (uint32_t)ts_payload_ptr[ts_payload_section_length+2];
-
-                ts_payload_crc_c = crc32_mpeg2(ts_payload_ptr, (ts_payload_section_length-1));
-
-                if(ts_payload_crc != ts_payload_crc_c)
-                {
-                    /* CRC Fail */
-                    ts_packet_ptr++;
-                    continue;
-                }
-
-                ts_pat_programs_count = (ts_payload_section_length - 9) / 4;
-
-                /* For now, only read the first programme */
-                /* TODO: Read all programs here to enable PID parsing of PMT */
-                if(ts_pat_programs_count > 0)
-                {
-                    //ts_pat_program_id = ((uint32_t)ts_payload_ptr[8] << 8) | (uint32_t)ts_payload_ptr[9];
-                    ts_pat_program_pid = ((uint32_t)(ts_payload_ptr[10] & 0x1F) << 8) | (uint32_t)ts_payload_ptr[11];
-                    //printf(" - PAT Program PID: %"PRIu32"\n", ts_pat_program_pid);
-                }
-
-                ts_packet_ptr++;
                 continue;
             }
-#endif
-            if(ts_pid == TS_PID_SDT)
-            {
-                ts_payload_content_length = 0;
-                ts_payload_ptr = (uint8_t *)&ts_packet_ptr[ts_payload_content_offset + 1 + ts_packet_ptr[ts_payload_content_offset]];
 
-                if(ts_payload_ptr[0] != TS_TABLE_SDT)
-                {
-                    ts_packet_ptr++;
-                    continue;
-                }
-
-                ts_payload_section_length = ((uint32_t)(ts_payload_ptr[1] & 0x0F) << 8) | (uint32_t)ts_payload_ptr[2];
-                //printf(" - SDT Section Length: %"PRIu32"\n", ts_payload_section_length);
-
-                if(ts_payload_section_length < 1)
-                {
-                    ts_packet_ptr++;
-                    continue;
-                }
-
-                ts_payload_crc = ((uint32_t)ts_payload_ptr[ts_payload_section_length-1] << 24) | ((uint32_t)ts_payload_ptr[ts_payload_section_length] << 16)
-                                | ((uint32_t)ts_payload_ptr[ts_payload_section_length+1] << 8) | (uint32_t)ts_payload_ptr[ts_payload_section_length+2];
-
-                ts_payload_crc_c = crc32_mpeg2(ts_payload_ptr, (ts_payload_section_length-1));
-
-                if(ts_payload_crc != ts_payload_crc_c)
-                {
-                    /* CRC Fail */
-                    ts_packet_ptr++;
-                    continue;
-                }
-
-                /* Per service */
-                ts_packet_sdt_table_ptr = &ts_payload_ptr[11];
-                ts_payload_content_length += 11;
-
-                //service_id = ((uint32_t)ts_packet_sdt_table_ptr[0] << 8) | (uint32_t)ts_packet_sdt_table_ptr[1];
-                //printf(" - - Service ID: %"PRIu32"\n", service_id);
-
-                /* Per descriptor */
-                ts_packet_sdt_descriptor_ptr = &ts_packet_sdt_table_ptr[5];
-                ts_payload_content_length += 5;
-
-                //descriptor_tag = (uint32_t)ts_packet_sdt_descriptor_ptr[0];
-                //printf(" - - - Descriptor Tag: %"PRIu32"\n", descriptor_tag);
-
-                //descriptor_length = (uint32_t)ts_packet_sdt_descriptor_ptr[1];
-                //printf(" - - - Descriptor Length: %"PRIu32"\n", descriptor_length);
-
-                //uint32_t service_type = (uint32_t)ts_packet_sdt_descriptor_ptr[2];
-                //printf(" - - - Service Type %"PRIu32"\n", service_type);
-
-                ts_payload_content_length += 3;
-
-                service_provider_name_length = (uint32_t)ts_packet_sdt_descriptor_ptr[3];
-                //printf(" - - - Service Provider Name Length %"PRIu32"\n", service_provider_name_length);
-                //printf(" - - - Service Provider Name: %.*s\n", service_provider_name_length, &ts_packet_sdt_descriptor_ptr[4]);
-
-                service_name_length = (uint32_t)ts_packet_sdt_descriptor_ptr[3+1+service_provider_name_length];
-                //printf(" - - - Service Name Length %"PRIu32"\n", service_name_length);
-                //printf(" - - - Service Name: %.*s\n", service_name_length, &ts_packet_sdt_descriptor_ptr[4+1+service_provider_name_length]);
-
-                pthread_mutex_lock(&status->mutex);
-                
-                memcpy(status->service_name, &ts_packet_sdt_descriptor_ptr[4+1+service_provider_name_length], service_name_length);
-                status->service_name[service_name_length] = '\0';
-
-                memcpy(status->service_provider_name, &ts_packet_sdt_descriptor_ptr[4], service_provider_name_length);
-                status->service_provider_name[service_provider_name_length] = '\0';
-
-                pthread_mutex_unlock(&status->mutex);
-
-                ts_payload_content_length += 1;
-                ts_payload_content_length += service_provider_name_length;
-                ts_payload_content_length += 1;
-                ts_payload_content_length += service_name_length;
-
-                ts_packet_ptr++;
+            /* anything other than the PAT, the SDT and the PMTs the PAT lists stops here, at the one look up */
+            if(ts_psi_slot[ts_pid] == 0)
+            {
                 continue;
             }
-            else // if(ts_pat_program_pid !=0x00 && ts_pid == ts_pat_program_pid) /* PMT, once found in PAT */
-            {
-                ts_payload_ptr = (uint8_t *)&ts_packet_ptr[ts_payload_content_offset + 1 + ts_packet_ptr[ts_payload_content_offset]];
+            ts_psi_ptr = ts_psi[ts_psi_slot[ts_pid] - 1];
 
-                /* We're not filtering by PID here yet, so we rely on filtering by table ID */
-                if(ts_payload_ptr[0] != TS_TABLE_PMT)
-                {
-                    ts_packet_ptr++;
-                    continue;
-                }
-
-                ts_payload_section_length = ((uint32_t)(ts_payload_ptr[1] & 0x0F) << 8) | (uint32_t)ts_payload_ptr[2];
+            psi_packet(ts_psi_ptr, &ts_packet_ptr[ts_payload_content_offset], TS_PACKET_SIZE - ts_payload_content_offset,
+                       ts_sync.headers.pusi[ts_sync.index] != 0, ts_sync.headers.cc[ts_sync.index]);
 
-                if(ts_payload_section_length < 1)
+            /* only the sections we have not had before come out */
+            while((ts_section_ptr = psi_section(ts_psi_ptr, &ts_section_length)) != NULL)
+            {
+                if(ts_pid == TS_PID_PAT)
                 {
-                    ts_packet_ptr++;
-                    continue;
+                    ts_parse_pat(ts_section_ptr, ts_section_length);
                 }
-
-                ts_payload_crc = ((uint32_t)ts_payload_ptr[ts_payload_section_length-1] << 24) | ((uint32_t)ts_payload_ptr[ts_payload_section_length] << 16)
-                                | ((uint32_t)ts_payload_ptr[ts_payload_section_length+1] << 8) | (uint32_t)ts_payload_ptr[ts_payload_section_length+2];
-
-                ts_payload_crc_c = crc32_mpeg2(ts_payload_ptr, (ts_payload_section_length-1));
-
-                if(ts_payload_crc != ts_payload_crc_c)
+                else if(ts_pid == TS_PID_SDT)
                 {
-                    /* CRC Fail */
-                    ts_packet_ptr++;
-                    continue;
+                    ts_parse_sdt(ts_section_ptr, ts_section_length);
                 }
-
-                //ts_pmt_pcr_pid = ((uint32_t)(ts_payload_ptr[8] & 0x1F) << 8) | (uint32_t)ts_payload_ptr[9];
-                //printf(" - PMT: PCR PID: %"PRIu32"\n", ts_pmt_pcr_pid);
-
-                ts_pmt_program_info_length = ((uint32_t)(ts_payload_ptr[10] & 0x0F) << 8) | (uint32_t)ts_payload_ptr[11];
-                //if(ts_pmt_program_info_length > 0)
-                //{
-                //    printf(" - PMT Program Info: %.*s\n", ts_pmt_program_info_length, &ts_payload_ptr[12]);
-                //}
-
-                ts_pmt_offset = 0;
-                ts_pmt_index = 0;
-                while((12+1+ts_pmt_program_info_length+ts_pmt_offset) < ts_payload_section_length)
+                else
                 {
-                    ts_pmt_es_ptr = &ts_payload_ptr[12 + ts_pmt_program_info_length + ts_pmt_offset];
-
-                    /* For each elementary PID */
-                    ts_pmt_es_type = (uint32_t)ts_pmt_es_ptr[0];
-
-                    ts_pmt_es_pid = ((uint32_t)(ts_pmt_es_ptr[1] & 0x1F) << 8) | (uint32_t)ts_pmt_es_ptr[2];
-
-                    ts_pmt_es_info_length = ((uint32_t)(ts_pmt_es_ptr[3] & 0x0F) << 8) | (uint32_t)ts_pmt_es_ptr[4];
-                    //if(ts_pmt_es_info_length > 0)
-                    //{
-                        //printf(" - - PMT ES Info: %.*s\n", ts_pmt_es_info_length, &ts_pmt_es_ptr[5]);
-                    //}
-
-                    pthread_mutex_lock(&status->mutex);
-
-                    status->ts_elementary_streams[ts_pmt_index][0] = ts_pmt_es_pid;
-                    status->ts_elementary_streams[ts_pmt_index][1] = ts_pmt_es_type;
-
-                    pthread_mutex_unlock(&status->mutex);
-
-                    ts_pmt_offset += (5 + ts_pmt_es_info_length);
-                    ts_pmt_index++;
+                    ts_parse_pmt(ts_pid, ts_section_ptr, ts_section_length);
                 }
 
-                ts_packet_ptr++;
-                continue;
+                ts_services_publish(status);
+                ts_monitor_refer(&ts_monitor, &ts_service_table);
             }
-
-            ts_packet_ptr++;
         }
-        pthread_mutex_lock(&status->mutex);
 
-        if(ts_packet_total_count > 0)
-        {
-            status->ts_null_percentage = (100 * ts_packet_null_count) / ts_packet_total_count;
-        }
-
-        /* Trigger pthread signal */
-        pthread_cond_signal(&status->signal);
+        ts_ring_read_release(&ts_parse_ring);
 
-        pthread_mutex_unlock(&status->mutex);
+        ts_parse_status(status, &ts_sync, ts_packet_total_count, ts_packet_null_count);
     }
 
-    free(ts_buffer);
+    ts_psi_free();
+    ts_services_free(&ts_service_table);
 
     return NULL;
 }
-
-static const uint32_t crc32_mpeg2_table[256] = {
-    0x00000000, 0x04c11db7, 0x09823b6e, 0x0d4326d9, 0x130476dc, 0x17c56b6b, 0x1a864db2, 0x1e475005,
-    0x2608edb8, 0x22c9f00f, 0x2f8ad6d6, 0x2b4bcb61, 0x350c9b64, 0x31cd86d3, 0x3c8ea00a, 0x384fbdbd,
-    0x4c11db70, 0x48d0c6c7, 0x4593e01e, 0x4152fda9, 0x5f15adac, 0x5bd4b01b, 0x569796c2, 0x52568b75,
-    0x6a1936c8, 0x6ed82b7f, 0x639b0da6, 0x675a1011, 0x791d4014, 0x7ddc5da3, 0x709f7b7a, 0x745e66cd,
-    0x9823b6e0, 0x9ce2ab57, 0x91a18d8e, 0x95609039, 0x8b27c03c, 0x8fe6dd8b, 0x82a5fb52, 0x8664e6e5,
-    0xbe2b5b58, 0xbaea46ef, 0xb7a96036, 0xb3687d81, 0xad2f2d84, 0xa9ee3033, 0xa4ad16ea, 0xa06c0b5d,
-    0xd4326d90, 0xd0f37027, 0xddb056fe, 0xd9714b49, 0xc7361b4c, 0xc3f706fb, 0xceb42022, 0xca753d95,
-    0xf23a8028, 0xf6fb9d9f, 0xfbb8bb46, 0xff79a6f1, 0xe13ef6f4, 0xe5ffeb43, 0xe8bccd9a, 0xec7dd02d,
-    0x34867077, 0x30476dc0, 0x3d044b19, 0x39c556ae, 0x278206ab, 0x23431b1c, 0x2e003dc5, 0x2ac12072,
-    0x128e9dcf, 0x164f8078, 0x1b0ca6a1, 0x1fcdbb16, 0x018aeb13, 0x054bf6a4, 0x0808d07d, 0x0cc9cdca,
-    0x7897ab07, 0x7c56b6b0, 0x71159069, 0x75d48dde, 0x6b93dddb, 0x6f52c06c, 0x6211e6b5, 0x66d0fb02,
-    0x5e9f46bf, 0x5a5e5b08, 0x571d7dd1, 0x53dc6066, 0x4d9b3063, 0x495a2dd4, 0x44190b0d, 0x40d816ba,
-    0xaca5c697, 0xa864db20, 0xa527fdf9, 0xa1e6e04e, 0xbfa1b04b, 0xbb60adfc, 0xb6238b25, 0xb2e29692,
-    0x8aad2b2f, 0x8e6c3698, 0x832f1041, 0x87ee0df6, 0x99a95df3, 0x9d684044, 0x902b669d, 0x94ea7b2a,
-    0xe0b41de7, 0xe4750050, 0xe9362689, 0xedf73b3e, 0xf3b06b3b, 0xf771768c, 0xfa325055, 0xfef34de2,
-    0xc6bcf05f, 0xc27dede8, 0xcf3ecb31, 0xcbffd686, 0xd5b88683, 0xd1799b34, 0xdc3abded, 0xd8fba05a,
-    0x690ce0ee, 0x6dcdfd59, 0x608edb80, 0x644fc637, 0x7a089632, 0x7ec98b85, 0x738aad5c, 0x774bb0eb,
-    0x4f040d56, 0x4bc510e1, 0x46863638, 0x42472b8f, 0x5c007b8a, 0x58c1663d, 0x558240e4, 0x51435d53,
-    0x251d3b9e, 0x21dc2629, 0x2c9f00f0, 0x285e1d47, 0x36194d42, 0x32d850f5, 0x3f9b762c, 0x3b5a6b9b,
-    0x0315d626, 0x07d4cb91, 0x0a97ed48, 0x0e56f0ff, 0x1011a0fa, 0x14d0bd4d, 0x19939b94, 0x1d528623,
-    0xf12f560e, 0xf5ee4bb9, 0xf8ad6d60, 0xfc6c70d7, 0xe22b20d2, 0xe6ea3d65, 0xeba91bbc, 0xef68060b,
-    0xd727bbb6, 0xd3e6a601, 0xdea580d8, 0xda649d6f, 0xc423cd6a, 0xc0e2d0dd, 0xcda1f604, 0xc960ebb3,
-    0xbd3e8d7e, 0xb9ff90c9, 0xb4bcb610, 0xb07daba7, 0xae3afba2, 0xaafbe615, 0xa7b8c0cc, 0xa379dd7b,
-    0x9b3660c6, 0x9ff77d71, 0x92b45ba8, 0x9675461f, 0x8832161a, 0x8cf30bad, 0x81b02d74, 0x857130c3,
-    0x5d8a9099, 0x594b8d2e, 0x5408abf7, 0x50c9b640, 0x4e8ee645, 0x4a4ffbf2, 0x470cdd2b, 0x43cdc09c,
-    0x7b827d21, 0x7f436096, 0x7200464f, 0x76c15bf8, 0x68860bfd, 0x6c47164a, 0x61043093, 0x65c52d24,
-    0x119b4be9, 0x155a565e, 0x18197087, 0x1cd86d30, 0x029f3d35, 0x065e2082, 0x0b1d065b, 0x0fdc1bec,
-    0x3793a651, 0x3352bbe6, 0x3e119d3f, 0x3ad08088, 0x2497d08d, 0x2056cd3a, 0x2d15ebe3, 0x29d4f654,
-    0xc5a92679, 0xc1683bce, 0xcc2b1d17, 0xc8ea00a0, 0xd6ad50a5, 0xd26c4d12, 0xdf2f6bcb, 0xdbee767c,
-    0xe3a1cbc1, 0xe760d676, 0xea23f0af, 0xeee2ed18, 0xf0a5bd1d, 0xf464a0aa, 0xf9278673, 0xfde69bc4,
-    0x89b8fd09, 0x8d79e0be, 0x803ac667, 0x84fbdbd0, 0x9abc8bd5, 0x9e7d9662, 0x933eb0bb, 0x97ffad0c,
-    0xafb010b1, 0xab710d06, 0xa6322bdf, 0xa2f33668, 0xbcb4666d, 0xb8757bda, 0xb5365d03, 0xb1f740b4
-};
\ No newline at end of file
@@ -22,8 +22,15 @@
 #ifndef TS_H
 #define TS_H
 
+#include <stdint.h>
+#include "main.h"
+
+uint8_t ts_init(longmynd_config_t *config);
+void ts_close(void);
 void *loop_ts(void *arg);
 void *loop_ts_parse(void *arg);
+void ts_services_copy(longmynd_service_table_t *dst, const longmynd_service_table_t *src);
+void ts_services_free(longmynd_service_table_t *table);
 
 #endif
 
@@ -0,0 +1,361 @@
+/* -------------------------------------------------------------------------------------------------- */
+/* The LongMynd receiver: ts_header.c                                                                 */
+/*    - an implementation of the Serit NIM controlling software for the MiniTiouner Hardware          */
+/*    - decodes the 4 byte headers of a run of TS packets into an array for each field               */
+/* Copyright 2019 Heather Lomond                                                                      */
+/* -------------------------------------------------------------------------------------------------- */
+/*
+    This file is part of longmynd.
+
+    Longmynd is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Longmynd is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with longmynd.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+/*
+    Each header is picked up as a 32 bit word, a lane of a vector, and all its fields are then
+    shifted and masked out of the lanes together. The lanes are narrowed down to bytes (or 16 bits
+    for the PID) and stored, so that 16 or 32 packets are done with a handful of instructions per
+    field.
+
+    There is a kernel for SSE2, AVX2 and NEON, and a scalar one for everything else and for the
+    packets left over at the end of a run. The AVX2 one is built with a target attribute, so the
+    binary does not need -mavx2 to have it, and ts_header_init() picks the best one the CPU has.
+*/
+
+/* -------------------------------------------------------------------------------------------------- */
+/* ----------------- INCLUDES ----------------------------------------------------------------------- */
+/* -------------------------------------------------------------------------------------------------- */
+
+#include <stdio.h>
+#include <string.h>
+#include "ts_header.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define TS_HEADER_X86
+#endif
+
+#if defined(__ARM_NEON) || defined(__aarch64__)
+#include <arm_neon.h>
+#define TS_HEADER_NEON
+#if !defined(__aarch64__)
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
+#endif
+
+/* -------------------------------------------------------------------------------------------------- */
+/* ----------------- DEFINES ------------------------------------------------------------------------ */
+/* -------------------------------------------------------------------------------------------------- */
+
+/* a kernel decodes as many packets as it can in its own size of step, and says how many that was */
+typedef uint32_t (*ts_header_kernel_t)(const uint8_t *, uint32_t, ts_header_batch_t *);
+
+/* -------------------------------------------------------------------------------------------------- */
+/* ----------------- GLOBALS ------------------------------------------------------------------------ */
+/* -------------------------------------------------------------------------------------------------- */
+
+static uint32_t ts_header_decode_none(const uint8_t *packets, uint32_t count, ts_header_batch_t *batch);
+
+static ts_header_kernel_t ts_header_vector=ts_header_decode_none;
+static const char *ts_header_vector_name="scalar";
+
+/* -------------------------------------------------------------------------------------------------- */
+/* ----------------- ROUTINES ----------------------------------------------------------------------- */
+/* -------------------------------------------------------------------------------------------------- */
+
+/* -------------------------------------------------------------------------------------------------- */
+static inline uint32_t ts_header_word(const uint8_t *packet) {
+/* -------------------------------------------------------------------------------------------------- */
+/* *packet: a TS packet                                                                               */
+/*  return: its header as a little endian word, so that byte 0 is in the bottom 8 bits               */
+/* -------------------------------------------------------------------------------------------------- */
+    return (uint32_t)packet[0] | ((uint32_t)packet[1] << 8) | ((uint32_t)packet[2] << 16) | ((uint32_t)packet[3] << 24);
+}
+
+/* -------------------------------------------------------------------------------------------------- */
+static uint32_t ts_header_decode_none(const uint8_t *packets, uint32_t count, ts_header_batch_t *batch) {
+/* -------------------------------------------------------------------------------------------------- */
+/* the kernel for when there is no vector unit, which leaves it all to the scalar code                */
+/* -------------------------------------------------------------------------------------------------- */
+    (void)packets;
+    (void)count;
+    (void)batch;
+
+    return 0;
+}
+
+/* -------------------------------------------------------------------------------------------------- */
+static void ts_header_decode_scalar(const uint8_t *packets, uint32_t first, uint32_t count, ts_header_batch_t *batch) {
+/* -------------------------------------------------------------------------------------------------- */
+/* decodes the headers one packet at a time                                                           */
+/* *packets: the first packet of the run                                                              */
+/*    first: the packet to start at                                                                   */
+/*    count: the number of packets in the run                                                         */
+/*   *batch: filled in with the fields                                                                */
+/* -------------------------------------------------------------------------------------------------- */
+    const uint8_t *packet;
+    uint32_t i;
+
+    for (i=first; i<count; i++) {
+        packet=&packets[i*TS_HEADER_PACKET_SIZE];
+        batch->sync[i]=(packet[0]==TS_HEADER_SYNC);
+        batch->tei[i]=packet[1] >> 7;
+        batch->pusi[i]=(packet[1] >> 6) & 0x01;
+        batch->pid[i]=((uint16_t)(packet[1] & 0x1f) << 8) | packet[2];
+        batch->scrambling[i]=packet[3] >> 6;
+        batch->afc[i]=(packet[3] >> 4) & 0x03;
+        batch->cc[i]=packet[3] & 0x0f;
+    }
+}
+
+#ifdef TS_HEADER_X86
+/* -------------------------------------------------------------------------------------------------- */
+static inline __m128i ts_header_sse2_load(const uint8_t *packets) {
+/* -------------------------------------------------------------------------------------------------- */
+/* *packets: the first of 4 packets                                                                   */
+/*   return: their headers, one in each lane                                                          */
+/* -------------------------------------------------------------------------------------------------- */
+    return _mm_setr_epi32((int)ts_header_word(&packets[0*TS_HEADER_PACKET_SIZE]),
+                          (int)ts_header_word(&packets[1*TS_HEADER_PACKET_SIZE]),
+                          (int)ts_header_word(&packets[2*TS_HEADER_PACKET_SIZE]),
+                          (int)ts_header_word(&packets[3*TS_HEADER_PACKET_SIZE]));
+}
+
+/* the fields, each still in 32 bit lanes, narrowed down to 16 bytes for 16 packets */
+#define TS_HEADER_SSE2_BYTES(dst, f0, f1, f2, f3) \
+    _mm_storeu_si128((__m128i *)(dst), _mm_packus_epi16(_mm_packs_epi32(f0, f1), _mm_packs_epi32(f2, f3)))
+
+/* -------------------------------------------------------------------------------------------------- */
+static uint32_t ts_header_decode_sse2(const uint8_t *packets, uint32_t count, ts_header_batch_t *batch) {
+/* -------------------------------------------------------------------------------------------------- */
+/* decodes the headers 16 packets at a time with SSE2                                                 */
+/* *packets: the first packet of the run                                                              */
+/*    count: the number of packets in the run                                                         */
+/*   *batch: filled in with the fields                                                                */
+/*   return: how many were decoded                                                                    */
+/* -------------------------------------------------------------------------------------------------- */
+    const __m128i sync=_mm_set1_epi32(TS_HEADER_SYNC);
+    const __m128i mask_byte=_mm_set1_epi32(0xff);
+    const __m128i mask_pid_high=_mm_set1_epi32(0x1f00);
+    const __m128i mask_1=_mm_set1_epi32(0x01);
+    const __m128i mask_3=_mm_set1_epi32(0x03);
+    const __m128i mask_f=_mm_set1_epi32(0x0f);
+    __m128i w[4];
+    __m128i f[4];
+    uint32_t i;
+    int j;
+
+    for (i=0; i+16<=count; i+=16) {
+        for (j=0; j<4; j++) w[j]=ts_header_sse2_load(&packets[(i+4*j)*TS_HEADER_PACKET_SIZE]);
+
+        for (j=0; j<4; j++) f[j]=_mm_srli_epi32(_mm_cmpeq_epi32(_mm_and_si128(w[j], mask_byte), sync), 31);
+        TS_HEADER_SSE2_BYTES(&batch->sync[i], f[0], f[1], f[2], f[3]);
+        for (j=0; j<4; j++) f[j]=_mm_and_si128(_mm_srli_epi32(w[j], 15), mask_1);
+        TS_HEADER_SSE2_BYTES(&batch->tei[i], f[0], f[1], f[2], f[3]);
+        for (j=0; j<4; j++) f[j]=_mm_and_si128(_mm_srli_epi32(w[j], 14), mask_1);
+        TS_HEADER_SSE2_BYTES(&batch->pusi[i], f[0], f[1], f[2], f[3]);
+        for (j=0; j<4; j++) f[j]=_mm_srli_epi32(w[j], 30);
+        TS_HEADER_SSE2_BYTES(&batch->scrambling[i], f[0], f[1], f[2], f[3]);
+        for (j=0; j<4; j++) f[j]=_mm_and_si128(_mm_srli_epi32(w[j], 28), mask_3);
+        TS_HEADER_SSE2_BYTES(&batch->afc[i], f[0], f[1], f[2], f[3]);
+        for (j=0; j<4; j++) f[j]=_mm_and_si128(_mm_srli_epi32(w[j], 24), mask_f);
+        TS_HEADER_SSE2_BYTES(&batch->cc[i], f[0], f[1], f[2], f[3]);
+
+        /* byte 1 is already in place for the top of the PID, byte 2 comes down to the bottom */
+        for (j=0; j<4; j++) f[j]=_mm_or_si128(_mm_and_si128(w[j], mask_pid_high), _mm_and_si128(_mm_srli_epi32(w[j], 16), mask_byte));
+        _mm_storeu_si128((__m128i *)&batch->pid[i], _mm_packs_epi32(f[0], f[1]));
+        _mm_storeu_si128((__m128i *)&batch->pid[i+8], _mm_packs_epi32(f[2], f[3]));
+    }
+
+    return i;
+}
+
+/* the same for AVX2, where the packs work within each 128 bit half so the result has to be put */
+/* back in order                                                                                  */
+#define TS_HEADER_AVX2_BYTES(dst, f0, f1, f2, f3) \
+    _mm256_storeu_si256((__m256i *)(dst), _mm256_permutevar8x32_epi32( \
+        _mm256_packus_epi16(_mm256_packs_epi32(f0, f1), _mm256_packs_epi32(f2, f3)), order))
+
+/* -------------------------------------------------------------------------------------------------- */
+__attribute__((target("avx2")))
+static uint32_t ts_header_decode_avx2(const uint8_t *packets, uint32_t count, ts_header_batch_t *batch) {
+/* -------------------------------------------------------------------------------------------------- */
+/* decodes the headers 32 packets at a time with AVX2, gathering 8 headers at once                    */
+/* *packets: the first packet of the run                                                              */
+/*    count: the number of packets in the run                                                         */
+/*   *batch: filled in with the fields                                                                */
+/*   return: how many were decoded                                                                    */
+/* -------------------------------------------------------------------------------------------------- */
+    const __m256i offsets=_mm256_setr_epi32(0*TS_HEADER_PACKET_SIZE, 1*TS_HEADER_PACKET_SIZE, 2*TS_HEADER_PACKET_SIZE,
+                                            3*TS_HEADER_PACKET_SIZE, 4*TS_HEADER_PACKET_SIZE, 5*TS_HEADER_PACKET_SIZE,
+                                            6*TS_HEADER_PACKET_SIZE, 7*TS_HEADER_PACKET_SIZE);
+    const __m256i order=_mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+    const __m256i sync=_mm256_set1_epi32(TS_HEADER_SYNC);
+    const __m256i mask_byte=_mm256_set1_epi32(0xff);
+    const __m256i mask_pid_high=_mm256_set1_epi32(0x1f00);
+    const __m256i mask_1=_mm256_set1_epi32(0x01);
+    const __m256i mask_3=_mm256_set1_epi32(0x03);
+    const __m256i mask_f=_mm256_set1_epi32(0x0f);
+    __m256i w[4];
+    __m256i f[4];
+    uint32_t i;
+    int j;
+
+    for (i=0; i+32<=count; i+=32) {
+        for (j=0; j<4; j++) w[j]=_mm256_i32gather_epi32((const int *)&packets[(i+8*j)*TS_HEADER_PACKET_SIZE], offsets, 1);
+
+        for (j=0; j<4; j++) f[j]=_mm256_srli_epi32(_mm256_cmpeq_epi32(_mm256_and_si256(w[j], mask_byte), sync), 31);
+        TS_HEADER_AVX2_BYTES(&batch->sync[i], f[0], f[1], f[2], f[3]);
+        for (j=0; j<4; j++) f[j]=_mm256_and_si256(_mm256_srli_epi32(w[j], 15), mask_1);
+        TS_HEADER_AVX2_BYTES(&batch->tei[i], f[0], f[1], f[2], f[3]);
+        for (j=0; j<4; j++) f[j]=_mm256_and_si256(_mm256_srli_epi32(w[j], 14), mask_1);
+        TS_HEADER_AVX2_BYTES(&batch->pusi[i], f[0], f[1], f[2], f[3]);
+        for (j=0; j<4; j++) f[j]=_mm256_srli_epi32(w[j], 30);
+        TS_HEADER_AVX2_BYTES(&batch->scrambling[i], f[0], f[1], f[2], f[3]);
+        for (j=0; j<4; j++) f[j]=_mm256_and_si256(_mm256_srli_epi32(w[j], 28), mask_3);
+        TS_HEADER_AVX2_BYTES(&batch->afc[i], f[0], f[1], f[2], f[3]);
+        for (j=0; j<4; j++) f[j]=_mm256_and_si256(_mm256_srli_epi32(w[j], 24), mask_f);
+        TS_HEADER_AVX2_BYTES(&batch->cc[i], f[0], f[1], f[2], f[3]);
+
+        for (j=0; j<4; j++) f[j]=_mm256_or_si256(_mm256_and_si256(w[j], mask_pid_high), _mm256_and_si256(_mm256_srli_epi32(w[j], 16), mask_byte));
+        _mm256_storeu_si256((__m256i *)&batch->pid[i], _mm256_permute4x64_epi64(_mm256_packs_epi32(f[0], f[1]), 0xd8));
+        _mm256_storeu_si256((__m256i *)&batch->pid[i+16], _mm256_permute4x64_epi64(_mm256_packs_epi32(f[2], f[3]), 0xd8));
+    }
+
+    return i;
+}
+#endif
+
+#ifdef TS_HEADER_NEON
+/* -------------------------------------------------------------------------------------------------- */
+static inline uint32x4_t ts_header_neon_load(const uint8_t *packets) {
+/* -------------------------------------------------------------------------------------------------- */
+/* *packets: the first of 4 packets                                                                   */
+/*   return: their headers, one in each lane                                                          */
+/* -------------------------------------------------------------------------------------------------- */
+    uint32_t words[4];
+
+    words[0]=ts_header_word(&packets[0*TS_HEADER_PACKET_SIZE]);
+    words[1]=ts_header_word(&packets[1*TS_HEADER_PACKET_SIZE]);
+    words[2]=ts_header_word(&packets[2*TS_HEADER_PACKET_SIZE]);
+    words[3]=ts_header_word(&packets[3*TS_HEADER_PACKET_SIZE]);
+
+    return vld1q_u32(words);
+}
+
+/* the fields, each still in 32 bit lanes, narrowed down to 16 bytes for 16 packets */
+#define TS_HEADER_NEON_BYTES(dst, f0, f1, f2, f3) \
+    vst1q_u8((dst), vcombine_u8(vmovn_u16(vcombine_u16(vmovn_u32(f0), vmovn_u32(f1))), \
+                                vmovn_u16(vcombine_u16(vmovn_u32(f2), vmovn_u32(f3)))))
+
+/* -------------------------------------------------------------------------------------------------- */
+static uint32_t ts_header_decode_neon(const uint8_t *packets, uint32_t count, ts_header_batch_t *batch) {
+/* -------------------------------------------------------------------------------------------------- */
+/* decodes the headers 16 packets at a time with NEON                                                 */
+/* *packets: the first packet of the run                                                              */
+/*    count: the number of packets in the run                                                         */
+/*   *batch: filled in with the fields                                                                */
+/*   return: how many were decoded                                                                    */
+/* -------------------------------------------------------------------------------------------------- */
+    const uint32x4_t sync=vdupq_n_u32(TS_HEADER_SYNC);
+    const uint32x4_t mask_byte=vdupq_n_u32(0xff);
+    const uint32x4_t mask_pid_high=vdupq_n_u32(0x1f00);
+    const uint32x4_t mask_1=vdupq_n_u32(0x01);
+    const uint32x4_t mask_3=vdupq_n_u32(0x03);
+    const uint32x4_t mask_f=vdupq_n_u32(0x0f);
+    uint32x4_t w[4];
+    uint32x4_t f[4];
+    uint32_t i;
+    int j;
+
+    for (i=0; i+16<=count; i+=16) {
+        for (j=0; j<4; j++) w[j]=ts_header_neon_load(&packets[(i+4*j)*TS_HEADER_PACKET_SIZE]);
+
+        for (j=0; j<4; j++) f[j]=vshrq_n_u32(vceqq_u32(vandq_u32(w[j], mask_byte), sync), 31);
+        TS_HEADER_NEON_BYTES(&batch->sync[i], f[0], f[1], f[2], f[3]);
+        for (j=0; j<4; j++) f[j]=vandq_u32(vshrq_n_u32(w[j], 15), mask_1);
+        TS_HEADER_NEON_BYTES(&batch->tei[i], f[0], f[1], f[2], f[3]);
+        for (j=0; j<4; j++) f[j]=vandq_u32(vshrq_n_u32(w[j], 14), mask_1);
+        TS_HEADER_NEON_BYTES(&batch->pusi[i], f[0], f[1], f[2], f[3]);
+        for (j=0; j<4; j++) f[j]=vshrq_n_u32(w[j], 30);
+        TS_HEADER_NEON_BYTES(&batch->scrambling[i], f[0], f[1], f[2], f[3]);
+        for (j=0; j<4; j++) f[j]=vandq_u32(vshrq_n_u32(w[j], 28), mask_3);
+        TS_HEADER_NEON_BYTES(&batch->afc[i], f[0], f[1], f[2], f[3]);
+        for (j=0; j<4; j++) f[j]=vandq_u32(vshrq_n_u32(w[j], 24), mask_f);
+        TS_HEADER_NEON_BYTES(&batch->cc[i], f[0], f[1], f[2], f[3]);
+
+        for (j=0; j<4; j++) f[j]=vorrq_u32(vandq_u32(w[j], mask_pid_high), vandq_u32(vshrq_n_u32(w[j], 16), mask_byte));
+        vst1q_u16(&batch->pid[i], vcombine_u16(vmovn_u32(f[0]), vmovn_u32(f[1])));
+        vst1q_u16(&batch->pid[i+8], vcombine_u16(vmovn_u32(f[2]), vmovn_u32(f[3])));
+    }
+
+    return i;
+}
+#endif
+
+/* -------------------------------------------------------------------------------------------------- */
+void ts_header_init(void) {
+/* -------------------------------------------------------------------------------------------------- */
+/* picks the fastest kernel the CPU we are running on has                                             */
+/* -------------------------------------------------------------------------------------------------- */
+#ifdef TS_HEADER_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        ts_header_vector=ts_header_decode_avx2;
+        ts_header_vector_name="AVX2";
+    } else if (__builtin_cpu_supports("sse2")) {
+        ts_header_vector=ts_header_decode_sse2;
+        ts_header_vector_name="SSE2";
+    }
+#endif
+#ifdef TS_HEADER_NEON
+#if defined(__aarch64__)
+    ts_header_vector=ts_header_decode_neon;
+    ts_header_vector_name="NEON";
+#else
+    if (getauxval(AT_HWCAP) & HWCAP_NEON) {
+        ts_header_vector=ts_header_decode_neon;
+        ts_header_vector_name="NEON";
+    }
+#endif
+#endif
+
+    printf("Flow: TS header decode using %s\n", ts_header_vector_name);
+}
+
+/* -------------------------------------------------------------------------------------------------- */
+const char *ts_header_kernel(void) {
+/* -------------------------------------------------------------------------------------------------- */
+/* return: the name of the kernel ts_header_init() picked                                             */
+/* -------------------------------------------------------------------------------------------------- */
+    return ts_header_vector_name;
+}
+
+/* -------------------------------------------------------------------------------------------------- */
+void ts_header_decode(const uint8_t *packets, uint32_t count, ts_header_batch_t *batch) {
+/* -------------------------------------------------------------------------------------------------- */
+/* decodes the headers of a run of packets that follow on from each other in memory                   */
+/* *packets: the first packet of the run                                                              */
+/*    count: the number of packets, no more than TS_HEADER_BATCH                                      */
+/*   *batch: filled in with the fields of each packet                                                 */
+/* -------------------------------------------------------------------------------------------------- */
+    uint32_t done;
+
+    if (count>TS_HEADER_BATCH) count=TS_HEADER_BATCH;
+
+    done=ts_header_vector(packets, count, batch);
+    ts_header_decode_scalar(packets, done, count, batch);
+    batch->count=count;
+}
+
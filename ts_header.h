@@ -0,0 +1,54 @@
+/* -------------------------------------------------------------------------------------------------- */
+/* The LongMynd receiver: ts_header.h                                                                 */
+/* Copyright 2019 Heather Lomond                                                                      */
+/* -------------------------------------------------------------------------------------------------- */
+/*
+    This file is part of longmynd.
+
+    Longmynd is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Longmynd is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with longmynd.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef TS_HEADER_H
+#define TS_HEADER_H
+
+#include <stdint.h>
+
+#define TS_HEADER_PACKET_SIZE 188
+#define TS_HEADER_SYNC        0x47
+
+/* the most packets decoded in one go, a multiple of what each of the kernels does at once */
+#define TS_HEADER_BATCH       64
+
+/* adaptation_field_control */
+#define TS_HEADER_AFC_PAYLOAD    0x01
+#define TS_HEADER_AFC_ADAPTATION 0x02
+
+/* the headers of a run of packets, a field at a time */
+typedef struct {
+    uint32_t count;
+    uint8_t sync[TS_HEADER_BATCH];       /* 1 if the sync byte is right                                */
+    uint8_t tei[TS_HEADER_BATCH];        /* transport_error_indicator                                  */
+    uint8_t pusi[TS_HEADER_BATCH];       /* payload_unit_start_indicator                               */
+    uint8_t scrambling[TS_HEADER_BATCH]; /* transport_scrambling_control                               */
+    uint8_t afc[TS_HEADER_BATCH];        /* adaptation_field_control, TS_HEADER_AFC_*                  */
+    uint8_t cc[TS_HEADER_BATCH];         /* continuity_counter                                         */
+    uint16_t pid[TS_HEADER_BATCH];
+} ts_header_batch_t;
+
+void ts_header_init(void);
+const char *ts_header_kernel(void);
+void ts_header_decode(const uint8_t *, uint32_t, ts_header_batch_t *);
+
+#endif
+
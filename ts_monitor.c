@@ -0,0 +1,434 @@
+/* -------------------------------------------------------------------------------------------------- */
+/* The LongMynd receiver: ts_monitor.c                                                                */
+/*    - an implementation of the Serit NIM controlling software for the MiniTiouner Hardware          */
+/*    - keeps a table of what is on each PID, and the ETSI TR 101 290 checks that go with it          */
+/* Copyright 2019 Heather Lomond                                                                      */
+/* -------------------------------------------------------------------------------------------------- */
+/*
+    This file is part of longmynd.
+
+    Longmynd is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Longmynd is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with longmynd.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+/*
+    Every packet goes through ts_monitor_packet(), so it has to be cheap. The PID indexes straight
+    into a flat table of all 8192 of them, and the header fields come from the run ts_header has
+    already decoded. For most packets that is a count, a couple of stores and the continuity
+    counter check. Only a packet with an adaptation field, or one on the PAT or a PMT, is looked at
+    any further.
+
+    The rest is done by ts_monitor_tick(), a buffer at a time and while no TS is coming in at all:
+    the PAT, PMT and PID timeouts every TS_MONITOR_CHECK_MS, and the bit rates once a second. Times are in ms from monotonic_ms(), cut
+    down to 32 bits, as only the differences between them matter.
+
+    What is checked, with its TR 101 290 number:
+        1.3  PAT_error       no PAT section for 0.5s, another table on PID 0, or the PAT scrambled
+        1.4  CC_error        a packet missing or out of order, or sent more than twice
+        1.5  PMT_error       no section for 0.5s on a PMT PID the PAT lists, or the PMT scrambled
+        1.6  PID_error       no packets for TS_MONITOR_PID_TIMEOUT_MS on a PID a PMT lists
+        2.1  Transport_error a packet with transport_error_indicator set
+        2.3  PCR_error       PCRs more than 40ms apart (repetition) or jumping by more than 100ms,
+                             or backwards, without the discontinuity_indicator (discontinuity)
+    The PCR intervals are taken from the PCR values, rather than when they came in, as the USB
+    hands the TS over in bursts. The sync loss and sync byte errors (1.1 and 1.2) are counted by the
+    parser as it keeps the packet sync, and the CRC errors (2.2) by the PSI section assemblers.
+*/
+
+/* -------------------------------------------------------------------------------------------------- */
+/* ----------------- INCLUDES ----------------------------------------------------------------------- */
+/* -------------------------------------------------------------------------------------------------- */
+
+#include <string.h>
+#include "ts_monitor.h"
+
+/* -------------------------------------------------------------------------------------------------- */
+/* ----------------- DEFINES ------------------------------------------------------------------------ */
+/* -------------------------------------------------------------------------------------------------- */
+
+#define TS_MONITOR_PID_PAT  0x0000
+#define TS_MONITOR_PID_NULL 0x1FFF
+
+#define TS_MONITOR_TABLE_PAT      0x00
+#define TS_MONITOR_TABLE_PMT      0x02
+#define TS_MONITOR_TABLE_STUFFING 0xFF
+
+/* the flags at the start of the adaptation field */
+#define TS_MONITOR_AF_DISCONTINUITY 0x80
+#define TS_MONITOR_AF_PCR           0x10
+
+#define TS_MONITOR_CHECK_MS         100
+#define TS_MONITOR_SECOND_MS        1000
+#define TS_MONITOR_TABLE_TIMEOUT_MS 500
+/* TR 101 290 leaves how long a PID can go quiet for up to the user */
+#define TS_MONITOR_PID_TIMEOUT_MS   5000
+
+/* the PCR is a 33 bit base at 90kHz and a 9 bit extension that counts to 300 at 27MHz */
+#define TS_MONITOR_PCR_WRAP          ((uint64_t)300 << 33)
+#define TS_MONITOR_PCR_PER_MS        27000
+#define TS_MONITOR_PCR_REPETITION    (40*TS_MONITOR_PCR_PER_MS)
+#define TS_MONITOR_PCR_DISCONTINUITY (100*TS_MONITOR_PCR_PER_MS)
+
+/* -------------------------------------------------------------------------------------------------- */
+/* ----------------- ROUTINES ----------------------------------------------------------------------- */
+/* -------------------------------------------------------------------------------------------------- */
+
+/* -------------------------------------------------------------------------------------------------- */
+void ts_monitor_init(ts_monitor_t *monitor, uint32_t now) {
+/* -------------------------------------------------------------------------------------------------- */
+/* sets up an empty table, with only the PAT expected                                                 */
+/* *monitor: the monitor                                                                              */
+/*      now: the time, in ms                                                                          */
+/* -------------------------------------------------------------------------------------------------- */
+    memset(monitor, 0, sizeof(ts_monitor_t));
+    monitor->now=now;
+    monitor->check_ms=now;
+    monitor->second_ms=now;
+    monitor->pids[TS_MONITOR_PID_PAT].kind=TS_MONITOR_KIND_PAT;
+    monitor->pids[TS_MONITOR_PID_PAT].section_ms=now;
+}
+
+/* -------------------------------------------------------------------------------------------------- */
+void ts_monitor_reset(ts_monitor_t *monitor) {
+/* -------------------------------------------------------------------------------------------------- */
+/* forgets the last continuity counter and PCR on every PID, for when the TS does not follow on from  */
+/* what came before                                                                                   */
+/* *monitor: the monitor                                                                              */
+/* -------------------------------------------------------------------------------------------------- */
+    uint32_t i;
+
+    for (i=0; i<TS_MONITOR_PIDS; i++) {
+        monitor->pids[i].cc_valid=false;
+        monitor->pids[i].cc_repeated=false;
+        monitor->pids[i].pcr_valid=false;
+    }
+}
+
+/* -------------------------------------------------------------------------------------------------- */
+static void ts_monitor_refer_pid(ts_monitor_t *monitor, uint32_t pid, uint8_t kind) {
+/* -------------------------------------------------------------------------------------------------- */
+/* expects a PID from now on. One that was not expected before gets the full timeout before it is    */
+/* missed                                                                                             */
+/* *monitor: the monitor                                                                              */
+/*      pid: the PID                                                                                  */
+/*     kind: what the PAT or PMT says it is, TS_MONITOR_KIND_PMT or TS_MONITOR_KIND_ES                */
+/* -------------------------------------------------------------------------------------------------- */
+    ts_monitor_pid_t *entry=&monitor->pids[pid];
+
+    if ((pid==TS_MONITOR_PID_PAT) || (pid>=TS_MONITOR_PID_NULL)) return;
+
+    if ((entry->kind==0) && (entry->listed==0)) {
+        if (monitor->num_referred==TS_MONITOR_MAX_REFERRED) return;
+        monitor->referred[monitor->num_referred++]=(uint16_t)pid;
+    }
+    if ((entry->kind & kind)==0) {
+        entry->section_ms=monitor->now;
+        entry->last_ms=monitor->now;
+    }
+    entry->listed|=kind;
+}
+
+/* -------------------------------------------------------------------------------------------------- */
+void ts_monitor_refer(ts_monitor_t *monitor, const longmynd_service_table_t *table) {
+/* -------------------------------------------------------------------------------------------------- */
+/* takes the PMT PIDs the PAT lists, and the PCR and ES PIDs the PMTs list, as the ones to check for  */
+/* from now on. Called each time the service table changes                                           */
+/* *monitor: the monitor                                                                              */
+/*   *table: the service table                                                                        */
+/* -------------------------------------------------------------------------------------------------- */
+    const longmynd_service_t *service;
+    ts_monitor_pid_t *entry;
+    uint32_t num_referred;
+    uint32_t i;
+    uint32_t j;
+
+    for (i=0; i<monitor->num_referred; i++) monitor->pids[monitor->referred[i]].listed=0;
+
+    for (i=0; i<table->num_services; i++) {
+        service=&table->services[i];
+        if (service->pmt_pid==0) continue;
+        ts_monitor_refer_pid(monitor, service->pmt_pid, TS_MONITOR_KIND_PMT);
+        if (service->pcr_pid!=0) ts_monitor_refer_pid(monitor, service->pcr_pid, TS_MONITOR_KIND_ES);
+        for (j=service->first_stream; j<service->first_stream+service->num_streams; j++) {
+            ts_monitor_refer_pid(monitor, table->streams[j].pid, TS_MONITOR_KIND_ES);
+        }
+    }
+
+    /* what is no longer listed is no longer expected */
+    num_referred=0;
+    for (i=0; i<monitor->num_referred; i++) {
+        entry=&monitor->pids[monitor->referred[i]];
+        entry->kind=entry->listed;
+        if (entry->kind!=0) monitor->referred[num_referred++]=monitor->referred[i];
+    }
+    monitor->num_referred=num_referred;
+}
+
+/* -------------------------------------------------------------------------------------------------- */
+static void ts_monitor_pcr(ts_monitor_t *monitor, ts_monitor_pid_t *entry, const uint8_t *packet,
+                           bool discontinuity) {
+/* -------------------------------------------------------------------------------------------------- */
+/* checks how far a PCR is on from the last one on its PID                                            */
+/*      *monitor: the monitor                                                                         */
+/*        *entry: the PID                                                                             */
+/*       *packet: the packet, with a PCR in its adaptation field                                      */
+/* discontinuity: the adaptation field's discontinuity_indicator                                     */
+/* -------------------------------------------------------------------------------------------------- */
+    uint64_t pcr;
+    uint64_t delta;
+
+    pcr = (((uint64_t)packet[6] << 25) | ((uint64_t)packet[7] << 17) | ((uint64_t)packet[8] << 9)
+           | ((uint64_t)packet[9] << 1) | (packet[10] >> 7)) * 300
+          + ((((uint64_t)packet[10] & 0x01) << 8) | packet[11]);
+
+    if (entry->pcr_valid && !discontinuity) {
+        /* a PCR that has gone backwards comes out as a very long way forwards */
+        delta=(pcr+TS_MONITOR_PCR_WRAP-entry->pcr) % TS_MONITOR_PCR_WRAP;
+        if (delta>TS_MONITOR_PCR_DISCONTINUITY) {
+            monitor->pcr_discontinuity_errors++;
+        } else if (delta>TS_MONITOR_PCR_REPETITION) {
+            monitor->pcr_repetition_errors++;
+        }
+    }
+
+    entry->pcr=pcr;
+    entry->pcr_valid=true;
+    entry->pcr_seen=true;
+}
+
+/* -------------------------------------------------------------------------------------------------- */
+static void ts_monitor_table(ts_monitor_t *monitor, ts_monitor_pid_t *entry, uint8_t afc, bool pusi,
+                             const uint8_t *packet) {
+/* -------------------------------------------------------------------------------------------------- */
+/* looks at a packet on the PAT or a PMT for the start of a section                                   */
+/* *monitor: the monitor                                                                              */
+/*   *entry: the PID                                                                                  */
+/*      afc: the packet's adaptation_field_control                                                    */
+/*     pusi: the packet's payload_unit_start_indicator                                                */
+/*  *packet: the packet                                                                               */
+/* -------------------------------------------------------------------------------------------------- */
+    uint32_t posn=4;
+    uint8_t table_id;
+    bool pat=(entry->kind & TS_MONITOR_KIND_PAT)!=0;
+
+    /* the tables are never scrambled */
+    if (entry->scrambling!=0) {
+        if (pat) {
+            monitor->pat_errors++;
+        } else {
+            monitor->pmt_errors++;
+        }
+        return;
+    }
+
+    if (!pusi) return;
+
+    /* the pointer field says where the first section to start in this packet is */
+    if (afc & TS_HEADER_AFC_ADAPTATION) posn+=1+packet[4];
+    if (posn>=TS_HEADER_PACKET_SIZE) return;
+    posn+=1+packet[posn];
+    if (posn>=TS_HEADER_PACKET_SIZE) return;
+    table_id=packet[posn];
+
+    if (pat) {
+        if (table_id==TS_MONITOR_TABLE_PAT) {
+            entry->section_ms=monitor->now;
+        } else if (table_id!=TS_MONITOR_TABLE_STUFFING) {
+            monitor->pat_errors++;
+        }
+    } else if (table_id==TS_MONITOR_TABLE_PMT) {
+        entry->section_ms=monitor->now;
+    }
+}
+
+/* -------------------------------------------------------------------------------------------------- */
+void ts_monitor_packet(ts_monitor_t *monitor, const ts_header_batch_t *headers, uint32_t index,
+                       const uint8_t *packet) {
+/* -------------------------------------------------------------------------------------------------- */
+/* takes note of a packet on its PID, and checks it follows on from the last                          */
+/* *monitor: the monitor                                                                              */
+/* *headers: the run of headers the packet is in                                                      */
+/*    index: which of them it is                                                                      */
+/*  *packet: the packet                                                                               */
+/* -------------------------------------------------------------------------------------------------- */
+    uint32_t pid=headers->pid[index];
+    ts_monitor_pid_t *entry=&monitor->pids[pid];
+    uint8_t afc=headers->afc[index];
+    uint8_t cc=headers->cc[index];
+    bool discontinuity=false;
+
+    entry->packets++;
+    entry->last_ms=monitor->now;
+    entry->scrambling=headers->scrambling[index];
+
+    /* nothing else in the packet can be trusted, not even that it is on this PID, so the next one */
+    /* is not held against the continuity counter of this one                                     */
+    if (headers->tei[index]) {
+        entry->transport_errors++;
+        monitor->transport_errors++;
+        entry->cc_valid=false;
+        return;
+    }
+
+    /* an adaptation field with anything in it has its flags first */
+    if ((afc & TS_HEADER_AFC_ADAPTATION) && (packet[4]>0) && (packet[4]<=183)) {
+        discontinuity=(packet[5] & TS_MONITOR_AF_DISCONTINUITY)!=0;
+        if ((packet[5] & TS_MONITOR_AF_PCR) && (packet[4]>=7)) ts_monitor_pcr(monitor, entry, packet, discontinuity);
+    }
+
+    /* the continuity counter only goes up with a payload, and means nothing on the null PID */
+    if (((afc & TS_HEADER_AFC_PAYLOAD)==0) || (pid==TS_MONITOR_PID_NULL)) return;
+
+    if (entry->cc_valid && !discontinuity) {
+        if (cc==entry->cc) {
+            /* a packet can be sent twice, but not three times */
+            if (entry->cc_repeated) {
+                entry->cc_errors++;
+                monitor->cc_errors++;
+            }
+            entry->cc_repeated=true;
+        } else {
+            if (cc!=((entry->cc+1) & 0x0F)) {
+                entry->cc_errors++;
+                monitor->cc_errors++;
+            }
+            entry->cc_repeated=false;
+        }
+    } else {
+        entry->cc_repeated=false;
+    }
+    entry->cc=cc;
+    entry->cc_valid=true;
+
+    if (entry->kind & (TS_MONITOR_KIND_PAT | TS_MONITOR_KIND_PMT)) {
+        ts_monitor_table(monitor, entry, afc, headers->pusi[index]!=0, packet);
+    }
+}
+
+/* -------------------------------------------------------------------------------------------------- */
+static void ts_monitor_timeouts(ts_monitor_t *monitor) {
+/* -------------------------------------------------------------------------------------------------- */
+/* counts an error for each of the PAT, the PMTs and the PIDs they list that has not turned up in     */
+/* time, and gives it the same time again before it is counted again                                  */
+/* *monitor: the monitor                                                                              */
+/* -------------------------------------------------------------------------------------------------- */
+    ts_monitor_pid_t *entry=&monitor->pids[TS_MONITOR_PID_PAT];
+    uint32_t now=monitor->now;
+    uint32_t i;
+
+    if (now-entry->section_ms>TS_MONITOR_TABLE_TIMEOUT_MS) {
+        monitor->pat_errors++;
+        entry->section_ms=now;
+    }
+
+    for (i=0; i<monitor->num_referred; i++) {
+        entry=&monitor->pids[monitor->referred[i]];
+        if ((entry->kind & TS_MONITOR_KIND_PMT) && (now-entry->section_ms>TS_MONITOR_TABLE_TIMEOUT_MS)) {
+            monitor->pmt_errors++;
+            entry->section_ms=now;
+        }
+        if ((entry->kind & TS_MONITOR_KIND_ES) && (now-entry->last_ms>TS_MONITOR_PID_TIMEOUT_MS)) {
+            monitor->pid_errors++;
+            entry->last_ms=now;
+        }
+    }
+}
+
+/* -------------------------------------------------------------------------------------------------- */
+static void ts_monitor_second(ts_monitor_t *monitor) {
+/* -------------------------------------------------------------------------------------------------- */
+/* works out the bit rate of each PID over the second just gone, and lists those that had packets    */
+/* *monitor: the monitor                                                                              */
+/* -------------------------------------------------------------------------------------------------- */
+    ts_monitor_pid_t *entry;
+    longmynd_pid_t *active;
+    uint32_t elapsed=monitor->now-monitor->second_ms;
+    uint32_t packets;
+    uint32_t i;
+
+    monitor->second_ms=monitor->now;
+    monitor->num_active=0;
+
+    for (i=0; i<TS_MONITOR_PIDS; i++) {
+        entry=&monitor->pids[i];
+        packets=entry->packets-entry->packets_second;
+        if ((packets==0) && (entry->rate==0)) continue;
+
+        entry->packets_second=entry->packets;
+        entry->rate=(uint32_t)(((uint64_t)packets*TS_HEADER_PACKET_SIZE*8*1000)/elapsed);
+
+        if ((packets>0) && (monitor->num_active<TS_MAX_STATUS_PIDS)) {
+            active=&monitor->active[monitor->num_active++];
+            active->pid=(uint16_t)i;
+            active->rate=entry->rate/1000;
+            active->cc_errors=entry->cc_errors;
+            active->transport_errors=entry->transport_errors;
+            active->flags=(entry->scrambling!=0 ? TS_PID_SCRAMBLED : 0) | (entry->pcr_seen ? TS_PID_PCR : 0);
+        }
+        entry->pcr_seen=false;
+    }
+
+    monitor->active_changed=true;
+}
+
+/* -------------------------------------------------------------------------------------------------- */
+void ts_monitor_tick(ts_monitor_t *monitor, uint32_t now, bool locked) {
+/* -------------------------------------------------------------------------------------------------- */
+/* moves the time on, for each buffer before its packets, and does what is due                        */
+/* *monitor: the monitor                                                                              */
+/*      now: the time, in ms                                                                          */
+/*   locked: true if the parser has the packet sync, or the TS has stopped and everything is missed.  */
+/*           Nothing is missed while it is hunting, and once it has the sync everything gets the full */
+/*           timeout again                                                                            */
+/* -------------------------------------------------------------------------------------------------- */
+    uint32_t i;
+
+    monitor->now=now;
+
+    if (!locked) {
+        monitor->pids[TS_MONITOR_PID_PAT].section_ms=now;
+        for (i=0; i<monitor->num_referred; i++) {
+            monitor->pids[monitor->referred[i]].section_ms=now;
+            monitor->pids[monitor->referred[i]].last_ms=now;
+        }
+        monitor->check_ms=now;
+    } else if (now-monitor->check_ms>=TS_MONITOR_CHECK_MS) {
+        monitor->check_ms=now;
+        ts_monitor_timeouts(monitor);
+    }
+
+    if (now-monitor->second_ms>=TS_MONITOR_SECOND_MS) ts_monitor_second(monitor);
+}
+
+/* -------------------------------------------------------------------------------------------------- */
+void ts_monitor_status(ts_monitor_t *monitor, longmynd_status_t *status) {
+/* -------------------------------------------------------------------------------------------------- */
+/* puts the error counts in the status, and the PIDs seen over the last second when they have been    */
+/* worked out again. The status mutex must be held                                                    */
+/* *monitor: the monitor                                                                              */
+/*  *status: the status                                                                               */
+/* -------------------------------------------------------------------------------------------------- */
+    status->ts_pat_errors=monitor->pat_errors;
+    status->ts_cc_errors=monitor->cc_errors;
+    status->ts_pmt_errors=monitor->pmt_errors;
+    status->ts_pid_errors=monitor->pid_errors;
+    status->ts_transport_errors=monitor->transport_errors;
+    status->ts_pcr_repetition_errors=monitor->pcr_repetition_errors;
+    status->ts_pcr_discontinuity_errors=monitor->pcr_discontinuity_errors;
+
+    if (monitor->active_changed) {
+        memcpy(status->ts_pids, monitor->active, monitor->num_active*sizeof(longmynd_pid_t));
+        status->ts_num_pids=monitor->num_active;
+        monitor->active_changed=false;
+    }
+}
@@ -0,0 +1,90 @@
+/* -------------------------------------------------------------------------------------------------- */
+/* The LongMynd receiver: ts_monitor.h                                                                */
+/* Copyright 2019 Heather Lomond                                                                      */
+/* -------------------------------------------------------------------------------------------------- */
+/*
+    This file is part of longmynd.
+
+    Longmynd is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Longmynd is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with longmynd.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef TS_MONITOR_H
+#define TS_MONITOR_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "main.h"
+#include "ts_header.h"
+
+#define TS_MONITOR_PIDS 8192
+
+/* the most PIDs the PAT and PMTs can point at that are checked for turning up */
+#define TS_MONITOR_MAX_REFERRED 256
+
+/* what a PID is to the PAT and PMTs, in ts_monitor_pid_t.kind */
+#define TS_MONITOR_KIND_PAT 0x01
+#define TS_MONITOR_KIND_PMT 0x02
+#define TS_MONITOR_KIND_ES  0x04
+
+/* everything kept on one PID, looked at for every packet on it */
+typedef struct {
+    uint32_t packets;
+    uint32_t packets_second;                            /* packets at the start of this second        */
+    uint32_t rate;                                      /* bit/s over the last second                 */
+    uint32_t cc_errors;
+    uint32_t transport_errors;                          /* packets with transport_error_indicator set */
+    uint32_t last_ms;                                   /* when a packet was last seen on it          */
+    uint32_t section_ms;                                /* when a PAT or PMT section last started     */
+    uint64_t pcr;                                       /* the last PCR, in 27MHz ticks               */
+    uint8_t cc;                                         /* of the last packet with a payload          */
+    bool cc_valid;
+    bool cc_repeated;                                   /* the last packet was a repeat               */
+    bool pcr_valid;
+    bool pcr_seen;                                      /* a PCR came on it this second               */
+    uint8_t scrambling;                                 /* of the last packet                         */
+    uint8_t kind;                                       /* TS_MONITOR_KIND_*                          */
+    uint8_t listed;                                     /* the kind being worked out, by refer        */
+} ts_monitor_pid_t;
+
+/* the TR 101 290 priority 1 and 2 checks on a TS, driven from its per PID table */
+typedef struct {
+    ts_monitor_pid_t pids[TS_MONITOR_PIDS];
+    uint32_t now;                                       /* ms, of the buffer being worked through     */
+    uint32_t check_ms;                                  /* when the timeouts were last looked at      */
+    uint32_t second_ms;                                 /* when the current second started            */
+    uint16_t referred[TS_MONITOR_MAX_REFERRED];         /* the PMT and ES PIDs, for the timeouts      */
+    uint32_t num_referred;
+    /* the errors so far, for the whole TS */
+    uint32_t pat_errors;
+    uint32_t cc_errors;
+    uint32_t pmt_errors;
+    uint32_t pid_errors;
+    uint32_t transport_errors;
+    uint32_t pcr_repetition_errors;
+    uint32_t pcr_discontinuity_errors;
+    /* the PIDs seen over the last second, for the status */
+    longmynd_pid_t active[TS_MAX_STATUS_PIDS];
+    uint32_t num_active;
+    bool active_changed;
+} ts_monitor_t;
+
+void ts_monitor_init(ts_monitor_t *, uint32_t);
+void ts_monitor_reset(ts_monitor_t *);
+void ts_monitor_refer(ts_monitor_t *, const longmynd_service_table_t *);
+void ts_monitor_packet(ts_monitor_t *, const ts_header_batch_t *, uint32_t, const uint8_t *);
+void ts_monitor_tick(ts_monitor_t *, uint32_t, bool);
+void ts_monitor_status(ts_monitor_t *, longmynd_status_t *);
+
+#endif
+
@@ -0,0 +1,315 @@
+/* -------------------------------------------------------------------------------------------------- */
+/* The LongMynd receiver: ts_ring.c                                                                   */
+/*    - an implementation of the Serit NIM controlling software for the MiniTiouner Hardware          */
+/*    - a single producer, single consumer ring of TS buffers between the TS reader and the parser    */
+/* Copyright 2019 Heather Lomond                                                                      */
+/* -------------------------------------------------------------------------------------------------- */
+/*
+    This file is part of longmynd.
+
+    Longmynd is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Longmynd is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with longmynd.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+/*
+    The producer (loop_ts) fills slots in place, straight from the USB, and never waits for the
+    consumer (loop_ts_parse). It can instead lend the consumer a buffer of its own, the USB transfer
+    buffer itself, which is given back through give_back by whichever side is done with it last: the
+    consumer once it has parsed it, or the producer when it drops it unread. The consumer works on the slot at head in place and moves head on when
+    it is done. Neither side takes a lock.
+
+    When the ring is full the producer either skips (the new buffer is not put in the ring) or drops
+    the oldest unread buffer by moving head on itself. To stop it dropping and then overwriting the
+    slot the consumer is part way through, the consumer publishes the slot it is working on in busy,
+    then checks head has not moved. The producer moves head, then checks busy. As all four of these
+    are sequentially consistent at least one side will see the other, so either the consumer backs
+    off or the producer skips this time round.
+*/
+
+/* -------------------------------------------------------------------------------------------------- */
+/* ----------------- INCLUDES ----------------------------------------------------------------------- */
+/* -------------------------------------------------------------------------------------------------- */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include "errors.h"
+#include "ts_ring.h"
+
+/* -------------------------------------------------------------------------------------------------- */
+/* ----------------- DEFINES ------------------------------------------------------------------------ */
+/* -------------------------------------------------------------------------------------------------- */
+
+#define TS_RING_NOT_BUSY  0
+#define TS_RING_NO_SLOT   0xffffffff
+
+/* -------------------------------------------------------------------------------------------------- */
+/* ----------------- ROUTINES ----------------------------------------------------------------------- */
+/* -------------------------------------------------------------------------------------------------- */
+
+/* -------------------------------------------------------------------------------------------------- */
+static void ts_ring_give_back(ts_ring_t *ring, uint32_t slot) {
+/* -------------------------------------------------------------------------------------------------- */
+/* gives back the buffer lent to a slot, if there is one. Only ever done once for each buffer lent    */
+/* ring: the ring the slot is in                                                                      */
+/* slot: the slot                                                                                     */
+/* -------------------------------------------------------------------------------------------------- */
+    uint8_t *lent;
+
+    lent=atomic_exchange(&ring->slots[slot].lent, NULL);
+    if ((lent!=NULL) && (ring->give_back!=NULL)) ring->give_back(lent);
+}
+
+/* -------------------------------------------------------------------------------------------------- */
+static void ts_ring_free_slots(ts_ring_t *ring) {
+/* -------------------------------------------------------------------------------------------------- */
+/* frees whatever slots the ring has managed to allocate                                              */
+/* ring: the ring to tidy up                                                                          */
+/* -------------------------------------------------------------------------------------------------- */
+    uint32_t i;
+
+    if (ring->slots!=NULL) {
+        for (i=0; i<ring->num_slots; i++) free(ring->slots[i].buffer);
+        free(ring->slots);
+    }
+    ring->slots=NULL;
+    ring->num_slots=0;
+}
+
+/* -------------------------------------------------------------------------------------------------- */
+uint8_t ts_ring_init(ts_ring_t *ring, uint8_t num_slots, uint32_t slot_size, uint8_t policy,
+                     void (*give_back)(uint8_t *)) {
+/* -------------------------------------------------------------------------------------------------- */
+/* allocates the slots for a ring and sets it up empty                                                */
+/*      ring: the ring to set up                                                                      */
+/* num_slots: how many buffers the ring holds                                                         */
+/* slot_size: the size of each buffer                                                                 */
+/*    policy: TS_RING_POLICY_SKIP or TS_RING_POLICY_DROP_OLDEST                                       */
+/* give_back: called with each buffer the producer lent once it is finished with, or NULL             */
+/*    return: error code                                                                              */
+/* -------------------------------------------------------------------------------------------------- */
+    uint8_t err=ERROR_NONE;
+    uint32_t i;
+
+    printf("Flow: TS ring init, %i slots\n",num_slots);
+
+    if (num_slots==0) num_slots=TS_RING_DEFAULT_SLOTS;
+    if (num_slots>TS_RING_MAX_SLOTS) num_slots=TS_RING_MAX_SLOTS;
+    /* a power of 2 so that the counters still map onto the right slots when they wrap */
+    while ((num_slots & (num_slots-1)) != 0) num_slots++;
+
+    ring->initialised=false;
+    ring->slots=NULL;
+    ring->num_slots=0;
+    ring->slot_size=slot_size;
+    ring->policy=policy;
+    ring->give_back=give_back;
+    atomic_init(&ring->head, 0);
+    atomic_init(&ring->tail, 0);
+    atomic_init(&ring->busy, TS_RING_NOT_BUSY);
+    atomic_init(&ring->overruns, 0);
+    ring->writing=TS_RING_NO_SLOT;
+    ring->reading=TS_RING_NO_SLOT;
+    ring->mask=num_slots-1;
+
+    if (0!=posix_memalign((void **)&ring->slots, TS_RING_CACHE_LINE, num_slots*sizeof(ts_ring_slot_t))) {
+        ring->slots=NULL;
+        err=ERROR_TS_BUFFER_MALLOC;
+    }
+
+    for (i=0; (err==ERROR_NONE) && (i<num_slots); i++) {
+        if (0!=posix_memalign((void **)&ring->slots[i].buffer, TS_RING_CACHE_LINE, slot_size)) {
+            err=ERROR_TS_BUFFER_MALLOC;
+        } else {
+            ring->slots[i].data=ring->slots[i].buffer;
+            ring->slots[i].length=0;
+            atomic_init(&ring->slots[i].lent, NULL);
+            ring->num_slots++;
+        }
+    }
+
+    if ((err==ERROR_NONE) && (0!=sem_init(&ring->doorbell, 0, 0))) err=ERROR_TS_BUFFER_MALLOC;
+
+    if (err==ERROR_NONE) {
+        ring->initialised=true;
+    } else {
+        printf("ERROR: TS ring init\n");
+        ts_ring_free_slots(ring);
+    }
+
+    return err;
+}
+
+/* -------------------------------------------------------------------------------------------------- */
+void ts_ring_free(ts_ring_t *ring) {
+/* -------------------------------------------------------------------------------------------------- */
+/* frees up a ring, giving back anything still lent. Neither side must be using it by now             */
+/* ring: the ring to free                                                                             */
+/* -------------------------------------------------------------------------------------------------- */
+    uint32_t i;
+
+    if (ring->initialised) {
+        for (i=0; i<ring->num_slots; i++) ts_ring_give_back(ring, i);
+        ts_ring_free_slots(ring);
+        ring->initialised=false;
+        sem_destroy(&ring->doorbell);
+    }
+}
+
+/* -------------------------------------------------------------------------------------------------- */
+uint8_t *ts_ring_write_acquire(ts_ring_t *ring) {
+/* -------------------------------------------------------------------------------------------------- */
+/* producer: gets the next free slot to fill. Never waits for the consumer                            */
+/*   ring: the ring to write to                                                                       */
+/* return: the buffer to fill, or NULL if there is no room and the caller must use its own buffer     */
+/* -------------------------------------------------------------------------------------------------- */
+    uint32_t t;
+    uint32_t h;
+
+    ring->writing=TS_RING_NO_SLOT;
+
+    t=atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    h=atomic_load(&ring->head);
+
+    if (t-h >= ring->num_slots) {
+        /* the consumer has fallen behind */
+        atomic_fetch_add(&ring->overruns, 1);
+        if (ring->policy!=TS_RING_POLICY_DROP_OLDEST) return NULL;
+        /* if this fails the consumer has just moved head on itself, so there is room anyway */
+        atomic_compare_exchange_strong(&ring->head, &h, h+1);
+    }
+
+    /* we cannot have the slot while the consumer is still on it from last time round */
+    if (atomic_load(&ring->busy)==(t & ring->mask)+1) {
+        atomic_fetch_add(&ring->overruns, 1);
+        return NULL;
+    }
+
+    /* a buffer lent to a slot that was dropped unread is ours to give back */
+    ts_ring_give_back(ring, t & ring->mask);
+
+    ring->writing=t;
+
+    return ring->slots[t & ring->mask].buffer;
+}
+
+/* -------------------------------------------------------------------------------------------------- */
+void ts_ring_write_publish(ts_ring_t *ring, uint8_t *data, uint32_t length, uint32_t tag) {
+/* -------------------------------------------------------------------------------------------------- */
+/* producer: hands the slot from ts_ring_write_acquire() over to the consumer                         */
+/*   ring: the ring being written to                                                                  */
+/*  *data: the buffer from ts_ring_write_acquire() if it was filled, otherwise one we lend the ring   */
+/*         until it comes back through give_back                                                      */
+/* length: the number of bytes in the buffer                                                          */
+/*    tag: anything the consumer needs to know about the data, it comes out in the slot               */
+/* -------------------------------------------------------------------------------------------------- */
+    ts_ring_slot_t *slot;
+
+    if (ring->writing!=TS_RING_NO_SLOT) {
+        slot=&ring->slots[ring->writing & ring->mask];
+        slot->data=data;
+        if (data!=slot->buffer) atomic_store(&slot->lent, data);
+        slot->length=length;
+        slot->tag=tag;
+        atomic_store(&ring->tail, ring->writing+1);
+        ring->writing=TS_RING_NO_SLOT;
+        sem_post(&ring->doorbell);
+    }
+}
+
+/* -------------------------------------------------------------------------------------------------- */
+ts_ring_slot_t *ts_ring_read_acquire(ts_ring_t *ring) {
+/* -------------------------------------------------------------------------------------------------- */
+/* consumer: gets the oldest filled slot, which stays ours until ts_ring_read_release()               */
+/*   ring: the ring to read from                                                                      */
+/* return: the slot, or NULL if the ring is empty                                                     */
+/* -------------------------------------------------------------------------------------------------- */
+    uint32_t h;
+
+    do {
+        h=atomic_load(&ring->head);
+        if (h==atomic_load(&ring->tail)) return NULL;
+        atomic_store(&ring->busy, (h & ring->mask)+1);
+        /* if head has moved the producer dropped this one before it saw we had it */
+    } while (h!=atomic_load(&ring->head));
+
+    ring->reading=h;
+
+    return &ring->slots[h & ring->mask];
+}
+
+/* -------------------------------------------------------------------------------------------------- */
+void ts_ring_read_release(ts_ring_t *ring) {
+/* -------------------------------------------------------------------------------------------------- */
+/* consumer: hands the slot from ts_ring_read_acquire() back to the producer                          */
+/* ring: the ring being read from                                                                     */
+/* -------------------------------------------------------------------------------------------------- */
+    uint32_t h=ring->reading;
+
+    if (h!=TS_RING_NO_SLOT) {
+        ring->reading=TS_RING_NO_SLOT;
+        /* before busy is cleared, as from then on the producer may give it back itself */
+        ts_ring_give_back(ring, h & ring->mask);
+        atomic_store(&ring->busy, TS_RING_NOT_BUSY);
+        /* fails harmlessly if the producer has already dropped it */
+        atomic_compare_exchange_strong(&ring->head, &h, h+1);
+    }
+}
+
+/* -------------------------------------------------------------------------------------------------- */
+bool ts_ring_read_wait(ts_ring_t *ring, uint32_t timeout_ms) {
+/* -------------------------------------------------------------------------------------------------- */
+/* consumer: sleeps until the producer publishes something or we time out. There is a doorbell token  */
+/* for each buffer published, but not every one is waited for and dropped buffers leave theirs        */
+/* behind, so a token on its own does not mean there is anything there                                */
+/*       ring: the ring being read from                                                               */
+/* timeout_ms: the longest to wait                                                                    */
+/*     return: true if there is something to read, false only once the whole time has gone by         */
+/* -------------------------------------------------------------------------------------------------- */
+    struct timespec ts;
+    bool rung=false;
+
+    /* the monotonic clock, so that the wall clock being set cannot change how long we wait */
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    ts.tv_sec+=timeout_ms/1000;
+    ts.tv_nsec+=(timeout_ms%1000)*1000000;
+    if (ts.tv_nsec>=1000000000) {
+        ts.tv_sec++;
+        ts.tv_nsec-=1000000000;
+    }
+
+    while (atomic_load(&ring->head)==atomic_load(&ring->tail)) {
+        if (sem_clockwait(&ring->doorbell, CLOCK_MONOTONIC, &ts)==0) {
+            rung=true;
+        } else if (errno!=EINTR) {
+            return atomic_load(&ring->head)!=atomic_load(&ring->tail);
+        }
+    }
+
+    /* take this buffer's token if we have not already, so that they do not pile up while we are behind */
+    if (!rung) sem_trywait(&ring->doorbell);
+
+    return true;
+}
+
+/* -------------------------------------------------------------------------------------------------- */
+uint32_t ts_ring_overruns(ts_ring_t *ring) {
+/* -------------------------------------------------------------------------------------------------- */
+/*   ring: the ring to look at                                                                        */
+/* return: the number of buffers the consumer has missed since the ring was set up                    */
+/* -------------------------------------------------------------------------------------------------- */
+    return atomic_load(&ring->overruns);
+}
+
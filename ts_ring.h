@@ -0,0 +1,76 @@
+/* -------------------------------------------------------------------------------------------------- */
+/* The LongMynd receiver: ts_ring.h                                                                   */
+/* Copyright 2019 Heather Lomond                                                                      */
+/* -------------------------------------------------------------------------------------------------- */
+/*
+    This file is part of longmynd.
+
+    Longmynd is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Longmynd is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with longmynd.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef TS_RING_H
+#define TS_RING_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <semaphore.h>
+
+#define TS_RING_CACHE_LINE 64
+
+#define TS_RING_MAX_SLOTS 64
+#define TS_RING_DEFAULT_SLOTS 4
+
+/* what the producer does when the consumer has fallen behind and the ring is full */
+#define TS_RING_POLICY_SKIP        0 /* the new buffer does not go in the ring */
+#define TS_RING_POLICY_DROP_OLDEST 1 /* the oldest unread buffer is thrown away to make room */
+
+typedef struct {
+    uint8_t *data;                                     /* the slot's own buffer or one lent by the producer */
+    uint32_t length;
+    uint32_t tag;                                      /* the producer's, passed over with the data        */
+    uint8_t *buffer;                                   /* the slot's own buffer                            */
+    _Atomic(uint8_t *) lent;                           /* the lent buffer until it is given back, or NULL  */
+} __attribute__((aligned(TS_RING_CACHE_LINE))) ts_ring_slot_t;
+
+typedef struct {
+    ts_ring_slot_t *slots;
+    uint32_t num_slots;
+    uint32_t slot_size;
+    uint8_t policy;
+    void (*give_back)(uint8_t *);                      /* hands a lent buffer back to the producer's owner */
+    uint32_t mask;                                     /* num_slots is a power of 2, this is num_slots-1   */
+    /* head and tail are free running counters, the slot is the counter masked with mask. Each of the  */
+    /* shared values lives on its own cache line as they are written from different threads            */
+    _Alignas(TS_RING_CACHE_LINE) atomic_uint head;     /* next slot for the consumer, both threads move it */
+    _Alignas(TS_RING_CACHE_LINE) atomic_uint tail;     /* next slot for the producer, only it moves it     */
+    _Alignas(TS_RING_CACHE_LINE) atomic_uint busy;     /* the slot the consumer is working on +1, or 0     */
+    _Alignas(TS_RING_CACHE_LINE) atomic_uint overruns; /* buffers the consumer never got to see            */
+    uint32_t writing;                                  /* producer only: the counter being filled          */
+    _Alignas(TS_RING_CACHE_LINE) uint32_t reading;     /* consumer only: the counter being worked on       */
+    sem_t doorbell;
+    bool initialised;
+} ts_ring_t;
+
+uint8_t ts_ring_init(ts_ring_t *, uint8_t, uint32_t, uint8_t, void (*)(uint8_t *));
+void ts_ring_free(ts_ring_t *);
+uint8_t *ts_ring_write_acquire(ts_ring_t *);
+void ts_ring_write_publish(ts_ring_t *, uint8_t *, uint32_t, uint32_t);
+ts_ring_slot_t *ts_ring_read_acquire(ts_ring_t *);
+void ts_ring_read_release(ts_ring_t *);
+bool ts_ring_read_wait(ts_ring_t *, uint32_t);
+uint32_t ts_ring_overruns(ts_ring_t *);
+
+#endif
+
@@ -0,0 +1,814 @@
+/* -------------------------------------------------------------------------------------------------- */
+/* The LongMynd receiver: ts_sink.c                                                                   */
+/*    - an implementation of the Serit NIM controlling software for the MiniTiouner Hardware          */
+/*    - fans the TS out to any number of outputs, each with its own writer thread                     */
+/* Copyright 2019 Heather Lomond                                                                      */
+/* -------------------------------------------------------------------------------------------------- */
+/*
+    This file is part of longmynd.
+
+    Longmynd is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Longmynd is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with longmynd.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+/*
+    loop_ts copies each transfer's TS once into a buffer from the pool and queues the same buffer on
+    every sink, with a reference for each. Each sink's writer thread takes buffers off its own queue,
+    writes them out and drops its reference; the last one out puts the buffer back in the pool.
+
+    The queues are bounded and loop_ts never waits on them: when a sink's queue is full it either
+    drops the new buffer or the oldest one, and counts it. So a stalled output only ever loses its
+    own data; it cannot hold up the USB or the other outputs. The pool is sized so that it can never
+    run dry, however full the queues get.
+*/
+
+/* -------------------------------------------------------------------------------------------------- */
+/* ----------------- INCLUDES ----------------------------------------------------------------------- */
+/* -------------------------------------------------------------------------------------------------- */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include "main.h"
+#include "errors.h"
+#include "fifo.h"
+#include "udp.h"
+#include "http.h"
+#include "record.h"
+#include "timeshift.h"
+#include "pace.h"
+#include "ts_sink.h"
+
+/* -------------------------------------------------------------------------------------------------- */
+/* ----------------- DEFINES ------------------------------------------------------------------------ */
+/* -------------------------------------------------------------------------------------------------- */
+
+/* how long an HTTP sink waits on its sockets before looking at its queue again anyway */
+#define TS_SINK_HTTP_WAIT_MS 100
+/* the most buffers a FIFO sink leaves in its pipe by reference, any more than that are copied in */
+#define TS_SINK_SPLICE_HELD 32
+
+typedef struct {
+    atomic_uint refs;
+    uint32_t len;
+    uint8_t *data;
+} ts_sink_buffer_t;
+
+typedef struct {
+    longmynd_ts_sink_config_t config;
+    uint8_t index;
+    uint8_t policy;
+    /* the output itself, depending on the type */
+    fifo_ts_t fifo;
+    udp_ts_t *udp;
+    pace_ts_t *pace;                      /* NULL if the UDP output goes out as it comes               */
+    http_ts_t *http;
+    record_ts_t *record;
+    timeshift_ts_t *timeshift;
+    int file_fd;
+    bool opened;
+    bool failed;                          /* it could not be opened, and its thread has gone           */
+    /* the queue of buffers waiting to be written out */
+    ts_sink_buffer_t *queue[TS_SINK_MAX_DEPTH];
+    uint32_t queue_head;
+    uint32_t queue_count;
+    uint32_t depth;
+    uint32_t backlog;                     /* the writer's copy of queue_count, as it took a buffer     */
+    uint32_t drops;
+    bool fifo_nonblocking;
+    bool fifo_splice;
+    /* buffers vmspliced into the pipe, kept back from the pool until the reader has been past them  */
+    ts_sink_buffer_t *held[TS_SINK_SPLICE_HELD];
+    uint64_t held_end[TS_SINK_SPLICE_HELD];   /* fifo.piped just after each one went in                */
+    uint32_t held_head;
+    uint32_t held_count;
+    uint32_t fifo_drops;                  /* copies of the fifo counters, for other threads to read    */
+    uint32_t fifo_reconnects;
+    uint32_t http_clients;                /* and of the http ones                                      */
+    uint32_t http_slow_disconnects;
+    uint32_t record_segment_mb;
+    uint32_t record_segment_s;
+    uint32_t record_rate;                 /* and of the recording ones                                 */
+    uint32_t record_worst_us;
+    uint32_t timeshift_mb;
+    uint8_t fec_l;
+    uint8_t fec_d;
+    uint32_t pace_rate;                   /* and of the paced UDP ones                                 */
+    uint32_t pace_jitter_us;
+    uint32_t pace_backlog;
+    bool running;
+    bool thread_started;
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t signal;
+} ts_sink_t;
+
+/* -------------------------------------------------------------------------------------------------- */
+/* ----------------- GLOBALS ------------------------------------------------------------------------ */
+/* -------------------------------------------------------------------------------------------------- */
+
+static ts_sink_t ts_sinks[TS_MAX_SINKS];
+static uint8_t ts_num_sinks=0;
+
+static ts_sink_buffer_t *ts_sink_pool=NULL;
+static uint32_t ts_sink_pool_size=0;
+static uint32_t ts_sink_buffer_size=0;
+static size_t ts_sink_alloc_size=0;
+static ts_sink_buffer_t **ts_sink_free=NULL;
+static uint32_t ts_sink_free_count=0;
+static pthread_mutex_t ts_sink_pool_mutex=PTHREAD_MUTEX_INITIALIZER;
+/* held by a time shift export, so that the sinks cannot be closed under it */
+static pthread_mutex_t ts_sink_export_mutex=PTHREAD_MUTEX_INITIALIZER;
+/* the error of the first sink that could not be opened, for loop_ts to stop on */
+static atomic_uint ts_sinks_err;
+
+/* -------------------------------------------------------------------------------------------------- */
+/* ----------------- ROUTINES ----------------------------------------------------------------------- */
+/* -------------------------------------------------------------------------------------------------- */
+
+/* -------------------------------------------------------------------------------------------------- */
+static uint8_t *ts_sink_buffer_map(void) {
+/* -------------------------------------------------------------------------------------------------- */
+/* the pool buffers are whole pages of their own, so that a pipe never holds a page of two of them   */
+/* return: a new page aligned buffer, or NULL if there is no memory                                   */
+/* -------------------------------------------------------------------------------------------------- */
+    void *data;
+
+    data=mmap(NULL, ts_sink_alloc_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    return (data==MAP_FAILED) ? NULL : (uint8_t *)data;
+}
+
+/* -------------------------------------------------------------------------------------------------- */
+static ts_sink_buffer_t *ts_sink_buffer_get(void) {
+/* -------------------------------------------------------------------------------------------------- */
+/* return: a free buffer from the pool, or NULL if there are none                                     */
+/* -------------------------------------------------------------------------------------------------- */
+    ts_sink_buffer_t *buffer=NULL;
+
+    pthread_mutex_lock(&ts_sink_pool_mutex);
+    if (ts_sink_free_count>0) buffer=ts_sink_free[--ts_sink_free_count];
+    pthread_mutex_unlock(&ts_sink_pool_mutex);
+
+    return buffer;
+}
+
+/* -------------------------------------------------------------------------------------------------- */
+static void ts_sink_buffer_release(ts_sink_buffer_t *buffer) {
+/* -------------------------------------------------------------------------------------------------- */
+/* drops a reference to a buffer, putting it back in the pool if it was the last one                  */
+/* *buffer: the buffer to release                                                                     */
+/* -------------------------------------------------------------------------------------------------- */
+    if (atomic_fetch_sub(&buffer->refs, 1)==1) {
+        pthread_mutex_lock(&ts_sink_pool_mutex);
+        ts_sink_free[ts_sink_free_count++]=buffer;
+        pthread_mutex_unlock(&ts_sink_pool_mutex);
+    }
+}
+
+/* -------------------------------------------------------------------------------------------------- */
+static void ts_sink_buffer_retain(void *buffer) {
+/* -------------------------------------------------------------------------------------------------- */
+/* takes another reference on a buffer, for an HTTP client to send it in its own time                 */
+/* *buffer: the buffer to hold on to                                                                  */
+/* -------------------------------------------------------------------------------------------------- */
+    atomic_fetch_add(&((ts_sink_buffer_t *)buffer)->refs, 1);
+}
+
+/* -------------------------------------------------------------------------------------------------- */
+static void ts_sink_buffer_unretain(void *buffer) {
+/* -------------------------------------------------------------------------------------------------- */
+/* gives back a reference taken with ts_sink_buffer_retain()                                          */
+/* *buffer: the buffer the HTTP client has finished with                                              */
+/* -------------------------------------------------------------------------------------------------- */
+    ts_sink_buffer_release((ts_sink_buffer_t *)buffer);
+}
+
+/* -------------------------------------------------------------------------------------------------- */
+static void ts_sink_splice_reclaim(ts_sink_t *sink, bool all) {
+/* -------------------------------------------------------------------------------------------------- */
+/* lets go of the buffers a FIFO sink has vmspliced that are no longer in its pipe                    */
+/* *sink: the FIFO sink                                                                               */
+/*   all: true to let go of all of them, once the pipe has been closed                                */
+/* -------------------------------------------------------------------------------------------------- */
+    uint64_t drained;
+
+    if (sink->held_count==0) return;
+
+    drained=fifo_ts_drained(&sink->fifo);
+    while ((sink->held_count>0) && (all || (sink->held_end[sink->held_head]<=drained))) {
+        ts_sink_buffer_release(sink->held[sink->held_head]);
+        sink->held_head=(sink->held_head+1) % TS_SINK_SPLICE_HELD;
+        sink->held_count--;
+    }
+}
+
+/* -------------------------------------------------------------------------------------------------- */
+static uint8_t ts_sink_open(ts_sink_t *sink) {
+/* -------------------------------------------------------------------------------------------------- */
+/* opens the output for a sink. This can block (eg. a FIFO with nothing reading it yet), which is why */
+/* it is done in the sink's own thread                                                                */
+/* *sink: the sink to open                                                                            */
+/* return: error code                                                                                 */
+/* -------------------------------------------------------------------------------------------------- */
+    uint8_t err=ERROR_NONE;
+
+    switch (sink->config.type) {
+        case TS_SINK_FIFO:
+            err=fifo_ts_init(&sink->fifo, sink->config.path, sink->fifo_nonblocking);
+            break;
+        case TS_SINK_UDP:
+            err=udp_ts_init(sink->udp, sink->config.path, sink->config.port, sink->config.rtp, sink->fec_l, sink->fec_d);
+            break;
+        case TS_SINK_FILE:
+            sink->file_fd=open(sink->config.path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            if (sink->file_fd<0) {
+                printf("ERROR: Failed to open TS file %s\n",sink->config.path);
+                err=ERROR_TS_FILE_OPEN;
+            }
+            break;
+        case TS_SINK_HTTP:
+            err=http_ts_init(sink->http, sink->config.port, ts_sink_buffer_retain, ts_sink_buffer_unretain);
+            break;
+        case TS_SINK_RECORD:
+            err=record_ts_init(sink->record, sink->config.path, sink->record_segment_mb, sink->record_segment_s);
+            break;
+        case TS_SINK_TIMESHIFT:
+            err=timeshift_ts_init(sink->timeshift, sink->config.path, sink->timeshift_mb);
+            break;
+    }
+
+    return err;
+}
+
+/* -------------------------------------------------------------------------------------------------- */
+static uint8_t ts_sink_output(ts_sink_t *sink, ts_sink_buffer_t *buffer) {
+/* -------------------------------------------------------------------------------------------------- */
+/* writes one buffer of TS out to a sink                                                              */
+/*   *sink: the sink to write to                                                                      */
+/* *buffer: the TS to write                                                                           */
+/*  return: error code                                                                                */
+/* -------------------------------------------------------------------------------------------------- */
+    uint8_t err=ERROR_NONE;
+    struct iovec iov;
+    uint32_t offset;
+    bool splice;
+
+    iov.iov_base=buffer->data;
+    iov.iov_len=buffer->len;
+
+    switch (sink->config.type) {
+        case TS_SINK_FIFO:
+            /* the pipe keeps pointing at what we splice, so the buffer stays ours until it is read; */
+            /* a reader that has fallen that far behind gets a copy instead                         */
+            ts_sink_splice_reclaim(sink, false);
+            splice=sink->fifo_splice && (sink->held_count<TS_SINK_SPLICE_HELD);
+            err=fifo_ts_write(&sink->fifo, &iov, 1, splice);
+            if (splice) {
+                atomic_fetch_add(&buffer->refs, 1);
+                sink->held[(sink->held_head+sink->held_count) % TS_SINK_SPLICE_HELD]=buffer;
+                sink->held_end[(sink->held_head+sink->held_count) % TS_SINK_SPLICE_HELD]=sink->fifo.piped;
+                sink->held_count++;
+            }
+            break;
+        case TS_SINK_UDP:
+            if (sink->pace==NULL) {
+                err=udp_ts_write(sink->udp, &iov, 1);
+                break;
+            }
+            /* a datagram at a time, each in its own slot */
+            pace_ts_feed(sink->pace, buffer->data, buffer->len);
+            for (offset=0; offset<buffer->len; offset+=UDP_TS_DATAGRAM_SIZE) {
+                iov.iov_base=&buffer->data[offset];
+                iov.iov_len = (buffer->len-offset<UDP_TS_DATAGRAM_SIZE) ? buffer->len-offset : UDP_TS_DATAGRAM_SIZE;
+                pace_ts_wait(sink->pace, iov.iov_len, sink->backlog);
+                if (udp_ts_write(sink->udp, &iov, 1)!=ERROR_NONE) err=ERROR_UDP_WRITE;
+            }
+            break;
+        case TS_SINK_FILE:
+            if (write(sink->file_fd, buffer->data, buffer->len)!=(ssize_t)buffer->len) {
+                printf("ERROR: TS file write\n");
+                err=ERROR_TS_FILE_WRITE;
+            }
+            break;
+        case TS_SINK_HTTP:
+            /* the clients take their own references, and send it when their sockets have room */
+            http_ts_queue(sink->http, buffer, buffer->data, buffer->len);
+            break;
+        case TS_SINK_RECORD:
+            err=record_ts_write(sink->record, buffer->data, buffer->len);
+            break;
+        case TS_SINK_TIMESHIFT:
+            timeshift_ts_write(sink->timeshift, buffer->data, buffer->len);
+            break;
+    }
+
+    return err;
+}
+
+/* -------------------------------------------------------------------------------------------------- */
+static void ts_sink_close(ts_sink_t *sink) {
+/* -------------------------------------------------------------------------------------------------- */
+/* closes the output for a sink                                                                       */
+/* *sink: the sink to close                                                                           */
+/* -------------------------------------------------------------------------------------------------- */
+    switch (sink->config.type) {
+        case TS_SINK_FIFO:
+            fifo_ts_close(&sink->fifo);
+            ts_sink_splice_reclaim(sink, true);
+            break;
+        case TS_SINK_UDP:
+            udp_ts_close(sink->udp);
+            break;
+        case TS_SINK_FILE:
+            close(sink->file_fd);
+            break;
+        case TS_SINK_HTTP:
+            http_ts_close(sink->http);
+            break;
+        case TS_SINK_RECORD:
+            record_ts_close(sink->record);
+            break;
+        case TS_SINK_TIMESHIFT:
+            timeshift_ts_close(sink->timeshift);
+            break;
+    }
+}
+
+/* -------------------------------------------------------------------------------------------------- */
+static void *ts_sink_loop(void *arg) {
+/* -------------------------------------------------------------------------------------------------- */
+/* the writer thread for one sink: opens it and then writes out whatever turns up on its queue        */
+/* -------------------------------------------------------------------------------------------------- */
+    ts_sink_t *sink=(ts_sink_t *)arg;
+    ts_sink_buffer_t *buffer;
+    uint8_t err;
+    unsigned int none=ERROR_NONE;
+
+    err=ts_sink_open(sink);
+
+    pthread_mutex_lock(&sink->mutex);
+    sink->opened=(err==ERROR_NONE);
+    if (err!=ERROR_NONE) {
+        /* nothing more goes on the queue from now on, and what is on it already is let go */
+        sink->failed=true;
+        while (sink->queue_count>0) {
+            ts_sink_buffer_release(sink->queue[sink->queue_head]);
+            sink->queue_head=(sink->queue_head+1) % TS_SINK_MAX_DEPTH;
+            sink->queue_count--;
+        }
+        atomic_compare_exchange_strong(&ts_sinks_err, &none, err);
+    }
+    pthread_mutex_unlock(&sink->mutex);
+
+    while (err==ERROR_NONE) {
+        pthread_mutex_lock(&sink->mutex);
+        if (sink->config.type==TS_SINK_FIFO) {
+            sink->fifo_drops=sink->fifo.drops;
+            sink->fifo_reconnects=sink->fifo.reconnects;
+        }
+        if (sink->pace!=NULL) {
+            sink->pace_rate=sink->pace->rate_kbps;
+            sink->pace_jitter_us=sink->pace->jitter_us;
+            sink->pace_backlog=sink->pace->backlog;
+        }
+        if (sink->config.type==TS_SINK_RECORD) {
+            sink->record_rate=sink->record->rate_kbps;
+            sink->record_worst_us=sink->record->worst_us;
+        }
+        if (sink->config.type==TS_SINK_HTTP) {
+            sink->http_clients=sink->http->num_clients;
+            sink->http_slow_disconnects=sink->http->slow_disconnects;
+            /* the clients need looking after while we wait, so we wait on them rather than the signal */
+            while ((sink->queue_count==0) && sink->running) {
+                pthread_mutex_unlock(&sink->mutex);
+                http_ts_service(sink->http, TS_SINK_HTTP_WAIT_MS);
+                pthread_mutex_lock(&sink->mutex);
+            }
+        }
+        while ((sink->queue_count==0) && sink->running) pthread_cond_wait(&sink->signal, &sink->mutex);
+        if (sink->queue_count==0) {
+            /* stopped and nothing left to write */
+            pthread_mutex_unlock(&sink->mutex);
+            break;
+        }
+        buffer=sink->queue[sink->queue_head];
+        sink->queue_head=(sink->queue_head+1) % TS_SINK_MAX_DEPTH;
+        sink->queue_count--;
+        sink->backlog=sink->queue_count;
+        pthread_mutex_unlock(&sink->mutex);
+
+        /* as before, a failed write is reported but does not stop the output */
+        ts_sink_output(sink, buffer);
+        ts_sink_buffer_release(buffer);
+    }
+
+    if (sink->opened) ts_sink_close(sink);
+
+    return NULL;
+}
+
+/* -------------------------------------------------------------------------------------------------- */
+uint8_t ts_sinks_init(longmynd_config_t *config, uint32_t buffer_size) {
+/* -------------------------------------------------------------------------------------------------- */
+/* sets up all the TS outputs in the config, and starts a writer thread for each                      */
+/*     *config: the list of outputs and the queue depth                                               */
+/* buffer_size: the most TS that will be handed to ts_sinks_write() in one go                         */
+/*      return: error code                                                                            */
+/* -------------------------------------------------------------------------------------------------- */
+    uint8_t err=ERROR_NONE;
+    ts_sink_t *sink;
+    char thread_name[16];
+    uint32_t i;
+
+    printf("Flow: TS sinks init, %i sinks\n",config->ts_num_sinks);
+
+    ts_num_sinks=0;
+    atomic_store(&ts_sinks_err, ERROR_NONE);
+    ts_sink_buffer_size=buffer_size;
+    ts_sink_alloc_size=(buffer_size+sysconf(_SC_PAGESIZE)-1) & ~(sysconf(_SC_PAGESIZE)-1);
+
+    /* every queue full, a buffer in every writer and one being filled is as many as we can ever need, */
+    /* plus every HTTP client's queue full and every splicing FIFO's pipe                              */
+    ts_sink_pool_size=config->ts_num_sinks*(config->ts_sink_depth+1)+1;
+    for (i=0; i<config->ts_num_sinks; i++) {
+        if (config->ts_sinks[i].type==TS_SINK_HTTP) ts_sink_pool_size+=HTTP_TS_MAX_CLIENTS*HTTP_TS_CLIENT_DEPTH;
+        if ((config->ts_sinks[i].type==TS_SINK_FIFO) && config->ts_fifo_splice) ts_sink_pool_size+=TS_SINK_SPLICE_HELD;
+    }
+    ts_sink_pool=calloc(ts_sink_pool_size, sizeof(ts_sink_buffer_t));
+    ts_sink_free=calloc(ts_sink_pool_size, sizeof(ts_sink_buffer_t *));
+    if ((ts_sink_pool==NULL) || (ts_sink_free==NULL)) err=ERROR_TS_BUFFER_MALLOC;
+
+    ts_sink_free_count=0;
+    for (i=0; (err==ERROR_NONE) && (i<ts_sink_pool_size); i++) {
+        ts_sink_pool[i].data=ts_sink_buffer_map();
+        if (ts_sink_pool[i].data==NULL) {
+            err=ERROR_TS_BUFFER_MALLOC;
+        } else {
+            atomic_init(&ts_sink_pool[i].refs, 0);
+            ts_sink_free[ts_sink_free_count++]=&ts_sink_pool[i];
+        }
+    }
+
+    for (i=0; (err==ERROR_NONE) && (i<config->ts_num_sinks); i++) {
+        sink=&ts_sinks[i];
+        memcpy(&sink->config, &config->ts_sinks[i], sizeof(longmynd_ts_sink_config_t));
+        sink->index=i;
+        /* live outputs want the newest TS, a recording wants it without holes for as long as it can */
+        sink->policy = ((sink->config.type==TS_SINK_FILE) || (sink->config.type==TS_SINK_RECORD) ||
+                        (sink->config.type==TS_SINK_TIMESHIFT)) ?
+                       TS_SINK_POLICY_DROP_NEWEST : TS_SINK_POLICY_DROP_OLDEST;
+        sink->depth=config->ts_sink_depth;
+        sink->queue_head=0;
+        sink->queue_count=0;
+        sink->drops=0;
+        sink->fifo_nonblocking=config->ts_fifo_nonblocking;
+        sink->fifo_splice=config->ts_fifo_splice;
+        sink->held_head=0;
+        sink->held_count=0;
+        sink->fifo_drops=0;
+        sink->fifo_reconnects=0;
+        sink->http_clients=0;
+        sink->http_slow_disconnects=0;
+        sink->record_segment_mb=config->ts_record_segment_mb;
+        sink->record_segment_s=config->ts_record_segment_s;
+        sink->record_rate=0;
+        sink->record_worst_us=0;
+        sink->timeshift_mb=config->ts_timeshift_mb;
+        sink->fec_l=config->ts_fec_l;
+        sink->fec_d=config->ts_fec_d;
+        sink->backlog=0;
+        sink->pace_rate=0;
+        sink->pace_jitter_us=0;
+        sink->pace_backlog=0;
+        sink->opened=false;
+        sink->failed=false;
+        sink->running=true;
+        sink->thread_started=false;
+        sink->udp=NULL;
+        sink->pace=NULL;
+        sink->http=NULL;
+        sink->record=NULL;
+        sink->timeshift=NULL;
+        pthread_mutex_init(&sink->mutex, NULL);
+        pthread_cond_init(&sink->signal, NULL);
+
+        if (sink->config.type==TS_SINK_UDP) {
+            sink->udp=malloc(sizeof(udp_ts_t));
+            if (sink->udp==NULL) err=ERROR_TS_BUFFER_MALLOC;
+            if ((err==ERROR_NONE) && config->ts_udp_pace) {
+                sink->pace=malloc(sizeof(pace_ts_t));
+                if (sink->pace==NULL) err=ERROR_TS_BUFFER_MALLOC;
+                else pace_ts_init(sink->pace);
+            }
+        }
+        if (sink->config.type==TS_SINK_HTTP) {
+            sink->http=malloc(sizeof(http_ts_t));
+            if (sink->http==NULL) err=ERROR_TS_BUFFER_MALLOC;
+        }
+        if (sink->config.type==TS_SINK_RECORD) {
+            sink->record=malloc(sizeof(record_ts_t));
+            if (sink->record==NULL) err=ERROR_TS_BUFFER_MALLOC;
+        }
+        if (sink->config.type==TS_SINK_TIMESHIFT) {
+            sink->timeshift=malloc(sizeof(timeshift_ts_t));
+            if (sink->timeshift==NULL) err=ERROR_TS_BUFFER_MALLOC;
+        }
+
+        if (err==ERROR_NONE) {
+            if (0!=pthread_create(&sink->thread, NULL, ts_sink_loop, (void *)sink)) {
+                printf("ERROR: TS sink thread create\n");
+                err=ERROR_THREAD_ERROR;
+            } else {
+                sprintf(thread_name, "TS Sink %i", i);
+                pthread_setname_np(sink->thread, thread_name);
+                sink->thread_started=true;
+                ts_num_sinks++;
+            }
+        }
+    }
+
+    if (err!=ERROR_NONE) printf("ERROR: TS sinks init\n");
+
+    return err;
+}
+
+/* -------------------------------------------------------------------------------------------------- */
+uint8_t ts_sinks_write(uint16_t program, struct iovec *iov, int iovcnt) {
+/* -------------------------------------------------------------------------------------------------- */
+/* queues a lump of TS on every sink that wants it, other than one that could not be opened. Never    */
+/* waits for any of them                                                                              */
+/* program: the programme the TS has been cut down to, 0 for the whole TS                             */
+/*    *iov: the segments of TS to be sent, the FTDI headers have already been taken out              */
+/*  iovcnt: the number of segments                                                                    */
+/*  return: error code                                                                                */
+/* -------------------------------------------------------------------------------------------------- */
+    ts_sink_buffer_t *buffer;
+    ts_sink_buffer_t *dropped;
+    ts_sink_t *sink;
+    uint32_t len=0;
+    uint8_t num_sinks=0;
+    uint8_t i;
+    int n;
+
+    for (i=0; i<ts_num_sinks; i++) {
+        if (ts_sinks[i].config.program==program) num_sinks++;
+    }
+    if (num_sinks==0) return ERROR_NONE;
+
+    buffer=ts_sink_buffer_get();
+    if (buffer==NULL) {
+        /* can't happen with the pool sized as it is, but if it does it is a drop for everyone */
+        for (i=0; i<ts_num_sinks; i++) {
+            if (ts_sinks[i].config.program!=program) continue;
+            pthread_mutex_lock(&ts_sinks[i].mutex);
+            ts_sinks[i].drops++;
+            pthread_mutex_unlock(&ts_sinks[i].mutex);
+        }
+        return ERROR_NONE;
+    }
+
+    for (n=0; n<iovcnt; n++) {
+        if (len+iov[n].iov_len>ts_sink_buffer_size) break;
+        memcpy(&buffer->data[len], iov[n].iov_base, iov[n].iov_len);
+        len+=iov[n].iov_len;
+    }
+    buffer->len=len;
+    atomic_store(&buffer->refs, num_sinks);
+
+    for (i=0; i<ts_num_sinks; i++) {
+        sink=&ts_sinks[i];
+        if (sink->config.program!=program) continue;
+        dropped=NULL;
+
+        pthread_mutex_lock(&sink->mutex);
+        if (sink->failed) {
+            /* its thread has gone, so there is no one to take it off the queue */
+            dropped=buffer;
+        } else if (sink->queue_count==sink->depth) {
+            sink->drops++;
+            if (sink->policy==TS_SINK_POLICY_DROP_OLDEST) {
+                dropped=sink->queue[sink->queue_head];
+                sink->queue_head=(sink->queue_head+1) % TS_SINK_MAX_DEPTH;
+                sink->queue_count--;
+            } else {
+                dropped=buffer;
+            }
+        }
+        if (dropped!=buffer) {
+            sink->queue[(sink->queue_head+sink->queue_count) % TS_SINK_MAX_DEPTH]=buffer;
+            sink->queue_count++;
+            pthread_cond_signal(&sink->signal);
+            if ((sink->config.type==TS_SINK_HTTP) && sink->opened) http_ts_doorbell(sink->http);
+        }
+        pthread_mutex_unlock(&sink->mutex);
+
+        if (dropped!=NULL) ts_sink_buffer_release(dropped);
+    }
+
+    return ERROR_NONE;
+}
+
+/* -------------------------------------------------------------------------------------------------- */
+void ts_sinks_close(void) {
+/* -------------------------------------------------------------------------------------------------- */
+/* stops all the writer threads once they have written out what they have queued                      */
+/* -------------------------------------------------------------------------------------------------- */
+    bool left_behind=false;
+    ts_sink_t *sink;
+    uint32_t i;
+
+    printf("Flow: TS sinks close\n");
+
+    /* let any export finish, and stop any more starting */
+    pthread_mutex_lock(&ts_sink_export_mutex);
+
+    for (i=0; i<ts_num_sinks; i++) {
+        sink=&ts_sinks[i];
+        pthread_mutex_lock(&sink->mutex);
+        sink->running=false;
+        pthread_cond_signal(&sink->signal);
+        if ((sink->config.type==TS_SINK_HTTP) && sink->opened) http_ts_doorbell(sink->http);
+        if (sink->opened || sink->failed) {
+            pthread_mutex_unlock(&sink->mutex);
+            pthread_join(sink->thread, NULL);
+            free(sink->udp);
+            free(sink->pace);
+            free(sink->http);
+            free(sink->record);
+            free(sink->timeshift);
+        } else {
+            /* still stuck opening (eg. a FIFO nobody is reading), so we have to leave it behind */
+            pthread_mutex_unlock(&sink->mutex);
+            pthread_detach(sink->thread);
+            left_behind=true;
+        }
+    }
+    ts_num_sinks=0;
+    pthread_mutex_unlock(&ts_sink_export_mutex);
+
+    /* a thread left behind may still get to its queue, so its buffers have to stay put */
+    if (!left_behind && (ts_sink_pool!=NULL)) {
+        for (i=0; i<ts_sink_pool_size; i++) {
+            if (ts_sink_pool[i].data!=NULL) munmap(ts_sink_pool[i].data, ts_sink_alloc_size);
+        }
+        free(ts_sink_pool);
+        free(ts_sink_free);
+        ts_sink_pool=NULL;
+        ts_sink_free=NULL;
+    }
+}
+
+/* -------------------------------------------------------------------------------------------------- */
+uint8_t ts_sinks_count(void) {
+/* -------------------------------------------------------------------------------------------------- */
+/* return: the number of TS outputs running                                                           */
+/* -------------------------------------------------------------------------------------------------- */
+    return ts_num_sinks;
+}
+
+/* -------------------------------------------------------------------------------------------------- */
+uint8_t ts_sinks_error(void) {
+/* -------------------------------------------------------------------------------------------------- */
+/* return: the error of the first TS output that could not be opened, or ERROR_NONE                  */
+/* -------------------------------------------------------------------------------------------------- */
+    return (uint8_t)atomic_load(&ts_sinks_err);
+}
+
+/* -------------------------------------------------------------------------------------------------- */
+uint32_t ts_sink_drops(uint8_t index) {
+/* -------------------------------------------------------------------------------------------------- */
+/*  index: which sink, in the order they were given on the command line                               */
+/* return: the number of buffers that sink has had to drop because its queue was full                 */
+/* -------------------------------------------------------------------------------------------------- */
+    uint32_t drops=0;
+
+    if (index<ts_num_sinks) {
+        pthread_mutex_lock(&ts_sinks[index].mutex);
+        drops=ts_sinks[index].drops;
+        pthread_mutex_unlock(&ts_sinks[index].mutex);
+    }
+
+    return drops;
+}
+
+/* -------------------------------------------------------------------------------------------------- */
+void ts_sink_fifo_stats(uint8_t index, uint32_t *drops, uint32_t *reconnects) {
+/* -------------------------------------------------------------------------------------------------- */
+/*       index: which sink, in the order they were given on the command line                          */
+/*      *drops: the number of TS packets a non-blocking FIFO has dropped because its pipe was full    */
+/* *reconnects: the number of times a non-blocking FIFO has lost its reader                           */
+/* -------------------------------------------------------------------------------------------------- */
+    *drops=0;
+    *reconnects=0;
+
+    if (index<ts_num_sinks) {
+        pthread_mutex_lock(&ts_sinks[index].mutex);
+        *drops=ts_sinks[index].fifo_drops;
+        *reconnects=ts_sinks[index].fifo_reconnects;
+        pthread_mutex_unlock(&ts_sinks[index].mutex);
+    }
+}
+
+/* -------------------------------------------------------------------------------------------------- */
+void ts_sink_http_stats(uint8_t index, uint32_t *clients, uint32_t *slow_disconnects) {
+/* -------------------------------------------------------------------------------------------------- */
+/*             index: which sink, in the order they were given on the command line                    */
+/*          *clients: the number of clients an HTTP output has connected                              */
+/* *slow_disconnects: the number of clients it has thrown off for not keeping up with the TS          */
+/* -------------------------------------------------------------------------------------------------- */
+    *clients=0;
+    *slow_disconnects=0;
+
+    if (index<ts_num_sinks) {
+        pthread_mutex_lock(&ts_sinks[index].mutex);
+        *clients=ts_sinks[index].http_clients;
+        *slow_disconnects=ts_sinks[index].http_slow_disconnects;
+        pthread_mutex_unlock(&ts_sinks[index].mutex);
+    }
+}
+
+/* -------------------------------------------------------------------------------------------------- */
+void ts_sink_record_stats(uint8_t index, uint32_t *rate, uint32_t *worst_us) {
+/* -------------------------------------------------------------------------------------------------- */
+/*     index: which sink, in the order they were given on the command line                            */
+/*     *rate: the KB/s a recording has been getting on to the disk                                    */
+/* *worst_us: the longest one of its writes or fsyncs took in that time, in us                        */
+/* -------------------------------------------------------------------------------------------------- */
+    *rate=0;
+    *worst_us=0;
+
+    if (index<ts_num_sinks) {
+        pthread_mutex_lock(&ts_sinks[index].mutex);
+        *rate=ts_sinks[index].record_rate;
+        *worst_us=ts_sinks[index].record_worst_us;
+        pthread_mutex_unlock(&ts_sinks[index].mutex);
+    }
+}
+
+/* -------------------------------------------------------------------------------------------------- */
+uint8_t ts_sink_timeshift_export(uint32_t ago_s, uint32_t length_s, char *path) {
+/* -------------------------------------------------------------------------------------------------- */
+/* saves an interval from the first time shift output to a .ts file. Runs in the caller's thread     */
+/*    ago_s: how many seconds ago the interval starts                                                 */
+/* length_s: how long it is in seconds, 0 for right up to now                                         */
+/*    *path: the file to save it to                                                                   */
+/*   return: error code                                                                               */
+/* -------------------------------------------------------------------------------------------------- */
+    uint8_t err=ERROR_TIMESHIFT_EXPORT;
+    bool found=false;
+    bool opened;
+    uint32_t i;
+
+    pthread_mutex_lock(&ts_sink_export_mutex);
+    for (i=0; !found && (i<ts_num_sinks); i++) {
+        if (ts_sinks[i].config.type!=TS_SINK_TIMESHIFT) continue;
+        found=true;
+        pthread_mutex_lock(&ts_sinks[i].mutex);
+        opened=ts_sinks[i].opened;
+        pthread_mutex_unlock(&ts_sinks[i].mutex);
+        if (opened) err=timeshift_ts_export(ts_sinks[i].timeshift, ago_s, length_s, path);
+    }
+    pthread_mutex_unlock(&ts_sink_export_mutex);
+
+    if (!found) printf("ERROR: There is no time shift output to export from\n");
+
+    return err;
+}
+
+/* -------------------------------------------------------------------------------------------------- */
+void ts_sink_pace_stats(uint8_t index, uint32_t *rate, uint32_t *jitter_us, uint32_t *backlog) {
+/* -------------------------------------------------------------------------------------------------- */
+/*      index: which sink, in the order they were given on the command line                           */
+/*      *rate: the bit rate a paced UDP output is sending at, in kbit/s                               */
+/* *jitter_us: the furthest a datagram went from its slot over the last second, in us                 */
+/*   *backlog: the most buffers it had queued up waiting to go over the last second                   */
+/* -------------------------------------------------------------------------------------------------- */
+    *rate=0;
+    *jitter_us=0;
+    *backlog=0;
+
+    if (index<ts_num_sinks) {
+        pthread_mutex_lock(&ts_sinks[index].mutex);
+        *rate=ts_sinks[index].pace_rate;
+        *jitter_us=ts_sinks[index].pace_jitter_us;
+        *backlog=ts_sinks[index].pace_backlog;
+        pthread_mutex_unlock(&ts_sinks[index].mutex);
+    }
+}
+
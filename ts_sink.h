@@ -0,0 +1,49 @@
+/* -------------------------------------------------------------------------------------------------- */
+/* The LongMynd receiver: ts_sink.h                                                                   */
+/* Copyright 2019 Heather Lomond                                                                      */
+/* -------------------------------------------------------------------------------------------------- */
+/*
+    This file is part of longmynd.
+
+    Longmynd is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    Longmynd is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with longmynd.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef TS_SINK_H
+#define TS_SINK_H
+
+#include <stdint.h>
+#include <sys/uio.h>
+#include "main.h"
+
+#define TS_SINK_DEFAULT_DEPTH 16
+#define TS_SINK_MAX_DEPTH     128
+
+/* what a sink does when its queue is full */
+#define TS_SINK_POLICY_DROP_NEWEST 0 /* the new buffer is not queued */
+#define TS_SINK_POLICY_DROP_OLDEST 1 /* the oldest queued buffer is thrown away to make room */
+
+uint8_t ts_sinks_init(longmynd_config_t *, uint32_t);
+uint8_t ts_sinks_write(uint16_t, struct iovec *, int);
+void ts_sinks_close(void);
+uint8_t ts_sinks_count(void);
+uint8_t ts_sinks_error(void);
+uint32_t ts_sink_drops(uint8_t);
+void ts_sink_fifo_stats(uint8_t, uint32_t *, uint32_t *);
+void ts_sink_http_stats(uint8_t, uint32_t *, uint32_t *);
+void ts_sink_record_stats(uint8_t, uint32_t *, uint32_t *);
+uint8_t ts_sink_timeshift_export(uint32_t, uint32_t, char *);
+void ts_sink_pace_stats(uint8_t, uint32_t *, uint32_t *, uint32_t *);
+
+#endif
+
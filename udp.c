@@ -31,68 +31,317 @@
 #include <sys/stat.h> 
 #include <sys/types.h> 
 #include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
 #include <unistd.h>
 #include <stdlib.h> 
 #include <sys/socket.h> 
+#include <sys/uio.h>
 #include <arpa/inet.h> 
 #include <netinet/in.h> 
+#include <netdb.h>
+#include <net/if.h>
 #include "errors.h"
 #include "udp.h"
 
+/* -------------------------------------------------------------------------------------------------- */
+/* ----------------- DEFINES ------------------------------------------------------------------------ */
+/* -------------------------------------------------------------------------------------------------- */
+
+#define UDP_TS_SYNC        0x47
+
+/* RFC 3550 header with no CSRCs, carrying MPEG-2 TS as in RFC 2250 */
+#define UDP_RTP_VERSION      0x80
+#define UDP_RTP_PAYLOAD_MP2T 33
+#define UDP_RTP_CLOCK        90000
+
+typedef struct {
+    struct iovec *iov;
+    int iovcnt;
+    size_t offset;
+    size_t remaining;
+} udp_ts_cursor_t;
+
 /* -------------------------------------------------------------------------------------------------- */
 /* ----------------- GLOBALS ------------------------------------------------------------------------ */
 /* -------------------------------------------------------------------------------------------------- */
 
-struct sockaddr_in servaddr_status; 
-struct sockaddr_in servaddr_ts;
+struct sockaddr_storage servaddr_status; 
+socklen_t servaddr_status_len;
 int sockfd_status; 
-int sockfd_ts;
+
+/* how the sockets behave when sending to a multicast group */
+static uint8_t udp_multicast_ttl=1;
+static char udp_multicast_iface[IF_NAMESIZE]="";
+static bool udp_multicast_loop=true;
 
 /* -------------------------------------------------------------------------------------------------- */
-/* ----------------- DEFINES ------------------------------------------------------------------------ */
+/* ----------------- ROUTINES ----------------------------------------------------------------------- */
 /* -------------------------------------------------------------------------------------------------- */
 
 /* -------------------------------------------------------------------------------------------------- */
-/* ----------------- ROUTINES ----------------------------------------------------------------------- */
+static size_t udp_ts_take(udp_ts_cursor_t *cursor, size_t len, struct iovec *pieces, int *num_pieces) {
+/* -------------------------------------------------------------------------------------------------- */
+/* moves the cursor on through the incoming TS, noting down where the bytes it passes over are        */
+/*     *cursor: where we are in the incoming TS                                                       */
+/*         len: how many bytes to take                                                                */
+/*     *pieces: if not NULL, the bytes taken are added onto this list as one or more segments         */
+/* *num_pieces: the number of segments in the list                                                    */
+/*      return: the number of bytes taken, less than len if the TS ran out                            */
+/* -------------------------------------------------------------------------------------------------- */
+    size_t taken=0;
+    size_t size;
+
+    while ((taken<len) && (cursor->iovcnt>0)) {
+        size=cursor->iov->iov_len-cursor->offset;
+        if (size>len-taken) size=len-taken;
+        if (pieces!=NULL) {
+            pieces[*num_pieces].iov_base=(uint8_t *)cursor->iov->iov_base+cursor->offset;
+            pieces[*num_pieces].iov_len=size;
+            (*num_pieces)++;
+        }
+        taken+=size;
+        cursor->offset+=size;
+        cursor->remaining-=size;
+        if (cursor->offset==cursor->iov->iov_len) {
+            cursor->iov++;
+            cursor->iovcnt--;
+            cursor->offset=0;
+        }
+    }
+
+    return taken;
+}
+
+/* -------------------------------------------------------------------------------------------------- */
+static uint8_t udp_ts_peek(udp_ts_cursor_t *cursor) {
 /* -------------------------------------------------------------------------------------------------- */
+/* *cursor: where we are in the incoming TS, must not be at the end                                   */
+/*  return: the byte at the cursor                                                                    */
+/* -------------------------------------------------------------------------------------------------- */
+    return ((uint8_t *)cursor->iov->iov_base)[cursor->offset];
+}
 
 /* -------------------------------------------------------------------------------------------------- */
-uint8_t udp_ts_write(uint8_t *buffer, uint32_t len) {
+static uint32_t udp_rtp_timestamp(void) {
 /* -------------------------------------------------------------------------------------------------- */
-/* takes a buffer and writes out the contents to udp socket                                           */
-/* *buffer: the buffer that contains the data to be sent                                              */
-/*     len: the length (number of bytes) of data to be sent                                           */
-/*  return: error code                                                                                */
+/* return: the time now on the 90kHz RTP clock                                                        */
+/* -------------------------------------------------------------------------------------------------- */
+    struct timespec tp;
+
+    clock_gettime(CLOCK_MONOTONIC, &tp);
+
+    return (uint32_t)((uint64_t)tp.tv_sec*UDP_RTP_CLOCK + (uint64_t)tp.tv_nsec*(UDP_RTP_CLOCK/1000)/1000000);
+}
+
+/* -------------------------------------------------------------------------------------------------- */
+static void udp_rtp_header(udp_ts_t *udp_ts, uint8_t *header, uint32_t timestamp) {
+/* -------------------------------------------------------------------------------------------------- */
+/* fills in the RTP header for the next datagram                                                      */
+/*   *udp_ts: the TS output the datagram is for                                                       */
+/*   *header: where to put the header                                                                 */
+/* timestamp: the 90kHz timestamp of the datagram                                                     */
+/* -------------------------------------------------------------------------------------------------- */
+    header[0]=UDP_RTP_VERSION;
+    header[1]=UDP_RTP_PAYLOAD_MP2T;
+    header[2]=(uint8_t)(udp_ts->rtp_sequence >> 8);
+    header[3]=(uint8_t)(udp_ts->rtp_sequence);
+    header[4]=(uint8_t)(timestamp >> 24);
+    header[5]=(uint8_t)(timestamp >> 16);
+    header[6]=(uint8_t)(timestamp >> 8);
+    header[7]=(uint8_t)(timestamp);
+    header[8]=(uint8_t)(udp_ts->rtp_ssrc >> 24);
+    header[9]=(uint8_t)(udp_ts->rtp_ssrc >> 16);
+    header[10]=(uint8_t)(udp_ts->rtp_ssrc >> 8);
+    header[11]=(uint8_t)(udp_ts->rtp_ssrc);
+
+    udp_ts->rtp_sequence++;
+}
+
+/* -------------------------------------------------------------------------------------------------- */
+static uint8_t udp_ts_send(udp_ts_t *udp_ts, struct mmsghdr *msgs, int num_msgs) {
+/* -------------------------------------------------------------------------------------------------- */
+/* sends a batch of datagrams to the TS socket in as few syscalls as possible                         */
+/*  *udp_ts: the TS output to send to                                                                 */
+/*    *msgs: the datagrams                                                                            */
+/* num_msgs: the number of datagrams                                                                  */
+/*   return: error code                                                                               */
 /* -------------------------------------------------------------------------------------------------- */
     uint8_t err=ERROR_NONE;
-    int32_t remaining_len; /* note it is signed so can go negative */
-    uint32_t write_size;
-
-    remaining_len=len;
-    /* we need to loop round sending 510 byte chunks so that we can skip the 2 extra bytes put in by */
-    /* the FTDI chip every 512 bytes of USB message */
-    while (remaining_len>0) {
-        if (remaining_len>510) {
-             /* calculate where to start in the buffer and how many bytes to send */
-             write_size=510;
-             sendto(sockfd_ts, &buffer[len-remaining_len], write_size, 0,
-                                (const struct sockaddr *) &servaddr_ts,  sizeof(struct sockaddr)); 
-             /* note we skip over the 2 bytes inserted by the FTDI */
-             remaining_len-=512;
-        } else {
-             write_size=remaining_len;
-             sendto(sockfd_ts, &buffer[len-remaining_len], write_size, 0,
-                                (const struct sockaddr *) &servaddr_ts,  sizeof(struct sockaddr)); 
-             remaining_len-=write_size; /* should be 0 if all went well */
+    int sent;
+    int ret;
+
+    /* sendmmsg can stop early, in which case we carry on with the rest */
+    for (sent=0; (err==ERROR_NONE) && (sent<num_msgs); sent+=ret) {
+        ret=sendmmsg(udp_ts->sockfd, &msgs[sent], num_msgs-sent, 0);
+        if (ret<=0) {
+            printf("ERROR: UDP socket write\n");
+            err=ERROR_UDP_WRITE;
         }
     }
 
-    /* if someting went bad with our calcs, remaining will not be 0 */
-    if ((err==ERROR_NONE) && (remaining_len!=0)) {
-        printf("ERROR: UDP socket write incorrect number of bytes\n");
+    return err;
+}
+
+/* -------------------------------------------------------------------------------------------------- */
+static uint8_t udp_ts_fec_send(udp_ts_t *udp_ts, uint8_t which, int stream) {
+/* -------------------------------------------------------------------------------------------------- */
+/* sends a parity packet that the FEC matrix says is ready                                            */
+/* *udp_ts: the TS output the parity is for                                                           */
+/*   which: FEC_TS_COLUMN or FEC_TS_ROW                                                               */
+/*  stream: the FEC socket to send it on, 0 for the columns and 1 for the rows                        */
+/*  return: error code                                                                                */
+/* -------------------------------------------------------------------------------------------------- */
+    uint8_t err=ERROR_NONE;
+    struct msghdr msg;
+    struct iovec iov[2];
+
+    fec_ts_packet(udp_ts->fec, which, iov);
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_name=&udp_ts->fec_servaddr[stream];
+    msg.msg_namelen=udp_ts->fec_servaddr_len[stream];
+    msg.msg_iov=iov;
+    msg.msg_iovlen=2;
+    if (sendmsg(udp_ts->fec_sockfd[stream], &msg, 0)<0) {
+        printf("ERROR: UDP FEC socket write\n");
         err=ERROR_UDP_WRITE;
     }
 
+    return err;
+}
+
+/* -------------------------------------------------------------------------------------------------- */
+static uint8_t udp_ts_fec(udp_ts_t *udp_ts, struct mmsghdr *msgs, int num_msgs) {
+/* -------------------------------------------------------------------------------------------------- */
+/* adds a batch of datagrams that has just been sent to the FEC matrix, sending the parity packets   */
+/* as they become ready                                                                               */
+/*  *udp_ts: the TS output the datagrams went to                                                      */
+/*    *msgs: the datagrams                                                                            */
+/* num_msgs: the number of datagrams                                                                  */
+/*   return: error code                                                                               */
+/* -------------------------------------------------------------------------------------------------- */
+    uint8_t err=ERROR_NONE;
+    uint8_t ready;
+    int i;
+
+    for (i=0; (err==ERROR_NONE) && (i<num_msgs); i++) {
+        ready=fec_ts_add(udp_ts->fec, msgs[i].msg_hdr.msg_iov, (int)msgs[i].msg_hdr.msg_iovlen);
+        if (ready & FEC_TS_ROW) err=udp_ts_fec_send(udp_ts, FEC_TS_ROW, 1);
+        if ((err==ERROR_NONE) && (ready & FEC_TS_COLUMN)) err=udp_ts_fec_send(udp_ts, FEC_TS_COLUMN, 0);
+    }
+
+    return err;
+}
+
+/* -------------------------------------------------------------------------------------------------- */
+uint8_t udp_ts_write(udp_ts_t *udp_ts, struct iovec *iov, int iovcnt) {
+/* -------------------------------------------------------------------------------------------------- */
+/* takes a list of TS segments, lines it up on the TS packets and sends it to the udp socket as       */
+/* datagrams of 7 whole packets, each with an RTP header if asked for. Whatever does not make up a    */
+/* whole datagram is kept in the tail buffer for next time                                            */
+/* *udp_ts: the TS output to send to                                                                  */
+/*    *iov: the segments of TS to be sent, the FTDI headers have already been taken out              */
+/*  iovcnt: the number of segments                                                                    */
+/*  return: error code                                                                                */
+/* -------------------------------------------------------------------------------------------------- */
+    uint8_t err=ERROR_NONE;
+    struct mmsghdr *msgs=udp_ts->msgs;
+    struct iovec (*pieces)[UDP_TS_MAX_PIECES]=udp_ts->pieces;
+    udp_ts_cursor_t cursor;
+    int num_msgs=0;
+    /* with RTP the first piece of each datagram is its header */
+    int first_piece = udp_ts->rtp ? 1 : 0;
+    int num_pieces=first_piece;
+    size_t dgram_len=0;
+    size_t partial;
+    uint32_t timestamp=0;
+    int i;
+
+    /* all the datagrams from this transfer arrived together, so they share a timestamp */
+    if (udp_ts->rtp) timestamp=udp_rtp_timestamp();
+
+    cursor.iov=iov;
+    cursor.iovcnt=iovcnt;
+    cursor.offset=0;
+    cursor.remaining=0;
+    for (i=0; i<iovcnt; i++) cursor.remaining+=iov[i].iov_len;
+
+    /* first finish off any packet that was split over the end of the last transfer */
+    partial=udp_ts->tail_len % UDP_TS_PACKET_SIZE;
+    if (partial>0) {
+        num_pieces=0;
+        udp_ts_take(&cursor, UDP_TS_PACKET_SIZE-partial, pieces[0], &num_pieces);
+        for (i=0; i<num_pieces; i++) {
+            memcpy(&udp_ts->tail[udp_ts->tail_len], pieces[0][i].iov_base, pieces[0][i].iov_len);
+            udp_ts->tail_len+=pieces[0][i].iov_len;
+        }
+        num_pieces=first_piece;
+    }
+    if ((udp_ts->tail_len % UDP_TS_PACKET_SIZE)!=0) return ERROR_NONE; /* still not enough */
+
+    /* the whole packets left over from last time go at the front of the first datagram */
+    if (udp_ts->tail_len>0) {
+        pieces[0][first_piece].iov_base=udp_ts->tail;
+        pieces[0][first_piece].iov_len=udp_ts->tail_len;
+        num_pieces=first_piece+1;
+        dgram_len=udp_ts->tail_len;
+    }
+
+    while (err==ERROR_NONE) {
+        if (dgram_len==UDP_TS_DATAGRAM_SIZE) {
+            if (udp_ts->rtp) {
+                udp_rtp_header(udp_ts, udp_ts->rtp_headers[num_msgs], timestamp);
+                pieces[num_msgs][0].iov_base=udp_ts->rtp_headers[num_msgs];
+                pieces[num_msgs][0].iov_len=UDP_RTP_HEADER_SIZE;
+            }
+            memset(&msgs[num_msgs], 0, sizeof(struct mmsghdr));
+            msgs[num_msgs].msg_hdr.msg_name=&udp_ts->servaddr;
+            msgs[num_msgs].msg_hdr.msg_namelen=udp_ts->servaddr_len;
+            msgs[num_msgs].msg_hdr.msg_iov=pieces[num_msgs];
+            msgs[num_msgs].msg_hdr.msg_iovlen=num_pieces;
+            num_msgs++;
+            num_pieces=first_piece;
+            dgram_len=0;
+            if (num_msgs==UDP_TS_MAX_MSGS) {
+                err=udp_ts_send(udp_ts, msgs, num_msgs);
+                if ((err==ERROR_NONE) && (udp_ts->fec!=NULL)) err=udp_ts_fec(udp_ts, msgs, num_msgs);
+                num_msgs=0;
+            }
+            continue;
+        }
+
+        if (cursor.remaining==0) break;
+        if (udp_ts_peek(&cursor)!=UDP_TS_SYNC) {
+            /* lost sync, so throw bytes away until we find it again */
+            udp_ts_take(&cursor, 1, NULL, NULL);
+            continue;
+        }
+        if (cursor.remaining<UDP_TS_PACKET_SIZE) break;
+
+        udp_ts_take(&cursor, UDP_TS_PACKET_SIZE, pieces[num_msgs], &num_pieces);
+        dgram_len+=UDP_TS_PACKET_SIZE;
+    }
+
+    if ((err==ERROR_NONE) && (num_msgs>0)) err=udp_ts_send(udp_ts, msgs, num_msgs);
+    if ((err==ERROR_NONE) && (num_msgs>0) && (udp_ts->fec!=NULL)) err=udp_ts_fec(udp_ts, msgs, num_msgs);
+
+    /* keep the packets that did not make a whole datagram, and any partial packet, for next time. */
+    /* The datagram may already start with the old tail, which is already in place                   */
+    udp_ts->tail_len=0;
+    for (i=first_piece; i<num_pieces; i++) {
+        if (pieces[num_msgs][i].iov_base!=udp_ts->tail) {
+            memcpy(&udp_ts->tail[udp_ts->tail_len], pieces[num_msgs][i].iov_base, pieces[num_msgs][i].iov_len);
+        }
+        udp_ts->tail_len+=pieces[num_msgs][i].iov_len;
+    }
+    num_pieces=0;
+    udp_ts_take(&cursor, cursor.remaining, pieces[num_msgs], &num_pieces);
+    for (i=0; i<num_pieces; i++) {
+        memcpy(&udp_ts->tail[udp_ts->tail_len], pieces[num_msgs][i].iov_base, pieces[num_msgs][i].iov_len);
+        udp_ts->tail_len+=pieces[num_msgs][i].iov_len;
+    }
+
     if (err!=ERROR_NONE) printf("ERROR: UDP socket ts write\n");
 
     return err;
@@ -111,7 +360,7 @@ uint8_t udp_status_write(uint8_t message, uint32_t data) {
 
     sprintf(status_message, "$%i,%i\n", message, data);
 
-    sendto(sockfd_status, status_message, strlen(status_message), 0, (const struct sockaddr *)&servaddr_status,  sizeof(struct sockaddr)); 
+    sendto(sockfd_status, status_message, strlen(status_message), 0, (const struct sockaddr *)&servaddr_status, servaddr_status_len); 
 
     return err;
 }
@@ -129,64 +378,221 @@ uint8_t udp_status_string_write(uint8_t message, char *data) {
 
     sprintf(status_message, "$%i,%s\n", message, data);
 
-    sendto(sockfd_status, status_message, strlen(status_message), 0, (const struct sockaddr *)&servaddr_status,  sizeof(struct sockaddr)); 
+    sendto(sockfd_status, status_message, strlen(status_message), 0, (const struct sockaddr *)&servaddr_status, servaddr_status_len); 
 
     return err;
 }
 
 
 /* -------------------------------------------------------------------------------------------------- */
-static uint8_t udp_init(struct sockaddr_in *servaddr_ptr, int *sockfd_ptr, char *udp_ip, int udp_port) {
+void udp_set_multicast(uint8_t ttl, char *iface, bool loop) {
+/* -------------------------------------------------------------------------------------------------- */
+/* sets how the sockets behave if they are sending to a multicast group. Call before the inits        */
+/*    ttl: the multicast TTL (IPv4) or hop limit (IPv6)                                               */
+/* *iface: the name of the interface to send multicast out of, or "" to let the routing decide       */
+/*   loop: true if multicast should also be looped back to receivers on this machine                  */
+/* -------------------------------------------------------------------------------------------------- */
+    udp_multicast_ttl=ttl;
+    strncpy(udp_multicast_iface, iface, IF_NAMESIZE-1);
+    udp_multicast_iface[IF_NAMESIZE-1]='\0';
+    udp_multicast_loop=loop;
+}
+
+/* -------------------------------------------------------------------------------------------------- */
+static uint8_t udp_multicast_setup(int sockfd, struct sockaddr_storage *servaddr_ptr) {
+/* -------------------------------------------------------------------------------------------------- */
+/* if the destination is a multicast group, sets the TTL, interface and loopback on the socket        */
+/*       sockfd: the socket to set up                                                                 */
+/* servaddr_ptr: the destination the socket will be sending to                                        */
+/*       return: error code                                                                           */
+/* -------------------------------------------------------------------------------------------------- */
+    uint8_t err=ERROR_NONE;
+    unsigned int ifindex=0;
+    unsigned char ttl_v4=udp_multicast_ttl;
+    unsigned char loop_v4=udp_multicast_loop ? 1 : 0;
+    int hops_v6=udp_multicast_ttl;
+    unsigned int loop_v6=udp_multicast_loop ? 1 : 0;
+    struct ip_mreqn mreqn;
+    struct sockaddr_in *addr_v4=(struct sockaddr_in *)servaddr_ptr;
+    struct sockaddr_in6 *addr_v6=(struct sockaddr_in6 *)servaddr_ptr;
+
+    if (udp_multicast_iface[0]!='\0') {
+        ifindex=if_nametoindex(udp_multicast_iface);
+        if (ifindex==0) {
+            printf("ERROR: UDP multicast interface %s not found\n", udp_multicast_iface);
+            err=ERROR_UDP_MULTICAST;
+        }
+    }
+
+    if ((err==ERROR_NONE) && (servaddr_ptr->ss_family==AF_INET) && IN_MULTICAST(ntohl(addr_v4->sin_addr.s_addr))) {
+        printf("      Status: UDP multicast to IPv4 group, TTL %i\n", udp_multicast_ttl);
+        if ((setsockopt(sockfd, IPPROTO_IP, IP_MULTICAST_TTL, &ttl_v4, sizeof(ttl_v4))<0) ||
+            (setsockopt(sockfd, IPPROTO_IP, IP_MULTICAST_LOOP, &loop_v4, sizeof(loop_v4))<0)) {
+            err=ERROR_UDP_MULTICAST;
+        }
+        if ((err==ERROR_NONE) && (ifindex!=0)) {
+            memset(&mreqn, 0, sizeof(mreqn));
+            mreqn.imr_ifindex=ifindex;
+            if (setsockopt(sockfd, IPPROTO_IP, IP_MULTICAST_IF, &mreqn, sizeof(mreqn))<0) err=ERROR_UDP_MULTICAST;
+        }
+    } else if ((err==ERROR_NONE) && (servaddr_ptr->ss_family==AF_INET6) && IN6_IS_ADDR_MULTICAST(&addr_v6->sin6_addr)) {
+        printf("      Status: UDP multicast to IPv6 group, hop limit %i\n", udp_multicast_ttl);
+        if ((setsockopt(sockfd, IPPROTO_IPV6, IPV6_MULTICAST_HOPS, &hops_v6, sizeof(hops_v6))<0) ||
+            (setsockopt(sockfd, IPPROTO_IPV6, IPV6_MULTICAST_LOOP, &loop_v6, sizeof(loop_v6))<0)) {
+            err=ERROR_UDP_MULTICAST;
+        }
+        if ((err==ERROR_NONE) && (ifindex!=0)) {
+            if (setsockopt(sockfd, IPPROTO_IPV6, IPV6_MULTICAST_IF, &ifindex, sizeof(ifindex))<0) err=ERROR_UDP_MULTICAST;
+            /* link local groups need to know which link they are on */
+            if (IN6_IS_ADDR_MC_LINKLOCAL(&addr_v6->sin6_addr)) addr_v6->sin6_scope_id=ifindex;
+        }
+    }
+
+    if (err!=ERROR_NONE) printf("ERROR: UDP multicast setup\n");
+
+    return err;
+}
+
+/* -------------------------------------------------------------------------------------------------- */
+static uint8_t udp_init(struct sockaddr_storage *servaddr_ptr, socklen_t *servaddr_len_ptr, int *sockfd_ptr,
+                        char *udp_ip, int udp_port) {
 /* -------------------------------------------------------------------------------------------------- */
 /* initialises the udp socket                                                                         */
-/*    udp_ip: the ip address (as a string) of the socket to open                                      */
-/*  udp_port: the UDP port to be opened at the given IP address                                       */
-/*    return: error code                                                                              */
+/*     servaddr_ptr: filled in with the destination address                                         */
+/* servaddr_len_ptr: filled in with the length of the destination address                            */
+/*       sockfd_ptr: filled in with the socket                                                        */
+/*           udp_ip: the IPv4 or IPv6 address (as a string) to send to, unicast or multicast          */
+/*         udp_port: the UDP port to send to at the given IP address                                  */
+/*           return: error code                                                                       */
 /* -------------------------------------------------------------------------------------------------- */
     uint8_t err=ERROR_NONE;
+    struct addrinfo hints;
+    struct addrinfo *result=NULL;
+    char port_str[8];
+    int ret;
   
     printf("Flow: UDP Init\n");
 
-    /* Creat the socket  for IPv4 and UDP */
-    if ((*sockfd_ptr = socket(AF_INET, SOCK_DGRAM, 0)) < 0 ) { 
-        printf("ERROR: socket creation failed\n"); 
-        err=ERROR_UDP_SOCKET_OPEN; 
+    /* work out whether it is IPv4 or IPv6 from the address itself */
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family=AF_UNSPEC;
+    hints.ai_socktype=SOCK_DGRAM;
+    hints.ai_flags=AI_NUMERICHOST | AI_NUMERICSERV;
+    sprintf(port_str, "%i", udp_port);
+    ret=getaddrinfo(udp_ip, port_str, &hints, &result);
+    if ((ret!=0) || (result==NULL)) {
+        printf("ERROR: UDP address %s not recognised (%s)\n", udp_ip, gai_strerror(ret));
+        err=ERROR_UDP_ADDRESS;
     } else {
-        /* setup all the destination fields */
-        memset(servaddr_ptr, 0, sizeof(struct sockaddr_in)); 
-        servaddr_ptr->sin_family = AF_INET; 
-        servaddr_ptr->sin_port = htons(udp_port); 
-        servaddr_ptr->sin_addr.s_addr = inet_addr(udp_ip); // INADDR_ANY; 
+        memset(servaddr_ptr, 0, sizeof(struct sockaddr_storage));
+        memcpy(servaddr_ptr, result->ai_addr, result->ai_addrlen);
+        *servaddr_len_ptr=result->ai_addrlen;
+
+        /* Create the socket for UDP */
+        if ((*sockfd_ptr = socket(result->ai_family, SOCK_DGRAM, 0)) < 0 ) { 
+            printf("ERROR: socket creation failed\n"); 
+            err=ERROR_UDP_SOCKET_OPEN; 
+        }
+        freeaddrinfo(result);
     }
+
+    if (err==ERROR_NONE) err=udp_multicast_setup(*sockfd_ptr, servaddr_ptr);
+
     if (err!=ERROR_NONE) printf("ERROR: UDP init\n");
 
     return err;
 }
 
 uint8_t udp_status_init(char *udp_ip, int udp_port) {
-    return udp_init(&servaddr_status, &sockfd_status, udp_ip, udp_port);
+    return udp_init(&servaddr_status, &servaddr_status_len, &sockfd_status, udp_ip, udp_port);
 }
 
-uint8_t udp_ts_init(char *udp_ip, int udp_port) {
-    return udp_init(&servaddr_ts, &sockfd_ts, udp_ip, udp_port);
+/* -------------------------------------------------------------------------------------------------- */
+uint8_t udp_ts_init(udp_ts_t *udp_ts, char *udp_ip, int udp_port, bool rtp, uint8_t fec_l, uint8_t fec_d) {
+/* -------------------------------------------------------------------------------------------------- */
+/* sets up a TS output to a udp socket. There can be as many of these as are needed                   */
+/*  *udp_ts: the TS output to set up                                                                  */
+/*   udp_ip: the IPv4 or IPv6 address (as a string) to send to, unicast or multicast                  */
+/* udp_port: the UDP port to send to at the given IP address                                          */
+/*      rtp: true to send each datagram with an RTP header                                            */
+/*    fec_l: the columns of SMPTE 2022-1 FEC to go with the RTP, 0 for none                           */
+/*    fec_d: the rows of SMPTE 2022-1 FEC to go with the RTP                                          */
+/*   return: error code                                                                               */
+/* -------------------------------------------------------------------------------------------------- */
+    uint8_t err;
+
+    udp_ts->tail_len=0;
+    udp_ts->rtp=rtp;
+    udp_ts->fec=NULL;
+    /* RFC 3550 wants the SSRC and the first sequence number to be random */
+    srand((unsigned int)(time(NULL) ^ getpid() ^ (uintptr_t)udp_ts));
+    udp_ts->rtp_ssrc=((uint32_t)rand() << 16) ^ (uint32_t)rand();
+    udp_ts->rtp_sequence=(uint16_t)rand();
+    err=udp_init(&udp_ts->servaddr, &udp_ts->servaddr_len, &udp_ts->sockfd, udp_ip, udp_port);
+
+    if ((err==ERROR_NONE) && rtp && (fec_l>0)) {
+        udp_ts->fec=malloc(sizeof(fec_ts_t));
+        if (udp_ts->fec==NULL) {
+            err=ERROR_TS_BUFFER_MALLOC;
+        } else {
+            fec_ts_init(udp_ts->fec, fec_l, fec_d);
+            err=udp_init(&udp_ts->fec_servaddr[0], &udp_ts->fec_servaddr_len[0], &udp_ts->fec_sockfd[0],
+                         udp_ip, udp_port+FEC_TS_COLUMN_PORT);
+            if (err==ERROR_NONE) {
+                err=udp_init(&udp_ts->fec_servaddr[1], &udp_ts->fec_servaddr_len[1], &udp_ts->fec_sockfd[1],
+                             udp_ip, udp_port+FEC_TS_ROW_PORT);
+                if (err!=ERROR_NONE) close(udp_ts->fec_sockfd[0]);
+            }
+            if (err!=ERROR_NONE) {
+                free(udp_ts->fec);
+                udp_ts->fec=NULL;
+            }
+        }
+        if (err!=ERROR_NONE) close(udp_ts->sockfd);
+    }
+
+    return err;
 }
 
 /* -------------------------------------------------------------------------------------------------- */
-uint8_t udp_close(void) {
+uint8_t udp_ts_close(udp_ts_t *udp_ts) {
 /* -------------------------------------------------------------------------------------------------- */
-/* closes the udp socket                                                                              */
-/* return: error code                                                                                 */
+/* closes a TS udp socket                                                                             */
+/* *udp_ts: the TS output to close                                                                    */
+/*  return: error code                                                                                */
 /* -------------------------------------------------------------------------------------------------- */
     uint8_t err=ERROR_NONE;
     int ret;
 
-    printf("Flow: UDP Close\n");
+    printf("Flow: UDP TS Close\n");
 
-    ret=close(sockfd_ts); 
+    ret=close(udp_ts->sockfd); 
     if (ret!=0) {
         err=ERROR_UDP_CLOSE;
         printf("ERROR: TS UDP close\n");
     }
+
+    if (udp_ts->fec!=NULL) {
+        close(udp_ts->fec_sockfd[0]);
+        close(udp_ts->fec_sockfd[1]);
+        free(udp_ts->fec);
+        udp_ts->fec=NULL;
+    }
+
+    return err;
+}
+
+/* -------------------------------------------------------------------------------------------------- */
+uint8_t udp_close(void) {
+/* -------------------------------------------------------------------------------------------------- */
+/* closes the status udp socket                                                                       */
+/* return: error code                                                                                 */
+/* -------------------------------------------------------------------------------------------------- */
+    uint8_t err=ERROR_NONE;
+    int ret;
+
+    printf("Flow: UDP Close\n");
+
     ret=close(sockfd_status); 
     if (ret!=0) {
         err=ERROR_UDP_CLOSE;
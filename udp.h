@@ -23,14 +23,55 @@
 #define UDP_H
 
 #include <stdint.h>
+#include <stdbool.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include "fec.h"
 
+#define UDP_TS_PACKET_SIZE 188
+/* the usual 7 TS packets per datagram, which keeps it under an ethernet MTU */
+#define UDP_TS_DATAGRAM_SIZE (7*UDP_TS_PACKET_SIZE)
+
+/* the most datagrams we will send in one go */
+#define UDP_TS_MAX_MSGS 64
+/* each TS packet in a datagram can be split over 2 USB packets, plus the tail from last time and */
+/* the RTP header                                                                                   */
+#define UDP_TS_MAX_PIECES (2*7+2)
+
+#define UDP_RTP_HEADER_SIZE  12
+
+typedef struct {
+    int sockfd;
+    struct sockaddr_storage servaddr;
+    socklen_t servaddr_len;
+    /* TS that did not make up a whole datagram last time round */
+    uint8_t tail[UDP_TS_DATAGRAM_SIZE];
+    size_t tail_len;
+    /* RTP encapsulation of the TS datagrams */
+    bool rtp;
+    uint16_t rtp_sequence;
+    uint32_t rtp_ssrc;
+    uint8_t rtp_headers[UDP_TS_MAX_MSGS][UDP_RTP_HEADER_SIZE];
+    /* SMPTE 2022-1 FEC on the RTP datagrams, NULL if there is none. [0] is the column stream to */
+    /* port+2, [1] the row stream to port+4                                                       */
+    fec_ts_t *fec;
+    int fec_sockfd[2];
+    struct sockaddr_storage fec_servaddr[2];
+    socklen_t fec_servaddr_len[2];
+    /* the batch of datagrams being put together */
+    struct mmsghdr msgs[UDP_TS_MAX_MSGS];
+    struct iovec pieces[UDP_TS_MAX_MSGS][UDP_TS_MAX_PIECES];
+} udp_ts_t;
+
+void udp_set_multicast(uint8_t ttl, char *iface, bool loop);
 uint8_t udp_status_init(char *udp_ip, int udp_port);
-uint8_t udp_ts_init(char *udp_ip, int udp_port);
+uint8_t udp_ts_init(udp_ts_t *udp_ts, char *udp_ip, int udp_port, bool rtp, uint8_t fec_l, uint8_t fec_d);
 
 uint8_t udp_status_write(uint8_t message, uint32_t data);
 uint8_t udp_status_string_write(uint8_t message, char *data);
-uint8_t udp_ts_write(uint8_t *buffer, uint32_t len);
+uint8_t udp_ts_write(udp_ts_t *udp_ts, struct iovec *iov, int iovcnt);
 
+uint8_t udp_ts_close(udp_ts_t *udp_ts);
 uint8_t udp_close(void);
 
 #endif